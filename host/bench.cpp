@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mtftp.h"
+#include "mtftp_os.h"
+#include "mtftp_trace.h"
+#include "sim.hpp"
+
+// goodput, completion time and retransmissions of reads through the simulated link, for every
+// window size and loss rate in the grid (each the average of a number of runs with different seeds)
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -s bytes    file size (65536)\n"
+    "  -n runs     runs for every window size and loss rate (5)\n"
+    "  -S seed     seed of the first run (1)\n"
+    "  -w list     window sizes (4,8,16,32,64,128)\n"
+    "  -L list     loss rates in %% (0,1,2,5,10,20)\n"
+    "  -B length   mean length of loss bursts, 0 for independent losses (0)\n"
+    "  -R percent  packets held back by 3 packet times so that later ones overtake them (0)\n"
+    "  -D percent  packets delivered twice (0)\n"
+    "  -l us       one way latency (1000)\n"
+    "  -j us       random delay added to the latency (0)\n"
+    "  -r bytes/s  link rate, 0 for no limit (125000)\n"
+    "  -q packets  link queue (16)\n"
+    "  -t us       time taken by a loop() that handles or sends a packet (50)\n"
+    "  -o options  rrq_options (0)\n"
+    "  -p blocks   parity blocks after every window (0)\n"
+    "  -a          adapt the window (the window sizes are the initial sizes)\n"
+    "  -c          print every run as CSV instead of the tables\n"
+    "  -f          exit with an error if any read does not complete (a read that writes data not in the file always does)\n"
+    "  -T file     write the trace of the first read that does not complete (or of the last read) to file, see mtftp_trace\n"
+    "  -v          log (repeat for more)\n",
+    name
+  );
+}
+
+static FILE *trace_file;
+
+static void writeTrace(const uint8_t *data, uint16_t len) {
+  fwrite(data, 1, len, trace_file);
+}
+
+static std::vector<double> parseList(const char *list) {
+  std::vector<double> values;
+
+  const char *value = list;
+  while (*value != '\0') {
+    char *end;
+    values.push_back(strtod(value, &end));
+    if (end == value) break;
+    value = *end == ',' ? end + 1 : end;
+  }
+
+  return values;
+}
+
+typedef struct cell {
+  uint32_t complete;
+  double incomplete;
+  double corrupt;
+  double goodput;
+  double time;
+  double rtx_blocks;
+  double rtx_pkts;
+  double retries;
+  double ring_high_water;
+} cell_t;
+
+static void printTable(const char *title, const std::vector<double> &windows, const std::vector<double> &losses,
+    const std::vector<cell_t> &cells, uint32_t runs, double cell_t::*field, const char *format, bool average = true) {
+  printf("\n%s\n%8s", title, "window");
+  for (double loss : losses) {
+    printf(" %7.4g%%", loss);
+  }
+  printf("\n");
+
+  for (size_t w = 0; w < windows.size(); w++) {
+    printf("%8g", windows[w]);
+
+    for (size_t l = 0; l < losses.size(); l++) {
+      const cell_t &cell = cells[w * losses.size() + l];
+
+      if (!average) {
+        printf(" %7.0f ", cell.*field);
+        continue;
+      }
+
+      if (cell.complete == 0) {
+        printf(" %8s", "-");
+        continue;
+      }
+
+      // averages over the runs that completed, marked if some did not
+      char value[16];
+      snprintf(value, sizeof(value), format, cell.*field / cell.complete);
+      printf(" %7s%c", value, cell.complete < runs ? '*' : ' ');
+    }
+
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  sim_transfer_t transfer = {};
+  transfer.file_size = 65536;
+  transfer.window_size = CONFIG_WINDOW_SIZE;
+  transfer.channel.latency = 1000;
+  transfer.channel.rate = 125000;
+  transfer.channel.queue_len = 16;
+  transfer.loop_time = 50;
+  transfer.idle_step = 100;
+
+  uint32_t runs = 5;
+  uint64_t first_seed = 1;
+  double burst_len = 0;
+  bool csv = false;
+  bool fail_incomplete = false;
+  const char *trace_path = NULL;
+  bool trace_written = false;
+  int log_level = MTFTP_LOG_NONE;
+  std::vector<double> windows = {4, 8, 16, 32, 64, 128};
+  std::vector<double> losses = {0, 1, 2, 5, 10, 20};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:S:w:L:B:R:D:l:j:r:q:t:o:p:acfT:vh")) != -1) {
+    switch (opt) {
+      case 's': transfer.file_size = strtoul(optarg, NULL, 0); break;
+      case 'n': runs = strtoul(optarg, NULL, 0); break;
+      case 'S': first_seed = strtoull(optarg, NULL, 0); break;
+      case 'w': windows = parseList(optarg); break;
+      case 'L': losses = parseList(optarg); break;
+      case 'B': burst_len = strtod(optarg, NULL); break;
+      case 'R': transfer.channel.reorder = strtod(optarg, NULL) / 100; break;
+      case 'D': transfer.channel.duplicate = strtod(optarg, NULL) / 100; break;
+      case 'l': transfer.channel.latency = strtoll(optarg, NULL, 0); break;
+      case 'j': transfer.channel.jitter = strtoll(optarg, NULL, 0); break;
+      case 'r': transfer.channel.rate = strtoul(optarg, NULL, 0); break;
+      case 'q': transfer.channel.queue_len = strtoul(optarg, NULL, 0); break;
+      case 't': transfer.loop_time = strtoll(optarg, NULL, 0); break;
+      case 'o': transfer.options = strtoul(optarg, NULL, 0); break;
+      case 'p': transfer.parity_blocks = strtoul(optarg, NULL, 0); break;
+      case 'a': transfer.adaptive_window = true; break;
+      case 'c': csv = true; break;
+      case 'f': fail_incomplete = true; break;
+      case 'T': trace_path = optarg; break;
+      case 'v': log_level ++; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  mtftp_log_level = (enum mtftp_log_level) (log_level > MTFTP_LOG_VERBOSE ? MTFTP_LOG_VERBOSE : log_level);
+
+  // held back long enough for 3 full packets to overtake it
+  int64_t airtime = transfer.channel.rate > 0 ? LEN_MAX_PACKET * 1000000LL / transfer.channel.rate : 100;
+  transfer.channel.reorder_delay = 3 * airtime;
+
+  if (!csv) {
+    printf(
+      "%d byte file, %d byte blocks, %d runs, latency %lld us, rate %d bytes/s, queue %d, %s losses%s\n",
+      transfer.file_size, CONFIG_LEN_BLOCK, runs, (long long) transfer.channel.latency, transfer.channel.rate,
+      transfer.channel.queue_len, burst_len > 1 ? "burst" : "independent", transfer.adaptive_window ? ", adaptive window" : ""
+    );
+  } else {
+    printf("window,loss,seed,complete,corrupt,time_us,goodput,data_sent,rtx_blocks,rtx_pkts,retries,lost_to_client,lost_to_server\n");
+  }
+
+  std::vector<cell_t> cells(windows.size() * losses.size());
+  uint32_t num_incomplete = 0;
+  uint32_t num_corrupt = 0;
+
+  for (size_t w = 0; w < windows.size(); w++) {
+    for (size_t l = 0; l < losses.size(); l++) {
+      cell_t &cell = cells[w * losses.size() + l];
+      double loss = losses[l] / 100;
+
+      transfer.window_size = windows[w];
+      transfer.channel.loss = loss;
+      transfer.channel.burst_enter = 0;
+
+      if (burst_len > 1 && loss > 0) {
+        // all lost in the bad state, as many packets lost on average as with independent losses
+        transfer.channel.loss = 0;
+        transfer.channel.burst_loss = 1;
+        transfer.channel.burst_exit = 1 / burst_len;
+        transfer.channel.burst_enter = loss * transfer.channel.burst_exit / (1 - loss);
+      }
+
+      // long enough for any transfer that is making progress
+      transfer.time_limit = 60 * 1000000LL;
+
+      for (uint32_t run = 0; run < runs; run++) {
+        transfer.seed = first_seed + run;
+
+        sim_result_t result;
+        simTransfer(&transfer, &result);
+
+        if (result.corrupt) {
+          cell.corrupt ++;
+          num_corrupt ++;
+        }
+        if (!result.complete) {
+          cell.incomplete ++;
+          num_incomplete ++;
+        }
+
+        bool last_run = w == windows.size() - 1 && l == losses.size() - 1 && run == runs - 1;
+
+        if (trace_path != NULL && !trace_written && (!result.complete || last_run)) {
+          trace_file = fopen(trace_path, "wb");
+          if (trace_file == NULL) {
+            perror(trace_path);
+            return 1;
+          }
+
+          mtftpTraceDump(&writeTrace);
+          fclose(trace_file);
+          trace_written = true;
+
+          if (!csv) {
+            printf("trace of window %g, loss %g%%, seed %llu written to %s\n", windows[w], losses[l], (unsigned long long) transfer.seed, trace_path);
+          }
+        }
+
+        if (csv) {
+          printf(
+            "%g,%g,%llu,%d,%d,%lld,%.0f,%d,%d,%d,%d,%d,%d\n",
+            windows[w], losses[l], (unsigned long long) transfer.seed, result.complete, result.corrupt, (long long) result.time, result.goodput,
+            result.data_sent, result.rtx_blocks, result.rtx_pkts, result.retries, result.to_client.lost, result.to_server.lost
+          );
+        }
+
+        if (!result.complete) continue;
+
+        cell.complete ++;
+        cell.goodput += result.goodput / 1000;
+        cell.time += result.time / 1000.0;
+        cell.rtx_blocks += result.rtx_blocks;
+        cell.rtx_pkts += result.rtx_pkts;
+        cell.retries += result.retries;
+        cell.ring_high_water += result.client.ring_high_water;
+      }
+    }
+  }
+
+  if (!csv) {
+    printTable("goodput (kB/s)", windows, losses, cells, runs, &cell_t::goodput, "%.1f");
+    printTable("completion time (ms)", windows, losses, cells, runs, &cell_t::time, "%.0f");
+    printTable("retransmitted blocks", windows, losses, cells, runs, &cell_t::rtx_blocks, "%.1f");
+    printTable("RTX/NACK packets", windows, losses, cells, runs, &cell_t::rtx_pkts, "%.1f");
+    printTable("client retries", windows, losses, cells, runs, &cell_t::retries, "%.1f");
+    printTable("client ring high water (slots)", windows, losses, cells, runs, &cell_t::ring_high_water, "%.1f");
+    printTable("reads not completed", windows, losses, cells, runs, &cell_t::incomplete, NULL, false);
+    printTable("reads that wrote data not in the file", windows, losses, cells, runs, &cell_t::corrupt, NULL, false);
+
+    printf("\n* some runs did not complete (averaged over those that did), - none did\n");
+    printf(
+      "%d of %d reads did not complete, %d wrote data not in the file\n",
+      num_incomplete, (uint32_t) (cells.size() * runs), num_corrupt
+    );
+  }
+
+  // data not in the file is never acceptable, whatever the link
+  return num_corrupt > 0 || (fail_incomplete && num_incomplete > 0) ? 1 : 0;
+}
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+
+#include "mtftp.h"
+#include "mtftp_os.h"
+#include "mtftp_server.hpp"
+#include "mtftp_download_manager.hpp"
+#include "sim_channel.hpp"
+#include "sim_clock.h"
+
+// time for a gateway to drain one file from every node of a fleet through MtftpDownloadManager, for every number of
+// reads run at once. The nodes share the radio: everything they send goes over one simulated link to the gateway
+// and everything the gateway sends over one link back (each the average of a number of runs with different seeds)
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -N nodes    nodes in the fleet, one file is read from each (16)\n"
+    "  -s bytes    file size (16384)\n"
+    "  -C list     reads run at once (1,2,4,8,16)\n"
+    "  -n runs     runs for every number of reads (3)\n"
+    "  -S seed     seed of the first run (1)\n"
+    "  -w blocks   window size of every read (16)\n"
+    "  -b blocks   window budget shared by the reads, 0 for none (0)\n"
+    "  -a          adapt the window (-w is the initial size)\n"
+    "  -o options  rrq_options (0)\n"
+    "  -P bytes/s  rate every node sends DATA at, 0 for no limit (0)\n"
+    "  -L percent  loss rate (0)\n"
+    "  -l us       one way latency (1000)\n"
+    "  -r bytes/s  link rate, 0 for no limit (125000)\n"
+    "  -q packets  link queue (16)\n"
+    "  -t us       time taken by a loop() that handles or sends a packet (50)\n"
+    "  -f          exit with an error if any read does not complete (a read that writes data not in the file always does)\n"
+    "  -v          log (repeat for more)\n",
+    name
+  );
+}
+
+static std::vector<double> parseList(const char *list) {
+  std::vector<double> values;
+
+  const char *value = list;
+  while (*value != '\0') {
+    char *end;
+    values.push_back(strtod(value, &end));
+    if (end == value) break;
+    value = *end == ',' ? end + 1 : end;
+  }
+
+  return values;
+}
+
+typedef struct sim_node {
+  uint8_t index;
+  uint8_t addr[LEN_PEER_ADDR];
+  MtftpServer server;
+} sim_node_t;
+
+typedef struct sim_fleet {
+  uint32_t file_size;
+  std::unique_ptr<sim_node_t[]> nodes;
+  // written by the gateway, one file for every job (the job of node i is i)
+  std::vector<std::vector<uint8_t>> files;
+  std::vector<uint32_t> len_files;
+  std::vector<bool> complete;
+  std::vector<int64_t> time_start;
+  std::vector<int64_t> time_end;
+  // a read wrote past the end of its file
+  bool overrun;
+  SimChannel *to_gateway;
+  SimChannel *to_nodes;
+} sim_fleet_t;
+
+static uint8_t nodeFileByte(uint8_t node, uint32_t offset) {
+  return (offset * 151 + (offset >> 8) + node * 97) & 0xFF;
+}
+
+// the nodes' callbacks are given their node, the fleet being simulated is held here
+static sim_fleet_t *sim_fleet;
+
+static bool nodeReadFile(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  sim_node_t *node = (sim_node_t *) ctx;
+
+  *br = 0;
+  while (*br < btr && file_offset + *br < sim_fleet->file_size) {
+    data[*br] = nodeFileByte(node->index, file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static void nodeSendPacket(void *ctx, const uint8_t *data, uint8_t len) {
+  sim_fleet->to_gateway->send(data, len, ((sim_node_t *) ctx)->index);
+}
+
+// the nodes hold DATA back while their queue for the shared link is full
+static bool nodeTxReady(void *ctx) {
+  return sim_fleet->to_gateway->ready(((sim_node_t *) ctx)->index);
+}
+
+static bool gatewayWriteFile(void *ctx, int job, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  sim_fleet_t *fleet = (sim_fleet_t *) ctx;
+
+  if (file_offset + btw > fleet->file_size) {
+    fleet->overrun = true;
+    return true;
+  }
+
+  memcpy(fleet->files[job].data() + file_offset, data, btw);
+  if (file_offset + btw > fleet->len_files[job]) fleet->len_files[job] = file_offset + btw;
+
+  return true;
+}
+
+static void gatewaySendPacket(void *ctx, const uint8_t *peer_addr, const uint8_t *data, uint8_t len) {
+  ((sim_fleet_t *) ctx)->to_nodes->send(data, len, peer_addr[0]);
+}
+
+static void gatewayJobEnd(void *ctx, int job, bool complete) {
+  sim_fleet_t *fleet = (sim_fleet_t *) ctx;
+
+  fleet->complete[job] = complete;
+  fleet->time_end[job] = mtftpTime();
+}
+
+typedef struct fleet_params {
+  uint16_t num_nodes;
+  uint32_t file_size;
+  uint16_t window_size;
+  uint16_t window_budget;
+  bool adaptive_window;
+  uint8_t options;
+  uint32_t node_rate;
+  SimChannel::params_t channel;
+  int64_t loop_time;
+  int64_t idle_step;
+  int64_t time_limit;
+} fleet_params_t;
+
+typedef struct fleet_result {
+  uint32_t complete;
+  uint32_t corrupt;
+  // time (us) until the last read ended, and the bytes of every file per second over it
+  int64_t drain_time;
+  double goodput;
+  // average time (us) of a read from its start, and Jain's index of the goodput of the reads (1 when every read
+  // got the same share of the link)
+  double read_time;
+  double fairness;
+} fleet_result_t;
+
+static void drainFleet(const fleet_params_t *params, uint8_t concurrency, uint64_t seed, fleet_result_t *result) {
+  memset(result, 0, sizeof(fleet_result_t));
+
+  sim_fleet_t fleet;
+  fleet.file_size = params->file_size;
+  fleet.nodes.reset(new sim_node_t[params->num_nodes]);
+  fleet.files.assign(params->num_nodes, std::vector<uint8_t>(params->file_size, 0));
+  fleet.len_files.assign(params->num_nodes, 0);
+  fleet.complete.assign(params->num_nodes, false);
+  fleet.time_start.assign(params->num_nodes, -1);
+  fleet.time_end.assign(params->num_nodes, -1);
+  fleet.overrun = false;
+  sim_fleet = &fleet;
+
+  simClockSet(0);
+
+  SimChannel to_gateway(params->channel, seed * 2);
+  SimChannel to_nodes(params->channel, seed * 2 + 1);
+  fleet.to_gateway = &to_gateway;
+  fleet.to_nodes = &to_nodes;
+
+  for (uint16_t i = 0; i < params->num_nodes; i++) {
+    sim_node_t *node = &fleet.nodes[i];
+    node->index = i;
+    memset(node->addr, 0, LEN_PEER_ADDR);
+    node->addr[0] = i;
+
+    node->server.init(&nodeReadFile, &nodeSendPacket, node);
+    node->server.setTxReadyCb(&nodeTxReady, node);
+    node->server.setPacing(params->node_rate, 2 * LEN_MAX_PACKET);
+  }
+
+  MtftpDownloadManager manager(concurrency, params->num_nodes);
+  manager.init(&gatewayWriteFile, &gatewaySendPacket, &fleet);
+  manager.setOnJobEndCb(&gatewayJobEnd, &fleet);
+  manager.setWindowBudget(params->window_budget);
+
+  for (uint8_t i = 0; i < concurrency; i++) {
+    manager.getSessionClient(i)->setAdaptiveWindow(params->adaptive_window);
+  }
+
+  for (uint16_t i = 0; i < params->num_nodes; i++) {
+    MtftpDownloadManager::job_t job = {};
+    memcpy(job.peer_addr, fleet.nodes[i].addr, LEN_PEER_ADDR);
+    job.window_size = params->window_size;
+    job.options = params->options;
+    manager.addJob(&job);
+  }
+
+  uint16_t first_node = 0;
+
+  while (!manager.isIdle() && mtftpTime() < params->time_limit) {
+    const SimChannel::packet_t *packet;
+    bool busy = false;
+
+    while ((packet = to_nodes.front()) != NULL) {
+      fleet.nodes[packet->peer].server.onPacketRecv(packet->data, packet->len);
+      to_nodes.pop();
+      busy = true;
+    }
+
+    while ((packet = to_gateway.front()) != NULL) {
+      manager.onPacketRecv(fleet.nodes[packet->peer].addr, packet->data, packet->len);
+      to_gateway.pop();
+      busy = true;
+    }
+
+    uint32_t num_sent = to_gateway.getStats().sent + to_nodes.getStats().sent;
+
+    // the node that goes first takes the room in the link's queue, so it takes turns as it would contending for the air
+    for (uint16_t i = 0; i < params->num_nodes; i++) {
+      fleet.nodes[(first_node + i) % params->num_nodes].server.loop();
+    }
+    first_node = (first_node + 1) % params->num_nodes;
+    manager.loop();
+
+    for (uint16_t i = 0; i < params->num_nodes; i++) {
+      if (fleet.time_start[i] < 0 && manager.getJobState(i) == MtftpDownloadManager::JOB_ACTIVE) {
+        fleet.time_start[i] = mtftpTime();
+      }
+    }
+
+    busy = busy || num_sent != to_gateway.getStats().sent + to_nodes.getStats().sent;
+
+    if (busy) {
+      simClockAdvance(params->loop_time);
+    } else {
+      // nothing to do until the next packet arrives (or a timeout)
+      int64_t now = mtftpTime();
+      int64_t time_next = now + params->idle_step;
+
+      int64_t time_event = to_gateway.nextEvent();
+      if (time_event < time_next) time_next = time_event;
+      time_event = to_nodes.nextEvent();
+      if (time_event < time_next) time_next = time_event;
+
+      simClockSet(time_next > now ? time_next : now + 1);
+    }
+  }
+
+  double sum_goodput = 0;
+  double sum_goodput_sq = 0;
+
+  for (uint16_t i = 0; i < params->num_nodes; i++) {
+    bool corrupt = false;
+    for (uint32_t j = 0; j < fleet.len_files[i]; j++) {
+      if (fleet.files[i][j] != nodeFileByte(i, j)) {
+        corrupt = true;
+        break;
+      }
+    }
+
+    if (corrupt) result->corrupt ++;
+    if (!fleet.complete[i] || corrupt || fleet.len_files[i] != params->file_size) continue;
+
+    result->complete ++;
+    if (fleet.time_end[i] > result->drain_time) result->drain_time = fleet.time_end[i];
+
+    int64_t read_time = fleet.time_end[i] - fleet.time_start[i];
+    double goodput = params->file_size * 1000000.0 / (read_time > 0 ? read_time : 1);
+
+    result->read_time += read_time;
+    sum_goodput += goodput;
+    sum_goodput_sq += goodput * goodput;
+  }
+
+  if (fleet.overrun) result->corrupt ++;
+
+  if (result->complete > 0) {
+    result->read_time /= result->complete;
+    result->fairness = sum_goodput * sum_goodput / (result->complete * sum_goodput_sq);
+  }
+  if (result->complete == params->num_nodes) {
+    result->goodput = (double) params->num_nodes * params->file_size * 1000000.0 / result->drain_time;
+  }
+}
+
+int main(int argc, char **argv) {
+  fleet_params_t params = {};
+  params.num_nodes = 16;
+  params.file_size = 16384;
+  params.window_size = CONFIG_WINDOW_SIZE;
+  params.channel.latency = 1000;
+  params.channel.rate = 125000;
+  params.channel.queue_len = 16;
+  params.loop_time = 50;
+  params.idle_step = 100;
+
+  uint32_t runs = 3;
+  uint64_t first_seed = 1;
+  bool fail_incomplete = false;
+  int log_level = MTFTP_LOG_NONE;
+  std::vector<double> concurrencies = {1, 2, 4, 8, 16};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "N:s:C:n:S:w:b:ao:P:L:l:r:q:t:fvh")) != -1) {
+    switch (opt) {
+      case 'N': params.num_nodes = strtoul(optarg, NULL, 0); break;
+      case 's': params.file_size = strtoul(optarg, NULL, 0); break;
+      case 'C': concurrencies = parseList(optarg); break;
+      case 'n': runs = strtoul(optarg, NULL, 0); break;
+      case 'S': first_seed = strtoull(optarg, NULL, 0); break;
+      case 'w': params.window_size = strtoul(optarg, NULL, 0); break;
+      case 'b': params.window_budget = strtoul(optarg, NULL, 0); break;
+      case 'a': params.adaptive_window = true; break;
+      case 'o': params.options = strtoul(optarg, NULL, 0); break;
+      case 'P': params.node_rate = strtoul(optarg, NULL, 0); break;
+      case 'L': params.channel.loss = strtod(optarg, NULL) / 100; break;
+      case 'l': params.channel.latency = strtoll(optarg, NULL, 0); break;
+      case 'r': params.channel.rate = strtoul(optarg, NULL, 0); break;
+      case 'q': params.channel.queue_len = strtoul(optarg, NULL, 0); break;
+      case 't': params.loop_time = strtoll(optarg, NULL, 0); break;
+      case 'f': fail_incomplete = true; break;
+      case 'v': log_level ++; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  // the peer on the simulated link is a uint8_t
+  if (params.num_nodes < 1 || params.num_nodes > 256) {
+    fprintf(stderr, "1 to 256 nodes\n");
+    return 2;
+  }
+
+  mtftp_log_level = (enum mtftp_log_level) (log_level > MTFTP_LOG_VERBOSE ? MTFTP_LOG_VERBOSE : log_level);
+
+  // long enough for a fleet that is making progress one read at a time
+  params.time_limit = 60 * 1000000LL + (int64_t) params.num_nodes * 10 * 1000000LL;
+
+  printf(
+    "%d nodes, %d byte files, %d byte blocks, window %d%s, budget %d, %d runs, latency %lld us, rate %d bytes/s, loss %g%%\n",
+    params.num_nodes, params.file_size, CONFIG_LEN_BLOCK, params.window_size, params.adaptive_window ? " (adaptive)" : "",
+    params.window_budget, runs, (long long) params.channel.latency, params.channel.rate, params.channel.loss * 100
+  );
+  printf("\n%8s %14s %14s %14s %10s %10s %10s\n", "reads", "drain (ms)", "goodput (kB/s)", "read (ms)", "fairness", "failed", "corrupt");
+
+  uint32_t num_incomplete = 0;
+  uint32_t num_corrupt = 0;
+
+  for (double value : concurrencies) {
+    uint8_t concurrency = value < 1 ? 1 : value > 255 ? 255 : value;
+
+    double drain_time = 0, goodput = 0, read_time = 0, fairness = 0;
+    uint32_t drained = 0, failed = 0, corrupt = 0;
+
+    for (uint32_t run = 0; run < runs; run++) {
+      fleet_result_t result;
+      drainFleet(&params, concurrency, first_seed + run, &result);
+
+      failed += params.num_nodes - result.complete;
+      corrupt += result.corrupt;
+      if (result.complete < params.num_nodes) continue;
+
+      drained ++;
+      drain_time += result.drain_time / 1000.0;
+      goodput += result.goodput / 1000;
+      read_time += result.read_time / 1000;
+      fairness += result.fairness;
+    }
+
+    num_incomplete += failed;
+    num_corrupt += corrupt;
+
+    if (drained == 0) {
+      printf("%8d %14s %14s %14s %10s %10d %10d\n", concurrency, "-", "-", "-", "-", failed, corrupt);
+      continue;
+    }
+
+    // averages over the runs in which every read completed, marked if some did not
+    printf(
+      "%8d %13.0f%c %14.1f %14.0f %10.3f %10d %10d\n", concurrency, drain_time / drained, drained < runs ? '*' : ' ',
+      goodput / drained, read_time / drained, fairness / drained, failed, corrupt
+    );
+  }
+
+  printf("\n* some runs did not drain the fleet (averaged over those that did), - none did\n");
+  printf("corrupt reads wrote data not in the file\n");
+
+  // data not in the file is never acceptable, whatever the link
+  return num_corrupt > 0 || (fail_incomplete && num_incomplete > 0) ? 1 : 0;
+}
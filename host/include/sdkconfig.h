@@ -0,0 +1,30 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// defaults from Kconfig for host builds (ESP-IDF generates this file for the target)
+#define CONFIG_WINDOW_SIZE 32
+#define CONFIG_WINDOW_SIZE_MIN 2
+#define CONFIG_WINDOW_INCREASE 2
+#define CONFIG_WINDOW_SIZE_MAX 128
+#define CONFIG_LEN_BLOCK 247
+#define CONFIG_TIMEOUT_CLIENT 20000
+#define CONFIG_MAX_RETRIES 5
+#define CONFIG_MAX_RESUMES 3
+#define CONFIG_TIMEOUT 100000
+#define CONFIG_LEN_MTFTP_BUFFER 32
+#define CONFIG_LEN_PACKET_QUEUE 32
+#define CONFIG_LEN_WRITE_BUFFER 512
+#define CONFIG_MAX_SESSIONS 4
+#define CONFIG_LEN_READ_CACHE 32
+#define CONFIG_MAX_PARITY_BLOCKS 4
+#define CONFIG_COMPRESSION 1
+#define CONFIG_DELTA_CHUNKS 64
+#define CONFIG_PACING_RATE 0
+#define CONFIG_PACING_BURST 2048
+#define CONFIG_LEN_TX_BATCH 32
+// host/CMakeLists.txt sets it from MTFTP_LEN_TRACE
+#ifndef CONFIG_LEN_TRACE
+#define CONFIG_LEN_TRACE 0
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+#include <string.h>
+#include <vector>
+#include "mtftp_os.h"
+
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+#include "mtftp_trace.h"
+#include "sim.hpp"
+#include "sim_clock.h"
+
+// the callbacks have no context, so the transfer being simulated is held here
+static std::vector<uint8_t> sim_file;
+static std::vector<uint8_t> sim_written;
+static uint32_t len_sim_written;
+// the client wrote past the end of the file
+static bool sim_overrun;
+
+static SimChannel *to_client;
+static SimChannel *to_server;
+static sim_result_t *sim_result;
+
+static bool simReadFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  if (file_offset < sim_file.size()) {
+    *br = btr < sim_file.size() - file_offset ? btr : sim_file.size() - file_offset;
+    memcpy(data, sim_file.data() + file_offset, *br);
+  }
+
+  return true;
+}
+
+static bool simWriteFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  if (file_offset + btw > sim_file.size()) {
+    sim_overrun = true;
+    return true;
+  }
+
+  // checked once the read has ended, as a write may be replaced by a later one (OPT_CRC)
+  memcpy(sim_written.data() + file_offset, data, btw);
+  if (file_offset + btw > len_sim_written) {
+    len_sim_written = file_offset + btw;
+  }
+
+  return true;
+}
+
+static void simServerSend(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    sim_result->data_sent ++;
+  }
+
+  to_client->send(data, len);
+}
+
+static void simClientSend(const uint8_t *data, uint8_t len) {
+  if (data[0] == TYPE_RETRANSMIT || data[0] == TYPE_NACK) {
+    sim_result->rtx_pkts ++;
+  }
+
+  to_server->send(data, len);
+}
+
+// the server holds DATA back while the link's queue is full, as it would for the transport's TX queue
+static bool simServerTxReady() {
+  return to_client->ready();
+}
+
+bool simTransfer(const sim_transfer_t *transfer, sim_result_t *result) {
+  memset(result, 0, sizeof(sim_result_t));
+  sim_result = result;
+
+  sim_file.resize(transfer->file_size);
+  uint64_t seed = transfer->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  for (uint32_t i = 0; i < transfer->file_size; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    sim_file[i] = seed >> 56;
+  }
+  sim_written.assign(transfer->file_size, 0);
+  len_sim_written = 0;
+  sim_overrun = false;
+
+  simClockSet(0);
+  // the trace only holds the events of this transfer
+  mtftpTraceClear();
+
+  SimChannel channel_to_client(transfer->channel, transfer->seed * 2);
+  SimChannel channel_to_server(transfer->channel, transfer->seed * 2 + 1);
+  to_client = &channel_to_client;
+  to_server = &channel_to_server;
+
+  MtftpClient client;
+  MtftpServer server;
+
+  client.init(&simWriteFile, &simClientSend);
+  // the clock only moves between calls to loop()
+  client.setRecvTimeout(0);
+  client.setAdaptiveWindow(transfer->adaptive_window);
+  server.init(&simReadFile, &simServerSend);
+  server.setTxReadyCb(&simServerTxReady);
+
+  client.beginRead(0, 0, transfer->window_size, transfer->options, transfer->parity_blocks);
+
+  while (client.getState() != MtftpClient::STATE_IDLE && mtftpTime() < transfer->time_limit) {
+    const SimChannel::packet_t *packet;
+    bool busy = false;
+
+    while ((packet = channel_to_server.front()) != NULL) {
+      server.onPacketRecv(packet->data, packet->len);
+      channel_to_server.pop();
+      busy = true;
+    }
+
+    while ((packet = channel_to_client.front()) != NULL) {
+      client.onPacketRecv(packet->data, packet->len);
+      channel_to_client.pop();
+    }
+
+    uint32_t num_sent = channel_to_client.getStats().sent + channel_to_server.getStats().sent;
+    // the client handles one packet every call
+    busy = busy || client.getPacketsQueued() > 0;
+
+    server.loop();
+    client.loop();
+
+    busy = busy || num_sent != channel_to_client.getStats().sent + channel_to_server.getStats().sent;
+
+    if (busy) {
+      simClockAdvance(transfer->loop_time);
+    } else {
+      // nothing to do until the next packet arrives (or a timeout)
+      int64_t now = mtftpTime();
+      int64_t time_next = now + transfer->idle_step;
+
+      int64_t time_event = channel_to_client.nextEvent();
+      if (time_event < time_next) time_next = time_event;
+      time_event = channel_to_server.nextEvent();
+      if (time_event < time_next) time_next = time_event;
+
+      simClockSet(time_next > now ? time_next : now + 1);
+    }
+  }
+
+  result->time = mtftpTime();
+  result->corrupt = sim_overrun || memcmp(sim_file.data(), sim_written.data(), len_sim_written) != 0;
+  result->complete = client.getState() == MtftpClient::STATE_IDLE && !result->corrupt && len_sim_written == transfer->file_size;
+  result->goodput = result->complete ? transfer->file_size * 1000000.0 / result->time : 0;
+
+  // the final block is short (empty if the file is a whole number of blocks)
+  uint32_t num_blocks = transfer->file_size / CONFIG_LEN_BLOCK + 1;
+  result->rtx_blocks = result->data_sent > num_blocks ? result->data_sent - num_blocks : 0;
+  result->retries = client.getRetries();
+  result->client = client.getStats();
+  result->server = server.getStats();
+  result->to_client = channel_to_client.getStats();
+  result->to_server = channel_to_server.getStats();
+
+  return result->complete;
+}
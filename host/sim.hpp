@@ -0,0 +1,51 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+#include "sim_channel.hpp"
+
+typedef struct sim_transfer {
+  // bytes of (pseudo random) file read
+  uint32_t file_size;
+  // passed to beginRead, the initial window size if adaptive_window
+  uint16_t window_size;
+  bool adaptive_window;
+  uint8_t options;
+  uint8_t parity_blocks;
+  // the link in each direction (each with its own random sequence)
+  SimChannel::params_t channel;
+  uint64_t seed;
+  // time (us) each call to loop() takes when it handles a packet or sends one
+  int64_t loop_time;
+  // largest time (us) the clock moves by while client and server are waiting, so that their timeouts are seen
+  int64_t idle_step;
+  // transfers taking longer (us) are given up on
+  int64_t time_limit;
+} sim_transfer_t;
+
+typedef struct sim_result {
+  // the client went idle having written the whole file
+  bool complete;
+  // the client wrote data that is not in the file
+  bool corrupt;
+  // time (us) until the client went idle, and the bytes of the file per second
+  int64_t time;
+  double goodput;
+  // DATA packets sent by the server, and those beyond one for every block of the file
+  uint32_t data_sent;
+  uint32_t rtx_blocks;
+  // RTX/NACK packets sent by the client, and RRQ/RTX/ACK packets resent after a timeout
+  uint32_t rtx_pkts;
+  uint32_t retries;
+  MtftpClient::client_stats_t client;
+  MtftpServer::server_stats_t server;
+  SimChannel::stats_t to_client;
+  SimChannel::stats_t to_server;
+} sim_result_t;
+
+// reads a file from a server through the simulated link, returns result->complete
+bool simTransfer(const sim_transfer_t *transfer, sim_result_t *result);
+
+#endif
@@ -0,0 +1,135 @@
+#include <string.h>
+#include "mtftp_os.h"
+
+#include "sim_channel.hpp"
+
+SimChannel::SimChannel(const params_t &_params, uint64_t seed) {
+  params = _params;
+
+  // splitmix64, so that nearby seeds give unrelated sequences (and the state is never 0)
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  rng_state = (z ^ (z >> 31)) | 1;
+}
+
+// xorshift64*, uniform in [0, 1)
+double SimChannel::uniform(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+
+  return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// forgets the packets that have finished sending over the link
+void SimChannel::drainLink(void) {
+  int64_t now = mtftpTime();
+
+  while (!link_queue.empty() && link_queue.front().time_sent <= now) {
+    link_queued[link_queue.front().peer] --;
+    link_queue.pop_front();
+  }
+}
+
+void SimChannel::arrive(const uint8_t *data, uint8_t len, uint8_t peer, int64_t time_arrival) {
+  packet_t packet;
+  packet.time_arrival = time_arrival;
+  packet.seq = seq ++;
+  packet.peer = peer;
+  packet.len = len;
+  memcpy(packet.data, data, len);
+
+  in_flight.push(packet);
+}
+
+bool SimChannel::send(const uint8_t *data, uint8_t len, uint8_t peer) {
+  if (!ready(peer)) {
+    stats.queue_drops ++;
+    return false;
+  }
+
+  stats.sent ++;
+
+  int64_t time_sent = mtftpTime();
+  int64_t airtime = 0;
+
+  if (params.rate > 0) {
+    // waits for the packets ahead of it, then takes its airtime (lost or not)
+    airtime = (int64_t) len * 1000000 / params.rate;
+    if (!link_queue.empty()) {
+      time_sent = link_queue.back().time_sent;
+    }
+    time_sent += airtime;
+    link_queue.push_back({time_sent, peer});
+    link_queued[peer] ++;
+  }
+
+  bool lost;
+  if (params.burst_enter > 0) {
+    lost = uniform() < (bad_state ? params.burst_loss : params.loss);
+    bad_state = bad_state ? uniform() >= params.burst_exit : uniform() < params.burst_enter;
+  } else {
+    lost = uniform() < params.loss;
+  }
+
+  if (lost) {
+    stats.lost ++;
+    return true;
+  }
+
+  int64_t time_arrival = time_sent + params.latency;
+  if (params.jitter > 0) {
+    time_arrival += (int64_t) (uniform() * params.jitter);
+  }
+
+  if (params.reorder > 0 && uniform() < params.reorder) {
+    stats.reordered ++;
+    time_arrival += params.reorder_delay;
+  }
+
+  arrive(data, len, peer, time_arrival);
+
+  if (params.duplicate > 0 && uniform() < params.duplicate) {
+    // sent again by the link layer
+    stats.duplicated ++;
+    arrive(data, len, peer, time_arrival + airtime + 1);
+  }
+
+  return true;
+}
+
+bool SimChannel::ready(uint8_t peer) {
+  if (params.rate == 0) return true;
+
+  drainLink();
+
+  return params.queue_len == 0 || link_queued[peer] < params.queue_len;
+}
+
+const SimChannel::packet_t *SimChannel::front(void) {
+  if (in_flight.empty() || in_flight.top().time_arrival > mtftpTime()) return NULL;
+
+  return &in_flight.top();
+}
+
+void SimChannel::pop(void) {
+  in_flight.pop();
+  stats.delivered ++;
+}
+
+int64_t SimChannel::nextEvent(void) {
+  int64_t time_next = in_flight.empty() ? INT64_MAX : in_flight.top().time_arrival;
+
+  // a sender held back by its full queue can carry on once the oldest packet has been sent
+  // (only checked once the link holds as many packets as one queue, which is exact with one peer)
+  if (params.rate > 0 && params.queue_len > 0) {
+    drainLink();
+
+    if (link_queue.size() >= params.queue_len && link_queue.front().time_sent < time_next) {
+      time_next = link_queue.front().time_sent;
+    }
+  }
+
+  return time_next;
+}
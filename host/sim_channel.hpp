@@ -0,0 +1,98 @@
+#ifndef SIM_CHANNEL_H
+#define SIM_CHANNEL_H
+
+#include <stdint.h>
+#include <deque>
+#include <queue>
+#include <vector>
+#include "mtftp.h"
+
+// one direction of a simulated link: packets queue for the link, take their airtime to send at rate
+// and arrive latency (plus jitter) later, unless they are lost, held back or duplicated on the way.
+// Time is the virtual clock (mtftpTime)
+class SimChannel {
+  public:
+    typedef struct params {
+      // probability of losing a packet (in the good state when burst_enter > 0)
+      double loss;
+      // burst loss (Gilbert-Elliott): probability of going into the bad state after a packet, of going back
+      // to the good state after a packet and of losing a packet while in the bad state
+      double burst_enter;
+      double burst_exit;
+      double burst_loss;
+      // probability of holding a packet back by reorder_delay (us), so that the packets after it overtake it
+      double reorder;
+      int64_t reorder_delay;
+      // probability of delivering a packet twice
+      double duplicate;
+      // one way delay (us), and largest random delay added to it (us)
+      int64_t latency;
+      int64_t jitter;
+      // bytes/s sent over the link (0 for no limit) and the number of packets each peer can have waiting for the link
+      // (packets sent while its queue is full are dropped)
+      uint32_t rate;
+      uint16_t queue_len;
+    } params_t;
+
+    typedef struct stats {
+      uint32_t sent;
+      uint32_t lost;
+      uint32_t queue_drops;
+      uint32_t reordered;
+      uint32_t duplicated;
+      uint32_t delivered;
+    } stats_t;
+
+    typedef struct packet {
+      int64_t time_arrival;
+      // order sent in, so that packets arriving at the same time are delivered in that order
+      uint32_t seq;
+      // node the packet is from (or for) on a channel shared by many, as given to send()
+      uint8_t peer;
+      uint8_t len;
+      uint8_t data[LEN_MAX_PACKET];
+    } packet_t;
+
+    SimChannel(const params_t &_params, uint64_t seed);
+
+    // sends a packet now, returns false if the peer's queue is full and the packet is dropped
+    bool send(const uint8_t *data, uint8_t len, uint8_t peer = 0);
+    // the peer's queue has room for another packet
+    bool ready(uint8_t peer = 0);
+    // oldest packet that has arrived by now (NULL if none), valid until pop() is called
+    const packet_t *front(void);
+    void pop(void);
+    // time of the next arrival or of the link's queue making room, INT64_MAX if nothing is in flight
+    int64_t nextEvent(void);
+    stats_t getStats(void) { return stats; };
+  private:
+    struct later {
+      bool operator()(const packet_t &a, const packet_t &b) const {
+        return a.time_arrival != b.time_arrival ? a.time_arrival > b.time_arrival : a.seq > b.seq;
+      }
+    };
+
+    params_t params;
+    uint64_t rng_state;
+    // in the bad state of the burst loss model
+    bool bad_state = false;
+    uint32_t seq = 0;
+    stats_t stats = {};
+
+    typedef struct link_slot {
+      int64_t time_sent;
+      uint8_t peer;
+    } link_slot_t;
+
+    // time the packets waiting for (or being sent over) the link finish sending, oldest first, and how many of them
+    // each peer has (the peers share the link, each has its own queue)
+    std::deque<link_slot_t> link_queue;
+    uint16_t link_queued[UINT8_MAX + 1] = {};
+    std::priority_queue<packet_t, std::vector<packet_t>, later> in_flight;
+
+    double uniform(void);
+    void drainLink(void);
+    void arrive(const uint8_t *data, uint8_t len, uint8_t peer, int64_t time_arrival);
+};
+
+#endif
@@ -0,0 +1,16 @@
+#include "mtftp_os.h"
+#include "sim_clock.h"
+
+static int64_t sim_time = 0;
+
+int64_t mtftpTime(void) {
+  return sim_time;
+}
+
+void simClockSet(int64_t time) {
+  sim_time = time;
+}
+
+void simClockAdvance(int64_t time) {
+  sim_time += time;
+}
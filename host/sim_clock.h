@@ -0,0 +1,11 @@
+#ifndef SIM_CLOCK_H
+#define SIM_CLOCK_H
+
+#include <stdint.h>
+
+// virtual clock behind mtftpTime (in place of port/posix/mtftp_clock.cpp), it only moves when the simulation moves it
+// so a transfer takes the same (simulated) time however fast the host is
+void simClockSet(int64_t time);
+void simClockAdvance(int64_t time);
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#include "mtftp.h"
+#include "mtftp_trace.h"
+
+// decodes a dump written by mtftpTraceDump, one line per event followed by a summary of every client and session
+
+// as in MtftpClient::client_state_str and MtftpServer::server_state_str
+static const char *CLIENT_STATES[] = {"Idle", "Transfer", "AwaitRTX", "AckSent", "NoChange"};
+static const char *SERVER_STATES[] = {"Idle", "Transfer", "Retransmit", "WaitAck", "Parity", "Signatures", "NoChange"};
+
+static const char *stateName(uint8_t source, uint32_t state) {
+  if (source & TRACE_SERVER) {
+    return state < sizeof(SERVER_STATES) / sizeof(SERVER_STATES[0]) ? SERVER_STATES[state] : "?";
+  }
+
+  return state < sizeof(CLIENT_STATES) / sizeof(CLIENT_STATES[0]) ? CLIENT_STATES[state] : "?";
+}
+
+static void printSource(uint8_t source) {
+  if (!(source & TRACE_SERVER)) {
+    printf("client %-3d", source);
+  } else if ((source & ~TRACE_SERVER) == TRACE_NO_SESSION) {
+    printf("server -  ");
+  } else {
+    printf("server %-3d", source & ~TRACE_SERVER);
+  }
+}
+
+typedef struct summary {
+  uint32_t events;
+  uint32_t data;
+  uint32_t retransmits;
+  uint32_t rtx;
+  uint32_t retries;
+  uint32_t timeouts;
+  uint32_t drops;
+  uint32_t state;
+  double time_last;
+} summary_t;
+
+int main(int argc, char **argv) {
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+    fprintf(stderr, "usage: %s [dump]  (reads the dump from stdin if no file is given)\n", argv[0]);
+    return 2;
+  }
+
+  FILE *file = argc == 2 ? fopen(argv[1], "rb") : stdin;
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
+    fprintf(stderr, "not a trace dump\n");
+    return 1;
+  }
+
+  if (header.version != TRACE_VERSION || header.len_event != sizeof(trace_event_t)) {
+    fprintf(stderr, "trace version %d with %d byte events, expected version %d with %d byte events\n",
+      header.version, header.len_event, TRACE_VERSION, (int) sizeof(trace_event_t));
+    return 1;
+  }
+
+  std::vector<trace_event_t> events(header.num_events);
+  size_t num_read = fread(events.data(), sizeof(trace_event_t), header.num_events, file);
+
+  if (num_read < header.num_events) {
+    fprintf(stderr, "dump truncated after %d of %d events\n", (int) num_read, header.num_events);
+    events.resize(num_read);
+  }
+
+  printf("%d events", (int) events.size());
+  if (header.num_lost > 0) printf(" (%d earlier events overwritten)", header.num_lost);
+  printf("\n\n");
+
+  std::map<uint8_t, summary_t> summaries;
+  // times are 32 bit, so they are added up from one event to the next
+  double time = 0;
+  uint32_t time_prev = events.empty() ? 0 : events[0].time;
+
+  for (const trace_event_t &event : events) {
+    time += (uint32_t) (event.time - time_prev) / 1000.0;
+    time_prev = event.time;
+
+    summary_t &summary = summaries[event.source];
+    summary.events ++;
+    summary.time_last = time;
+
+    printf("%12.3f ms  ", time);
+    printSource(event.source);
+    printf("  ");
+
+    switch (event.type) {
+      case TRACE_STATE:
+        printf("state %s -> %s", stateName(event.source, event.arg), stateName(event.source, event.value));
+        summary.state = event.value;
+        break;
+      case TRACE_RRQ_TX:
+      case TRACE_RRQ_RX:
+        printf("read request %s file %d offset %d", event.type == TRACE_RRQ_TX ? "sent" : "received", event.arg, event.value);
+        break;
+      case TRACE_DATA_TX:
+        printf("DATA sent block %d len %d%s", event.arg, event.value & 0xFFFF, (event.value & TRACE_RETRANSMIT) ? " (retransmit)" : "");
+        summary.data ++;
+        if (event.value & TRACE_RETRANSMIT) summary.retransmits ++;
+        break;
+      case TRACE_DATA_RX:
+        printf("DATA received block %d len %d", event.arg, event.value);
+        summary.data ++;
+        break;
+      case TRACE_RTX_TX:
+        printf("RTX sent for %d blocks in %d runs", event.arg, event.value);
+        summary.rtx ++;
+        break;
+      case TRACE_RTX_RUN:
+        printf("    blocks %d-%d", event.arg, event.arg + event.value - 1);
+        break;
+      case TRACE_RTX_RX:
+        printf("%s received for %d blocks", event.value == TYPE_NACK ? "NACK" : "RTX", event.arg);
+        summary.rtx ++;
+        break;
+      case TRACE_ACK_TX:
+      case TRACE_ACK_RX:
+        printf(
+          "ACK %s block %d window_no %d window_size %d", event.type == TRACE_ACK_TX ? "sent" : "received",
+          event.arg, event.value & 0xFF, event.value >> 16
+        );
+        break;
+      case TRACE_RETRY:
+        printf("retry %d, rto %.3f ms", event.arg, event.value / 1000.0);
+        summary.retries ++;
+        break;
+      case TRACE_TIMEOUT:
+        printf("timeout in state %s", stateName(event.source, event.arg));
+        summary.timeouts ++;
+        break;
+      case TRACE_QUEUE_DROP:
+        printf("packet of %d bytes dropped, queue full (%d dropped)", event.arg, event.value);
+        summary.drops ++;
+        break;
+      default:
+        printf("unknown event %d arg %d value %d", event.type, event.arg, event.value);
+        break;
+    }
+
+    printf("\n");
+  }
+
+  printf("\n%-10s %8s %8s %8s %8s %8s %8s %8s %12s  %s\n", "source", "events", "DATA", "resent", "RTX", "retries", "timeouts", "drops", "last (ms)", "state");
+  for (const auto &entry : summaries) {
+    const summary_t &summary = entry.second;
+
+    printSource(entry.first);
+    printf(
+      " %8d %8d %8d %8d %8d %8d %8d %12.3f  %s\n", summary.events, summary.data, summary.retransmits, summary.rtx,
+      summary.retries, summary.timeouts, summary.drops, summary.time_last, stateName(entry.first, summary.state)
+    );
+  }
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "mtftp.h"
+#include "mtftp_os.h"
+#include "mtftp_server.hpp"
+
+// packets per second a server sends over loopback UDP, one sendto per block (sendPacket) against one
+// sendmmsg per window (setSendBatchCb). The server is polled and every window acknowledged straight away,
+// so nothing but the server and the send path is measured. The datagrams are never read, the kernel drops
+// them once the socket buffer is full
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -w list     window sizes (1,4,8,16,32)\n"
+    "  -p packets  packets sent for every window size and path (200000)\n",
+    name
+  );
+}
+
+static int fd;
+static struct sockaddr_in sink_addr;
+static uint64_t packets_sent;
+
+// every block full, the file never ends
+static bool readFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  memset(data, file_offset & 0xFF, btr);
+  *br = btr;
+
+  return true;
+}
+
+static void sendPacket(const uint8_t *data, uint8_t len) {
+  sendto(fd, data, len, MSG_DONTWAIT, (const struct sockaddr *) &sink_addr, sizeof(sink_addr));
+  packets_sent ++;
+}
+
+static void sendBatch(const uint8_t *peer_addr, const MtftpServer::tx_packet_t *packets, uint16_t num_packets) {
+  struct mmsghdr msgs[CONFIG_LEN_TX_BATCH];
+  struct iovec iovs[CONFIG_LEN_TX_BATCH];
+
+  for (uint16_t i = 0; i < num_packets; i++) {
+    iovs[i].iov_base = (void *) packets[i].data;
+    iovs[i].iov_len = packets[i].len;
+
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_name = &sink_addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(sink_addr);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  sendmmsg(fd, msgs, num_packets, MSG_DONTWAIT);
+  packets_sent += num_packets;
+}
+
+static int64_t cpuTime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+  return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// packets sent per second of CPU time
+static double run(uint16_t window_size, bool batch, uint64_t num_packets) {
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+  if (batch) server.setSendBatchCb(&sendBatch);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 0;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = window_size;
+  server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+
+  packet_ack_t pkt_ack;
+  pkt_ack.block_no = window_size - 1;
+
+  packets_sent = 0;
+  int64_t cpu_start = cpuTime();
+
+  while (packets_sent < num_packets) {
+    server.poll();
+
+    if (server.getState() != MtftpServer::STATE_AWAIT_RESPONSE) {
+      fprintf(stderr, "server in state %d after a window\n", server.getState());
+      exit(1);
+    }
+
+    server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(pkt_ack));
+    pkt_ack.window_no ++;
+  }
+
+  int64_t cpu = cpuTime() - cpu_start;
+
+  return cpu > 0 ? (double) packets_sent * 1000000 / cpu : 0;
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint16_t> window_sizes = {1, 4, 8, 16, 32};
+  uint64_t num_packets = 200000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:p:h")) != -1) {
+    switch (opt) {
+      case 'w':
+      {
+        window_sizes.clear();
+        for (char *size = strtok(optarg, ","); size != NULL; size = strtok(NULL, ",")) {
+          window_sizes.push_back(strtoul(size, NULL, 0));
+        }
+        break;
+      }
+      case 'p': num_packets = strtoull(optarg, NULL, 0); break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  int sink = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+  memset(&sink_addr, 0, sizeof(sink_addr));
+  sink_addr.sin_family = AF_INET;
+  sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  socklen_t len_addr = sizeof(sink_addr);
+  if (fd < 0 || sink < 0 || bind(sink, (struct sockaddr *) &sink_addr, sizeof(sink_addr)) < 0 ||
+      getsockname(sink, (struct sockaddr *) &sink_addr, &len_addr) < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  printf("%d byte packets, %llu for every window size and path\n\n", LEN_DATA_HEADER + CONFIG_LEN_BLOCK, (unsigned long long) num_packets);
+  printf("%8s %14s %14s %8s\n", "window", "sendto pkt/s", "sendmmsg pkt/s", "speedup");
+
+  for (uint16_t window_size : window_sizes) {
+    if (window_size < 1 || window_size > CONFIG_WINDOW_SIZE_MAX) {
+      fprintf(stderr, "window size %d is not from 1 to %d\n", window_size, CONFIG_WINDOW_SIZE_MAX);
+      return 2;
+    }
+
+    double single = run(window_size, false, num_packets);
+    double batched = run(window_size, true, num_packets);
+    double speedup = single > 0 ? batched / single : 0;
+
+    printf("%8d %14.0f %14.0f %7.2fx\n", window_size, single, batched, speedup);
+  }
+
+  close(sink);
+  close(fd);
+
+  return 0;
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "mtftp.h"
+#include "mtftp_os.h"
+#include "mtftp_server.hpp"
+#include "mtftp_udp_gateway.hpp"
+
+// loopback benchmark of MtftpUdpGateway: one thread runs a server for every node, the main thread reads
+// a file from each of them at once through the gateway. The CPU time of the gateway thread gives the
+// blocks it can handle per core, and so how many sessions one core keeps up with at the rate of a node.
+// Both threads sleep until a packet arrives or the next deadline returned by poll(), -l drives them with
+// loop() instead (the servers busy-polled, the gateway woken every millisecond) to compare the two.
+// The packets the node thread sends per second of its CPU time compare sendto with the batch path (-b)
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -s bytes    file size (262144)\n"
+    "  -N list     numbers of nodes read from at once (1,4,16,64,256)\n"
+    "  -w blocks   window size (32)\n"
+    "  -o options  rrq_options (0)\n"
+    "  -R bytes/s  rate of one session over the radio, for the sessions per core (100000)\n"
+    "  -l          run the servers and the gateway with loop() rather than poll()\n"
+    "  -b          the servers hand each window to sendmmsg (setSendBatchCb) rather than sendto one block at a time\n"
+    "  -f          exit with an error if any read does not complete\n"
+    "  -v          log (repeat for more)\n",
+    name
+  );
+}
+
+static uint32_t file_size;
+
+static uint8_t fileByte(uint16_t file_index, uint32_t offset) {
+  return (offset * 31 + (offset >> 8) + file_index * 7) & 0xFF;
+}
+
+// nodes, each with its own socket and server (the server callbacks carry no context either)
+typedef struct node {
+  MtftpServer server;
+  int fd;
+  struct sockaddr_in addr;
+  struct sockaddr_in peer;
+} node_t;
+
+static node_t *active_node;
+
+static bool nodeReadFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < file_size) {
+    data[*br] = fileByte(file_index, file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+// packets sent by the node thread, read once it has stopped
+static uint64_t node_packets;
+
+static void nodeSendPacket(const uint8_t *data, uint8_t len) {
+  sendto(active_node->fd, data, len, MSG_DONTWAIT, (const struct sockaddr *) &active_node->peer, sizeof(active_node->peer));
+  node_packets ++;
+}
+
+static void nodeSendBatch(const uint8_t *peer_addr, const MtftpServer::tx_packet_t *packets, uint16_t num_packets) {
+  struct mmsghdr msgs[CONFIG_LEN_TX_BATCH];
+  struct iovec iovs[CONFIG_LEN_TX_BATCH];
+
+  for (uint16_t i = 0; i < num_packets; i++) {
+    iovs[i].iov_base = (void *) packets[i].data;
+    iovs[i].iov_len = packets[i].len;
+
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_name = &active_node->peer;
+    msgs[i].msg_hdr.msg_namelen = sizeof(active_node->peer);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  sendmmsg(active_node->fd, msgs, num_packets, MSG_DONTWAIT);
+  node_packets += num_packets;
+}
+
+static std::atomic<bool> stop_nodes;
+static bool use_loop;
+static bool use_batch;
+
+// longest the node thread sleeps, so that it sees stop_nodes
+static const int64_t MAX_NODE_SLEEP = 10000;
+
+// CPU time of a thread (CLOCK_THREAD_CPUTIME_ID for the calling one)
+static int64_t cpuTime(clockid_t clock = CLOCK_THREAD_CPUTIME_ID) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+
+  return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void runNodes(std::vector<node_t> *nodes) {
+  uint8_t data[LEN_MAX_PACKET + 1];
+  std::vector<struct pollfd> fds(nodes->size());
+
+  for (size_t i = 0; i < nodes->size(); i++) {
+    fds[i].fd = (*nodes)[i].fd;
+    fds[i].events = POLLIN;
+  }
+
+  while (!stop_nodes.load()) {
+    bool busy = false;
+    int64_t deadline = mtftpTime() + MAX_NODE_SLEEP;
+
+    for (node_t &node : *nodes) {
+      socklen_t len_peer = sizeof(node.peer);
+      ssize_t len;
+
+      while ((len = recvfrom(node.fd, data, sizeof(data), MSG_DONTWAIT, (struct sockaddr *) &node.peer, &len_peer)) > 0) {
+        if (len <= LEN_MAX_PACKET) node.server.onPacketRecv(data, len);
+      }
+
+      active_node = &node;
+
+      if (use_loop) {
+        node.server.loop();
+        busy = busy || !node.server.isIdle();
+      } else {
+        int64_t node_deadline = node.server.poll();
+        if (node_deadline < deadline) deadline = node_deadline;
+      }
+    }
+
+    if (use_loop) {
+      if (!busy) usleep(100);
+    } else {
+      // until a datagram arrives for any node or a server has a block or a timeout due
+      int64_t time_left = deadline - mtftpTime();
+      if (time_left > 0) ::poll(fds.data(), fds.size(), (time_left + 999) / 1000);
+    }
+  }
+}
+
+// reads, checked as they are written
+static MtftpUdpGateway *active_gateway;
+static std::vector<uint32_t> len_written;
+static uint32_t num_corrupt;
+static uint32_t num_ended;
+static uint32_t num_complete;
+// response times (RRQ/RTX/ACK to the next packet) seen by the clients
+static int64_t rtt_sum;
+static uint32_t rtt_samples;
+
+static bool gatewayWriteFile(int read, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  for (uint16_t i = 0; i < btw; i++) {
+    if (data[i] != fileByte(file_index, file_offset + i)) {
+      num_corrupt ++;
+      break;
+    }
+  }
+
+  if (file_offset + btw > len_written[read]) {
+    len_written[read] = file_offset + btw;
+  }
+
+  return true;
+}
+
+static void gatewayReadEnd(int read, bool complete) {
+  num_ended ++;
+
+  MtftpClient::client_stats_t stats = active_gateway->getClient(read)->getStats();
+  rtt_sum += stats.rtt_avg * stats.rtt_samples;
+  rtt_samples += stats.rtt_samples;
+
+  if (complete && len_written[read] == file_size) num_complete ++;
+}
+
+// runs the gateway with no reads for IDLE_TIME, the CPU both threads take while waiting for work
+static const int64_t IDLE_TIME = 200000;
+
+static void runGateway(MtftpUdpGateway *gateway) {
+  // loop(): the timers were only checked when run() returned, so it was run every millisecond
+  gateway->run(use_loop ? 1 : 10);
+}
+
+int main(int argc, char **argv) {
+  file_size = 262144;
+  std::vector<uint16_t> node_counts = {1, 4, 16, 64, 256};
+  uint16_t window_size = 32;
+  uint8_t options = 0;
+  uint32_t session_rate = 100000;
+  bool fail_incomplete = false;
+  int log_level = MTFTP_LOG_NONE;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:N:w:o:R:lbfvh")) != -1) {
+    switch (opt) {
+      case 's': file_size = strtoul(optarg, NULL, 0); break;
+      case 'N':
+      {
+        node_counts.clear();
+        for (char *count = strtok(optarg, ","); count != NULL; count = strtok(NULL, ",")) {
+          node_counts.push_back(strtoul(count, NULL, 0));
+        }
+        break;
+      }
+      case 'w': window_size = strtoul(optarg, NULL, 0); break;
+      case 'o': options = strtoul(optarg, NULL, 0); break;
+      case 'R': session_rate = strtoul(optarg, NULL, 0); break;
+      case 'l': use_loop = true; break;
+      case 'b': use_batch = true; break;
+      case 'f': fail_incomplete = true; break;
+      case 'v': log_level ++; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  mtftp_log_level = (enum mtftp_log_level) (log_level > MTFTP_LOG_VERBOSE ? MTFTP_LOG_VERBOSE : log_level);
+
+  uint32_t num_blocks = file_size / CONFIG_LEN_BLOCK + 1;
+  bool failed = false;
+
+  printf(
+    "%d byte file (%d blocks), window %d, sessions per core at %d bytes/s per session, %s, %s\n\n",
+    file_size, num_blocks, window_size, session_rate, use_loop ? "loop()" : "poll()", use_batch ? "sendmmsg" : "sendto"
+  );
+  printf(
+    "%6s %10s %12s %8s %10s %12s %14s %12s %10s %12s\n", "nodes", "time (ms)", "goodput kB/s", "rtt us",
+    "gw cpu %", "cpu us/block", "blocks/s/core", "sessions/core", "node pkt/s", "idle cpu %"
+  );
+
+  for (uint16_t num_nodes : node_counts) {
+    std::vector<node_t> nodes(num_nodes);
+
+    for (node_t &node : nodes) {
+      node.server.init(&nodeReadFile, &nodeSendPacket);
+      if (use_batch) node.server.setSendBatchCb(&nodeSendBatch);
+
+      node.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      memset(&node.addr, 0, sizeof(node.addr));
+      node.addr.sin_family = AF_INET;
+      node.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      socklen_t len_addr = sizeof(node.addr);
+      if (node.fd < 0 || bind(node.fd, (struct sockaddr *) &node.addr, sizeof(node.addr)) < 0 ||
+          getsockname(node.fd, (struct sockaddr *) &node.addr, &len_addr) < 0) {
+        perror("node socket");
+        return 1;
+      }
+    }
+
+    stop_nodes.store(false);
+    std::thread node_thread(runNodes, &nodes);
+    clockid_t node_clock;
+    pthread_getcpuclockid(node_thread.native_handle(), &node_clock);
+
+    MtftpUdpGateway gateway(num_nodes);
+    gateway.init(&gatewayWriteFile, &gatewayReadEnd);
+    active_gateway = &gateway;
+
+    len_written.assign(num_nodes, 0);
+    num_corrupt = 0;
+    num_ended = 0;
+    num_complete = 0;
+    rtt_sum = 0;
+    rtt_samples = 0;
+    node_packets = 0;
+
+    int64_t time_start = mtftpTime();
+    int64_t cpu_start = cpuTime();
+    int64_t node_cpu_start = cpuTime(node_clock);
+
+    for (uint16_t i = 0; i < num_nodes; i++) {
+      gateway.getFreeClient()->setAdaptiveWindow(false);
+      gateway.beginRead(&nodes[i].addr, i, 0, window_size, options);
+    }
+
+    while (gateway.getNumReads() > 0) {
+      runGateway(&gateway);
+    }
+
+    int64_t time = mtftpTime() - time_start;
+    int64_t cpu = cpuTime() - cpu_start;
+    int64_t node_cpu = cpuTime(node_clock) - node_cpu_start;
+
+    // every server is idle again (the last ACK may still be on its way)
+    int64_t time_idle = mtftpTime();
+    while (mtftpTime() - time_idle < IDLE_TIME) {
+      runGateway(&gateway);
+    }
+
+    int64_t cpu_idle_start = cpuTime() + cpuTime(node_clock);
+    time_idle = mtftpTime();
+    while (mtftpTime() - time_idle < IDLE_TIME) {
+      runGateway(&gateway);
+    }
+    int64_t cpu_idle = cpuTime() + cpuTime(node_clock) - cpu_idle_start;
+    time_idle = mtftpTime() - time_idle;
+
+    stop_nodes.store(true);
+    node_thread.join();
+
+    for (node_t &node : nodes) {
+      close(node.fd);
+    }
+
+    uint64_t blocks = (uint64_t) num_blocks * num_complete;
+    double cpu_per_block = blocks > 0 ? (double) cpu / blocks : 0;
+    double blocks_per_core = cpu_per_block > 0 ? 1000000 / cpu_per_block : 0;
+
+    printf(
+      "%6d %10.1f %12.1f %8.0f %10.1f %12.2f %14.0f %12.0f %10.0f %12.2f",
+      num_nodes, time / 1000.0, (double) file_size * num_complete * 1000 / time,
+      rtt_samples > 0 ? (double) rtt_sum / rtt_samples : 0, 100.0 * cpu / time,
+      cpu_per_block, blocks_per_core, blocks_per_core * CONFIG_LEN_BLOCK / session_rate,
+      node_cpu > 0 ? (double) node_packets * 1000000 / node_cpu : 0, 100.0 * cpu_idle / time_idle
+    );
+    if (num_complete < num_nodes || num_corrupt > 0) {
+      printf("  (%d of %d complete, %d corrupt writes)", num_complete, num_nodes, num_corrupt);
+      failed = true;
+    }
+    printf("\n");
+  }
+
+  return fail_incomplete && failed ? 1 : 0;
+}
@@ -3,26 +3,98 @@
 
 #include "sdkconfig.h"
 #include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// max length of a packet (ESP-NOW payload), the size packets, MtftpClient and MtftpServer are built for.
+// The basic_packet_* templates, BasicMtftpClient and BasicMtftpServer take other sizes
+const uint8_t LEN_MAX_PACKET = 250;
+// longest packet they can be built for (nackNext counts the bits of a NACK in a uint16_t)
+const uint16_t LEN_PACKET_LIMIT = 8192;
+
+// smallest unsigned type that holds lengths up to max, so that lengths of packets of up to 255 bytes
+// (and the send callbacks written for them) stay uint8_t
+template <uint16_t max>
+using mtftp_len_t = typename std::conditional<max <= UINT8_MAX, uint8_t, uint16_t>::type;
 
 // length of header of packet_data (minus length of block)
 const uint8_t LEN_DATA_HEADER = 3;
 const uint8_t LEN_RTX_HEADER = 2;
-// max number of block nos that can be sent in a TYPE_RETRANSMIT packet
-const uint8_t LEN_RETRANSMIT = (250 - 2) / sizeof(uint16_t);
+
+// max number of block nos that can be sent in a TYPE_RETRANSMIT packet of len_packet bytes (num_elements is a uint8_t)
+constexpr uint8_t lenRetransmit(uint16_t len_packet) {
+  return (len_packet - LEN_RTX_HEADER) / sizeof(uint16_t) < UINT8_MAX ? (len_packet - LEN_RTX_HEADER) / sizeof(uint16_t) : UINT8_MAX;
+}
+
+const uint8_t LEN_RETRANSMIT = lenRetransmit(LEN_MAX_PACKET);
+// length of header of packet_nack (minus ranges and bitmap)
+const uint8_t LEN_NACK_HEADER = 4;
+const uint8_t LEN_NACK_PAYLOAD = LEN_MAX_PACKET - LEN_NACK_HEADER;
+// length of the address identifying a peer (eg ESP-NOW MAC address)
+const uint8_t LEN_PEER_ADDR = 6;
+// deadline returned by poll() when no timer is running, sleep until the next packet is received
+const int64_t NO_DEADLINE = INT64_MAX;
+
+// parity_no in packet_parity is 3 bits and last_block_no 12 bits
+const uint8_t MAX_PARITY_BLOCKS = 8;
+const uint16_t MAX_PARITY_WINDOW_SIZE = 4096;
+// max bytes of the file packed into one compressed block (OPT_COMPRESS), the client unpacks a block into a buffer this size
+const uint16_t MAX_COMPRESS_INPUT = 1024;
+// largest chunk of a delta read, the client copies a chunk through the same buffer it unpacks compressed blocks into
+const uint16_t MAX_DELTA_CHUNK_SIZE = MAX_COMPRESS_INPUT;
+// smallest chunk beginDeltaRead picks for a copy, smaller chunks are only used if asked for
+const uint16_t MIN_DELTA_CHUNK_SIZE = 64;
 
 enum packet_types {
   TYPE_READ_REQUEST = 1,
   TYPE_DATA,
   TYPE_RETRANSMIT,
   TYPE_ACK,
-  TYPE_ERR
+  TYPE_ERR,
+  TYPE_NACK,
+  TYPE_PARITY,
+  TYPE_BATCH_READ_REQUEST,
+  TYPE_DELTA_READ_REQUEST,
+  TYPE_CRC
 };
 
+// DATA and PARITY carry a window tag (and DATA a retransmit flag) in the upper bits of the opcode,
+// every other packet has a plain opcode
+const uint8_t OPCODE_MASK = 0x0F;
+
+// tag of the window_no-th window in DATA and PARITY packets, 0 for untagged packets (a stream, or a client
+// whose RRQ has no options) so that a block that arrives after its window has been acknowledged can be told
+// from a block of the next window. The tags repeat every 7 windows
+static inline uint8_t windowTag(uint8_t window_no) {
+  return (window_no % 7) + 1;
+}
+
 enum err_types {
-  ERR_FREAD
+  ERR_FREAD,
+  ERR_BUSY,
+  // the server does not support an option requested in the RRQ
+  ERR_OPTION,
+  // an ACK/RTX from a client the server has no session with (it has timed out), the client starts the read again
+  ERR_NO_SESSION
 };
 
-extern const char *err_types_str[1];
+extern const char *err_types_str[4];
+
+// options requested by the client in packet_rrq
+enum rrq_options {
+  // sliding window: the server keeps sending as long as fewer than window_size blocks are unacknowledged,
+  // block nos count up from the RRQ (wrapping at 65535) instead of restarting every window,
+  // ACKs are cumulative and NACKs are sent while the transfer is in progress
+  OPT_STREAM = 0x01,
+  // every DATA block holds as much of the file as fits once compressed (see compressBlock), blocks
+  // before the final block are always full, the server answers with ERR_OPTION if it cannot compress
+  // (not with OPT_STREAM)
+  OPT_COMPRESS = 0x02,
+  // the server sends a packet_crc after the final block of every window, the client only acknowledges
+  // a window once the crc32c of its blocks matches and reads the window again if it does not
+  // (not with OPT_STREAM)
+  OPT_CRC = 0x04
+};
 
 typedef struct __attribute__((__packed__)) packet_rrq {
   enum packet_types opcode:8;
@@ -32,33 +104,403 @@ typedef struct __attribute__((__packed__)) packet_rrq {
   uint32_t file_offset;
   // number of chunks to transfer in one window
   uint16_t window_size;
+  // rrq_options
+  uint8_t options;
+  // number of parity blocks to send after every window (0 for none)
+  uint8_t parity_blocks;
 
-  packet_rrq(): opcode(TYPE_READ_REQUEST) {}
+  packet_rrq(): opcode(TYPE_READ_REQUEST), options(0), parity_blocks(0) {}
 } packet_rrq_t;
 
-typedef struct __attribute__((__packed__)) packet_data {
+// length of packet_rrq sent by clients without support for options
+const uint8_t LEN_RRQ_BASE = 9;
+// length of packet_rrq sent by clients without support for parity blocks
+const uint8_t LEN_RRQ_OPTIONS = 10;
+
+// file requested in packet_brq
+typedef struct __attribute__((__packed__)) batch_file {
+  uint16_t file_index;
+  uint32_t file_offset;
+} batch_file_t;
+
+// length of header of packet_brq (minus files)
+const uint8_t LEN_BRQ_HEADER = 4;
+
+// max number of files that can be requested in a TYPE_BATCH_READ_REQUEST packet of len_packet bytes
+constexpr uint8_t lenBatch(uint16_t len_packet) {
+  return (len_packet - LEN_BRQ_HEADER) / sizeof(batch_file_t) < UINT8_MAX ? (len_packet - LEN_BRQ_HEADER) / sizeof(batch_file_t) : UINT8_MAX;
+}
+
+const uint8_t LEN_BATCH = lenBatch(LEN_MAX_PACKET);
+
+// reads every file in turn, each starting at a new block straight after the final (partial) block of the one before,
+// so a window can hold the end of one file and the start of the next
+template <uint16_t LEN_PACKET>
+struct __attribute__((__packed__)) basic_packet_brq {
+  enum packet_types opcode:8;
+  // number of chunks to transfer in one window
+  uint16_t window_size;
+  uint8_t num_files;
+  batch_file_t files[lenBatch(LEN_PACKET)];
+
+  basic_packet_brq(): opcode(TYPE_BATCH_READ_REQUEST), num_files(0) {}
+};
+
+typedef basic_packet_brq<LEN_MAX_PACKET> packet_brq_t;
+
+// signature of a chunk of the copy of the file the client already holds
+typedef struct __attribute__((__packed__)) delta_chunk {
+  // deltaWeak, can be rolled along the file one byte at a time
+  uint32_t weak;
+  // deltaStrong, 0 (with weak 0) if the chunk is unknown
+  uint32_t strong;
+} delta_chunk_t;
+
+// length of header of packet_drq (minus chunks)
+const uint8_t LEN_DRQ_HEADER = 15;
+
+// max number of chunk signatures in a TYPE_DELTA_READ_REQUEST packet of len_packet bytes
+constexpr uint8_t lenDrqChunks(uint16_t len_packet) {
+  return (len_packet - LEN_DRQ_HEADER) / sizeof(delta_chunk_t) < UINT8_MAX ? (len_packet - LEN_DRQ_HEADER) / sizeof(delta_chunk_t) : UINT8_MAX;
+}
+
+const uint8_t LEN_DRQ_CHUNKS = lenDrqChunks(LEN_MAX_PACKET);
+
+// reads the file as changes to the copy the client already holds: every DATA block holds literal runs
+// (as in a compressed block) and runs of chunks to copy from that copy, a token byte >= 0x80 is followed
+// by a uint16_t chunk no and copies (token & 0x7F) + 1 chunks from there on.
+// The signatures are sent in as many DRQs as needed, the transfer starts once the DRQ with last set arrives
+// (chunks in a lost DRQ are sent as literals)
+template <uint16_t LEN_PACKET>
+struct __attribute__((__packed__)) basic_packet_drq {
   enum packet_types opcode:8;
+  uint16_t file_index;
+  // offset of the file to start the read at (chunks are always numbered from the start of the file)
+  uint32_t file_offset;
+  uint16_t window_size;
+  // chunk n starts at n * chunk_size of the client's copy, up to MAX_DELTA_CHUNK_SIZE
+  uint16_t chunk_size;
+  uint16_t first_chunk;
+  uint8_t last;
+  uint8_t num_chunks;
+  delta_chunk_t chunks[lenDrqChunks(LEN_PACKET)];
+
+  basic_packet_drq(): opcode(TYPE_DELTA_READ_REQUEST), last(0), num_chunks(0) {}
+};
+
+typedef basic_packet_drq<LEN_MAX_PACKET> packet_drq_t;
+
+// rsync rolling checksum of len bytes
+uint32_t deltaWeak(const uint8_t *data, uint16_t len);
+// moves the len bytes summed by weak on by one byte, dropping out and adding in
+uint32_t deltaRoll(uint32_t weak, uint8_t out, uint8_t in, uint16_t len);
+// FNV-1a hash of len bytes, checked once the weak checksum of a chunk matches
+uint32_t deltaStrong(const uint8_t *data, uint16_t len);
+
+template <uint16_t LEN_BLOCK>
+struct __attribute__((__packed__)) basic_packet_data {
+  enum packet_types opcode:4;
+  // windowTag of the window the block was sent in
+  uint8_t window_tag:3;
+  // the block has been sent before (in response to a RTX/NACK, or the window was sent again)
+  uint8_t retransmit:1;
   uint16_t block_no;
-  uint8_t block[CONFIG_LEN_BLOCK];
+  uint8_t block[LEN_BLOCK];
+
+  basic_packet_data(): opcode(TYPE_DATA), window_tag(0), retransmit(0) {}
+};
+
+typedef basic_packet_data<CONFIG_LEN_BLOCK> packet_data_t;
 
-  packet_data(): opcode(TYPE_DATA) {}
-} packet_data_t;
+static_assert(sizeof(packet_data_t) == LEN_DATA_HEADER + CONFIG_LEN_BLOCK, "the window tag does not fit in the opcode");
 
-typedef struct __attribute__((__packed__)) packet_rtx {
+// sent by the server after the blocks of a window, parity_no is the XOR of every block
+// of the window whose block_no % parity_blocks == parity_no (see parityAdd),
+// so the client can rebuild one missing block out of each of those groups
+template <uint16_t LEN_BLOCK>
+struct __attribute__((__packed__)) basic_packet_parity {
+  enum packet_types opcode:4;
+  // as in packet_data
+  uint8_t window_tag:3;
+  uint8_t reserved:1;
+  // final block of the window
+  uint16_t last_block_no:12;
+  // last_block_no is the final (partial) block of the file
+  uint16_t eof:1;
+  uint16_t parity_no:3;
+  uint8_t block[LEN_BLOCK];
+
+  basic_packet_parity(): opcode(TYPE_PARITY), window_tag(0), reserved(0) {}
+};
+
+typedef basic_packet_parity<CONFIG_LEN_BLOCK> packet_parity_t;
+
+// crc32c of the blocks of a window (as sent, so of the packed blocks of a compressed window),
+// sent after the final block of the window and again whenever that block is retransmitted
+typedef struct __attribute__((__packed__)) packet_crc {
+  enum packet_types opcode:8;
+  // final block of the window
+  uint16_t last_block_no;
+  // window_no of the window (see packet_ack)
+  uint8_t window_no;
+  uint32_t crc;
+
+  packet_crc(): opcode(TYPE_CRC) {}
+} packet_crc_t;
+
+// CRC-32C (Castagnoli) of len bytes carried on from crc (0 to start), with the SSE4.2 or ARMv8 CRC
+// instructions if the CPU has them (checked at run time on x86), slice-by-8 tables otherwise
+uint32_t crc32c(uint32_t crc, const uint8_t *data, uint32_t len);
+// the slice-by-8 path on its own, whatever the CPU has
+uint32_t crc32cTable(uint32_t crc, const uint8_t *data, uint32_t len);
+// true if crc32c uses the CRC instructions
+bool crc32cHardware(void);
+
+// XORs the block (len bytes) into parity (blocks of len_block bytes), the final block of the file (len < len_block)
+// is padded with zeros and has its length in the last byte, which it can never fill. Blocks longer than 256 bytes
+// have the number of bytes the final block leaves free, less one, in the last byte (up to 127)
+// or with the top bit set, in the last two bytes
+void parityAdd(uint8_t *parity, const uint8_t *block, uint16_t len, uint16_t len_block = CONFIG_LEN_BLOCK);
+// length of the final block of the file rebuilt from parity, more than len_block if it is not a valid final block
+uint16_t parityLength(const uint8_t *block, uint16_t len_block = CONFIG_LEN_BLOCK);
+
+// packs as much of data (len_data bytes, up to MAX_COMPRESS_INPUT) as fits into block, *len_used is set to
+// the number of bytes packed and the length of the block is returned. Each block can be unpacked on its own.
+// The block is padded to len_block unless eof is set and every byte of data fits,
+// so only the final block of the file is ever short
+uint16_t compressBlock(
+  const uint8_t *data, uint16_t len_data, bool eof, uint8_t *block, uint16_t *len_used, uint16_t len_block = CONFIG_LEN_BLOCK
+);
+// unpacks a block made by compressBlock into data (MAX_COMPRESS_INPUT bytes), returns false if it is corrupt
+bool decompressBlock(const uint8_t *block, uint16_t len_block, uint8_t *data, uint16_t *len_data);
+
+template <uint16_t LEN_PACKET>
+struct __attribute__((__packed__)) basic_packet_rtx {
   enum packet_types opcode:8;
   uint8_t num_elements;
-  uint16_t block_nos[LEN_RETRANSMIT];
+  uint16_t block_nos[lenRetransmit(LEN_PACKET)];
+
+  basic_packet_rtx(): opcode(TYPE_RETRANSMIT) {}
+};
 
-  packet_rtx(): opcode(TYPE_RETRANSMIT) {}
-} packet_rtx_t;
+typedef basic_packet_rtx<LEN_MAX_PACKET> packet_rtx_t;
+
+// run of missing blocks in a TYPE_NACK packet
+typedef struct __attribute__((__packed__)) nack_range {
+  // relative to base_block_no
+  uint16_t offset;
+  uint16_t num_blocks;
+} nack_range_t;
+
+template <uint16_t LEN_PACKET>
+struct __attribute__((__packed__)) basic_packet_nack {
+  enum packet_types opcode:8;
+  uint16_t base_block_no;
+  uint8_t num_ranges;
+  // num_ranges nack_range_t, followed by a bitmap (to the end of the packet)
+  // where bit i (LSB first) marks block base_block_no + i missing
+  uint8_t payload[LEN_PACKET - LEN_NACK_HEADER];
+
+  basic_packet_nack(): opcode(TYPE_NACK) {}
+};
+
+typedef basic_packet_nack<LEN_MAX_PACKET> packet_nack_t;
+
+// position of nackNext in a TYPE_NACK packet
+typedef struct nack_iter {
+  uint16_t bit_index;
+  uint8_t range_index;
+  uint16_t range_offset;
+} nack_iter_t;
+
+// encodes the missing blocks described by the sorted runs (offset relative to 0) into pkt,
+// using a range for runs that are cheaper to send that way and a bitmap for the rest
+// *num_runs is updated to the number of runs that fit, returns the length of the packet
+template <uint16_t LEN_PACKET>
+mtftp_len_t<LEN_PACKET> nackEncode(basic_packet_nack<LEN_PACKET> *pkt, const nack_range_t *runs, uint16_t *num_runs) {
+  const uint16_t LEN_PAYLOAD = LEN_PACKET - LEN_NACK_HEADER;
+  // (num_ranges is a uint8_t)
+  const uint16_t MAX_RANGES = LEN_PAYLOAD / sizeof(nack_range_t) < UINT8_MAX ? LEN_PAYLOAD / sizeof(nack_range_t) : UINT8_MAX;
+
+  nack_range_t ranges[MAX_RANGES];
+  uint8_t bitmap[LEN_PAYLOAD];
+
+  uint8_t num_ranges = 0;
+  uint16_t len_bitmap = 0;
+
+  memset(bitmap, 0, sizeof(bitmap));
+
+  // runs at least this long are always cheaper to send as a range
+  const uint16_t LEN_LONG_RUN = sizeof(nack_range_t) * 8;
+
+  // the bitmap starts at the first short run, long runs before it are sent as ranges
+  // (offsets wrap around, so ranges can be before base_block_no)
+  pkt->base_block_no = *num_runs > 0 ? runs[0].offset : 0;
+  for (uint16_t i = 0; i < *num_runs; i++) {
+    if (runs[i].num_blocks < LEN_LONG_RUN) {
+      pkt->base_block_no = runs[i].offset;
+      break;
+    }
+  }
+
+  uint16_t i;
+  for (i = 0; i < *num_runs; i++) {
+    uint16_t offset = runs[i].offset - pkt->base_block_no;
+    uint32_t end = (uint32_t) offset + runs[i].num_blocks;
+
+    uint16_t len_used = (num_ranges * sizeof(nack_range_t)) + len_bitmap;
+
+    // number of bytes the bitmap would need to grow by to hold this run
+    uint32_t len_grow = ((end + 7) / 8) > len_bitmap ? ((end + 7) / 8) - len_bitmap : 0;
+
+    if (
+      runs[i].num_blocks < LEN_LONG_RUN &&
+      runs[i].offset >= pkt->base_block_no &&
+      len_grow <= sizeof(nack_range_t) &&
+      len_used + len_grow <= LEN_PAYLOAD
+    ) {
+      for (uint32_t bit = offset; bit < end; bit++) {
+        bitmap[bit / 8] |= 1 << (bit % 8);
+      }
+
+      len_bitmap += len_grow;
+    } else if (len_used + sizeof(nack_range_t) <= LEN_PAYLOAD && num_ranges < MAX_RANGES) {
+      ranges[num_ranges].offset = offset;
+      ranges[num_ranges].num_blocks = runs[i].num_blocks;
+      num_ranges ++;
+    } else {
+      break;
+    }
+  }
+
+  *num_runs = i;
+
+  pkt->num_ranges = num_ranges;
+  memcpy(pkt->payload, ranges, num_ranges * sizeof(nack_range_t));
+  memcpy(pkt->payload + (num_ranges * sizeof(nack_range_t)), bitmap, len_bitmap);
+
+  return LEN_NACK_HEADER + (num_ranges * sizeof(nack_range_t)) + len_bitmap;
+}
+
+template <uint16_t LEN_PACKET>
+bool nackValid(const basic_packet_nack<LEN_PACKET> *pkt, uint16_t len_pkt) {
+  return len_pkt >= LEN_NACK_HEADER && len_pkt <= LEN_PACKET &&
+    (pkt->num_ranges * sizeof(nack_range_t)) <= (uint16_t) (len_pkt - LEN_NACK_HEADER);
+}
+
+template <uint16_t LEN_PACKET>
+uint32_t nackCount(const basic_packet_nack<LEN_PACKET> *pkt, uint16_t len_pkt) {
+  const nack_range_t *ranges = (const nack_range_t *) pkt->payload;
+  uint16_t len_ranges = pkt->num_ranges * sizeof(nack_range_t);
+
+  uint32_t count = 0;
+
+  for (uint8_t i = 0; i < pkt->num_ranges; i++) {
+    count += ranges[i].num_blocks;
+  }
+
+  for (uint16_t i = len_ranges; i < len_pkt - LEN_NACK_HEADER; i++) {
+    count += __builtin_popcount(pkt->payload[i]);
+  }
+
+  return count;
+}
+
+// the block no that nackNext returns last
+template <uint16_t LEN_PACKET>
+uint16_t nackLast(const basic_packet_nack<LEN_PACKET> *pkt, uint16_t len_pkt) {
+  const nack_range_t *ranges = (const nack_range_t *) pkt->payload;
+  uint16_t len_ranges = pkt->num_ranges * sizeof(nack_range_t);
+
+  // ranges are returned after the bitmap
+  for (int16_t i = pkt->num_ranges - 1; i >= 0; i--) {
+    if (ranges[i].num_blocks > 0) {
+      return pkt->base_block_no + ranges[i].offset + ranges[i].num_blocks - 1;
+    }
+  }
+
+  for (int16_t i = len_pkt - LEN_NACK_HEADER - 1; i >= len_ranges; i--) {
+    if (pkt->payload[i] != 0) {
+      return pkt->base_block_no + (i - len_ranges) * 8 + (31 - __builtin_clz(pkt->payload[i]));
+    }
+  }
+
+  return pkt->base_block_no;
+}
+
+// sets *block_no to the next missing block, returns false once all blocks have been returned
+template <uint16_t LEN_PACKET>
+bool nackNext(const basic_packet_nack<LEN_PACKET> *pkt, uint16_t len_pkt, nack_iter_t *iter, uint16_t *block_no) {
+  const nack_range_t *ranges = (const nack_range_t *) pkt->payload;
+  uint16_t len_ranges = pkt->num_ranges * sizeof(nack_range_t);
+  const uint8_t *bitmap = pkt->payload + len_ranges;
+  uint16_t num_bits = (len_pkt - LEN_NACK_HEADER - len_ranges) * 8;
+
+  // bitmap first
+  while (iter->bit_index < num_bits) {
+    uint16_t bit = iter->bit_index;
+    uint8_t bits = bitmap[bit / 8] >> (bit % 8);
+
+    // skip to the next byte if no more bits are set in this one
+    if (bits == 0) {
+      iter->bit_index = ((bit / 8) + 1) * 8;
+      continue;
+    }
+
+    bit += __builtin_ctz(bits);
+    iter->bit_index = bit + 1;
+
+    *block_no = pkt->base_block_no + bit;
+    return true;
+  }
+
+  // then ranges
+  while (iter->range_index < pkt->num_ranges) {
+    if (iter->range_offset < ranges[iter->range_index].num_blocks) {
+      *block_no = pkt->base_block_no + ranges[iter->range_index].offset + iter->range_offset;
+      iter->range_offset ++;
+      return true;
+    }
+
+    iter->range_index ++;
+    iter->range_offset = 0;
+  }
+
+  return false;
+}
+
+// bitmaps are arrays of words, bit i is bit i % 32 of word i / 32
+static inline bool bitmapTest(const uint32_t *bitmap, uint32_t i) {
+  return bitmap[i / 32] & (1UL << (i % 32));
+}
+
+static inline void bitmapSet(uint32_t *bitmap, uint32_t i) {
+  bitmap[i / 32] |= 1UL << (i % 32);
+}
+
+static inline void bitmapClear(uint32_t *bitmap, uint32_t i) {
+  bitmap[i / 32] &= ~(1UL << (i % 32));
+}
+
+// index of the first bit from first up to (not including) last that is set (clear if !set), last if there is none.
+// Skips 32 bits at a time, so it costs one step per word rather than per bit
+uint32_t bitmapFind(const uint32_t *bitmap, uint32_t first, uint32_t last, bool set);
 
 typedef struct __attribute__((__packed__)) packet_ack {
   enum packet_types opcode:8;
   uint16_t block_no;
+  // window size the client wants from now on (0 to keep the current size)
+  uint16_t window_size;
+  // number of windows acknowledged before this one (wrapping at 255), so that the server
+  // can tell a repeated ACK for the previous window apart from an ACK for the current window
+  uint8_t window_no;
 
-  packet_ack(): opcode(TYPE_ACK) {}
+  packet_ack(): opcode(TYPE_ACK), window_size(0), window_no(0) {}
 } packet_ack_t;
 
+// length of packet_ack sent by clients that do not adapt the window size
+const uint8_t LEN_ACK_BASE = 3;
+
 typedef struct __attribute__((__packed__)) packet_err {
   enum packet_types opcode:8;
   enum err_types err:8;
@@ -73,7 +515,36 @@ typedef enum {
   RECV_STATE,
   RECV_BAD_OPCODE,
   RECV_BAD_AFT_ACK,
-  RECV_BAD_BLOCK_NO
+  RECV_BAD_BLOCK_NO,
+  RECV_NO_SESSION,
+  RECV_QUEUE_FULL,
+  RECV_BAD_OPTION
 } recv_result_t;
 
+// a callback given either as a plain function or as a function taking a context pointer (given back as its first argument),
+// so that one function can serve many clients or servers and tell them apart
+template <typename R, typename... Args>
+class MtftpCallback {
+  public:
+    MtftpCallback &operator=(R (*_fn)(Args...)) {
+      fn = _fn;
+      fn_ctx = NULL;
+      ctx = NULL;
+      return *this;
+    };
+
+    void set(R (*_fn_ctx)(void *ctx, Args...), void *_ctx) {
+      fn = NULL;
+      fn_ctx = _fn_ctx;
+      ctx = _ctx;
+    };
+
+    explicit operator bool() const { return fn != NULL || fn_ctx != NULL; };
+    R operator()(Args... args) const { return fn_ctx != NULL ? fn_ctx(ctx, args...) : fn(args...); };
+  private:
+    R (*fn)(Args...) = NULL;
+    R (*fn_ctx)(void *ctx, Args...) = NULL;
+    void *ctx = NULL;
+};
+
 #endif
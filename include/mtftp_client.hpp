@@ -2,11 +2,35 @@
 #define MTFTP_CLIENT_H
 
 #include "mtftp.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/ringbuf.h"
+#include "mtftp_packet_queue.hpp"
+#include "mtftp_os.h"
+
+// client built for blocks of LEN_BLOCK bytes sent in packets of up to LEN_PACKET bytes, with a ring of LEN_BUFFER blocks
+// for the blocks received ahead of the next one expected (every buffer is sized from these when the client is built)
+template <uint16_t LEN_BLOCK = CONFIG_LEN_BLOCK, uint16_t LEN_BUFFER = CONFIG_LEN_MTFTP_BUFFER, uint16_t LEN_PACKET = LEN_MAX_PACKET>
+class BasicMtftpClient {
+  static_assert(LEN_DATA_HEADER + LEN_BLOCK <= LEN_PACKET, "a DATA packet does not fit in LEN_PACKET");
+  static_assert(LEN_PACKET <= LEN_PACKET_LIMIT, "LEN_PACKET is larger than LEN_PACKET_LIMIT");
+  static_assert(LEN_BUFFER > 0, "LEN_BUFFER must be at least 1");
 
-class MtftpClient {
   public:
+    // the packets at the sizes of this client
+    typedef basic_packet_data<LEN_BLOCK> packet_data_t;
+    typedef basic_packet_parity<LEN_BLOCK> packet_parity_t;
+    typedef basic_packet_rtx<LEN_PACKET> packet_rtx_t;
+    typedef basic_packet_nack<LEN_PACKET> packet_nack_t;
+    typedef basic_packet_brq<LEN_PACKET> packet_brq_t;
+    typedef basic_packet_drq<LEN_PACKET> packet_drq_t;
+    typedef BasicMtftpPacketQueue<LEN_PACKET> packet_queue_t;
+
+    static constexpr uint8_t LEN_RETRANSMIT = lenRetransmit(LEN_PACKET);
+    static constexpr uint8_t LEN_BATCH = lenBatch(LEN_PACKET);
+    static constexpr uint8_t LEN_DRQ_CHUNKS = lenDrqChunks(LEN_PACKET);
+
+    // upper bound of the retransmission timeout (us). The server ends a session CONFIG_TIMEOUT after its last packet,
+    // and the client only starts counting from the last packet it received, so a few retries have to fit in before that
+    static constexpr int64_t RTO_MAX = CONFIG_TIMEOUT / 3;
+
     enum client_state {
       STATE_IDLE,
       STATE_TRANSFER,  // RRQ sent, receiving window
@@ -23,56 +47,353 @@ class MtftpClient {
       "NoChange"
     };
 
-    MtftpClient();
-    ~MtftpClient();
+    // persists how far each file has been read, so that a read can carry on from there after a reboot
+    typedef struct checkpoint_store {
+      // returns false if there is no checkpoint for file_index
+      bool (*load)(uint16_t file_index, uint32_t *file_offset);
+      // every byte of the file before file_offset has been written (writeFile returned true)
+      void (*save)(uint16_t file_index, uint32_t file_offset);
+      // the file has been read to the end
+      void (*clear)(uint16_t file_index);
+    } checkpoint_store_t;
+
+    // as checkpoint_store_t, the callbacks are given the ctx passed to setCheckpointStore as their first argument
+    typedef struct checkpoint_store_ctx {
+      bool (*load)(void *ctx, uint16_t file_index, uint32_t *file_offset);
+      void (*save)(void *ctx, uint16_t file_index, uint32_t file_offset);
+      void (*clear)(void *ctx, uint16_t file_index);
+    } checkpoint_store_ctx_t;
+
+    // counters of the current (or last) read, from beginRead/beginBatchRead/beginDeltaRead until it ends
+    typedef struct client_stats {
+      // DATA packets received, blocks that had already been received and blocks received ahead of the next one expected
+      uint32_t blocks_received;
+      uint32_t duplicates;
+      uint32_t out_of_order;
+      // blocks dropped for lack of room in the ring (LEN_BUFFER) and the most slots of it in use at once
+      uint32_t ring_drops;
+      uint16_t ring_high_water;
+      // RTX/NACK packets sent and the blocks requested in them
+      uint32_t rtx_sent;
+      uint32_t blocks_requested;
+      uint32_t retries;
+      uint32_t recovered;
+      uint32_t crc_errors;
+      // packets dropped because the packet queue was full, and its high water mark (since init)
+      uint32_t packet_drops;
+      uint16_t packet_high_water;
+      // round trip times (us) of the RRQ/RTX/ACKs answered without being resent
+      uint32_t rtt_samples;
+      int64_t rtt_min;
+      int64_t rtt_avg;
+      int64_t rtt_max;
+      // bytes given to writeFile, time (us) the read has been running and bytes written per second over it
+      uint32_t bytes_written;
+      int64_t time;
+      uint32_t goodput;
+    } client_stats_t;
+
+    BasicMtftpClient();
+    ~BasicMtftpClient();
 
     void init(
       bool (*_writeFile)(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
-      void (*_sendPacket)(const uint8_t *data, uint8_t len)
+      void (*_sendPacket)(const uint8_t *data, mtftp_len_t<LEN_PACKET> len)
+    );
+
+    // as init, the callbacks are given ctx as their first argument
+    void init(
+      bool (*_writeFile)(void *ctx, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+      void (*_sendPacket)(void *ctx, const uint8_t *data, mtftp_len_t<LEN_PACKET> len),
+      void *ctx
     );
 
+    // each callback can also be given with a context pointer, which it is called with as its first argument
     void setOnIdleCb(void (*_onIdle)());
+    void setOnIdleCb(void (*_onIdle)(void *ctx), void *ctx) { onIdle.set(_onIdle, ctx); };
     void setOnTimeoutCb(void (*_onTimeout)());
+    void setOnTimeoutCb(void (*_onTimeout)(void *ctx), void *ctx) { onTimeout.set(_onTimeout, ctx); };
     void setOnTransferEndCb(void (*_onTransferEnd)());
+    void setOnTransferEndCb(void (*_onTransferEnd)(void *ctx), void *ctx) { onTransferEnd.set(_onTransferEnd, ctx); };
+    // called once the final block of each file has been written, file_offset is the end of the file
+    void setOnFileEndCb(void (*_onFileEnd)(uint16_t file_index, uint32_t file_offset));
+    void setOnFileEndCb(void (*_onFileEnd)(void *ctx, uint16_t file_index, uint32_t file_offset), void *ctx) {
+      onFileEnd.set(_onFileEnd, ctx);
+    };
+    // coalesce received blocks into CONFIG_LEN_WRITE_BUFFER aligned writes (default)
+    // or call writeFile once for every block
+    void setWriteCoalescing(bool enable);
+    // grow the window while blocks arrive without loss and shrink it when blocks are lost (default),
+    // or keep the window size given to beginRead for the whole transfer
+    void setAdaptiveWindow(bool enable);
+    // largest window the client asks for (CONFIG_WINDOW_SIZE_MAX by default), eg its share of a channel shared with other reads.
+    // Takes effect from the next window of a read in progress
+    void setWindowLimit(uint16_t limit) { window_limit = limit > CONFIG_WINDOW_SIZE_MIN ? limit : CONFIG_WINDOW_SIZE_MIN; };
+    // saves a checkpoint with every ACK, beginRead/beginBatchRead then start each file after its checkpoint
+    // (if it is past the offset given) and a read that times out is started again from its checkpoint
+    // up to CONFIG_MAX_RESUMES times, keeping any blocks buffered after the missing ones
+    void setCheckpointStore(const checkpoint_store_t *store);
+    void setCheckpointStore(const checkpoint_store_ctx_t *store, void *ctx);
+    // reads the copy of a file the client already holds (needed for beginDeltaRead), returns false on error
+    void setReadBasisCb(bool (*_readBasis)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br));
+    void setReadBasisCb(
+      bool (*_readBasis)(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br), void *ctx
+    ) {
+      readBasis.set(_readBasis, ctx);
+    };
+    // longest time (ms) loop() sleeps for a packet when none is queued (100 by default),
+    // 0 so that loop() never blocks (eg when one thread drives many clients)
+    void setRecvTimeout(uint32_t timeout_ms) { recv_timeout = timeout_ms; };
+    // source of the client's trace events (below TRACE_SERVER, 0 by default), to tell clients apart in a trace
+    void setTraceId(uint8_t id) { trace_id = id; };
     void onPacketRecv(const uint8_t *data, uint16_t len_data);
-    void beginRead(uint16_t file_index, uint32_t file_offset, uint8_t window_size);
+    // options is a combination of rrq_options (OPT_COMPRESS is dropped if the server does not support it), parity_blocks (up to CONFIG_MAX_PARITY_BLOCKS) are sent
+    // by the server after every window so that as many lost blocks can be rebuilt without an RTX
+    void beginRead(
+      uint16_t file_index,
+      uint32_t file_offset,
+      uint16_t window_size = CONFIG_WINDOW_SIZE,
+      uint8_t options = 0,
+      uint8_t parity_blocks = 0
+    );
+    // reads num_files (up to LEN_BATCH) files one after the other in a single transfer
+    void beginBatchRead(const batch_file_t *files, uint8_t num_files, uint16_t window_size = CONFIG_WINDOW_SIZE);
+    // reads file_index from the start, only sending the parts that are not in the len_basis bytes of the copy
+    // readBasis gives (signatures of up to CONFIG_DELTA_CHUNKS chunks of chunk_size are sent, 0 sizes them to
+    // the copy). The copy is read while the file is written, so it must not be the file being written to.
+    // Reads the whole file if the server does not support delta reads
+    void beginDeltaRead(uint16_t file_index, uint32_t len_basis, uint16_t window_size = CONFIG_WINDOW_SIZE, uint16_t chunk_size = 0);
+    // handles one queued packet (sleeping up to the receive timeout for one if none is queued) and runs the timers
     void loop(void);
+    // handles every queued packet and runs the timers without blocking, returns the next deadline (NO_DEADLINE while idle).
+    // Call it again when a packet is received or once mtftpTime() reaches the deadline, eg with wait()
+    int64_t poll(void);
+    // mtftpTime() by which the timers need to run again (the retransmission or read timeout), NO_DEADLINE while idle
+    int64_t getDeadline(void);
+    // sleeps until a packet is queued (returns true) or until deadline
+    bool wait(int64_t deadline);
     client_state getState(void) { return state; };
+    uint16_t getWindowSize(void) { return params.window_size; };
+    // number of RRQ/RTX/ACK packets resent because no response arrived before the retransmission timeout
+    uint32_t getRetries(void) { return retries; };
+    // number of lost blocks rebuilt from parity blocks
+    uint32_t getRecovered(void) { return recovered; };
+    // number of windows read again because the crc32c of their blocks did not match (OPT_CRC)
+    uint32_t getCrcErrors(void) { return crc_errors; };
+    // number of times the current read has been started again after a timeout
+    uint8_t getResumes(void) { return params.num_resumes; };
+    // current retransmission timeout (us)
+    int64_t getRto(void) { return rto; };
+    uint32_t getPacketDrops(void) { return packet_queue.getDrops(); };
+    uint16_t getPacketHighWater(void) { return packet_queue.getHighWater(); };
+    // packets received and not yet handled by loop() (one is handled per call) or poll()
+    uint16_t getPacketsQueued(void) { return packet_queue.size(); };
+    client_stats_t getStats(void);
   private:
+    static constexpr const char *TAG = "mtftp-client";
+
+    // lower bound of the retransmission timeout (us), well above the time to send one packet
+    static constexpr int64_t RTO_MIN = 2000;
+
+    // variation in the time per block (us) that is put down to jitter rather than a busy channel
+    static constexpr int64_t BLOCK_TIME_JITTER = 1000;
+
     enum client_state state;
 
     struct {
       uint16_t file_index;
       uint32_t file_offset;
+      // end of the data of file_index written without an error, file_offset once every write succeeds
+      uint32_t durable_offset;
+      // durable_offset last given to checkpointSave
+      uint32_t saved_offset;
+      uint8_t num_resumes;
+      // window size to go back to once the blocks missing before those kept on resume have arrived, 0 if none
+      uint16_t resume_window_size;
+
+      // batch read: files requested (0 for a RRQ), batch_file is the one being written
+      batch_file_t batch_files[LEN_BATCH];
+      uint8_t num_batch_files;
+      uint8_t batch_file;
+      // files left at the start of the window, final blocks of files received in the window and the largest of them
+      // (once every file left has ended in the window, the largest is the end of the batch)
+      uint8_t batch_window_files;
+      uint8_t batch_num_ends;
+      int32_t batch_last_end;
 
       uint16_t window_size;
+      uint8_t options;
 
       // int32_t to represent -1 to 65535
       // stores the block no of the last successfully received block
       int32_t block_no;
       int32_t largest_block_no;
-      uint8_t len_largest_block;
+      mtftp_len_t<LEN_BLOCK> len_largest_block;
+      // block no of the final (partial) block, -1 until received
+      int32_t eof_block_no;
 
       int64_t time_last_packet = 0;
 
-      // block number of the first block in the buffer
-      int32_t buffer_base_block_no;
+      // blocks received ahead of block_no (stream_expected when streaming), buffer is used as a ring
+      // and ring_slot is the slot of the next block expected
       uint8_t *buffer = NULL;
-      uint8_t num_missing;
-      // 0xFFFF for unused slot, no where near enough memory to buffer 65535 blocks
-      uint16_t missing_block_nos[CONFIG_LEN_MTFTP_BUFFER];
+      uint16_t ring_slot;
+      // slots of buffer holding a block (bitmap, see bitmapFind) and the length of the block in each of them
+      uint32_t ring_filled[(LEN_BUFFER + 31) / 32];
+      mtftp_len_t<LEN_BLOCK> ring_len[LEN_BUFFER];
+      // parity blocks requested after every window, for each group (the blocks whose block_no % parity_blocks == g)
+      // parity holds the XOR of its parity block (once received) and the blocks of the group buffered so far
+      uint8_t parity_blocks;
+      uint8_t *parity = NULL;
+      uint8_t parity_received;
+      uint16_t parity_num_blocks[MAX_PARITY_BLOCKS];
+
+      // OPT_COMPRESS: each block is unpacked here (MAX_COMPRESS_INPUT bytes) before it is written,
+      // a block that cannot be unpacked ends the transfer
+      uint8_t *unpack_buffer = NULL;
+      bool unpack_failed;
+
+      // delta read: size of the chunks of the copy (0 if not a delta read) and the number of chunks signed,
+      // each chunk is copied through unpack_buffer
+      uint16_t delta_chunk_size;
+      uint16_t delta_num_chunks;
+
+      // OPT_CRC: crc32c of the blocks of the window received in order (they are held in the ring until it has been
+      // checked), the crc sent by the server (once crc_received) and the number of times the window has been read again
+      uint32_t window_crc;
+      uint32_t crc_expected;
+      bool crc_received;
+      uint8_t num_refetches;
+
+      // block no the server will retransmit last in response to the last RTX sent
+      uint16_t last_rtx_block_no;
+
+      // OPT_STREAM: next block no expected
+      uint16_t stream_expected;
+      // largest block no received (0xFFFF before the first), missing blocks up to stream_nacked have been requested
+      uint16_t stream_largest;
+      uint16_t stream_nacked;
+      // blocks written since the last ACK
+      uint16_t stream_unacked;
+      bool stream_dup_acked;
+      int64_t time_last_progress;
+
+      // last RRQ/RTX/ACK sent, resent if no response arrives within rto (len_ctrl_pkt is 0 if none is pending)
+      uint8_t ctrl_pkt[LEN_PACKET];
+      mtftp_len_t<LEN_PACKET> len_ctrl_pkt;
+      int64_t time_ctrl_sent;
+      // time the packets the server still sends ahead of its response (the parity blocks not yet received) take to arrive
+      int64_t ctrl_drain;
+      // set once a response to ctrl_pkt has been timed
+      bool ctrl_answered;
+      // times ctrl_pkt (or the stream ACK/NACK) has been resent without a response
+      uint8_t num_retries;
+      // number of windows acknowledged
+      uint8_t window_no;
+
+      // adaptive window: RTX/NACKs sent and blocks received since the window size last changed
+      uint16_t num_rtx_sent;
+      uint16_t window_blocks;
+      int64_t time_window_start;
+      // shortest time per block seen in a window without loss, 0 until measured
+      int64_t min_block_time;
+      // first block received in the window and when it arrived, for the rate of the window until min_block_time is known
+      int32_t first_block_no;
+      int64_t time_first_block;
 
-      RingbufHandle_t packet_buffer;
+      // blocks staged to be written at write_offset
+      uint8_t *write_buffer = NULL;
+      uint32_t write_offset;
+      uint16_t len_write = 0;
     } params;
 
-    bool (*writeFile)(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) = NULL;
-    void (*sendPacket)(const uint8_t *data, uint8_t len) = NULL;
-    void (*onIdle)() = NULL;
-    void (*onTimeout)() = NULL;
-    void (*onTransferEnd)() = NULL;
+    bool write_coalescing = CONFIG_LEN_WRITE_BUFFER > 0;
+    bool adaptive_window = true;
+    uint16_t window_limit = CONFIG_WINDOW_SIZE_MAX;
 
+    // smoothed round trip time and its variation, 0 until the first sample
+    int64_t srtt = 0;
+    int64_t rttvar = 0;
+    // retransmission timeout
+    int64_t rto = CONFIG_TIMEOUT_CLIENT;
+    uint32_t retries = 0;
+    uint32_t recovered = 0;
+    uint32_t crc_errors = 0;
+
+    // only counted in loop(), the rest of the fields are filled in by getStats
+    client_stats_t stats = {};
+    int64_t stats_rtt_sum = 0;
+    int64_t stats_time_start = 0;
+    int64_t stats_time_end = 0;
+    uint32_t stats_packet_drops = 0;
+
+    packet_queue_t packet_queue;
+    // given by onPacketRecv so that loop() can sleep while the queue is empty
+    mtftp_signal_t packet_ready;
+    uint32_t recv_timeout = 100;
+    uint8_t trace_id = 0;
+
+    MtftpCallback<bool, uint16_t, uint32_t, const uint8_t *, uint16_t> writeFile;
+    MtftpCallback<void, const uint8_t *, mtftp_len_t<LEN_PACKET>> sendPacket;
+    MtftpCallback<void> onIdle;
+    MtftpCallback<void> onTimeout;
+    MtftpCallback<void> onTransferEnd;
+    MtftpCallback<void, uint16_t, uint32_t> onFileEnd;
+    MtftpCallback<bool, uint16_t, uint32_t, uint8_t *, uint16_t, uint16_t *> readBasis;
+    // the checkpoint store, unset without one
+    MtftpCallback<bool, uint16_t, uint32_t *> checkpointLoad;
+    MtftpCallback<void, uint16_t, uint32_t> checkpointSave;
+    MtftpCallback<void, uint16_t> checkpointClear;
+
+    void startRead(uint16_t window_size, uint8_t options, uint8_t parity_blocks);
+    uint32_t loadCheckpoint(uint16_t file_index, uint32_t file_offset);
+    void saveCheckpoint(void);
+    bool resume(void);
+    void sendDeltaRequest(void);
+    void sendReadRequest(void);
+    bool nextFile(void);
+    void write(const uint8_t *data, uint16_t len);
+    void flushWrites(void);
+    void sendControl(const uint8_t *data, uint16_t len);
+    void onRttSample(int64_t rtt);
+    bool retransmit(void);
+    void sendRtx(void);
+    void sendMissing(const nack_range_t *runs, uint16_t num_runs);
+    void sendAck(uint16_t block_no);
+    void onStreamStart(void);
+    void sendStreamNack(void);
+    client_state onStreamData(const packet_data_t *data_pkt, uint16_t len_block);
+    void adaptWindow(uint16_t num_blocks);
     void onWindowStart(void);
+    int32_t windowEnd(void);
+    int64_t drainTime(int32_t num_blocks);
+    bool ringFilled(uint16_t slot) { return bitmapTest(params.ring_filled, slot); };
+    uint16_t ringFind(uint16_t first, uint16_t last, bool filled);
+    uint16_t ringMissing(uint16_t first, uint16_t last, uint16_t block_no, nack_range_t *runs);
+    void ringClear(void);
+    bool flushRing(uint16_t *num_blocks);
+    bool writeBlocks(const uint8_t *blocks, uint16_t len);
+    bool unpackDelta(const uint8_t *block, uint16_t len_block);
+    bool storeBlock(uint16_t block_no, const uint8_t *block, uint16_t len_block);
+    void recoverBlocks(void);
+    client_state onWindowData(const packet_data_t *data_pkt, uint16_t len_block);
+    client_state onWindowParity(const packet_parity_t *parity_pkt);
+    client_state onWindowTail(void);
+    client_state onWindowCrc(const packet_crc_t *crc_pkt);
+    client_state refetchWindow(void);
     client_state onWindowEnd(void);
+    // handles a received packet, returns the state it leads to
+    client_state handlePacket(const uint8_t *data, uint16_t len_data);
+    // resends the RRQ/RTX/ACK or times the read out once they are due
+    void checkTimers(void);
+    void changeState(client_state new_state, bool timeout);
 };
 
+typedef BasicMtftpClient<> MtftpClient;
+
+#include "mtftp_client_impl.hpp"
+
+// the default sizes are built once, in mtftp_client.cpp
+extern template class BasicMtftpClient<>;
+
 #endif
@@ -0,0 +1,1937 @@
+// definitions of BasicMtftpClient, included by mtftp_client.hpp
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "mtftp_trace.h"
+
+#define MTFTP_CLIENT_TEMPLATE template <uint16_t LEN_BLOCK, uint16_t LEN_BUFFER, uint16_t LEN_PACKET>
+#define MTFTP_CLIENT BasicMtftpClient<LEN_BLOCK, LEN_BUFFER, LEN_PACKET>
+
+MTFTP_CLIENT_TEMPLATE
+MTFTP_CLIENT::BasicMtftpClient() : packet_queue(CONFIG_LEN_PACKET_QUEUE) {
+  params.buffer = (uint8_t *) malloc(LEN_BUFFER * LEN_BLOCK);
+  if (params.buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate data packet buffer");
+  }
+
+  assert(params.buffer != NULL);
+
+#if CONFIG_MAX_PARITY_BLOCKS > 0
+  params.parity = (uint8_t *) malloc(CONFIG_MAX_PARITY_BLOCKS * LEN_BLOCK);
+  if (params.parity == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate parity blocks");
+  }
+
+  assert(params.parity != NULL);
+#endif
+
+#if CONFIG_COMPRESSION || CONFIG_DELTA_CHUNKS > 0
+  params.unpack_buffer = (uint8_t *) malloc(MAX_COMPRESS_INPUT);
+  if (params.unpack_buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate unpack buffer");
+  }
+
+  assert(params.unpack_buffer != NULL);
+#endif
+
+  if (CONFIG_LEN_WRITE_BUFFER > 0) {
+    params.write_buffer = (uint8_t *) malloc(CONFIG_LEN_WRITE_BUFFER);
+    if (params.write_buffer == NULL) {
+      MTFTP_LOGW(TAG, "failed to allocate write buffer");
+    }
+
+    assert(params.write_buffer != NULL);
+  }
+
+  packet_ready = mtftpSignalCreate();
+
+  assert(packet_ready != NULL);
+}
+
+MTFTP_CLIENT_TEMPLATE
+MTFTP_CLIENT::~BasicMtftpClient() {
+  free(params.buffer);
+  free(params.parity);
+  free(params.unpack_buffer);
+  free(params.write_buffer);
+  mtftpSignalDelete(packet_ready);
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::init(
+    bool (*_writeFile)(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+    void (*_sendPacket)(const uint8_t *data, mtftp_len_t<LEN_PACKET> len)
+  ) {
+  state = STATE_IDLE;
+
+  writeFile = _writeFile;
+  sendPacket = _sendPacket;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::init(
+    bool (*_writeFile)(void *ctx, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+    void (*_sendPacket)(void *ctx, const uint8_t *data, mtftp_len_t<LEN_PACKET> len),
+    void *ctx
+  ) {
+  state = STATE_IDLE;
+
+  writeFile.set(_writeFile, ctx);
+  sendPacket.set(_sendPacket, ctx);
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setOnIdleCb(void (*_onIdle)()) {
+  onIdle = _onIdle;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setOnTimeoutCb(void (*_onTimeout)()) {
+  onTimeout = _onTimeout;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setOnTransferEndCb(void (*_onTransferEnd)()) {
+  onTransferEnd = _onTransferEnd;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setOnFileEndCb(void (*_onFileEnd)(uint16_t file_index, uint32_t file_offset)) {
+  onFileEnd = _onFileEnd;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setWriteCoalescing(bool enable) {
+  flushWrites();
+
+  write_coalescing = enable && CONFIG_LEN_WRITE_BUFFER > 0;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setAdaptiveWindow(bool enable) {
+  adaptive_window = enable;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setReadBasisCb(
+    bool (*_readBasis)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br)
+  ) {
+  readBasis = _readBasis;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setCheckpointStore(const checkpoint_store_t *store) {
+  checkpointLoad = store != NULL ? store->load : NULL;
+  checkpointSave = store != NULL ? store->save : NULL;
+  checkpointClear = store != NULL ? store->clear : NULL;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::setCheckpointStore(const checkpoint_store_ctx_t *store, void *ctx) {
+  if (store == NULL) {
+    setCheckpointStore((const checkpoint_store_t *) NULL);
+    return;
+  }
+
+  checkpointLoad.set(store->load, ctx);
+  checkpointSave.set(store->save, ctx);
+  checkpointClear.set(store->clear, ctx);
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_stats_t MTFTP_CLIENT::getStats(void) {
+  client_stats_t result = stats;
+
+  result.packet_drops = packet_queue.getDrops() - stats_packet_drops;
+  result.packet_high_water = packet_queue.getHighWater();
+  result.rtt_avg = stats.rtt_samples > 0 ? stats_rtt_sum / stats.rtt_samples : 0;
+
+  if (stats_time_start != 0) {
+    result.time = (state == STATE_IDLE ? stats_time_end : mtftpTime()) - stats_time_start;
+  }
+
+  result.goodput = result.time > 0 ? (int64_t) stats.bytes_written * 1000000 / result.time : 0;
+
+  return result;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::write(const uint8_t *data, uint16_t len) {
+  stats.bytes_written += len;
+
+  if (!write_coalescing) {
+    // anything after a failed write has to be read again, so the checkpoint stays before it
+    if (writeFile(params.file_index, params.file_offset, data, len) && params.durable_offset == params.file_offset) {
+      params.durable_offset += len;
+    }
+
+    // advance file_offset by the number of bytes we just wrote
+    params.file_offset += len;
+    return;
+  }
+
+#if CONFIG_LEN_WRITE_BUFFER > 0
+  while (len > 0) {
+    if (params.len_write == 0) {
+      params.write_offset = params.file_offset;
+    }
+
+    // stage up to the next CONFIG_LEN_WRITE_BUFFER aligned offset, so that
+    // every write apart from the first and the last is a whole aligned sector
+    uint16_t len_free = CONFIG_LEN_WRITE_BUFFER - (params.file_offset % CONFIG_LEN_WRITE_BUFFER);
+    uint16_t len_copy = len < len_free ? len : len_free;
+
+    memcpy(params.write_buffer + params.len_write, data, len_copy);
+    params.len_write += len_copy;
+    params.file_offset += len_copy;
+
+    data += len_copy;
+    len -= len_copy;
+
+    if (len_copy == len_free) {
+      flushWrites();
+    }
+  }
+#endif
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::flushWrites(void) {
+  if (params.len_write == 0) return;
+
+  MTFTP_LOGV(TAG, "flushing %d bytes at offset %d", params.len_write, params.write_offset);
+  bool written = writeFile(params.file_index, params.write_offset, params.write_buffer, params.len_write);
+
+  if (written && params.durable_offset == params.write_offset) {
+    params.durable_offset += params.len_write;
+  }
+
+  params.len_write = 0;
+}
+
+MTFTP_CLIENT_TEMPLATE
+uint32_t MTFTP_CLIENT::loadCheckpoint(uint16_t file_index, uint32_t file_offset) {
+  uint32_t checkpoint;
+
+  if (!checkpointLoad || !checkpointLoad(file_index, &checkpoint) || checkpoint <= file_offset) {
+    return file_offset;
+  }
+
+  MTFTP_LOGI(TAG, "resuming %d from checkpoint at offset %d", file_index, checkpoint);
+  return checkpoint;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::saveCheckpoint(void) {
+  if (!checkpointSave || params.durable_offset == params.saved_offset) return;
+
+  checkpointSave(params.file_index, params.durable_offset);
+  params.saved_offset = params.durable_offset;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::adaptWindow(uint16_t num_blocks) {
+  const char *TAG = "adaptWindow";
+
+  int64_t now = mtftpTime();
+  int64_t block_time = num_blocks > 0 ? (now - params.time_window_start) / num_blocks : 0;
+
+  uint16_t window_size = params.window_size;
+  // a stream cannot run further ahead than fits in the buffer, nor can a window held until its crc is checked,
+  // other windows can (blocks that do not fit are requested again once the blocks before them arrive)
+  uint16_t max_window_size = (params.options & (OPT_STREAM | OPT_CRC)) ? LEN_BUFFER : CONFIG_WINDOW_SIZE_MAX;
+  if (params.parity_blocks > 0 && max_window_size > MAX_PARITY_WINDOW_SIZE) {
+    max_window_size = MAX_PARITY_WINDOW_SIZE;
+  }
+  if (max_window_size > window_limit) {
+    max_window_size = window_limit;
+  }
+
+  if (params.num_rtx_sent > 0) {
+    // blocks were lost, back off
+    window_size /= 2;
+    if (window_size < CONFIG_WINDOW_SIZE_MIN) {
+      window_size = CONFIG_WINDOW_SIZE_MIN;
+    }
+  } else if (params.min_block_time > 0 && block_time > 2 * params.min_block_time + BLOCK_TIME_JITTER) {
+    // no loss, but blocks are taking twice as long as they can, the channel is busy
+    // so hold the window where it is
+  } else if (window_size < max_window_size) {
+    window_size += CONFIG_WINDOW_INCREASE;
+    if (window_size > max_window_size) {
+      window_size = max_window_size;
+    }
+  }
+
+  if (params.num_rtx_sent == 0 && block_time > 0 && (params.min_block_time == 0 || block_time < params.min_block_time)) {
+    params.min_block_time = block_time;
+  }
+
+  if (window_size != params.window_size) {
+    MTFTP_LOGD(TAG, "window size %d -> %d (%d rtx, %" PRId64 " us/block)", params.window_size, window_size, params.num_rtx_sent, block_time);
+  }
+
+  params.window_size = window_size;
+  params.num_rtx_sent = 0;
+  params.window_blocks = 0;
+  params.time_window_start = now;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::onWindowStart(void) {
+  params.block_no = -1;
+  params.largest_block_no = -1;
+  params.len_largest_block = 0;
+  params.first_block_no = -1;
+
+  params.eof_block_no = -1;
+
+  params.window_crc = 0;
+  params.crc_received = false;
+
+  params.batch_window_files = params.num_batch_files - params.batch_file;
+  params.batch_num_ends = 0;
+  params.batch_last_end = -1;
+
+  if (params.parity_blocks > 0) {
+    memset(params.parity, 0, params.parity_blocks * LEN_BLOCK);
+    memset(params.parity_num_blocks, 0, sizeof(params.parity_num_blocks));
+    params.parity_received = 0;
+  }
+}
+
+MTFTP_CLIENT_TEMPLATE
+int32_t MTFTP_CLIENT::windowEnd(void) {
+  // the window ends early at the final block of the file
+  return params.eof_block_no != -1 ? params.eof_block_no : params.window_size - 1;
+}
+
+// time (us) num_blocks blocks and the parity blocks of the window not yet received take to arrive,
+// at the fastest rate seen (or the rate of this window until that has been measured)
+MTFTP_CLIENT_TEMPLATE
+int64_t MTFTP_CLIENT::drainTime(int32_t num_blocks) {
+  int64_t block_time = params.min_block_time;
+  if (block_time == 0 && params.largest_block_no > params.first_block_no) {
+    block_time = (params.time_last_packet - params.time_first_block) / (params.largest_block_no - params.first_block_no);
+  }
+
+  if (num_blocks < 0) num_blocks = 0;
+
+  if (params.parity_blocks > 0) {
+    num_blocks += params.parity_blocks - __builtin_popcount(params.parity_received);
+  }
+
+  return num_blocks * block_time;
+}
+
+// position (from ring_slot) of the first slot from first up to last that is filled (or empty), last if there is none
+MTFTP_CLIENT_TEMPLATE
+uint16_t MTFTP_CLIENT::ringFind(uint16_t first, uint16_t last, bool filled) {
+  if (first >= last) return last;
+
+  // the positions run to the end of the buffer and then on from its start
+  uint16_t slot = (params.ring_slot + first) % LEN_BUFFER;
+  uint16_t num = last - first;
+  uint16_t len = LEN_BUFFER - slot < num ? LEN_BUFFER - slot : num;
+
+  uint16_t found = bitmapFind(params.ring_filled, slot, slot + len, filled);
+  if (found < slot + len) return first + (found - slot);
+  if (len == num) return last;
+
+  return first + len + bitmapFind(params.ring_filled, 0, num - len, filled);
+}
+
+// collects the empty slots from position first up to last into runs, block_no is the block at position 0
+MTFTP_CLIENT_TEMPLATE
+uint16_t MTFTP_CLIENT::ringMissing(uint16_t first, uint16_t last, uint16_t block_no, nack_range_t *runs) {
+  uint16_t num_runs = 0;
+
+  for (uint16_t start = ringFind(first, last, false); start < last; start = ringFind(start, last, false)) {
+    uint16_t end = ringFind(start, last, true);
+
+    runs[num_runs].offset = block_no + start;
+    runs[num_runs].num_blocks = end - start;
+    num_runs ++;
+
+    start = end;
+  }
+
+  return num_runs;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::ringClear(void) {
+  memset(params.ring_filled, 0, sizeof(params.ring_filled));
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::flushRing(uint16_t *num_blocks) {
+  *num_blocks = 0;
+
+  // with OPT_CRC the window is held from slot 0, once the ring has wrapped all of it has been counted
+  if ((params.options & OPT_CRC) && params.ring_slot == 0 && params.block_no != -1) {
+    return false;
+  }
+
+  while (ringFilled(params.ring_slot)) {
+    // blocks in consecutive slots are written together
+    uint16_t first_slot = params.ring_slot;
+    uint16_t len = 0;
+    bool file_end = false;
+
+    do {
+      uint16_t len_block = params.ring_len[params.ring_slot];
+
+      len += len_block;
+      file_end = len_block < LEN_BLOCK;
+
+      // with OPT_CRC the blocks stay in the ring until the crc of the window has been checked
+      if (!(params.options & OPT_CRC)) {
+        bitmapClear(params.ring_filled, params.ring_slot);
+      }
+      params.ring_slot = (params.ring_slot + 1) % LEN_BUFFER;
+      (*num_blocks) ++;
+    } while (!file_end && params.ring_slot != 0 && ringFilled(params.ring_slot));
+
+    if (params.options & OPT_CRC) {
+      // the blocks as they were sent, before they are unpacked
+      params.window_crc = crc32c(params.window_crc, params.buffer + (first_slot * LEN_BLOCK), len);
+
+      // the window starts at slot 0 and fits in the ring, it is written by onWindowEnd once checked
+      // (and the file only ends then)
+      if (file_end || params.ring_slot == 0) return file_end;
+      continue;
+    }
+
+    if (!writeBlocks(params.buffer + (first_slot * LEN_BLOCK), len)) {
+      return true;
+    }
+
+    if (file_end && !nextFile()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::writeBlocks(const uint8_t *blocks, uint16_t len) {
+  if (params.options & OPT_COMPRESS) {
+    // every block is unpacked on its own
+    for (uint16_t offset = 0; offset < len; offset += LEN_BLOCK) {
+      uint16_t len_block = len - offset < LEN_BLOCK ? len - offset : LEN_BLOCK;
+      uint16_t len_data;
+
+      if (!decompressBlock(blocks + offset, len_block, params.unpack_buffer, &len_data)) {
+        MTFTP_LOGE(TAG, "failed to unpack block at offset %d", params.file_offset);
+
+        params.unpack_failed = true;
+        return false;
+      }
+
+      write(params.unpack_buffer, len_data);
+    }
+  } else if (params.delta_chunk_size > 0) {
+    for (uint16_t offset = 0; offset < len; offset += LEN_BLOCK) {
+      uint16_t len_block = len - offset < LEN_BLOCK ? len - offset : LEN_BLOCK;
+
+      if (!unpackDelta(blocks + offset, len_block)) {
+        MTFTP_LOGE(TAG, "failed to unpack delta block at offset %d", params.file_offset);
+
+        params.unpack_failed = true;
+        return false;
+      }
+    }
+  } else {
+    write(blocks, len);
+  }
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::unpackDelta(const uint8_t *block, uint16_t len_block) {
+  uint16_t pos = 0;
+
+  while (pos < len_block) {
+    uint8_t token = block[pos ++];
+
+    if (token < 0x80) {
+      if (pos + token > len_block) return false;
+
+      write(block + pos, token);
+      pos += token;
+    } else {
+      if (pos + 2 > len_block) return false;
+
+      uint16_t num_chunks = (token & 0x7F) + 1;
+      uint16_t chunk = block[pos] | (block[pos + 1] << 8);
+      pos += 2;
+
+      if (chunk + num_chunks > params.delta_num_chunks) return false;
+
+      // copied a chunk at a time through unpack_buffer
+      for (uint16_t i = 0; i < num_chunks; i++) {
+        uint16_t br;
+
+        if (
+          !readBasis(params.file_index, (chunk + i) * params.delta_chunk_size, params.unpack_buffer, params.delta_chunk_size, &br) ||
+          br != params.delta_chunk_size
+        ) {
+          return false;
+        }
+
+        write(params.unpack_buffer, params.delta_chunk_size);
+      }
+    }
+  }
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::nextFile(void) {
+  const char *TAG = "nextFile";
+
+  flushWrites();
+
+  if (checkpointSave) {
+    if (params.durable_offset == params.file_offset) {
+      checkpointClear(params.file_index);
+    } else {
+      // a write failed, the file has to be read again from there
+      checkpointSave(params.file_index, params.durable_offset);
+    }
+
+    params.saved_offset = params.durable_offset;
+  }
+
+  if (onFileEnd) onFileEnd(params.file_index, params.file_offset);
+
+  if (params.batch_file + 1 >= params.num_batch_files) {
+    return false;
+  }
+
+  // the next block is the start of the next file in the batch
+  params.batch_file ++;
+  params.file_index = params.batch_files[params.batch_file].file_index;
+  params.file_offset = params.batch_files[params.batch_file].file_offset;
+  params.durable_offset = params.file_offset;
+  params.saved_offset = params.file_offset;
+
+  MTFTP_LOGD(TAG, "file %d of %d (index=%d)", params.batch_file + 1, params.num_batch_files, params.file_index);
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendControl(const uint8_t *data, uint16_t len) {
+  memcpy(params.ctrl_pkt, data, len);
+  params.len_ctrl_pkt = len;
+  params.time_ctrl_sent = mtftpTime();
+  // the server only answers once the rest of the window has been sent
+  params.ctrl_drain = (params.options & OPT_STREAM) ? 0 : drainTime(0);
+  params.ctrl_answered = false;
+  // a new packet, its retries are counted (and its response timed) from the start
+  params.num_retries = 0;
+
+  sendPacket(data, len);
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::onRttSample(int64_t rtt) {
+  // RFC 6298
+  if (srtt == 0) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  } else {
+    int64_t delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+
+    rttvar = (3 * rttvar + delta) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+
+  rto = srtt + 4 * rttvar;
+
+  if (rto < RTO_MIN) rto = RTO_MIN;
+  if (rto > RTO_MAX) rto = RTO_MAX;
+
+  MTFTP_LOGV(TAG, "rtt=%" PRId64 " srtt=%" PRId64 " rttvar=%" PRId64 " rto=%" PRId64, rtt, srtt, rttvar, rto);
+
+  if (stats.rtt_samples == 0 || rtt < stats.rtt_min) stats.rtt_min = rtt;
+  if (rtt > stats.rtt_max) stats.rtt_max = rtt;
+  stats_rtt_sum += rtt;
+  stats.rtt_samples ++;
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::retransmit(void) {
+  const char *TAG = "retransmit";
+
+  if (params.num_retries >= CONFIG_MAX_RETRIES) {
+    MTFTP_LOGW(TAG, "no response after %d retries", params.num_retries);
+    return false;
+  }
+
+  // the packets below are the same request sent again, sendControl would start the count from 0
+  uint8_t num_retries = params.num_retries + 1;
+  retries ++;
+  stats.retries ++;
+
+  MTFTP_TRACE(TRACE_RETRY, trace_id, num_retries, rto);
+
+  // back off until a response arrives
+  rto *= 2;
+  if (rto > RTO_MAX) rto = RTO_MAX;
+
+  MTFTP_LOGD(TAG, "retry %d in state %s, rto=%" PRId64, num_retries, client_state_str[state], rto);
+
+  // no block of the stream has arrived, the RRQ itself may have been lost
+  bool stream_started = params.stream_largest != 0xFFFF || params.ctrl_pkt[0] != TYPE_READ_REQUEST;
+
+  if ((params.options & OPT_STREAM) && stream_started) {
+    sendAck(params.stream_expected - 1);
+
+    // request every missing block again
+    params.stream_nacked = params.stream_expected - 1;
+    if (params.stream_largest != 0xFFFF) {
+      sendStreamNack();
+    }
+
+    params.time_last_progress = mtftpTime();
+  } else if (state == STATE_AWAIT_RTX) {
+    // some of the blocks may have arrived since the RTX was sent, only ask for the rest
+    sendRtx();
+  } else {
+    sendPacket(params.ctrl_pkt, params.len_ctrl_pkt);
+    params.time_ctrl_sent = mtftpTime();
+  }
+
+  params.num_retries = num_retries;
+  // anything the server had to send ahead of the response has had time to arrive
+  params.ctrl_drain = 0;
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendRtx(void) {
+  if (params.block_no >= windowEnd()) {
+    // every block has been written but the crc that follows the final block has not arrived,
+    // ask for the final block again
+    nack_range_t run;
+    run.offset = windowEnd();
+    run.num_blocks = 1;
+
+    sendMissing(&run, 1);
+    return;
+  }
+
+  // every empty slot up to the end of the window is missing, blocks that do not fit
+  // in the buffer yet are requested once the blocks before them have been written
+  int32_t num_blocks = windowEnd() - params.block_no;
+  if (num_blocks > LEN_BUFFER) {
+    num_blocks = LEN_BUFFER;
+  }
+
+  // collect the missing block nos into runs of consecutive blocks
+  nack_range_t runs[LEN_BUFFER];
+  uint16_t num_runs = ringMissing(0, num_blocks, params.block_no + 1, runs);
+
+  sendMissing(runs, num_runs);
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendMissing(const nack_range_t *runs, uint16_t num_runs) {
+  const char *TAG = "sendMissing";
+
+  params.num_rtx_sent ++;
+
+  packet_nack_t nack_pkt;
+  uint16_t num_runs_nack = num_runs;
+  uint16_t len_nack = nackEncode(&nack_pkt, runs, &num_runs_nack);
+
+  uint32_t num_missing = 0;
+  for (uint16_t i = 0; i < num_runs; i++) {
+    num_missing += runs[i].num_blocks;
+  }
+
+  stats.rtx_sent ++;
+  stats.blocks_requested += num_missing;
+
+  MTFTP_TRACE(TRACE_RTX_TX, trace_id, num_missing, num_runs);
+  for (uint16_t i = 0; i < num_runs; i++) {
+    MTFTP_TRACE(TRACE_RTX_RUN, trace_id, runs[i].offset, runs[i].num_blocks);
+  }
+
+  uint16_t len_rtx = LEN_RTX_HEADER + (num_missing * sizeof(uint16_t));
+
+  // use the plain list of block nos if it is no longer than the NACK
+  if (num_missing <= LEN_RETRANSMIT && len_rtx <= len_nack) {
+    packet_rtx_t rtx_pkt;
+
+    rtx_pkt.num_elements = 0;
+
+    for (uint16_t i = 0; i < num_runs; i++) {
+      for (uint16_t j = 0; j < runs[i].num_blocks; j++) {
+        rtx_pkt.block_nos[rtx_pkt.num_elements ++] = runs[i].offset + j;
+      }
+    }
+
+    params.last_rtx_block_no = rtx_pkt.block_nos[rtx_pkt.num_elements - 1];
+
+    MTFTP_LOGD(TAG, "sending rtx for %d block(s)", rtx_pkt.num_elements);
+    sendControl((uint8_t *) &rtx_pkt, len_rtx);
+  } else {
+    params.last_rtx_block_no = nackLast(&nack_pkt, len_nack);
+
+    MTFTP_LOGD(TAG, "sending nack for %d block(s) in %d bytes", nackCount(&nack_pkt, len_nack), len_nack);
+    sendControl((uint8_t *) &nack_pkt, len_nack);
+  }
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendAck(uint16_t block_no) {
+  // data has to be written out before it is acknowledged
+  flushWrites();
+  saveCheckpoint();
+
+  packet_ack_t ack_pkt;
+  ack_pkt.block_no = block_no;
+  ack_pkt.window_no = params.window_no;
+
+  // a limit set since the last ACK takes effect from the next window
+  if (params.window_size > window_limit) {
+    params.window_size = window_limit;
+  }
+
+  ack_pkt.window_size = params.window_size;
+
+  MTFTP_TRACE(TRACE_ACK_TX, trace_id, block_no, params.window_no | ((uint32_t) params.window_size << 16));
+
+  sendControl((uint8_t *) &ack_pkt, sizeof(ack_pkt));
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::onStreamStart(void) {
+  params.stream_expected = 0;
+  params.ring_slot = 0;
+  params.stream_largest = 0xFFFF;
+  params.stream_nacked = 0xFFFF;
+  params.stream_unacked = 0;
+  params.stream_dup_acked = false;
+  params.time_last_progress = mtftpTime();
+
+  ringClear();
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendStreamNack(void) {
+  // missing blocks between the next block expected and the largest block received
+  // that have not been requested yet
+  uint16_t num_ahead = params.stream_largest - params.stream_expected;
+  // every block up to the largest has been written (the largest is behind the next block expected)
+  if (num_ahead >= LEN_BUFFER) return;
+
+  uint16_t first = (uint16_t) (params.stream_nacked + 1 - params.stream_expected) <= num_ahead ?
+    params.stream_nacked + 1 - params.stream_expected : 0;
+
+  nack_range_t runs[LEN_BUFFER];
+  uint16_t num_runs = ringMissing(first, num_ahead, params.stream_expected, runs);
+
+  params.stream_nacked = params.stream_largest;
+
+  if (num_runs > 0) {
+    sendMissing(runs, num_runs);
+  }
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::onStreamData(const packet_data_t *data_pkt, uint16_t len_block) {
+  // position of the block relative to the next block expected
+  uint16_t ahead = data_pkt->block_no - params.stream_expected;
+
+  if (ahead >= LEN_BUFFER) {
+    if (ahead >= 0x8000) {
+      stats.duplicates ++;
+    } else {
+      stats.ring_drops ++;
+    }
+
+    if (ahead >= 0x8000 && !params.stream_dup_acked) {
+      // already written, the server is resending blocks since our ACK was lost
+      MTFTP_LOGD(TAG, "duplicate block %d, resending ACK", data_pkt->block_no);
+
+      sendAck(params.stream_expected - 1);
+      params.stream_dup_acked = true;
+    } else if (ahead < 0x8000) {
+      MTFTP_LOGW(TAG, "received block %d outside the window (expected %d)", data_pkt->block_no, params.stream_expected);
+    }
+
+    return STATE_NOCHANGE;
+  }
+
+  uint16_t slot = (params.ring_slot + ahead) % LEN_BUFFER;
+
+  if (!ringFilled(slot)) {
+    memcpy(params.buffer + (slot * LEN_BLOCK), data_pkt->block, len_block);
+    params.ring_len[slot] = len_block;
+    bitmapSet(params.ring_filled, slot);
+
+    if (ahead > 0) stats.out_of_order ++;
+    if (ahead >= stats.ring_high_water) stats.ring_high_water = ahead + 1;
+  } else {
+    stats.duplicates ++;
+  }
+
+  if (params.stream_largest == 0xFFFF || (uint16_t) (data_pkt->block_no - params.stream_largest) < 0x8000) {
+    params.stream_largest = data_pkt->block_no;
+  }
+
+  // write out every block that is now in order
+  uint16_t num_written;
+  bool eof = flushRing(&num_written);
+
+  if (num_written > 0) {
+    params.stream_expected += num_written;
+    params.stream_unacked += num_written;
+    params.stream_dup_acked = false;
+    params.window_blocks += num_written;
+    params.num_retries = 0;
+    params.time_last_progress = mtftpTime();
+  }
+
+  if (eof) {
+    MTFTP_LOGD(TAG, "end of transfer at block %d", params.stream_expected - 1);
+
+    sendAck(params.stream_expected - 1);
+    return STATE_IDLE;
+  }
+
+  // there is no end of window when streaming, so resize the window every window_size blocks
+  if (adaptive_window && params.window_blocks >= params.window_size) {
+    adaptWindow(params.window_blocks);
+  }
+
+  // acknowledge a few times per window so that the server never has to stop
+  uint16_t ack_interval = params.window_size >= 4 ? params.window_size / 4 : 1;
+  if (params.stream_unacked >= ack_interval) {
+    sendAck(params.stream_expected - 1);
+    params.stream_unacked = 0;
+  }
+
+  // blocks are missing if we received any after the next block expected
+  if (ahead > 0) {
+    sendStreamNack();
+  }
+
+  return STATE_NOCHANGE;
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::storeBlock(uint16_t block_no, const uint8_t *block, uint16_t len_block) {
+  // position of the block relative to the next block expected
+  uint16_t ahead = block_no - (params.block_no + 1);
+
+  if (ahead >= LEN_BUFFER) {
+    // no room until the blocks before it have arrived, it is requested again after them
+    MTFTP_LOGD(TAG, "no room for block %d (expected %d)", block_no, params.block_no + 1);
+    return false;
+  }
+
+  uint16_t slot = (params.ring_slot + ahead) % LEN_BUFFER;
+
+  if (ringFilled(slot)) return false;
+
+  if (ahead > 0) {
+    MTFTP_LOGV(TAG, "out of order block %d (expected %d)", block_no, params.block_no + 1);
+  }
+
+  memcpy(params.buffer + (slot * LEN_BLOCK), block, len_block);
+  params.ring_len[slot] = len_block;
+  bitmapSet(params.ring_filled, slot);
+
+  if (params.parity_blocks > 0) {
+    uint8_t group = block_no % params.parity_blocks;
+
+    parityAdd(params.parity + (group * LEN_BLOCK), block, len_block, LEN_BLOCK);
+    params.parity_num_blocks[group] ++;
+  }
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::recoverBlocks(void) {
+  const char *TAG = "recoverBlocks";
+
+  int32_t window_end = windowEnd();
+
+  for (uint8_t group = 0; group < params.parity_blocks; group++) {
+    if (!(params.parity_received & (1 << group)) || group > window_end) continue;
+
+    // a block can only be rebuilt if it is the only one of its group missing
+    uint16_t num_blocks = ((window_end - group) / params.parity_blocks) + 1;
+    if (params.parity_num_blocks[group] + 1 != num_blocks) continue;
+
+    // the missing block is the first of the group not yet written or buffered
+    int32_t block_no = group;
+    while (block_no <= params.block_no) {
+      block_no += params.parity_blocks;
+    }
+
+    while (block_no <= window_end) {
+      uint16_t ahead = block_no - (params.block_no + 1);
+
+      if (ahead >= LEN_BUFFER || !ringFilled((params.ring_slot + ahead) % LEN_BUFFER)) break;
+
+      block_no += params.parity_blocks;
+    }
+
+    uint16_t ahead = block_no - (params.block_no + 1);
+
+    // no room for it yet, it is rebuilt once the blocks before it have been written
+    if (block_no > window_end || ahead >= LEN_BUFFER) continue;
+
+    uint8_t *block = params.parity + (group * LEN_BLOCK);
+    uint16_t len_block = block_no == params.eof_block_no ? parityLength(block, LEN_BLOCK) : LEN_BLOCK;
+
+    if (len_block > LEN_BLOCK) {
+      MTFTP_LOGW(TAG, "rebuilt final block %d has length %d", block_no, len_block);
+      continue;
+    }
+
+    MTFTP_LOGD(TAG, "rebuilt block %d from parity %d", block_no, group);
+
+    if (block_no > params.largest_block_no) {
+      params.largest_block_no = block_no;
+      params.len_largest_block = len_block;
+    }
+
+    storeBlock(block_no, block, len_block);
+    recovered ++;
+    stats.recovered ++;
+  }
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::onWindowParity(const packet_parity_t *parity_pkt) {
+  const char *TAG = "onWindowParity";
+
+  if (parity_pkt->parity_no >= params.parity_blocks || (params.parity_received & (1 << parity_pkt->parity_no))) {
+    return STATE_NOCHANGE;
+  }
+
+  if (parity_pkt->eof && params.eof_block_no == -1) {
+    // the final block of the file was lost, the window ends there
+    MTFTP_LOGD(TAG, "final block is %d", parity_pkt->last_block_no);
+    params.eof_block_no = parity_pkt->last_block_no;
+  }
+
+  parityAdd(params.parity + (parity_pkt->parity_no * LEN_BLOCK), parity_pkt->block, LEN_BLOCK, LEN_BLOCK);
+  params.parity_received |= 1 << parity_pkt->parity_no;
+
+  recoverBlocks();
+
+  // write out every block that is now in order
+  uint16_t num_written;
+  flushRing(&num_written);
+  params.block_no += num_written;
+
+  if (params.unpack_failed) return STATE_IDLE;
+
+  if (params.block_no >= windowEnd()) {
+    return onWindowEnd();
+  }
+
+  // the last parity block is the end of the window, request what could not be rebuilt
+  if (state == STATE_TRANSFER && parity_pkt->parity_no == params.parity_blocks - 1) {
+    return onWindowEnd();
+  }
+
+  return STATE_NOCHANGE;
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::onWindowData(const packet_data_t *data_pkt, uint16_t len_block) {
+  const char *TAG = "onWindowData";
+
+  if (params.eof_block_no != -1 && data_pkt->block_no > params.eof_block_no) {
+    // past the end of the file, requested before the final block was seen
+    MTFTP_LOGD(TAG, "ignoring block %d after the final block %d", data_pkt->block_no, params.eof_block_no);
+    return STATE_NOCHANGE;
+  }
+
+  // the server has retransmitted the last block requested, a copy of it sent before the RTX (late or duplicated
+  // on the way) does not mean the rest have been sent (a server that does not tag its blocks does not flag them)
+  bool rtx_end = state == STATE_AWAIT_RTX && data_pkt->block_no == params.last_rtx_block_no &&
+    (data_pkt->retransmit || data_pkt->window_tag == 0);
+
+  if (data_pkt->block_no <= params.block_no) {
+    MTFTP_LOGD(TAG, "duplicate block %d", data_pkt->block_no);
+    stats.duplicates ++;
+
+    // the last block requested was rebuilt from parity (or arrived late) before it was retransmitted
+    if (rtx_end) {
+      return onWindowEnd();
+    }
+
+    return STATE_NOCHANGE;
+  }
+
+  if (params.first_block_no == -1) {
+    params.first_block_no = data_pkt->block_no;
+    params.time_first_block = mtftpTime();
+  }
+
+  if (len_block < LEN_BLOCK && params.num_batch_files == 0) {
+    // final block of the file, nothing after it exists
+    params.eof_block_no = data_pkt->block_no;
+    params.largest_block_no = data_pkt->block_no;
+    params.len_largest_block = len_block;
+  } else if (data_pkt->block_no > params.largest_block_no) {
+    params.largest_block_no = data_pkt->block_no;
+    params.len_largest_block = len_block;
+  }
+
+  // position of the block relative to the next block expected
+  uint16_t ahead = data_pkt->block_no - (params.block_no + 1);
+  bool stored = storeBlock(data_pkt->block_no, data_pkt->block, len_block);
+
+  if (!stored) {
+    if (ahead >= LEN_BUFFER) {
+      stats.ring_drops ++;
+    } else {
+      stats.duplicates ++;
+    }
+  } else {
+    if (ahead > 0) stats.out_of_order ++;
+    if (ahead >= stats.ring_high_water) stats.ring_high_water = ahead + 1;
+  }
+
+  if (stored && len_block < LEN_BLOCK && params.num_batch_files > 0) {
+    // final block of a file in the batch, only the last of them ends the transfer
+    params.batch_num_ends ++;
+    if (data_pkt->block_no > params.batch_last_end) {
+      params.batch_last_end = data_pkt->block_no;
+    }
+
+    if (params.batch_num_ends == params.batch_window_files) {
+      params.eof_block_no = params.batch_last_end;
+    }
+  }
+
+  recoverBlocks();
+
+  // write out every block that is now in order
+  uint16_t num_written;
+  flushRing(&num_written);
+  params.block_no += num_written;
+
+  if (params.unpack_failed) return STATE_IDLE;
+
+  // (the blocks kept on a resume may take block_no past the end of the window)
+  if (params.block_no >= windowEnd()) {
+    // every block of the window has been written
+    return onWindowEnd();
+  }
+
+  if (state == STATE_AWAIT_RTX) {
+    // the server has retransmitted every block requested but some are still missing
+    // (not all fit into the RTX or the buffer, or retransmits were lost), request the rest
+    if (rtx_end) {
+      return onWindowEnd();
+    }
+
+    return STATE_NOCHANGE;
+  }
+
+  // the server has sent the whole window once it sends the final block (or the parity blocks after it)
+  if (params.parity_blocks == 0 && (data_pkt->block_no == (params.window_size - 1) || params.eof_block_no != -1)) {
+    MTFTP_LOGD(TAG, "end of window (%d blocks), missing blocks after %d", data_pkt->block_no + 1, params.block_no);
+    return onWindowEnd();
+  }
+
+  return STATE_NOCHANGE;
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::onWindowTail(void) {
+  const char *TAG = "onWindowTail";
+
+  MTFTP_LOGD(TAG, "no blocks after %d, requesting the rest of the window", params.largest_block_no);
+
+  sendRtx();
+
+  return STATE_AWAIT_RTX;
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::onWindowEnd(void) {
+  const char *TAG = "onWindowEnd";
+
+  bool complete = params.block_no >= windowEnd();
+
+  if (complete && (params.options & OPT_CRC)) {
+    // the crc follows the final block of the window, it is requested again if it does not arrive
+    if (!params.crc_received) {
+      MTFTP_LOGD(TAG, "window complete, waiting for crc");
+      return STATE_NOCHANGE;
+    }
+
+    if (params.window_crc != params.crc_expected) {
+      return refetchWindow();
+    }
+
+    params.num_refetches = 0;
+
+    // the window has been checked, it is held in the ring from slot 0
+    uint16_t len = 0;
+    for (int32_t slot = 0; slot <= params.block_no; slot++) {
+      len += params.ring_len[slot];
+    }
+
+    bool written = writeBlocks(params.buffer, len);
+
+    params.ring_slot = 0;
+    ringClear();
+
+    if (!written) return STATE_IDLE;
+
+    if (params.eof_block_no != -1) {
+      nextFile();
+    }
+  }
+
+  if (!complete) {
+    bool buffered = bitmapFind(params.ring_filled, 0, LEN_BUFFER, true) < LEN_BUFFER;
+
+    // (the crc covers the whole window, so with OPT_CRC the rest of it is always requested)
+    if (buffered || params.block_no == -1 || (params.options & OPT_CRC)) {
+      // blocks after the missing ones are buffered, send out a RTX
+      sendRtx();
+
+      return STATE_AWAIT_RTX;
+    }
+
+    // nothing after the missing blocks could be buffered, they all have to be sent again anyway
+    // so acknowledge the blocks written and let the next window start after them
+    MTFTP_LOGD(TAG, "acknowledging %d of %d blocks", params.block_no + 1, windowEnd() + 1);
+
+    // counts as a loss when sizing the window
+    params.num_rtx_sent ++;
+  }
+
+  if (params.resume_window_size != 0) {
+    // the window only covered the blocks missing before those kept on resume
+    params.window_size = params.resume_window_size;
+    params.resume_window_size = 0;
+  }
+
+  // the next window is sized by how this one went, the server is told in the ACK
+  if (adaptive_window) {
+    adaptWindow(params.block_no + 1);
+  }
+
+  sendAck(params.block_no);
+  params.window_no ++;
+
+  // the final block has been written, end of transfer
+  if (complete && params.eof_block_no != -1) {
+    return STATE_IDLE;
+  }
+
+  return STATE_ACK_SENT;
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::onWindowCrc(const packet_crc_t *crc_pkt) {
+  const char *TAG = "onWindowCrc";
+
+  if (crc_pkt->window_no != params.window_no) {
+    MTFTP_LOGD(TAG, "crc of window %d when window is %d", crc_pkt->window_no, params.window_no);
+    return STATE_NOCHANGE;
+  }
+
+  params.crc_expected = crc_pkt->crc;
+  params.crc_received = true;
+
+  // waiting for the crc once every block has been written
+  if (params.block_no >= windowEnd()) {
+    return onWindowEnd();
+  }
+
+  return STATE_NOCHANGE;
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::refetchWindow(void) {
+  const char *TAG = "refetchWindow";
+
+  crc_errors ++;
+  stats.crc_errors ++;
+
+  MTFTP_LOGW(TAG, "crc %08X of window at offset %d does not match %08X", params.window_crc, params.file_offset, params.crc_expected);
+
+  if (params.num_refetches >= CONFIG_MAX_RETRIES) {
+    MTFTP_LOGW(TAG, "giving up after reading window %d times", params.num_refetches + 1);
+    return STATE_IDLE;
+  }
+
+  params.num_refetches ++;
+
+  // nothing of the window has been written, every block of it is requested again
+  // (the parity blocks are not sent again, so nothing can be rebuilt from them)
+  params.block_no = -1;
+  params.window_crc = 0;
+  params.crc_received = false;
+  params.ring_slot = 0;
+  ringClear();
+
+  if (params.parity_blocks > 0) {
+    memset(params.parity, 0, params.parity_blocks * LEN_BLOCK);
+    memset(params.parity_num_blocks, 0, sizeof(params.parity_num_blocks));
+    params.parity_received = 0;
+  }
+
+  nack_range_t run;
+  run.offset = 0;
+  run.num_blocks = windowEnd() + 1;
+
+  sendMissing(&run, 1);
+
+  return STATE_AWAIT_RTX;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::onPacketRecv(const uint8_t *data, uint16_t len_data) {
+  const char *TAG = "onPacketRecv";
+
+  if (len_data < 1) {
+    MTFTP_LOGW(TAG, "called with len_data == 0!");
+    return;
+  }
+
+  // the client only has one peer
+  static const uint8_t peer_addr[LEN_PEER_ADDR] = {0};
+
+  if (!packet_queue.push(peer_addr, data, len_data)) {
+    MTFTP_TRACE(TRACE_QUEUE_DROP, trace_id, len_data, packet_queue.getDrops());
+    MTFTP_LOGW(TAG, "failed to push %d bytes, %d packets dropped (increase LEN_PACKET_QUEUE ?)", len_data, packet_queue.getDrops());
+    return;
+  }
+
+  mtftpSignalGive(packet_ready);
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::startRead(uint16_t window_size, uint8_t options, uint8_t parity_blocks) {
+  params.window_size = window_size < window_limit ? window_size : window_limit;
+  params.options = options;
+  params.block_no = -1;
+  params.len_write = 0;
+  params.durable_offset = params.file_offset;
+  params.saved_offset = params.file_offset;
+  params.num_resumes = 0;
+  params.resume_window_size = 0;
+  params.time_last_packet = mtftpTime();
+
+  memset(&stats, 0, sizeof(stats));
+  stats_rtt_sum = 0;
+  stats_time_start = params.time_last_packet;
+  stats_time_end = 0;
+  stats_packet_drops = packet_queue.getDrops();
+
+  params.num_rtx_sent = 0;
+  params.window_blocks = 0;
+  params.time_window_start = params.time_last_packet;
+  params.min_block_time = 0;
+
+  params.num_retries = 0;
+  params.window_no = 0;
+
+  params.unpack_failed = false;
+  params.num_refetches = 0;
+  params.delta_chunk_size = 0;
+  params.delta_num_chunks = 0;
+
+#if CONFIG_COMPRESSION
+  // the server keeps the offset of every block of a compressed window, so it is limited to CONFIG_WINDOW_SIZE_MAX
+  if ((options & OPT_COMPRESS) && params.window_size > CONFIG_WINDOW_SIZE_MAX) {
+    params.window_size = CONFIG_WINDOW_SIZE_MAX;
+  }
+#else
+  if (options & OPT_COMPRESS) {
+    MTFTP_LOGW(TAG, "beginRead: compression not supported (CONFIG_COMPRESSION)");
+    params.options &= ~OPT_COMPRESS;
+  }
+#endif
+
+  // blocks are requested again long after the window they were sent in (and there are no windows to check)
+  if (options & OPT_STREAM) {
+    params.options &= ~(OPT_COMPRESS | OPT_CRC);
+  }
+
+  // a stream has no windows for parity blocks to cover
+  params.parity_blocks = (options & OPT_STREAM) ? 0 : parity_blocks;
+  if (params.parity_blocks > CONFIG_MAX_PARITY_BLOCKS) {
+    MTFTP_LOGW(TAG, "beginRead: %d parity blocks requested, limit is %d", params.parity_blocks, CONFIG_MAX_PARITY_BLOCKS);
+    params.parity_blocks = CONFIG_MAX_PARITY_BLOCKS;
+  }
+
+  if (params.parity_blocks > 0 && params.window_size > MAX_PARITY_WINDOW_SIZE) {
+    params.window_size = MAX_PARITY_WINDOW_SIZE;
+  }
+
+  // the blocks of a window are held in the buffer until its crc has been checked
+  if ((params.options & OPT_CRC) && params.window_size > LEN_BUFFER) {
+    params.window_size = LEN_BUFFER;
+  }
+
+  if (options & OPT_STREAM) {
+    // never have more blocks in flight than can be buffered while waiting for a missing one
+    if (params.window_size > LEN_BUFFER) {
+      params.window_size = LEN_BUFFER;
+    }
+
+    onStreamStart();
+  }
+
+  params.ring_slot = 0;
+  ringClear();
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendDeltaRequest(void) {
+  packet_drq_t drq_pkt;
+
+  drq_pkt.file_index = params.file_index;
+  drq_pkt.file_offset = params.file_offset;
+  drq_pkt.window_size = params.window_size;
+  drq_pkt.chunk_size = params.delta_chunk_size;
+
+  for (uint16_t chunk = 0; chunk < params.delta_num_chunks || chunk == 0; chunk += LEN_DRQ_CHUNKS) {
+    drq_pkt.first_chunk = chunk;
+    drq_pkt.num_chunks = params.delta_num_chunks - chunk < LEN_DRQ_CHUNKS ? params.delta_num_chunks - chunk : LEN_DRQ_CHUNKS;
+    drq_pkt.last = chunk + drq_pkt.num_chunks >= params.delta_num_chunks;
+
+    for (uint8_t i = 0; i < drq_pkt.num_chunks; i++) {
+      uint16_t br;
+
+      if (
+        readBasis(params.file_index, (chunk + i) * params.delta_chunk_size, params.unpack_buffer, params.delta_chunk_size, &br) &&
+        br == params.delta_chunk_size
+      ) {
+        drq_pkt.chunks[i].weak = deltaWeak(params.unpack_buffer, params.delta_chunk_size);
+        drq_pkt.chunks[i].strong = deltaStrong(params.unpack_buffer, params.delta_chunk_size);
+      } else {
+        // never copied, the server sends the bytes instead
+        drq_pkt.chunks[i].weak = 0;
+        drq_pkt.chunks[i].strong = 0;
+      }
+    }
+
+    uint16_t len_pkt = LEN_DRQ_HEADER + (drq_pkt.num_chunks * sizeof(delta_chunk_t));
+
+    // only the last DRQ is answered (by the first window), so only it is resent
+    if (drq_pkt.last) {
+      sendControl((uint8_t *) &drq_pkt, len_pkt);
+      break;
+    }
+
+    sendPacket((uint8_t *) &drq_pkt, len_pkt);
+  }
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::sendReadRequest(void) {
+  MTFTP_TRACE(TRACE_RRQ_TX, trace_id, params.file_index, params.file_offset);
+
+  if (params.delta_chunk_size > 0) {
+    sendDeltaRequest();
+    return;
+  }
+
+  if (params.num_batch_files > 0) {
+    // the files not yet read to the end
+    uint8_t num_files = params.num_batch_files - params.batch_file;
+
+    packet_brq_t brq_pkt;
+
+    brq_pkt.window_size = params.window_size;
+    brq_pkt.num_files = num_files;
+    memcpy(brq_pkt.files, params.batch_files + params.batch_file, num_files * sizeof(batch_file_t));
+    brq_pkt.files[0].file_offset = params.file_offset;
+
+    sendControl((uint8_t *) &brq_pkt, LEN_BRQ_HEADER + (num_files * sizeof(batch_file_t)));
+    return;
+  }
+
+  packet_rrq_t rrq_pkt;
+
+  rrq_pkt.file_index = params.file_index;
+  rrq_pkt.file_offset = params.file_offset;
+  rrq_pkt.window_size = params.window_size;
+  rrq_pkt.options = params.options;
+  rrq_pkt.parity_blocks = params.parity_blocks;
+
+  sendControl((uint8_t *) &rrq_pkt, sizeof(rrq_pkt));
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::resume(void) {
+  const char *TAG = "resume";
+
+  flushWrites();
+  saveCheckpoint();
+
+  if (params.num_resumes >= CONFIG_MAX_RESUMES) {
+    MTFTP_LOGW(TAG, "giving up on %d at offset %d after %d resumes", params.file_index, params.durable_offset, params.num_resumes);
+    return false;
+  }
+
+  params.num_resumes ++;
+
+  // blocks after the missing ones can be kept if they start right where the file has been written up to,
+  // the window then only covers the blocks missing before them (the final block of the file ends the
+  // window and its block no would not match the new window, so it is read again)
+  uint16_t gap = ringFind(0, LEN_BUFFER, true);
+
+  uint16_t num_kept = 0;
+  while (gap + num_kept < LEN_BUFFER) {
+    uint16_t slot = (params.ring_slot + gap + num_kept) % LEN_BUFFER;
+    if (!ringFilled(slot) || params.ring_len[slot] != LEN_BLOCK) break;
+
+    num_kept ++;
+  }
+
+  // (compressed and delta blocks would be packed differently from the new offset, and the crc of the window
+  // would not cover the blocks kept)
+  bool keep = num_kept > 0 && !(params.options & (OPT_STREAM | OPT_COMPRESS | OPT_CRC)) && params.delta_chunk_size == 0 &&
+    params.num_batch_files == 0 && params.durable_offset == params.file_offset;
+
+  if (keep) {
+    // only the run of blocks straight after the gap, blocks past the next gap would be left
+    // in the ring after the window has been written
+    uint16_t first_slot = (params.ring_slot + gap + num_kept) % LEN_BUFFER;
+    for (uint16_t i = 0; i < LEN_BUFFER - gap - num_kept; i++) {
+      bitmapClear(params.ring_filled, (first_slot + i) % LEN_BUFFER);
+    }
+
+    if (params.resume_window_size == 0) {
+      params.resume_window_size = params.window_size;
+    }
+
+    params.window_size = gap;
+  } else {
+    params.ring_slot = 0;
+    ringClear();
+
+    if (params.resume_window_size != 0) {
+      params.window_size = params.resume_window_size;
+      params.resume_window_size = 0;
+    }
+  }
+
+  // start again after the last byte written
+  params.file_offset = params.durable_offset;
+  params.block_no = -1;
+  params.num_retries = 0;
+  params.window_no = 0;
+
+  MTFTP_LOGI(
+    TAG, "resume %d of %d: %d at offset %d, %d blocks kept",
+    params.num_resumes, CONFIG_MAX_RESUMES, params.file_index, params.file_offset, keep ? num_kept : 0
+  );
+
+  sendReadRequest();
+
+  if (params.options & OPT_STREAM) {
+    onStreamStart();
+  } else {
+    onWindowStart();
+  }
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::beginRead(
+    uint16_t file_index,
+    uint32_t file_offset,
+    uint16_t window_size,
+    uint8_t options,
+    uint8_t parity_blocks
+  ) {
+  if (state != STATE_IDLE) {
+    MTFTP_LOGW(TAG, "beginRead: called while state == %s", client_state_str[state]);
+    return;
+  }
+
+  params.file_index = file_index;
+  params.file_offset = loadCheckpoint(file_index, file_offset);
+  params.num_batch_files = 0;
+  params.batch_file = 0;
+
+  startRead(window_size, options, parity_blocks);
+  sendReadRequest();
+
+  MTFTP_LOGI(TAG, "beginRead: sent RRQ for %d at offset %d", file_index, params.file_offset);
+  state = STATE_TRANSFER;
+
+  onWindowStart();
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::beginBatchRead(const batch_file_t *files, uint8_t num_files, uint16_t window_size) {
+  if (state != STATE_IDLE) {
+    MTFTP_LOGW(TAG, "beginBatchRead: called while state == %s", client_state_str[state]);
+    return;
+  }
+
+  if (num_files == 0 || num_files > LEN_BATCH) {
+    MTFTP_LOGW(TAG, "beginBatchRead: %d files requested (1 to %d)", num_files, LEN_BATCH);
+    return;
+  }
+
+  memcpy(params.batch_files, files, num_files * sizeof(batch_file_t));
+  for (uint8_t i = 0; i < num_files; i++) {
+    params.batch_files[i].file_offset = loadCheckpoint(files[i].file_index, files[i].file_offset);
+  }
+
+  params.num_batch_files = num_files;
+  params.batch_file = 0;
+  params.file_index = params.batch_files[0].file_index;
+  params.file_offset = params.batch_files[0].file_offset;
+
+  // the end of a file cannot be told apart from the end of the batch in a rebuilt block, so no parity blocks
+  startRead(window_size, 0, 0);
+  sendReadRequest();
+
+  MTFTP_LOGI(TAG, "beginBatchRead: sent BRQ for %d files", num_files);
+  state = STATE_TRANSFER;
+
+  onWindowStart();
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::beginDeltaRead(uint16_t file_index, uint32_t len_basis, uint16_t window_size, uint16_t chunk_size) {
+  if (state != STATE_IDLE) {
+    MTFTP_LOGW(TAG, "beginDeltaRead: called while state == %s", client_state_str[state]);
+    return;
+  }
+
+  if (chunk_size == 0) {
+    // spread CONFIG_DELTA_CHUNKS over the copy, chunks much smaller than a block would not pay for their copy token
+    chunk_size = CONFIG_DELTA_CHUNKS > 0 ? (len_basis + CONFIG_DELTA_CHUNKS - 1) / CONFIG_DELTA_CHUNKS : 0;
+    if (chunk_size < MIN_DELTA_CHUNK_SIZE) chunk_size = MIN_DELTA_CHUNK_SIZE;
+    if (chunk_size > MAX_DELTA_CHUNK_SIZE) chunk_size = MAX_DELTA_CHUNK_SIZE;
+  }
+
+  params.file_index = file_index;
+  params.file_offset = loadCheckpoint(file_index, 0);
+  params.num_batch_files = 0;
+  params.batch_file = 0;
+
+  startRead(window_size, 0, 0);
+
+  if (CONFIG_DELTA_CHUNKS == 0 || !readBasis || chunk_size > MAX_DELTA_CHUNK_SIZE) {
+    MTFTP_LOGW(TAG, "beginDeltaRead: delta reads not supported (CONFIG_DELTA_CHUNKS, setReadBasisCb), reading the whole file");
+  } else {
+    params.delta_chunk_size = chunk_size;
+
+    params.delta_num_chunks = len_basis / chunk_size;
+    if (params.delta_num_chunks > CONFIG_DELTA_CHUNKS) {
+      params.delta_num_chunks = CONFIG_DELTA_CHUNKS;
+    }
+
+    // the server keeps the offset of every block of the window, as for a compressed window
+    if (params.window_size > CONFIG_WINDOW_SIZE_MAX) {
+      params.window_size = CONFIG_WINDOW_SIZE_MAX;
+    }
+  }
+
+  sendReadRequest();
+
+  MTFTP_LOGI(TAG, "beginDeltaRead: sent DRQ for %d at offset %d, %d chunks of %d", file_index, params.file_offset, params.delta_num_chunks, chunk_size);
+  state = STATE_TRANSFER;
+
+  onWindowStart();
+}
+
+MTFTP_CLIENT_TEMPLATE
+typename MTFTP_CLIENT::client_state MTFTP_CLIENT::handlePacket(const uint8_t *data, uint16_t len_data) {
+  enum client_state new_state = STATE_NOCHANGE;
+
+  recv_result_t result = RECV_UNSET;
+
+  switch(data[0] & OPCODE_MASK) {
+    case TYPE_DATA:
+    {
+      if (len_data < LEN_DATA_HEADER) {
+        MTFTP_LOGW(TAG, "len DATA packet is %d (< %d)", len_data, LEN_DATA_HEADER);
+        break;
+      }
+
+      // only possible when the packets are longer than a DATA packet
+      if (len_data > LEN_DATA_HEADER + LEN_BLOCK) {
+        MTFTP_LOGW(TAG, "len DATA packet is %d (> %d)", len_data, LEN_DATA_HEADER + LEN_BLOCK);
+        break;
+      }
+
+      if (state != STATE_TRANSFER && state != STATE_AWAIT_RTX && state != STATE_ACK_SENT) {
+        MTFTP_LOGW(TAG, "DATA received in state %s", client_state_str[state]);
+        break;
+      }
+
+      packet_data_t *data_pkt = (packet_data_t *) data;
+      stats.blocks_received ++;
+
+      MTFTP_TRACE(TRACE_DATA_RX, trace_id, data_pkt->block_no, len_data - LEN_DATA_HEADER);
+
+      // sent in a window already acknowledged (or a window resent), the block no is that of another window
+      if (data_pkt->window_tag != 0 && data_pkt->window_tag != windowTag(params.window_no)) {
+        MTFTP_LOGD(TAG, "block %d of another window received", data_pkt->block_no);
+        stats.duplicates ++;
+        break;
+      }
+
+      // the server has responded to the last RRQ/RTX/ACK, time the response unless it was resent
+      // (while streaming, blocks arrive regardless of the ACKs so only the RRQ can be timed)
+      if (params.len_ctrl_pkt > 0 && !params.ctrl_answered) {
+        bool timed = !(params.options & OPT_STREAM) || params.ctrl_pkt[0] == TYPE_READ_REQUEST;
+
+        if (timed && params.num_retries == 0) {
+          onRttSample(mtftpTime() - params.time_ctrl_sent);
+        }
+
+        params.ctrl_answered = true;
+      }
+
+      if (state != STATE_AWAIT_RTX) {
+        // a new window (or the stream) has started, there is nothing to resend
+        params.len_ctrl_pkt = 0;
+        params.num_retries = 0;
+      }
+
+      if (params.options & OPT_STREAM) {
+        result = RECV_OK;
+        new_state = onStreamData(data_pkt, len_data - LEN_DATA_HEADER);
+        break;
+      }
+
+      // a block past the end of the window just acknowledged (made smaller) can only be a late retransmit of the last one
+      if (state == STATE_ACK_SENT && data_pkt->block_no >= params.window_size) {
+        MTFTP_LOGD(TAG, "block %d of the previous window received after its ACK", data_pkt->block_no);
+        stats.duplicates ++;
+        break;
+      }
+
+      // new window
+      if (state == STATE_ACK_SENT) {
+        onWindowStart();
+        new_state = STATE_TRANSFER;
+      }
+
+      uint16_t len_block = len_data - LEN_DATA_HEADER;
+
+      if (data_pkt->block_no >= params.window_size) {
+        MTFTP_LOGW(TAG, "received block %d when window size is only %d", data_pkt->block_no, params.window_size);
+        new_state = STATE_IDLE;
+
+        result = RECV_BAD_BLOCK_NO;
+        break;
+      }
+
+      result = RECV_OK;
+
+      enum client_state change = onWindowData(data_pkt, len_block);
+      if (change != STATE_NOCHANGE) {
+        new_state = change;
+      }
+
+      break;
+    }
+    case TYPE_PARITY:
+    {
+      if (len_data != sizeof(packet_parity_t)) {
+        MTFTP_LOGW(TAG, "len PARITY packet is %d (!= %d)", len_data, (int) sizeof(packet_parity_t));
+
+        result = RECV_LEN;
+        break;
+      }
+
+      // parity blocks only follow the blocks of a window, anything later belongs to a window already acknowledged
+      if (state != STATE_TRANSFER && state != STATE_AWAIT_RTX) {
+        MTFTP_LOGD(TAG, "PARITY received in state %s", client_state_str[state]);
+        break;
+      }
+
+      packet_parity_t *parity_pkt = (packet_parity_t *) data;
+
+      if (parity_pkt->window_tag != 0 && parity_pkt->window_tag != windowTag(params.window_no)) {
+        MTFTP_LOGD(TAG, "PARITY of another window received");
+        break;
+      }
+
+      result = RECV_OK;
+
+      new_state = onWindowParity(parity_pkt);
+      break;
+    }
+    case TYPE_CRC:
+    {
+      if (len_data != sizeof(packet_crc_t)) {
+        MTFTP_LOGW(TAG, "len CRC packet is %d (!= %d)", len_data, (int) sizeof(packet_crc_t));
+
+        result = RECV_LEN;
+        break;
+      }
+
+      // the crc follows the final block of the window, anything later belongs to a window already acknowledged
+      if ((params.options & OPT_STREAM) || (state != STATE_TRANSFER && state != STATE_AWAIT_RTX)) {
+        MTFTP_LOGD(TAG, "CRC received in state %s", client_state_str[state]);
+        break;
+      }
+
+      result = RECV_OK;
+
+      new_state = onWindowCrc((packet_crc_t *) data);
+      break;
+    }
+    case TYPE_ERR:
+    {
+      if (len_data != sizeof(packet_err_t)) {
+        MTFTP_LOGW(TAG, "len ERR packet is %d (!= %d)", len_data, (int) sizeof(packet_err_t));
+
+        result = RECV_LEN;
+        break;
+      }
+
+      result = RECV_OK;
+
+      packet_err_t *pkt = (packet_err_t *) data;
+
+      MTFTP_LOGW(TAG, "recv err %s", err_types_str[pkt->err]);
+
+      if (pkt->err == ERR_OPTION && (params.options & OPT_COMPRESS) && state == STATE_TRANSFER && params.block_no == -1) {
+        // the server cannot compress, read the file as it is
+        MTFTP_LOGI(TAG, "compression not supported by the server, resending RRQ without it");
+
+        params.options &= ~OPT_COMPRESS;
+        sendReadRequest();
+        break;
+      }
+
+      if (pkt->err == ERR_OPTION && params.delta_chunk_size > 0 && state == STATE_TRANSFER && params.block_no == -1) {
+        MTFTP_LOGI(TAG, "delta read not supported by the server, resending as a RRQ");
+
+        params.delta_chunk_size = 0;
+        sendReadRequest();
+        break;
+      }
+
+      if (pkt->err == ERR_NO_SESSION) {
+        // a late answer to an ACK/RTX that blocks (or a new request) have been sent after
+        uint8_t ctrl_type = params.ctrl_pkt[0];
+        if (
+          state == STATE_IDLE || params.len_ctrl_pkt == 0 || ctrl_type == TYPE_READ_REQUEST ||
+          ctrl_type == TYPE_BATCH_READ_REQUEST || ctrl_type == TYPE_DELTA_READ_REQUEST
+        ) {
+          break;
+        }
+
+        // the server has timed out the session, start again from the last checkpoint rather than retrying
+        // (the offset written up to is known without a checkpoint store, which only keeps it across reboots)
+        if (resume()) {
+          new_state = STATE_TRANSFER;
+          break;
+        }
+      }
+
+      if (state != STATE_IDLE) {
+        new_state = STATE_IDLE;
+      }
+      break;
+    }
+    default:
+      MTFTP_LOGW(TAG, "bad packet opcode: %02X", *data);
+
+      result = RECV_BAD_OPCODE;
+      break;
+  }
+
+  if (result == RECV_OK) {
+    params.time_last_packet = mtftpTime();
+  }
+
+  return new_state;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::checkTimers(void) {
+  enum client_state new_state = STATE_NOCHANGE;
+
+  int64_t now = mtftpTime();
+  bool timeout = false;
+
+  // the last RRQ/RTX/ACK (or the blocks sent in response) may have been lost, resend it
+  // streaming: no progress for a while, our ACK or NACK (or the retransmits) may have been lost
+  bool stream = params.options & OPT_STREAM;
+  bool pending = state != STATE_IDLE && (stream || params.len_ctrl_pkt > 0);
+
+  // the end of the window never arrived once the blocks still queued behind the last one should have, request the rest of it
+  if (
+    state == STATE_TRANSFER && !pending && params.largest_block_no != -1 &&
+    (now - params.time_last_packet) > rto + drainTime(windowEnd() - params.largest_block_no)
+  ) {
+    new_state = onWindowTail();
+    pending = true;
+  }
+
+  if (pending) {
+    int64_t time_ctrl = params.time_ctrl_sent + params.ctrl_drain;
+    int64_t time_last = stream ? params.time_last_progress :
+      (time_ctrl > params.time_last_packet ? time_ctrl : params.time_last_packet);
+
+    if ((now - time_last) > rto && !retransmit()) {
+      timeout = true;
+    }
+  } else if (state != STATE_IDLE && (now - params.time_last_packet) > CONFIG_TIMEOUT) {
+    timeout = true;
+  }
+
+  // start the read again from the last checkpoint
+  if (timeout && checkpointSave && resume()) {
+    timeout = false;
+    new_state = STATE_TRANSFER;
+  }
+
+  if (timeout) {
+    MTFTP_LOGW(TAG, "timeout!");
+    MTFTP_TRACE(TRACE_TIMEOUT, trace_id, state, 0);
+    new_state = STATE_IDLE;
+  }
+
+  if (new_state != STATE_NOCHANGE) {
+    changeState(new_state, timeout);
+  }
+}
+
+MTFTP_CLIENT_TEMPLATE
+int64_t MTFTP_CLIENT::getDeadline(void) {
+  if (state == STATE_IDLE) return NO_DEADLINE;
+
+  // as checkTimers: the RRQ/RTX/ACK is resent (or the stream's missing blocks requested again) one rto after it was sent
+  // (and after the packets the server sends ahead of its response)
+  if ((params.options & OPT_STREAM) || params.len_ctrl_pkt > 0) {
+    int64_t time_ctrl = params.time_ctrl_sent + params.ctrl_drain;
+    int64_t time_last = (params.options & OPT_STREAM) ? params.time_last_progress :
+      (time_ctrl > params.time_last_packet ? time_ctrl : params.time_last_packet);
+
+    return time_last + rto + 1;
+  }
+
+  // the rest of the window is requested one rto after the rest of it should have arrived, the read times out after CONFIG_TIMEOUT
+  int64_t deadline = params.time_last_packet + CONFIG_TIMEOUT + 1;
+  int64_t time_tail = params.time_last_packet + rto + drainTime(windowEnd() - params.largest_block_no) + 1;
+  if (state == STATE_TRANSFER && params.largest_block_no != -1 && time_tail < deadline) {
+    deadline = time_tail;
+  }
+
+  return deadline;
+}
+
+MTFTP_CLIENT_TEMPLATE
+bool MTFTP_CLIENT::wait(int64_t deadline) {
+  while (packet_queue.front() == NULL) {
+    int64_t time_left = deadline - mtftpTime();
+    if (time_left <= 0) return false;
+
+    // the signal counts in ms, round up so that the deadline has passed when it times out
+    uint32_t timeout_ms = time_left / 1000 + 1 < UINT32_MAX ? time_left / 1000 + 1 : UINT32_MAX;
+    mtftpSignalWait(packet_ready, timeout_ms);
+  }
+
+  return true;
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::loop(void) {
+  typename packet_queue_t::packet_slot_t *slot = packet_queue.front();
+  if (slot == NULL) {
+    // sleep until the next packet is received, or until the next timer is due
+    uint32_t timeout_ms = recv_timeout;
+    int64_t time_left = getDeadline() - mtftpTime();
+
+    if (time_left < (int64_t) timeout_ms * 1000) {
+      timeout_ms = time_left > 0 ? time_left / 1000 + 1 : 0;
+    }
+
+    mtftpSignalWait(packet_ready, timeout_ms);
+    slot = packet_queue.front();
+  }
+
+  if (slot != NULL) {
+    enum client_state new_state = handlePacket(slot->data, slot->len);
+    packet_queue.pop();
+
+    if (new_state != STATE_NOCHANGE) {
+      changeState(new_state, false);
+    }
+  }
+
+  checkTimers();
+}
+
+MTFTP_CLIENT_TEMPLATE
+int64_t MTFTP_CLIENT::poll(void) {
+  typename packet_queue_t::packet_slot_t *slot;
+  while ((slot = packet_queue.front()) != NULL) {
+    enum client_state new_state = handlePacket(slot->data, slot->len);
+    packet_queue.pop();
+
+    if (new_state != STATE_NOCHANGE) {
+      changeState(new_state, false);
+    }
+  }
+
+  checkTimers();
+
+  return getDeadline();
+}
+
+MTFTP_CLIENT_TEMPLATE
+void MTFTP_CLIENT::changeState(client_state new_state, bool timeout) {
+  MTFTP_LOGD(TAG, "loop: state change from %s to %s", client_state_str[state], client_state_str[new_state]);
+
+  enum client_state prev_state = state;
+
+  state = new_state;
+
+  MTFTP_TRACE(TRACE_STATE, trace_id, prev_state, new_state);
+
+  if (new_state == STATE_IDLE) {
+    // write out anything still staged, whether the transfer ended or timed out
+    flushWrites();
+    stats_time_end = mtftpTime();
+  }
+
+  if (timeout) {
+    if (onTimeout) onTimeout();
+  }
+
+  if (new_state == STATE_IDLE) {
+    if (!timeout && (prev_state == STATE_TRANSFER || prev_state == STATE_ACK_SENT || prev_state == STATE_AWAIT_RTX)) {
+      if (onTransferEnd) onTransferEnd();
+    }
+
+    if (onIdle) onIdle();
+  }
+}
+
+#undef MTFTP_CLIENT
+#undef MTFTP_CLIENT_TEMPLATE
@@ -0,0 +1,121 @@
+#ifndef MTFTP_DOWNLOAD_MANAGER_H
+#define MTFTP_DOWNLOAD_MANAGER_H
+
+#include <atomic>
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+
+// reads files from many servers (peers) at once over one transport: up to max_sessions clients run at the same time,
+// each reading from a different peer, and the jobs waiting for a client are started highest priority first.
+// The clients are serviced in turn and their windows are capped so that together they stay within the window budget.
+// onPacketRecv may be called from another task than loop() (eg the receive callback of the radio), every other method
+// has to be called from the task that runs loop()
+class MtftpDownloadManager {
+  public:
+    typedef struct job {
+      // server to read from
+      uint8_t peer_addr[LEN_PEER_ADDR];
+      // as for MtftpClient::beginRead
+      uint16_t file_index;
+      uint32_t file_offset;
+      uint16_t window_size;
+      uint8_t options;
+      uint8_t parity_blocks;
+      // jobs with a higher priority start first, those of the same priority in the order they were added
+      uint8_t priority;
+    } job_t;
+
+    enum job_state {
+      JOB_FREE,
+      JOB_QUEUED,
+      JOB_ACTIVE
+    };
+
+    MtftpDownloadManager(uint8_t _max_sessions, uint16_t _max_jobs);
+    ~MtftpDownloadManager();
+
+    // writeFile is called with the id of the job (from addJob) the data belongs to, sendPacketTo with the peer of the job
+    void init(
+      bool (*_writeFile)(void *ctx, int job, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+      void (*_sendPacketTo)(void *ctx, const uint8_t *peer_addr, const uint8_t *data, mtftp_len_t<LEN_MAX_PACKET> len),
+      void *ctx
+    );
+    // called once a job is over, with complete set if the final block of the file has been written
+    void setOnJobEndCb(void (*_onJobEnd)(void *ctx, int job, bool complete), void *ctx) { onJobEnd.set(_onJobEnd, ctx); };
+    // blocks the running clients may have in flight together (0 for no limit, the default): each client's window
+    // is capped at its share, window_budget / running clients, from its next window
+    void setWindowBudget(uint16_t blocks);
+
+    // queues a job, returns its id (-1 if max_jobs are already queued or running). The id is free again once onJobEnd is called
+    int addJob(const job_t *job);
+    // drops a job that has not started yet, returns false if it is running (or there is no such job)
+    bool cancelJob(int job);
+    // hands the packet to the client reading from peer_addr (RECV_NO_SESSION if there is none). Safe to call while
+    // loop() runs on another task: a packet that arrives as a job ends may go to the job's client or be dropped
+    recv_result_t onPacketRecv(const uint8_t *peer_addr, const uint8_t *data, uint16_t len_data);
+    // starts queued jobs on the free clients, then runs each client in turn (every packet it has queued and its timers)
+    // and ends the jobs whose client went idle. Never blocks
+    void loop(void);
+
+    job_state getJobState(int job) { return job >= 0 && job < max_jobs ? jobs[job].state : JOB_FREE; };
+    uint16_t getNumQueued(void) { return num_queued; };
+    uint8_t getNumActive(void) { return num_active; };
+    bool isIdle(void) { return num_queued == 0 && num_active == 0; };
+    // client running a job (NULL if it is not running), eg for its stats
+    MtftpClient *getClient(int job);
+    // client of each session (0 to max_sessions - 1), to change its settings before any job starts (its callbacks,
+    // receive timeout and window limit are the manager's)
+    MtftpClient *getSessionClient(uint8_t session) { return &sessions[session].client; };
+  private:
+    static constexpr const char *TAG = "mtftp-manager";
+
+    typedef struct job_slot {
+      job_state state;
+      job_t job;
+      // order added in, so that jobs of the same priority start first come first served
+      uint32_t seq;
+      // session running the job
+      uint8_t session;
+    } job_slot_t;
+
+    typedef struct session {
+      MtftpDownloadManager *manager;
+      MtftpClient client;
+      // job being run, -1 if the client is free (it is read by onPacketRecv on the receiving task)
+      std::atomic<int> job;
+      // peer of the job, copied so that onPacketRecv does not read the job table addJob writes to
+      uint8_t peer_addr[LEN_PEER_ADDR];
+      // the final block of the file has been written
+      bool complete;
+    } session_t;
+
+    job_slot_t *jobs;
+    uint16_t max_jobs;
+    uint16_t num_queued = 0;
+    uint32_t next_seq = 0;
+
+    session_t *sessions;
+    uint8_t max_sessions;
+    uint8_t num_active = 0;
+    // session serviced first by the next loop(), so that none is always first on the channel
+    uint8_t next_session = 0;
+
+    uint16_t window_budget = 0;
+
+    MtftpCallback<bool, int, uint16_t, uint32_t, const uint8_t *, uint16_t> writeFile;
+    MtftpCallback<void, const uint8_t *, const uint8_t *, mtftp_len_t<LEN_MAX_PACKET>> sendPacketTo;
+    MtftpCallback<void, int, bool> onJobEnd;
+
+    static bool sessionWriteFile(void *ctx, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw);
+    static void sessionSendPacket(void *ctx, const uint8_t *data, mtftp_len_t<LEN_MAX_PACKET> len);
+    static void sessionFileEnd(void *ctx, uint16_t file_index, uint32_t file_offset);
+
+    bool peerActive(const uint8_t *peer_addr);
+    int nextJob(void);
+    void startJobs(void);
+    void endJob(session_t *session);
+    // caps the window of every client at its share of the budget
+    void shareWindows(void);
+};
+
+#endif
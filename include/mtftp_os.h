@@ -0,0 +1,86 @@
+#ifndef MTFTP_OS_H
+#define MTFTP_OS_H
+
+#include <stdint.h>
+
+// everything the protocol engine needs from the platform: a clock, a signal that a packet has been queued
+// (so loop() can sleep until one arrives) and logging. ESP-IDF maps them onto esp_timer, FreeRTOS and esp_log,
+// other platforms link a port implementing the functions declared below (port/posix)
+
+#ifdef ESP_PLATFORM
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define MTFTP_LOGE ESP_LOGE
+#define MTFTP_LOGW ESP_LOGW
+#define MTFTP_LOGI ESP_LOGI
+#define MTFTP_LOGD ESP_LOGD
+#define MTFTP_LOGV ESP_LOGV
+
+typedef SemaphoreHandle_t mtftp_signal_t;
+
+static inline int64_t mtftpTime(void) {
+  return esp_timer_get_time();
+}
+
+static inline mtftp_signal_t mtftpSignalCreate(void) {
+  return xSemaphoreCreateBinary();
+}
+
+static inline void mtftpSignalDelete(mtftp_signal_t signal) {
+  vSemaphoreDelete(signal);
+}
+
+static inline void mtftpSignalGive(mtftp_signal_t signal) {
+  xSemaphoreGive(signal);
+}
+
+static inline bool mtftpSignalWait(mtftp_signal_t signal, uint32_t timeout_ms) {
+  // rounded up to whole ticks, so that it does not time out before timeout_ms
+  return xSemaphoreTake(signal, (timeout_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS) == pdTRUE;
+}
+
+#else
+
+enum mtftp_log_level {
+  MTFTP_LOG_NONE,
+  MTFTP_LOG_ERROR,
+  MTFTP_LOG_WARN,
+  MTFTP_LOG_INFO,
+  MTFTP_LOG_DEBUG,
+  MTFTP_LOG_VERBOSE
+};
+
+// messages up to this level are logged (MTFTP_LOG_WARN by default), the arguments of the others are not evaluated
+extern enum mtftp_log_level mtftp_log_level;
+
+void mtftpLog(enum mtftp_log_level level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#define MTFTP_LOG(level, tag, format, ...) do { \
+    if (mtftp_log_level >= level) mtftpLog(level, tag, format, ##__VA_ARGS__); \
+  } while (0)
+
+#define MTFTP_LOGE(tag, format, ...) MTFTP_LOG(MTFTP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define MTFTP_LOGW(tag, format, ...) MTFTP_LOG(MTFTP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define MTFTP_LOGI(tag, format, ...) MTFTP_LOG(MTFTP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define MTFTP_LOGD(tag, format, ...) MTFTP_LOG(MTFTP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define MTFTP_LOGV(tag, format, ...) MTFTP_LOG(MTFTP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+typedef struct mtftp_signal *mtftp_signal_t;
+
+// monotonic time in microseconds (kept apart from the rest of the port, so a simulator can run the engine on its own clock)
+int64_t mtftpTime(void);
+
+// binary signal, given from any thread and waited on by the thread calling loop()
+mtftp_signal_t mtftpSignalCreate(void);
+void mtftpSignalDelete(mtftp_signal_t signal);
+void mtftpSignalGive(mtftp_signal_t signal);
+// returns false if the signal was not given within timeout_ms (0 to not wait), clears it otherwise
+bool mtftpSignalWait(mtftp_signal_t signal, uint32_t timeout_ms);
+
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef MTFTP_PACKET_QUEUE_H
+#define MTFTP_PACKET_QUEUE_H
+
+#include <atomic>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "mtftp.h"
+#include "mtftp_os.h"
+
+// lock-free single-producer/single-consumer queue of received packets
+// push() is called from the ESP-NOW receive callback (producer) while
+// front()/pop() are called from loop() (consumer), packets are copied into
+// preallocated fixed size slots of LEN_PACKET bytes so there is no allocation per packet
+template <uint16_t LEN_PACKET = LEN_MAX_PACKET>
+class BasicMtftpPacketQueue {
+  public:
+    typedef struct packet_slot {
+      uint8_t peer_addr[LEN_PEER_ADDR];
+      mtftp_len_t<LEN_PACKET> len;
+      uint8_t data[LEN_PACKET];
+    } packet_slot_t;
+
+    BasicMtftpPacketQueue(uint16_t _num_slots);
+    ~BasicMtftpPacketQueue();
+
+    bool push(const uint8_t *peer_addr, const uint8_t *data, uint16_t len);
+    // oldest packet in the queue (NULL if empty), valid until pop() is called
+    packet_slot_t *front(void);
+    void pop(void);
+
+    uint16_t size(void);
+    uint32_t getDrops(void) { return drops.load(std::memory_order_relaxed); };
+    uint16_t getHighWater(void) { return high_water.load(std::memory_order_relaxed); };
+  private:
+    static constexpr const char *TAG = "mtftp-queue";
+
+    // one more slot than the capacity, so that head == tail only when empty
+    packet_slot_t *slots = NULL;
+    uint16_t num_slots;
+
+    // head is only written by the producer, tail only by the consumer
+    std::atomic<uint16_t> head;
+    std::atomic<uint16_t> tail;
+
+    // only written by the producer
+    std::atomic<uint32_t> drops;
+    std::atomic<uint16_t> high_water;
+};
+
+typedef BasicMtftpPacketQueue<> MtftpPacketQueue;
+
+template <uint16_t LEN_PACKET>
+BasicMtftpPacketQueue<LEN_PACKET>::BasicMtftpPacketQueue(uint16_t _num_slots) {
+  num_slots = _num_slots + 1;
+
+  slots = (packet_slot_t *) malloc(num_slots * sizeof(packet_slot_t));
+  if (slots == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate %d packet slots", _num_slots);
+  }
+
+  assert(slots != NULL);
+
+  head.store(0);
+  tail.store(0);
+  drops.store(0);
+  high_water.store(0);
+}
+
+template <uint16_t LEN_PACKET>
+BasicMtftpPacketQueue<LEN_PACKET>::~BasicMtftpPacketQueue() {
+  free(slots);
+}
+
+template <uint16_t LEN_PACKET>
+bool BasicMtftpPacketQueue<LEN_PACKET>::push(const uint8_t *peer_addr, const uint8_t *data, uint16_t len) {
+  uint16_t index = head.load(std::memory_order_relaxed);
+  uint16_t next = (index + 1) == num_slots ? 0 : index + 1;
+  uint16_t index_tail = tail.load(std::memory_order_acquire);
+
+  if (len > LEN_PACKET || next == index_tail) {
+    drops.store(drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return false;
+  }
+
+  packet_slot_t *slot = &slots[index];
+
+  memcpy(slot->peer_addr, peer_addr, LEN_PEER_ADDR);
+  memcpy(slot->data, data, len);
+  slot->len = len;
+
+  // publish the slot to the consumer
+  head.store(next, std::memory_order_release);
+
+  uint16_t used = (next + num_slots - index_tail) % num_slots;
+  if (used > high_water.load(std::memory_order_relaxed)) {
+    high_water.store(used, std::memory_order_relaxed);
+  }
+
+  return true;
+}
+
+template <uint16_t LEN_PACKET>
+typename BasicMtftpPacketQueue<LEN_PACKET>::packet_slot_t *BasicMtftpPacketQueue<LEN_PACKET>::front(void) {
+  uint16_t index = tail.load(std::memory_order_relaxed);
+
+  if (index == head.load(std::memory_order_acquire)) return NULL;
+
+  return &slots[index];
+}
+
+template <uint16_t LEN_PACKET>
+void BasicMtftpPacketQueue<LEN_PACKET>::pop(void) {
+  uint16_t index = tail.load(std::memory_order_relaxed);
+
+  if (index == head.load(std::memory_order_acquire)) return;
+
+  // hand the slot back to the producer
+  tail.store((index + 1) == num_slots ? 0 : index + 1, std::memory_order_release);
+}
+
+template <uint16_t LEN_PACKET>
+uint16_t BasicMtftpPacketQueue<LEN_PACKET>::size(void) {
+  return (head.load(std::memory_order_acquire) + num_slots - tail.load(std::memory_order_acquire)) % num_slots;
+}
+
+// the default size is built once, in mtftp_packet_queue.cpp
+extern template class BasicMtftpPacketQueue<>;
+
+#endif
@@ -2,14 +2,49 @@
 #define MTFTP_SERVER_H
 
 #include "mtftp.h"
+#include "mtftp_packet_queue.hpp"
+#include "mtftp_os.h"
+
+// server built for blocks of LEN_BLOCK bytes sent in packets of up to LEN_PACKET bytes
+// (the read cache, parity blocks and packets of every session are sized from these when the server is built)
+template <uint16_t LEN_BLOCK = CONFIG_LEN_BLOCK, uint16_t LEN_PACKET = LEN_MAX_PACKET>
+class BasicMtftpServer {
+  static_assert(LEN_DATA_HEADER + LEN_BLOCK <= LEN_PACKET, "a DATA packet does not fit in LEN_PACKET");
+  static_assert(LEN_PACKET <= LEN_PACKET_LIMIT, "LEN_PACKET is larger than LEN_PACKET_LIMIT");
+  // the read cache is filled in a single readFile
+  static_assert(CONFIG_LEN_READ_CACHE * LEN_BLOCK <= UINT16_MAX, "CONFIG_LEN_READ_CACHE blocks do not fit in a uint16_t");
 
-class MtftpServer {
   public:
+    // the packets at the sizes of this server
+    typedef basic_packet_data<LEN_BLOCK> packet_data_t;
+    typedef basic_packet_parity<LEN_BLOCK> packet_parity_t;
+    typedef basic_packet_rtx<LEN_PACKET> packet_rtx_t;
+    typedef basic_packet_nack<LEN_PACKET> packet_nack_t;
+    typedef basic_packet_brq<LEN_PACKET> packet_brq_t;
+    typedef basic_packet_drq<LEN_PACKET> packet_drq_t;
+    typedef BasicMtftpPacketQueue<LEN_PACKET> packet_queue_t;
+
+    static constexpr uint8_t LEN_BATCH = lenBatch(LEN_PACKET);
+    static constexpr uint8_t LEN_DRQ_CHUNKS = lenDrqChunks(LEN_PACKET);
+    // time (us) after which getDeadline() checks the transport again while it holds blocks back
+    static constexpr int64_t TX_READY_RECHECK = 1000;
+    // time (us) without an ACK moving a stream on after which its unacknowledged blocks are resent (at most CONFIG_MAX_RETRIES times in a row).
+    // A stream session times out CONFIG_TIMEOUT after the last packet received from its client
+    static constexpr int64_t STREAM_RESEND = CONFIG_TIMEOUT / 2;
+
+    // a packet handed to the batch send callback
+    typedef struct tx_packet {
+      const uint8_t *data;
+      mtftp_len_t<LEN_PACKET> len;
+    } tx_packet_t;
+
     enum server_state {
       STATE_IDLE,
       STATE_TRANSFER,        // RRQ received, transmitting window
       STATE_RTX,             // RTX received, retransmissing missing packets
       STATE_AWAIT_RESPONSE,  // window transmitted, waiting for ACK/RTX
+      STATE_PARITY,          // window transmitted, sending parity blocks (ACK/RTX accepted)
+      STATE_SIGNATURES,      // DRQ received, waiting for the DRQ with the last chunk signatures
       STATE_NOCHANGE
     };
 
@@ -18,47 +53,304 @@ class MtftpServer {
       "Transfer",
       "Retransmit",
       "WaitAck",
+      "Parity",
+      "Signatures",
       "NoChange"
     };
 
+    typedef struct cache_stats {
+      // blocks sent straight out of the read cache
+      uint32_t hits;
+      // blocks that required the cache to be refilled with readFile
+      uint32_t misses;
+    } cache_stats_t;
+
+    // counters of one transfer, from its read request until it ends
+    typedef struct server_stats {
+      // DATA packets sent, the blocks among them sent before (in response to an RTX/NACK, a repeated ACK or
+      // a stream timing out) and parity blocks sent
+      uint32_t blocks_sent;
+      uint32_t blocks_retransmitted;
+      uint32_t parity_sent;
+      // RTX/NACK packets received and the blocks requested in them
+      uint32_t rtx_received;
+      uint32_t blocks_requested;
+      // windows acknowledged and repeated ACKs of the previous window (the window is sent again)
+      uint32_t windows;
+      uint32_t duplicate_acks;
+      // packets dropped because the packet queue was full, and its high water mark (shared by every session, since init)
+      uint32_t packet_drops;
+      uint16_t packet_high_water;
+      // time (us) from the end of a window to the ACK/RTX for it (not sampled when streaming)
+      uint32_t rtt_samples;
+      int64_t rtt_min;
+      int64_t rtt_avg;
+      int64_t rtt_max;
+      // bytes of the file sent in new blocks, time (us) the transfer has been running and bytes sent per second over it
+      uint32_t bytes_sent;
+      int64_t time;
+      uint32_t goodput;
+    } server_stats_t;
+
+    BasicMtftpServer();
+    ~BasicMtftpServer();
+
+    // single client: all packets are assumed to come from (and go to) the same peer
     void init(
       bool (*_readFile)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
-      void (*_sendPacket)(const uint8_t *data, uint8_t len)
+      void (*_sendPacket)(const uint8_t *data, mtftp_len_t<LEN_PACKET> len)
     );
 
+    // multiple clients: packets are addressed to the peer that owns the session
+    void init(
+      bool (*_readFile)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+      void (*_sendPacketTo)(const uint8_t *peer_addr, const uint8_t *data, mtftp_len_t<LEN_PACKET> len)
+    );
+
+    // as the inits above, the callbacks are given ctx as their first argument
+    void init(
+      bool (*_readFile)(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+      void (*_sendPacket)(void *ctx, const uint8_t *data, mtftp_len_t<LEN_PACKET> len),
+      void *ctx
+    );
+    void init(
+      bool (*_readFile)(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+      void (*_sendPacketTo)(void *ctx, const uint8_t *peer_addr, const uint8_t *data, mtftp_len_t<LEN_PACKET> len),
+      void *ctx
+    );
+
+    // each callback can also be given with a context pointer, which it is called with as its first argument
     void setOnIdleCb(void (*_onIdle)());
+    void setOnIdleCb(void (*_onIdle)(void *ctx), void *ctx) { onIdle.set(_onIdle, ctx); };
     void setOnTimeoutCb(void (*_onTimeout)());
+    void setOnTimeoutCb(void (*_onTimeout)(void *ctx), void *ctx) { onTimeout.set(_onTimeout, ctx); };
+    // limit DATA packets to rate bytes/sec on average (0 for no limit), allowing bursts of up to burst bytes
+    void setPacing(uint32_t rate, uint32_t burst);
+    // polled before a DATA packet is sent, return false while the transport's TX queue is full
+    void setTxReadyCb(bool (*_txReady)());
+    void setTxReadyCb(bool (*_txReady)(void *ctx), void *ctx) { txReady.set(_txReady, ctx); };
+    // hands the transport the rest of a window in one call instead of calling sendPacket once per block (eg for sendmmsg):
+    // up to CONFIG_LEN_TX_BATCH DATA packets and the PARITY/CRC packets that follow them, all for peer_addr (all zeros
+    // for packets given to onPacketRecv without a peer). The pacer and setTxReadyCb are checked as each block is prepared.
+    // The packets are only valid during the call, and every other packet still goes to sendPacket
+    void setSendBatchCb(void (*_sendBatch)(const uint8_t *peer_addr, const tx_packet_t *packets, uint16_t num_packets));
+    void setSendBatchCb(
+      void (*_sendBatch)(void *ctx, const uint8_t *peer_addr, const tx_packet_t *packets, uint16_t num_packets), void *ctx
+    );
+    // queues the packet to be handled in the next call to loop()
     recv_result_t onPacketRecv(const uint8_t *data, uint16_t len_data);
+    recv_result_t onPacketRecv(const uint8_t *peer_addr, const uint8_t *data, uint16_t len_data);
+    // handles every queued packet, sends one block (for the next session with one to send) and runs the timers
     void loop(void);
+    // as loop(), but sends every block the pacer and the transport allow. Never blocks, returns the next deadline
+    // (NO_DEADLINE while idle): call it again when a packet is received or once mtftpTime() reaches the deadline
+    int64_t poll(void);
+    // mtftpTime() by which the server needs to run again (to send a block the pacer held back, or for a timeout), NO_DEADLINE while idle.
+    // While the transport holds blocks back (setTxReadyCb) it is TX_READY_RECHECK away, unless the transport wakes the caller sooner
+    int64_t getDeadline(void);
 
-    server_state getState(void) { return state; };
-    bool isIdle(void) { return state == STATE_IDLE; };
+    // state of the first active session (or STATE_IDLE if there are none)
+    server_state getState(void);
+    server_state getState(const uint8_t *peer_addr);
+    uint8_t getNumSessions(void);
+    bool isIdle(void) { return getNumSessions() == 0; };
+    cache_stats_t getCacheStats(void) { return cache_stats; };
+    // number of times loop() (or poll()) had a block to send but held it back for the pacer or the transport
+    uint32_t getPacedLoops(void) { return paced_loops; };
+    uint32_t getPacketDrops(void) { return packet_queue.getDrops(); };
+    uint16_t getPacketHighWater(void) { return packet_queue.getHighWater(); };
+    uint16_t getPacketsQueued(void) { return packet_queue.size(); };
+    // transfer in progress (or the last one) that started most recently, or with peer_addr
+    server_stats_t getStats(void);
+    server_stats_t getStats(const uint8_t *peer_addr);
   private:
-    enum server_state state;
+    static constexpr const char *TAG = "mtftp-server";
+    // most packets one step of a window sends (a block, and the CRC after the final block)
+    static constexpr uint8_t MAX_STEP_PACKETS = 2;
+
+    // peer used for all packets when the server is used with a single client
+    static constexpr uint8_t DEFAULT_PEER_ADDR[LEN_PEER_ADDR] = {};
+
+    // buckets of delta chunk signatures, by weak checksum
+    static const uint8_t DELTA_BUCKETS = 64;
 
-    struct {
-      uint16_t file_index;
-      uint32_t file_offset;
-      uint16_t window_size;
+    static uint8_t deltaBucket(uint32_t weak, uint8_t num_buckets) { return (weak ^ (weak >> 16)) % num_buckets; };
 
-      uint16_t block_no;
-      int32_t largest_block_no;
-      uint8_t len_largest_block;
+    typedef struct session {
+      enum server_state state;
+      uint8_t peer_addr[LEN_PEER_ADDR];
 
-      int64_t time_last_packet = 0;
+      struct {
+        uint16_t file_index;
+        uint32_t file_offset;
+        uint16_t window_size;
+        uint8_t options;
+        // number of windows acknowledged (wrapping at 255)
+        uint8_t window_no;
+        // DATA and PARITY carry windowTag(window_no) (not for a stream, or a client whose RRQ has no options)
+        bool tag_windows;
+        // parity blocks sent after every window, parity_no is the next one to send
+        uint8_t parity_blocks;
+        uint8_t parity_no;
+        // OPT_CRC: crc32c of the blocks of the window sent so far
+        uint32_t window_crc;
 
-      uint16_t rtx_index;
-      uint8_t num_rtx;
-      uint16_t rtx_block_nos[CONFIG_LEN_MTFTP_BUFFER];
-    } transfer_params;
+        // delta read: size of the chunks of the client's copy (0 if not a delta read), the chunks with
+        // a weak checksum in each bucket are chained from delta_head through delta_next (0xFF ends the chain)
+        uint16_t delta_chunk_size;
+        uint8_t delta_head[DELTA_BUCKETS];
 
-    bool (*readFile)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) = NULL;
-    void (*sendPacket)(const uint8_t *data, uint8_t len) = NULL;
-    void (*onIdle)() = NULL;
-    void (*onTimeout)() = NULL;
+        // batch read: files requested (0 for a RRQ), file_index and file_offset are those of
+        // batch_file, the file at block 0 of the window
+        batch_file_t batch_files[LEN_BATCH];
+        uint8_t num_batch_files;
+        uint8_t batch_file;
+        // files started in the window and the block each of them starts at
+        uint8_t batch_num_started;
+        uint16_t batch_start[LEN_BATCH];
 
-    void onWindowStart(void);
-    bool sendBlock(uint16_t block_no, uint16_t *bytes_read);
+        uint16_t block_no;
+        int32_t largest_block_no;
+        mtftp_len_t<LEN_BLOCK> len_largest_block;
+
+        int64_t time_last_packet = 0;
+
+        // RTX or NACK packet listing the blocks to retransmit
+        uint8_t rtx_pkt[LEN_PACKET];
+        mtftp_len_t<LEN_PACKET> len_rtx_pkt;
+        // position in rtx_pkt of the next block to retransmit
+        uint8_t rtx_index;
+        nack_iter_t rtx_iter;
+        // number of blocks left to retransmit
+        uint32_t num_rtx;
+
+        // OPT_STREAM: indexes of blocks from the start of the transfer
+        // oldest unacknowledged block, next block not yet sent, final block of the file (UINT32_MAX until read)
+        uint32_t stream_base;
+        uint32_t stream_next;
+        uint32_t stream_eof;
+        int64_t time_last_ack;
+        // times the blocks have been resent since an ACK last moved the stream on
+        uint8_t stream_resends;
+      } transfer_params;
+
+      // counted as the transfer runs, the rest of the fields are filled in by getStats.
+      // Blocks of the stream below stats_stream_sent have been sent before, as has every block of
+      // a window sent again after a repeated ACK
+      server_stats_t stats;
+      int64_t stats_rtt_sum;
+      int64_t stats_time_start;
+      int64_t stats_time_end;
+      int64_t stats_time_window_end;
+      uint32_t stats_stream_sent;
+      bool stats_window_resent;
+
+      // CONFIG_LEN_READ_CACHE blocks of the file read ahead, starting at cache_offset
+      uint8_t *cache;
+      uint16_t cache_file_index;
+      bool cache_valid;
+      // readFile returned less than requested, there is no data after the cache
+      bool cache_eof;
+      uint32_t cache_offset;
+      uint16_t cache_len;
+
+      // CONFIG_MAX_PARITY_BLOCKS parity blocks of the window being sent
+      uint8_t *parity;
+
+      // OPT_COMPRESS: offset in the file of each block of the window (and of the end of the last block sent),
+      // CONFIG_WINDOW_SIZE_MAX + 1 entries
+      uint32_t *raw_offsets;
+
+      // delta read: CONFIG_DELTA_CHUNKS signatures of the client's copy and the next chunk in their bucket
+      delta_chunk_t *delta_chunks;
+      uint8_t *delta_next;
+    } session_t;
+
+    session_t sessions[CONFIG_MAX_SESSIONS] = {};
+    // index of the session that loop() will service first
+    uint8_t next_session = 0;
+
+    // backing memory of the read caches of all sessions
+    uint8_t *cache_buffer = NULL;
+    cache_stats_t cache_stats = {};
+    // backing memory of the parity blocks of all sessions
+    uint8_t *parity_buffer = NULL;
+    // backing memory of the block offsets of all sessions
+    uint32_t *raw_offset_buffer = NULL;
+    // backing memory of the chunk signatures of all sessions
+    uint8_t *delta_buffer = NULL;
+
+    packet_queue_t packet_queue;
+
+    // token bucket, in bytes * 1000000 so that tokens are not lost to rounding between calls to loop()
+    uint32_t pacing_rate = CONFIG_PACING_RATE;
+    uint32_t pacing_burst = CONFIG_PACING_BURST;
+    int64_t pacing_tokens = 0;
+    int64_t time_last_refill = 0;
+    uint32_t paced_loops = 0;
+
+    // packets prepared for sendBatch (batch_buffer holds their data), and the session being sent for while a batch is prepared
+    uint8_t *batch_buffer = NULL;
+    tx_packet_t batch_packets[CONFIG_LEN_TX_BATCH];
+    uint16_t num_batched = 0;
+    session_t *batch_session = NULL;
+
+    MtftpCallback<bool, uint16_t, uint32_t, uint8_t *, uint16_t, uint16_t *> readFile;
+    MtftpCallback<void, const uint8_t *, mtftp_len_t<LEN_PACKET>> sendPacket;
+    MtftpCallback<void, const uint8_t *, const uint8_t *, mtftp_len_t<LEN_PACKET>> sendPacketTo;
+    MtftpCallback<void> onIdle;
+    MtftpCallback<void> onTimeout;
+    MtftpCallback<bool> txReady;
+    MtftpCallback<void, const uint8_t *, const tx_packet_t *, uint16_t> sendBatch;
+
+    // ends every session, for init
+    void reset(void);
+    session_t *findSession(const uint8_t *peer_addr);
+    session_t *claimSession(const uint8_t *peer_addr);
+    void onTransferStart(session_t *session);
+    void addChunks(session_t *session, const packet_drq_t *pkt);
+    void indexChunks(session_t *session);
+    int16_t findChunk(session_t *session, uint32_t weak, const uint8_t *data);
+    uint16_t packDelta(session_t *session, const uint8_t *data, uint16_t len_data, bool eof, uint8_t *block, uint16_t *len_used);
+    recv_result_t handlePacket(const uint8_t *peer_addr, const uint8_t *data, uint16_t len_data);
+    void setState(session_t *session, server_state new_state);
+    void send(session_t *session, const uint8_t *data, uint16_t len);
+    void sendErr(const uint8_t *peer_addr, err_types err);
+    bool canSend(void);
+    // mtftpTime() at which canSend() allows the next block
+    int64_t sendTime(void);
+    // sends the next block of the first session (in round-robin order) that has one, returns false if none was sent.
+    // With a batch send callback, the rest of the session's window is sent
+    bool sendNext(void);
+    void sendStep(session_t *session);
+    bool isSending(session_t *session) {
+      return session->state == STATE_TRANSFER || session->state == STATE_RTX || session->state == STATE_PARITY;
+    };
+    void allocBatch(void);
+    // times out the sessions whose client has gone quiet
+    void checkTimers(void);
+    // OPT_COMPRESS or a delta read: blocks hold different amounts of the file
+    bool isPacked(session_t *session);
+    void onWindowStart(session_t *session);
+    void blockPosition(session_t *session, uint32_t block_no, uint16_t *file_index, uint32_t *offset);
+    bool fillCache(session_t *session, uint32_t block_no, uint16_t file_index, uint32_t offset);
+    server_state onBatchAck(session_t *session, uint16_t block_no);
+    bool sendBlock(session_t *session, uint32_t block_no, uint16_t *bytes_read, bool add_parity = false);
+    void sendParity(session_t *session);
+    void sendCrc(session_t *session);
+    server_state onStreamAck(session_t *session, uint16_t block_no);
+    server_state streamSend(session_t *session);
+    bool nextRtxBlock(session_t *session, uint16_t *block_no);
+    void sampleWindowRtt(session_t *session);
+    uint8_t traceSource(session_t *session);
+    server_stats_t sessionStats(session_t *session);
 };
 
+typedef BasicMtftpServer<> MtftpServer;
+
+#include "mtftp_server_impl.hpp"
+
+// the default sizes are built once, in mtftp_server.cpp
+extern template class BasicMtftpServer<>;
+
 #endif
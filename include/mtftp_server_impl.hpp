@@ -0,0 +1,1611 @@
+// definitions of BasicMtftpServer, included by mtftp_server.hpp
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "mtftp_trace.h"
+
+#define MTFTP_SERVER_TEMPLATE template <uint16_t LEN_BLOCK, uint16_t LEN_PACKET>
+#define MTFTP_SERVER BasicMtftpServer<LEN_BLOCK, LEN_PACKET>
+
+MTFTP_SERVER_TEMPLATE
+MTFTP_SERVER::BasicMtftpServer() : packet_queue(CONFIG_LEN_PACKET_QUEUE) {
+  cache_buffer = (uint8_t *) malloc(CONFIG_MAX_SESSIONS * CONFIG_LEN_READ_CACHE * LEN_BLOCK);
+  if (cache_buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate read cache");
+  }
+
+  assert(cache_buffer != NULL);
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    sessions[i].cache = cache_buffer + (i * CONFIG_LEN_READ_CACHE * LEN_BLOCK);
+  }
+
+#if CONFIG_MAX_PARITY_BLOCKS > 0
+  parity_buffer = (uint8_t *) malloc(CONFIG_MAX_SESSIONS * CONFIG_MAX_PARITY_BLOCKS * LEN_BLOCK);
+  if (parity_buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate parity blocks");
+  }
+
+  assert(parity_buffer != NULL);
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    sessions[i].parity = parity_buffer + (i * CONFIG_MAX_PARITY_BLOCKS * LEN_BLOCK);
+  }
+#endif
+
+#if CONFIG_COMPRESSION || CONFIG_DELTA_CHUNKS > 0
+  raw_offset_buffer = (uint32_t *) malloc(CONFIG_MAX_SESSIONS * (CONFIG_WINDOW_SIZE_MAX + 1) * sizeof(uint32_t));
+  if (raw_offset_buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate block offsets");
+  }
+
+  assert(raw_offset_buffer != NULL);
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    sessions[i].raw_offsets = raw_offset_buffer + (i * (CONFIG_WINDOW_SIZE_MAX + 1));
+  }
+#endif
+
+#if CONFIG_DELTA_CHUNKS > 0
+  delta_buffer = (uint8_t *) malloc(CONFIG_MAX_SESSIONS * CONFIG_DELTA_CHUNKS * (sizeof(delta_chunk_t) + 1));
+  if (delta_buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate chunk signatures");
+  }
+
+  assert(delta_buffer != NULL);
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    sessions[i].delta_chunks = (delta_chunk_t *) (delta_buffer + (i * CONFIG_DELTA_CHUNKS * sizeof(delta_chunk_t)));
+    sessions[i].delta_next = delta_buffer + (CONFIG_MAX_SESSIONS * CONFIG_DELTA_CHUNKS * sizeof(delta_chunk_t)) + (i * CONFIG_DELTA_CHUNKS);
+  }
+#endif
+}
+
+MTFTP_SERVER_TEMPLATE
+MTFTP_SERVER::~BasicMtftpServer() {
+  free(cache_buffer);
+  free(parity_buffer);
+  free(raw_offset_buffer);
+  free(delta_buffer);
+  free(batch_buffer);
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::reset(void) {
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    sessions[i].state = STATE_IDLE;
+  }
+
+  memset(&cache_stats, 0, sizeof(cache_stats));
+
+  setPacing(pacing_rate, pacing_burst);
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::init(
+    bool (*_readFile)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+    void (*_sendPacket)(const uint8_t *data, mtftp_len_t<LEN_PACKET> len)
+  ) {
+  reset();
+
+  readFile = _readFile;
+  sendPacket = _sendPacket;
+  sendPacketTo = NULL;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::init(
+    bool (*_readFile)(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+    void (*_sendPacketTo)(const uint8_t *peer_addr, const uint8_t *data, mtftp_len_t<LEN_PACKET> len)
+  ) {
+  reset();
+
+  readFile = _readFile;
+  sendPacket = NULL;
+  sendPacketTo = _sendPacketTo;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::init(
+    bool (*_readFile)(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+    void (*_sendPacket)(void *ctx, const uint8_t *data, mtftp_len_t<LEN_PACKET> len),
+    void *ctx
+  ) {
+  reset();
+
+  readFile.set(_readFile, ctx);
+  sendPacket.set(_sendPacket, ctx);
+  sendPacketTo = NULL;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::init(
+    bool (*_readFile)(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br),
+    void (*_sendPacketTo)(void *ctx, const uint8_t *peer_addr, const uint8_t *data, mtftp_len_t<LEN_PACKET> len),
+    void *ctx
+  ) {
+  reset();
+
+  readFile.set(_readFile, ctx);
+  sendPacket = NULL;
+  sendPacketTo.set(_sendPacketTo, ctx);
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setOnIdleCb(void (*_onIdle)()) {
+  onIdle = _onIdle;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setOnTimeoutCb(void (*_onTimeout)()) {
+  onTimeout = _onTimeout;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setPacing(uint32_t rate, uint32_t burst) {
+  pacing_rate = rate;
+  pacing_burst = burst;
+
+  // start with a full bucket
+  pacing_tokens = (int64_t) burst * 1000000;
+  time_last_refill = mtftpTime();
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setSendBatchCb(void (*_sendBatch)(const uint8_t *peer_addr, const tx_packet_t *packets, uint16_t num_packets)) {
+  allocBatch();
+  sendBatch = _sendBatch;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setSendBatchCb(
+  void (*_sendBatch)(void *ctx, const uint8_t *peer_addr, const tx_packet_t *packets, uint16_t num_packets), void *ctx
+) {
+  allocBatch();
+  sendBatch.set(_sendBatch, ctx);
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::allocBatch(void) {
+  if (batch_buffer != NULL) return;
+
+  batch_buffer = (uint8_t *) malloc(CONFIG_LEN_TX_BATCH * LEN_PACKET);
+  if (batch_buffer == NULL) {
+    MTFTP_LOGW(TAG, "failed to allocate TX batch");
+  }
+
+  assert(batch_buffer != NULL);
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setTxReadyCb(bool (*_txReady)()) {
+  txReady = _txReady;
+}
+
+MTFTP_SERVER_TEMPLATE
+bool MTFTP_SERVER::canSend(void) {
+  if (txReady && !txReady()) return false;
+
+  if (pacing_rate == 0) return true;
+
+  int64_t now = mtftpTime();
+  int64_t max_tokens = (int64_t) pacing_burst * 1000000;
+
+  pacing_tokens += (now - time_last_refill) * pacing_rate;
+  if (pacing_tokens > max_tokens) pacing_tokens = max_tokens;
+
+  time_last_refill = now;
+
+  // enough for a full DATA packet, sendBlock takes the bytes actually sent
+  return pacing_tokens >= (int64_t) (LEN_DATA_HEADER + LEN_BLOCK) * 1000000;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_state MTFTP_SERVER::getState(void) {
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    if (sessions[i].state != STATE_IDLE) return sessions[i].state;
+  }
+
+  return STATE_IDLE;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_state MTFTP_SERVER::getState(const uint8_t *peer_addr) {
+  session_t *session = findSession(peer_addr);
+
+  return session == NULL ? STATE_IDLE : session->state;
+}
+
+MTFTP_SERVER_TEMPLATE
+uint8_t MTFTP_SERVER::getNumSessions(void) {
+  uint8_t num_sessions = 0;
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    if (sessions[i].state != STATE_IDLE) num_sessions ++;
+  }
+
+  return num_sessions;
+}
+
+MTFTP_SERVER_TEMPLATE
+uint8_t MTFTP_SERVER::traceSource(session_t *session) {
+  return TRACE_SERVER | (session == NULL ? TRACE_NO_SESSION : session - sessions);
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::sampleWindowRtt(session_t *session) {
+  // only once the whole window has been sent, and not when streaming (there is no end of window to time from)
+  if (session->state != STATE_AWAIT_RESPONSE || (session->transfer_params.options & OPT_STREAM)) return;
+
+  int64_t rtt = mtftpTime() - session->stats_time_window_end;
+
+  if (session->stats.rtt_samples == 0 || rtt < session->stats.rtt_min) session->stats.rtt_min = rtt;
+  if (rtt > session->stats.rtt_max) session->stats.rtt_max = rtt;
+  session->stats_rtt_sum += rtt;
+  session->stats.rtt_samples ++;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_stats_t MTFTP_SERVER::sessionStats(session_t *session) {
+  server_stats_t result = session->stats;
+
+  result.packet_drops = packet_queue.getDrops();
+  result.packet_high_water = packet_queue.getHighWater();
+  result.rtt_avg = session->stats.rtt_samples > 0 ? session->stats_rtt_sum / session->stats.rtt_samples : 0;
+
+  if (session->stats_time_start != 0) {
+    result.time = (session->state == STATE_IDLE ? session->stats_time_end : mtftpTime()) - session->stats_time_start;
+  }
+
+  result.goodput = result.time > 0 ? (int64_t) session->stats.bytes_sent * 1000000 / result.time : 0;
+
+  return result;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_stats_t MTFTP_SERVER::getStats(void) {
+  session_t *latest = &sessions[0];
+
+  for (uint8_t i = 1; i < CONFIG_MAX_SESSIONS; i++) {
+    if (sessions[i].stats_time_start > latest->stats_time_start) latest = &sessions[i];
+  }
+
+  return sessionStats(latest);
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_stats_t MTFTP_SERVER::getStats(const uint8_t *peer_addr) {
+  session_t *session = findSession(peer_addr);
+
+  // the transfer has ended, the session keeps its stats until it is claimed again
+  if (session == NULL) {
+    for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+      if (memcmp(sessions[i].peer_addr, peer_addr, LEN_PEER_ADDR) != 0) continue;
+
+      if (session == NULL || sessions[i].stats_time_start > session->stats_time_start) session = &sessions[i];
+    }
+  }
+
+  if (session == NULL) {
+    server_stats_t none = {};
+    return none;
+  }
+
+  return sessionStats(session);
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::session_t *MTFTP_SERVER::findSession(const uint8_t *peer_addr) {
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    if (sessions[i].state != STATE_IDLE && memcmp(sessions[i].peer_addr, peer_addr, LEN_PEER_ADDR) == 0) {
+      return &sessions[i];
+    }
+  }
+
+  return NULL;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::session_t *MTFTP_SERVER::claimSession(const uint8_t *peer_addr) {
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    if (sessions[i].state == STATE_IDLE) {
+      memcpy(sessions[i].peer_addr, peer_addr, LEN_PEER_ADDR);
+      return &sessions[i];
+    }
+  }
+
+  MTFTP_LOGW(TAG, "read request received with all %d sessions active", CONFIG_MAX_SESSIONS);
+
+  sendErr(peer_addr, ERR_BUSY);
+
+  return NULL;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::setState(session_t *session, server_state new_state) {
+  MTFTP_LOGD(TAG, "state change from %s to %s", server_state_str[session->state], server_state_str[new_state]);
+
+  MTFTP_TRACE(TRACE_STATE, traceSource(session), session->state, new_state);
+
+  session->state = new_state;
+
+  if (new_state == STATE_IDLE) {
+    session->stats_time_end = mtftpTime();
+  } else if (new_state == STATE_AWAIT_RESPONSE) {
+    session->stats_time_window_end = mtftpTime();
+  }
+
+  // only notify once the last active session has ended
+  if (new_state == STATE_IDLE && isIdle()) {
+    if (onIdle) onIdle();
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::send(session_t *session, const uint8_t *data, uint16_t len) {
+  if (session == batch_session) {
+    // handed to the transport with the rest of the batch
+    uint8_t *slot = batch_buffer + num_batched * LEN_PACKET;
+    memcpy(slot, data, len);
+
+    batch_packets[num_batched].data = slot;
+    batch_packets[num_batched].len = len;
+    num_batched ++;
+    return;
+  }
+
+  if (sendPacketTo) {
+    sendPacketTo(session->peer_addr, data, len);
+  } else {
+    sendPacket(data, len);
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::sendErr(const uint8_t *peer_addr, err_types err) {
+  packet_err_t err_pkt;
+  err_pkt.err = err;
+
+  if (sendPacketTo) {
+    sendPacketTo(peer_addr, (uint8_t *) &err_pkt, sizeof(err_pkt));
+  } else {
+    sendPacket((uint8_t *) &err_pkt, sizeof(err_pkt));
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::onTransferStart(session_t *session) {
+  session->transfer_params.window_no = 0;
+  session->transfer_params.num_rtx = 0;
+  session->transfer_params.stream_base = 0;
+  session->transfer_params.stream_next = 0;
+  session->transfer_params.stream_eof = UINT32_MAX;
+  session->transfer_params.time_last_ack = mtftpTime();
+  session->transfer_params.stream_resends = 0;
+
+  memset(&session->stats, 0, sizeof(session->stats));
+  session->stats_rtt_sum = 0;
+  session->stats_time_start = session->transfer_params.time_last_ack;
+  session->stats_time_end = 0;
+  session->stats_stream_sent = 0;
+
+  MTFTP_TRACE(TRACE_RRQ_RX, traceSource(session), session->transfer_params.file_index, session->transfer_params.file_offset);
+
+  // the cache may hold data from a different file
+  session->cache_valid = false;
+
+  onWindowStart(session);
+}
+
+MTFTP_SERVER_TEMPLATE
+bool MTFTP_SERVER::isPacked(session_t *session) {
+  return (session->transfer_params.options & OPT_COMPRESS) || session->transfer_params.delta_chunk_size > 0;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::onWindowStart(session_t *session) {
+  session->transfer_params.block_no = 0;
+  session->transfer_params.largest_block_no = -1;
+  session->transfer_params.len_largest_block = 0;
+
+  session->transfer_params.batch_num_started = 1;
+  session->transfer_params.batch_start[0] = 0;
+
+  if (session->transfer_params.parity_blocks > 0) {
+    memset(session->parity, 0, session->transfer_params.parity_blocks * LEN_BLOCK);
+  }
+
+  if (isPacked(session)) {
+    session->raw_offsets[0] = session->transfer_params.file_offset;
+  }
+
+  session->transfer_params.window_crc = 0;
+  session->stats_window_resent = false;
+}
+
+MTFTP_SERVER_TEMPLATE
+recv_result_t MTFTP_SERVER::onPacketRecv(const uint8_t *data, uint16_t len_data) {
+  return onPacketRecv(DEFAULT_PEER_ADDR, data, len_data);
+}
+
+MTFTP_SERVER_TEMPLATE
+recv_result_t MTFTP_SERVER::onPacketRecv(const uint8_t *peer_addr, const uint8_t *data, uint16_t len_data) {
+  const char *TAG = "onPacketRecv";
+
+  if (len_data < 1) {
+    MTFTP_LOGW(TAG, "onPacketRecv: called with len_data == 0!");
+    return RECV_LEN;
+  }
+
+  if (!packet_queue.push(peer_addr, data, len_data)) {
+    MTFTP_TRACE(TRACE_QUEUE_DROP, TRACE_SERVER | TRACE_NO_SESSION, len_data, packet_queue.getDrops());
+    MTFTP_LOGW(TAG, "failed to push %d bytes, %d packets dropped (increase LEN_PACKET_QUEUE ?)", len_data, packet_queue.getDrops());
+    return RECV_QUEUE_FULL;
+  }
+
+  return RECV_OK;
+}
+
+MTFTP_SERVER_TEMPLATE
+recv_result_t MTFTP_SERVER::handlePacket(const uint8_t *peer_addr, const uint8_t *data, uint16_t len_data) {
+  const char *TAG = "handlePacket";
+
+  recv_result_t result = RECV_UNSET;
+
+  enum server_state new_state = STATE_NOCHANGE;
+
+  session_t *session = findSession(peer_addr);
+
+  switch(*data) {
+    case TYPE_READ_REQUEST: 
+    case TYPE_BATCH_READ_REQUEST:
+    {
+      bool batch = *data == TYPE_BATCH_READ_REQUEST;
+
+      if (batch) {
+        packet_brq_t *pkt = (packet_brq_t *) data;
+
+        if (
+          len_data < LEN_BRQ_HEADER || pkt->num_files == 0 || pkt->num_files > LEN_BATCH ||
+          len_data != LEN_BRQ_HEADER + (pkt->num_files * sizeof(batch_file_t))
+        ) {
+          MTFTP_LOGW(TAG, "len BRQ packet is %d", len_data);
+
+          result = RECV_LEN;
+          break;
+        }
+      } else if (len_data != sizeof(packet_rrq_t) && len_data != LEN_RRQ_OPTIONS && len_data != LEN_RRQ_BASE) {
+        MTFTP_LOGW(TAG, "len RRQ packet is %d (!= %d)", len_data, (int) sizeof(packet_rrq_t));
+
+        result = RECV_LEN;
+        break;
+      }
+
+      if (session != NULL) {
+        MTFTP_LOGW(TAG, "RRQ received in state %s", server_state_str[session->state]);
+
+        result = RECV_STATE;
+        break;
+      }
+
+      if (!batch && len_data >= LEN_RRQ_OPTIONS) {
+        packet_rrq_t *pkt = (packet_rrq_t *) data;
+
+        // the offset of every block of the window is kept, so a compressed window is limited to CONFIG_WINDOW_SIZE_MAX
+        bool compress = (pkt->options & OPT_COMPRESS) && !(pkt->options & OPT_STREAM);
+
+#if CONFIG_COMPRESSION
+        bool supported = pkt->window_size <= CONFIG_WINDOW_SIZE_MAX;
+#else
+        bool supported = false;
+#endif
+
+        if (compress && !supported) {
+          MTFTP_LOGW(TAG, "RRQ for compressed window of %d blocks not supported", pkt->window_size);
+
+          sendErr(peer_addr, ERR_OPTION);
+
+          result = RECV_BAD_OPTION;
+          break;
+        }
+      }
+
+      session = claimSession(peer_addr);
+      if (session == NULL) {
+        result = RECV_NO_SESSION;
+        break;
+      }
+
+      session->transfer_params.delta_chunk_size = 0;
+
+      if (batch) {
+        packet_brq_t *pkt = (packet_brq_t *) data;
+
+        MTFTP_LOGI(TAG, "BRQ for %d files", pkt->num_files);
+
+        memcpy(session->transfer_params.batch_files, pkt->files, pkt->num_files * sizeof(batch_file_t));
+        session->transfer_params.num_batch_files = pkt->num_files;
+        session->transfer_params.batch_file = 0;
+        session->transfer_params.file_index = pkt->files[0].file_index;
+        session->transfer_params.file_offset = pkt->files[0].file_offset;
+        session->transfer_params.window_size = pkt->window_size;
+        session->transfer_params.options = 0;
+        session->transfer_params.parity_blocks = 0;
+        session->transfer_params.tag_windows = true;
+      } else {
+        packet_rrq_t *pkt = (packet_rrq_t *) data;
+
+        MTFTP_LOGI(TAG, "RRQ for index=%d offset=%d", pkt->file_index, pkt->file_offset);
+
+        session->transfer_params.num_batch_files = 0;
+        session->transfer_params.file_index = pkt->file_index;
+        session->transfer_params.file_offset = pkt->file_offset;
+        session->transfer_params.window_size = pkt->window_size;
+        session->transfer_params.options = len_data >= LEN_RRQ_OPTIONS ? pkt->options : 0;
+
+        // a stream is not compressed, blocks can be requested long after the window they were sent in
+        // (and has no windows to check)
+        if (session->transfer_params.options & OPT_STREAM) {
+          session->transfer_params.options &= ~(OPT_COMPRESS | OPT_CRC);
+        }
+
+        // a stream has no windows to protect
+        uint8_t parity_blocks = len_data == sizeof(packet_rrq_t) && !(session->transfer_params.options & OPT_STREAM) ?
+          pkt->parity_blocks : 0;
+        if (parity_blocks > CONFIG_MAX_PARITY_BLOCKS) {
+          MTFTP_LOGW(TAG, "%d parity blocks requested, sending %d", parity_blocks, CONFIG_MAX_PARITY_BLOCKS);
+          parity_blocks = CONFIG_MAX_PARITY_BLOCKS;
+        }
+
+        session->transfer_params.parity_blocks = parity_blocks;
+        // a client that sends options reads the window tag
+        session->transfer_params.tag_windows = len_data >= LEN_RRQ_OPTIONS && !(session->transfer_params.options & OPT_STREAM);
+      }
+
+      onTransferStart(session);
+
+      new_state = STATE_TRANSFER;
+
+      result = RECV_OK;
+      break;
+    }
+    case TYPE_DELTA_READ_REQUEST:
+    {
+      packet_drq_t *pkt = (packet_drq_t *) data;
+
+      if (
+        len_data < LEN_DRQ_HEADER || pkt->num_chunks > LEN_DRQ_CHUNKS ||
+        len_data != LEN_DRQ_HEADER + (pkt->num_chunks * sizeof(delta_chunk_t))
+      ) {
+        MTFTP_LOGW(TAG, "len DRQ packet is %d", len_data);
+
+        result = RECV_LEN;
+        break;
+      }
+
+      // the signatures of a delta read may take several DRQs
+      if (session != NULL && session->state != STATE_SIGNATURES) {
+        MTFTP_LOGW(TAG, "DRQ received in state %s", server_state_str[session->state]);
+
+        result = RECV_STATE;
+        break;
+      }
+
+      // the offset of every block of the window is kept, as for a compressed window
+      bool supported = CONFIG_DELTA_CHUNKS > 0 && pkt->window_size <= CONFIG_WINDOW_SIZE_MAX &&
+        pkt->chunk_size > 0 && pkt->chunk_size <= MAX_DELTA_CHUNK_SIZE;
+
+      if (!supported) {
+        MTFTP_LOGW(TAG, "DRQ for window of %d blocks, chunks of %d bytes not supported", pkt->window_size, pkt->chunk_size);
+
+        // every DRQ of the request is rejected, only answer the last so that the client gets a single ERR
+        if (pkt->last) {
+          sendErr(peer_addr, ERR_OPTION);
+        }
+
+        result = RECV_BAD_OPTION;
+        break;
+      }
+
+      if (session == NULL) {
+        session = claimSession(peer_addr);
+        if (session == NULL) {
+          result = RECV_NO_SESSION;
+          break;
+        }
+
+        MTFTP_LOGI(TAG, "DRQ for index=%d offset=%d chunk_size=%d", pkt->file_index, pkt->file_offset, pkt->chunk_size);
+
+        session->transfer_params.num_batch_files = 0;
+        session->transfer_params.file_index = pkt->file_index;
+        session->transfer_params.file_offset = pkt->file_offset;
+        session->transfer_params.window_size = pkt->window_size;
+        session->transfer_params.options = 0;
+        session->transfer_params.parity_blocks = 0;
+        session->transfer_params.tag_windows = true;
+        session->transfer_params.delta_chunk_size = pkt->chunk_size;
+
+        // chunks in a DRQ that never arrives are unknown
+        memset(session->delta_chunks, 0, CONFIG_DELTA_CHUNKS * sizeof(delta_chunk_t));
+
+        new_state = STATE_SIGNATURES;
+      }
+
+      addChunks(session, pkt);
+
+      if (pkt->last) {
+        indexChunks(session);
+        onTransferStart(session);
+
+        new_state = STATE_TRANSFER;
+      }
+
+      result = RECV_OK;
+      break;
+    }
+    case TYPE_RETRANSMIT:
+    case TYPE_NACK:
+    {
+      // when streaming, missing blocks are reported while the transfer is in progress
+      bool stream = session != NULL && (session->transfer_params.options & OPT_STREAM);
+
+      // the client may not need the rest of the parity blocks
+      if (session == NULL || (!stream && session->state != STATE_AWAIT_RESPONSE && session->state != STATE_PARITY)) {
+        MTFTP_LOGW(TAG, "RTX received in state %s", server_state_str[session == NULL ? STATE_IDLE : session->state]);
+
+        // the session has timed out, so that the client does not keep asking
+        if (session == NULL) sendErr(peer_addr, ERR_NO_SESSION);
+
+        result = RECV_STATE;
+        break;
+      }
+
+      uint32_t num_rtx;
+
+      if (*data == TYPE_RETRANSMIT) {
+        packet_rtx_t *pkt_rtx = (packet_rtx_t *) data;
+
+        uint16_t len_elements = pkt_rtx->num_elements * sizeof(uint16_t);
+        if (len_data != LEN_RTX_HEADER + len_elements) {
+          MTFTP_LOGW(TAG, "len RTX packet is %d (!= %d)", len_data, LEN_RTX_HEADER + len_elements);
+        }
+
+        // only retransmit the block nos actually contained in the packet
+        num_rtx = len_data < LEN_RTX_HEADER ? 0 : (len_data - LEN_RTX_HEADER) / sizeof(uint16_t);
+        if (pkt_rtx->num_elements < num_rtx) {
+          num_rtx = pkt_rtx->num_elements;
+        }
+      } else {
+        if (!nackValid((packet_nack_t *) data, len_data)) {
+          MTFTP_LOGW(TAG, "len NACK packet is %d (< %d ranges)", len_data, ((packet_nack_t *) data)->num_ranges);
+
+          result = RECV_LEN;
+          break;
+        }
+
+        num_rtx = nackCount((packet_nack_t *) data, len_data);
+      }
+
+      MTFTP_LOGD(TAG, "RTX received for %d blocks", num_rtx);
+      MTFTP_TRACE(TRACE_RTX_RX, traceSource(session), num_rtx, *data);
+
+      session->stats.rtx_received ++;
+      session->stats.blocks_requested += num_rtx;
+      sampleWindowRtt(session);
+
+      memcpy(session->transfer_params.rtx_pkt, data, len_data);
+      session->transfer_params.len_rtx_pkt = len_data;
+      session->transfer_params.rtx_index = 0;
+      memset(&session->transfer_params.rtx_iter, 0, sizeof(nack_iter_t));
+      session->transfer_params.num_rtx = num_rtx;
+
+      result = RECV_OK;
+
+      if (stream) {
+        session->transfer_params.time_last_ack = mtftpTime();
+        new_state = STATE_TRANSFER;
+      } else if (num_rtx > 0) {
+        new_state = STATE_RTX;
+      }
+      break;
+    }
+    case TYPE_ACK:
+    {
+      if (len_data != sizeof(packet_ack_t) && len_data != LEN_ACK_BASE) {
+        MTFTP_LOGW(TAG, "len ACK packet is %d (!= %d)", len_data, (int) sizeof(packet_ack_t));
+
+        result = RECV_LEN;
+        break;
+      }
+
+      packet_ack_t *pkt = (packet_ack_t *) data;
+
+      MTFTP_TRACE(
+        TRACE_ACK_RX, traceSource(session), pkt->block_no,
+        len_data == sizeof(packet_ack_t) ? pkt->window_no | ((uint32_t) pkt->window_size << 16) : 0
+      );
+
+      // the client has resized the window, takes effect from the next window (or immediately when streaming)
+      if (
+        session != NULL && len_data == sizeof(packet_ack_t) && pkt->window_size != 0 &&
+        (
+          (session->transfer_params.options & OPT_STREAM) || session->state == STATE_AWAIT_RESPONSE ||
+          session->state == STATE_PARITY || session->state == STATE_RTX
+        )
+      ) {
+        uint16_t window_size = pkt->window_size;
+        if (isPacked(session) && window_size > CONFIG_WINDOW_SIZE_MAX) {
+          window_size = CONFIG_WINDOW_SIZE_MAX;
+        }
+
+        if (window_size != session->transfer_params.window_size) {
+          MTFTP_LOGD(TAG, "window size %d -> %d", session->transfer_params.window_size, window_size);
+        }
+
+        session->transfer_params.window_size = window_size;
+      }
+
+      if (session != NULL && (session->transfer_params.options & OPT_STREAM)) {
+        result = RECV_OK;
+        new_state = onStreamAck(session, pkt->block_no);
+        break;
+      }
+
+      // the client may have rebuilt the blocks still being sent from parity
+      if (
+        session == NULL ||
+        (session->state != STATE_AWAIT_RESPONSE && session->state != STATE_PARITY && session->state != STATE_RTX)
+      ) {
+        MTFTP_LOGW(TAG, "ACK received in state %s", server_state_str[session == NULL ? STATE_IDLE : session->state]);
+
+        if (session == NULL) sendErr(peer_addr, ERR_NO_SESSION);
+
+        result = RECV_STATE;
+        break;
+      }
+
+      if (len_data == sizeof(packet_ack_t) && pkt->window_no != session->transfer_params.window_no) {
+        if (pkt->window_no == (uint8_t) (session->transfer_params.window_no - 1)) {
+          // the client has resent its ACK of the previous window, so it received none of this window
+          MTFTP_LOGD(TAG, "repeated ACK of window %d, resending window", pkt->window_no);
+
+          result = RECV_OK;
+
+          onWindowStart(session);
+          session->stats.duplicate_acks ++;
+          session->stats_window_resent = true;
+          new_state = STATE_TRANSFER;
+        } else {
+          MTFTP_LOGW(TAG, "ACK of window %d when window is %d", pkt->window_no, session->transfer_params.window_no);
+
+          result = RECV_BAD_BLOCK_NO;
+        }
+        break;
+      }
+
+      result = RECV_OK;
+
+      MTFTP_LOGD(TAG, "ACK of %d", pkt->block_no);
+
+      session->stats.windows ++;
+      sampleWindowRtt(session);
+
+      if (session->transfer_params.num_batch_files > 0) {
+        new_state = onBatchAck(session, pkt->block_no);
+        break;
+      }
+
+      // if ACK matches last block number sent AND the last block was not full
+      // there is no more data to transfer
+      if (pkt->block_no == session->transfer_params.block_no && session->transfer_params.len_largest_block < LEN_BLOCK) {
+        new_state = STATE_IDLE;
+        break;
+      }
+
+      if (isPacked(session)) {
+        if ((int32_t) pkt->block_no > session->transfer_params.largest_block_no) {
+          MTFTP_LOGW(TAG, "ACK of %d, only sent up to %d", pkt->block_no, session->transfer_params.largest_block_no);
+
+          result = RECV_BAD_BLOCK_NO;
+          break;
+        }
+
+        // blocks hold different amounts of the file, the next window starts where the block acknowledged ended
+        session->transfer_params.file_offset = session->raw_offsets[pkt->block_no + 1];
+      } else {
+        // advance file_offset by the number of bytes successfully transferred
+        session->transfer_params.file_offset += (pkt->block_no * LEN_BLOCK) +
+        // block_no is one less than actual number of blocks transferred, so add final block
+        // final block might be partial, so use bytes read instead of full block
+          (pkt->block_no == session->transfer_params.largest_block_no ? session->transfer_params.len_largest_block: LEN_BLOCK);
+      }
+
+      session->transfer_params.window_no ++;
+      onWindowStart(session);
+
+      // start transfer of next window
+      new_state = STATE_TRANSFER;
+      break;
+    }
+    default:
+      MTFTP_LOGW(TAG, "bad packet opcode: %02X", *data);
+      
+      result = RECV_BAD_OPCODE;
+      break;
+  }
+
+  if (result == RECV_OK) {
+    session->transfer_params.time_last_packet = mtftpTime();
+  }
+
+  if (new_state != STATE_NOCHANGE) {
+    setState(session, new_state);
+  }
+
+  return result;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::blockPosition(session_t *session, uint32_t block_no, uint16_t *file_index, uint32_t *offset) {
+  // the file the block belongs to is the last one started at or before it
+  uint8_t started = 0;
+  while (
+    started + 1 < session->transfer_params.batch_num_started &&
+    session->transfer_params.batch_start[started + 1] <= block_no
+  ) {
+    started ++;
+  }
+
+  if (started == 0) {
+    *file_index = session->transfer_params.file_index;
+    *offset = session->transfer_params.file_offset + (block_no * LEN_BLOCK);
+  } else {
+    // files after the first of the window are read from the start
+    batch_file_t *file = &session->transfer_params.batch_files[session->transfer_params.batch_file + started];
+
+    *file_index = file->file_index;
+    *offset = file->file_offset + ((block_no - session->transfer_params.batch_start[started]) * LEN_BLOCK);
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+bool MTFTP_SERVER::fillCache(session_t *session, uint32_t block_no, uint16_t file_index, uint32_t offset) {
+  // read ahead up to the end of the window in a single call to readFile
+  // (a streaming transfer has no end of window and a packed window holds more than window_size blocks
+  // of the file, so just fill the cache)
+  uint16_t num_blocks = CONFIG_LEN_READ_CACHE;
+  if (
+    !(session->transfer_params.options & OPT_STREAM) && !isPacked(session) &&
+    block_no < session->transfer_params.window_size &&
+    (session->transfer_params.window_size - block_no) < num_blocks
+  ) {
+    num_blocks = session->transfer_params.window_size - block_no;
+  }
+
+  uint16_t btr = num_blocks * LEN_BLOCK;
+
+  session->cache_valid = false;
+
+  if (!readFile(
+    file_index,
+    offset,
+    session->cache,
+    btr,
+    &session->cache_len
+  )) {
+    return false;
+  }
+
+  MTFTP_LOGV(TAG, "cached %d bytes at offset %d", session->cache_len, offset);
+
+  session->cache_valid = true;
+  session->cache_file_index = file_index;
+  session->cache_eof = session->cache_len < btr;
+  session->cache_offset = offset;
+
+  return true;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::addChunks(session_t *session, const packet_drq_t *pkt) {
+  for (uint8_t i = 0; i < pkt->num_chunks; i++) {
+    uint32_t chunk = pkt->first_chunk + i;
+
+    // the client never sends more than CONFIG_DELTA_CHUNKS, unless it was built with a larger one
+    if (chunk >= CONFIG_DELTA_CHUNKS) break;
+
+    session->delta_chunks[chunk] = pkt->chunks[i];
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::indexChunks(session_t *session) {
+  memset(session->transfer_params.delta_head, 0xFF, DELTA_BUCKETS);
+
+  // chained in reverse, so that the first of identical chunks is found first
+  for (int16_t i = CONFIG_DELTA_CHUNKS - 1; i >= 0; i--) {
+    delta_chunk_t *chunk = &session->delta_chunks[i];
+
+    if (chunk->weak == 0 && chunk->strong == 0) continue;
+
+    uint8_t bucket = deltaBucket(chunk->weak, DELTA_BUCKETS);
+    session->delta_next[i] = session->transfer_params.delta_head[bucket];
+    session->transfer_params.delta_head[bucket] = i;
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+int16_t MTFTP_SERVER::findChunk(session_t *session, uint32_t weak, const uint8_t *data) {
+  uint8_t i = session->transfer_params.delta_head[deltaBucket(weak, DELTA_BUCKETS)];
+  // only worked out if a weak checksum matches
+  bool have_strong = false;
+  uint32_t strong = 0;
+
+  while (i != 0xFF) {
+    if (session->delta_chunks[i].weak == weak) {
+      if (!have_strong) {
+        strong = deltaStrong(data, session->transfer_params.delta_chunk_size);
+        have_strong = true;
+      }
+
+      if (session->delta_chunks[i].strong == strong) return i;
+    }
+
+    i = session->delta_next[i];
+  }
+
+  return -1;
+}
+
+MTFTP_SERVER_TEMPLATE
+uint16_t MTFTP_SERVER::packDelta(session_t *session, const uint8_t *data, uint16_t len_data, bool eof, uint8_t *block, uint16_t *len_used) {
+  // same literal runs as compressBlock, a token byte >= 0x80 copies (token & 0x7F) + 1 chunks from a uint16_t chunk no
+  const uint8_t MAX_LITERALS = 0x7F;
+  const uint8_t MAX_RUN = 0x80;
+  const uint8_t LEN_COPY = 3;
+
+  uint16_t len_chunk = session->transfer_params.delta_chunk_size;
+
+  uint16_t len_block = 0;
+  uint16_t pos = 0;
+  // first byte of the literals not yet copied to the block
+  uint16_t literals = 0;
+  // position in the block of the last copy token (if nothing has been added since) and its last chunk
+  int16_t last_copy = -1;
+  uint16_t last_chunk = 0;
+
+  // weak checksum of the len_chunk bytes at pos, rolled along while nothing matches
+  bool rolling = false;
+  uint32_t weak = 0;
+
+  while (pos < len_data) {
+    int16_t chunk = -1;
+
+    if (pos + len_chunk <= len_data) {
+      weak = rolling ? deltaRoll(weak, data[pos - 1], data[pos + len_chunk - 1], len_chunk) : deltaWeak(data + pos, len_chunk);
+      rolling = true;
+
+      chunk = findChunk(session, weak, data + pos);
+    } else if (!eof && pos > 0) {
+      // the next block may find a chunk starting here, once more of the file is available
+      break;
+    }
+
+    uint16_t num_literals = pos - literals;
+
+    if (chunk >= 0) {
+      if (num_literals == 0 && last_copy >= 0 && chunk == last_chunk + 1 && (block[last_copy] & 0x7F) < MAX_RUN - 1) {
+        // the chunk after the last one copied
+        block[last_copy] ++;
+      } else {
+        if (len_block + (num_literals > 0 ? num_literals + 1 : 0) + LEN_COPY > LEN_BLOCK) break;
+
+        if (num_literals > 0) {
+          block[len_block ++] = num_literals;
+          memcpy(block + len_block, data + literals, num_literals);
+          len_block += num_literals;
+        }
+
+        last_copy = len_block;
+        block[len_block ++] = 0x80;
+        block[len_block ++] = chunk & 0xFF;
+        block[len_block ++] = chunk >> 8;
+      }
+
+      last_chunk = chunk;
+      pos += len_chunk;
+      literals = pos;
+      rolling = false;
+    } else {
+      // room for the token and every literal so far, plus this one
+      if (len_block + num_literals + 2 > LEN_BLOCK) break;
+
+      pos ++;
+      last_copy = -1;
+
+      if (pos - literals == MAX_LITERALS) {
+        block[len_block ++] = MAX_LITERALS;
+        memcpy(block + len_block, data + literals, MAX_LITERALS);
+        len_block += MAX_LITERALS;
+        literals = pos;
+      }
+    }
+  }
+
+  if (pos > literals) {
+    block[len_block ++] = pos - literals;
+    memcpy(block + len_block, data + literals, pos - literals);
+    len_block += pos - literals;
+  }
+
+  *len_used = pos;
+
+  // a short block marks the end of the file
+  if (!eof || pos < len_data) {
+    memset(block + len_block, 0, LEN_BLOCK - len_block);
+    len_block = LEN_BLOCK;
+  }
+
+  return len_block;
+}
+
+MTFTP_SERVER_TEMPLATE
+bool MTFTP_SERVER::sendBlock(session_t *session, uint32_t block_no, uint16_t *bytes_read, bool add_parity) {
+  packet_data_t data_pkt;
+
+  data_pkt.block_no = block_no;
+
+  bool delta = session->transfer_params.delta_chunk_size > 0;
+  bool packed = isPacked(session);
+
+  uint16_t file_index;
+  uint32_t offset;
+  // bytes of the file that go into the block
+  uint16_t len_block_data = LEN_BLOCK;
+  // where the cache is filled from on a miss
+  uint32_t fill_offset;
+
+  if (packed) {
+    // blocks are only ever sent after the block before them, so the offset of every block sent is known
+    file_index = session->transfer_params.file_index;
+    offset = session->raw_offsets[block_no];
+    fill_offset = offset;
+
+    len_block_data = MAX_COMPRESS_INPUT < CONFIG_LEN_READ_CACHE * LEN_BLOCK ?
+      MAX_COMPRESS_INPUT : CONFIG_LEN_READ_CACHE * LEN_BLOCK;
+
+    if (delta) {
+      // a run of chunks covers far more of the file than MAX_COMPRESS_INPUT, so the block is packed from
+      // the rest of the cache. The cache is filled from a multiple of half its size, so that the bytes
+      // given to packDelta only depend on offset and the cache is only refilled every half
+      const uint16_t LEN_HALF_CACHE = (CONFIG_LEN_READ_CACHE * LEN_BLOCK) / 2;
+
+      fill_offset = offset - (offset % LEN_HALF_CACHE);
+      len_block_data = (CONFIG_LEN_READ_CACHE * LEN_BLOCK) - (offset % LEN_HALF_CACHE);
+    }
+  } else {
+    blockPosition(session, block_no, &file_index, &offset);
+    fill_offset = offset;
+  }
+
+  uint32_t cache_end = session->cache_offset + session->cache_len;
+
+  // the block is in the cache if it is entirely within the cache,
+  // or if it is (part of) the final block of the file
+  bool hit = session->cache_valid && file_index == session->cache_file_index && offset >= session->cache_offset &&
+    ((offset + len_block_data) <= cache_end || session->cache_eof);
+
+  if (hit) {
+    cache_stats.hits ++;
+  } else {
+    cache_stats.misses ++;
+
+    if (!fillCache(session, block_no, file_index, fill_offset)) {
+      MTFTP_LOGW(TAG, "loop: reading from %d at offset %d failed. state=IDLE", file_index, offset);
+      packet_err_t err_pkt;
+
+      err_pkt.err = ERR_FREAD;
+
+      send(session, (uint8_t *) &err_pkt, sizeof(err_pkt));
+
+      return false;
+    }
+
+    cache_end = session->cache_offset + session->cache_len;
+  }
+
+  uint32_t len_available = offset < cache_end ? cache_end - offset : 0;
+
+  *bytes_read = 0;
+  if (packed) {
+    // the same bytes of the file always pack into the same block, so it is rebuilt identically when retransmitted
+    const uint8_t *block_data = session->cache + (offset - session->cache_offset);
+    uint16_t len_data = len_available < len_block_data ? len_available : len_block_data;
+    bool eof = session->cache_eof && len_available <= len_block_data;
+    uint16_t len_used;
+
+    if (delta) {
+      *bytes_read = packDelta(session, block_data, len_data, eof, data_pkt.block, &len_used);
+    } else {
+      *bytes_read = compressBlock(block_data, len_data, eof, data_pkt.block, &len_used, LEN_BLOCK);
+    }
+
+    session->raw_offsets[block_no + 1] = offset + len_used;
+  } else if (len_available > 0) {
+    *bytes_read = len_available < LEN_BLOCK ? len_available : LEN_BLOCK;
+    memcpy(data_pkt.block, session->cache + (offset - session->cache_offset), *bytes_read);
+  }
+
+  // blocks are sent in order the first time, retransmits were already counted
+  if ((session->transfer_params.options & OPT_CRC) && (int32_t) block_no > session->transfer_params.largest_block_no) {
+    session->transfer_params.window_crc = crc32c(session->transfer_params.window_crc, data_pkt.block, *bytes_read);
+  }
+
+  if (add_parity) {
+    parityAdd(
+      session->parity + ((block_no % session->transfer_params.parity_blocks) * LEN_BLOCK),
+      data_pkt.block,
+      *bytes_read,
+      LEN_BLOCK
+    );
+  }
+
+  bool retransmit = (session->transfer_params.options & OPT_STREAM) ? block_no < session->stats_stream_sent :
+    (int32_t) block_no <= session->transfer_params.largest_block_no || session->stats_window_resent;
+
+  if (session->transfer_params.tag_windows) {
+    data_pkt.window_tag = windowTag(session->transfer_params.window_no);
+    data_pkt.retransmit = retransmit;
+  }
+
+  session->stats.blocks_sent ++;
+  if (retransmit) {
+    session->stats.blocks_retransmitted ++;
+  } else {
+    session->stats.bytes_sent += packed ? session->raw_offsets[block_no + 1] - offset : *bytes_read;
+  }
+
+  MTFTP_LOGV(TAG, "sending block %d len=%d", data_pkt.block_no, *bytes_read);
+  MTFTP_TRACE(TRACE_DATA_TX, traceSource(session), data_pkt.block_no, *bytes_read | (retransmit ? TRACE_RETRANSMIT : 0));
+
+  send(session, (uint8_t *) &data_pkt, LEN_DATA_HEADER + *bytes_read);
+
+  if (pacing_rate != 0) {
+    pacing_tokens -= (int64_t) (LEN_DATA_HEADER + *bytes_read) * 1000000;
+  }
+
+  if (session->transfer_params.block_no > session->transfer_params.largest_block_no) {
+    session->transfer_params.largest_block_no = session->transfer_params.block_no;
+    session->transfer_params.len_largest_block = *bytes_read;
+  }
+
+  return true;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_state MTFTP_SERVER::onBatchAck(session_t *session, uint16_t block_no) {
+  // file of the block acknowledged, the last one started at or before it
+  uint8_t started = 0;
+  while (
+    started + 1 < session->transfer_params.batch_num_started &&
+    session->transfer_params.batch_start[started + 1] <= block_no
+  ) {
+    started ++;
+  }
+
+  uint8_t file = session->transfer_params.batch_file + started;
+
+  // the block acknowledged is the final block of its file if the next file starts after it,
+  // or if it is the final block sent and was partial
+  bool file_end = started + 1 < session->transfer_params.batch_num_started ?
+    session->transfer_params.batch_start[started + 1] == block_no + 1 :
+    block_no == session->transfer_params.largest_block_no && session->transfer_params.len_largest_block < LEN_BLOCK;
+
+  if (file_end) {
+    if (file + 1 >= session->transfer_params.num_batch_files) {
+      MTFTP_LOGD(TAG, "batch of %d files complete", session->transfer_params.num_batch_files);
+      return STATE_IDLE;
+    }
+
+    // the next window starts with the next file
+    file ++;
+    session->transfer_params.file_index = session->transfer_params.batch_files[file].file_index;
+    session->transfer_params.file_offset = session->transfer_params.batch_files[file].file_offset;
+  } else {
+    uint32_t file_offset = started == 0 ?
+      session->transfer_params.file_offset : session->transfer_params.batch_files[file].file_offset;
+
+    session->transfer_params.file_index = session->transfer_params.batch_files[file].file_index;
+    session->transfer_params.file_offset = file_offset +
+      ((block_no + 1 - session->transfer_params.batch_start[started]) * LEN_BLOCK);
+  }
+
+  session->transfer_params.batch_file = file;
+  session->transfer_params.window_no ++;
+  onWindowStart(session);
+
+  // start transfer of next window
+  return STATE_TRANSFER;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::sendParity(session_t *session) {
+  packet_parity_t parity_pkt;
+
+  parity_pkt.last_block_no = session->transfer_params.block_no;
+  parity_pkt.eof = session->transfer_params.len_largest_block < LEN_BLOCK;
+  parity_pkt.parity_no = session->transfer_params.parity_no;
+  if (session->transfer_params.tag_windows) {
+    parity_pkt.window_tag = windowTag(session->transfer_params.window_no);
+  }
+  memcpy(parity_pkt.block, session->parity + (session->transfer_params.parity_no * LEN_BLOCK), LEN_BLOCK);
+
+  MTFTP_LOGV(TAG, "sending parity %d of window ending at %d", parity_pkt.parity_no, parity_pkt.last_block_no);
+
+  send(session, (uint8_t *) &parity_pkt, sizeof(parity_pkt));
+  session->stats.parity_sent ++;
+
+  if (pacing_rate != 0) {
+    pacing_tokens -= (int64_t) sizeof(parity_pkt) * 1000000;
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::sendCrc(session_t *session) {
+  packet_crc_t crc_pkt;
+
+  crc_pkt.last_block_no = session->transfer_params.largest_block_no;
+  crc_pkt.window_no = session->transfer_params.window_no;
+  crc_pkt.crc = session->transfer_params.window_crc;
+
+  MTFTP_LOGV(TAG, "sending crc %08X of window ending at %d", crc_pkt.crc, crc_pkt.last_block_no);
+
+  send(session, (uint8_t *) &crc_pkt, sizeof(crc_pkt));
+
+  if (pacing_rate != 0) {
+    pacing_tokens -= (int64_t) sizeof(crc_pkt) * 1000000;
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_state MTFTP_SERVER::onStreamAck(session_t *session, uint16_t block_no) {
+  // number of blocks newly acknowledged, the ACK is for the last block received in order
+  uint16_t num_acked = block_no + 1 - (uint16_t) session->transfer_params.stream_base;
+
+  if (num_acked > session->transfer_params.stream_next - session->transfer_params.stream_base) {
+    MTFTP_LOGD(TAG, "stale ACK of %d", block_no);
+    return STATE_NOCHANGE;
+  }
+
+  session->transfer_params.stream_base += num_acked;
+  session->transfer_params.time_last_ack = mtftpTime();
+  session->transfer_params.stream_resends = 0;
+
+  MTFTP_LOGV(TAG, "ACK of %d, base=%d", block_no, session->transfer_params.stream_base);
+
+  // every block up to and including the final block has been acknowledged
+  if (session->transfer_params.stream_base > session->transfer_params.stream_eof) {
+    return STATE_IDLE;
+  }
+
+  // the window has moved, send the blocks that are now in it
+  return session->state == STATE_AWAIT_RESPONSE ? STATE_TRANSFER : STATE_NOCHANGE;
+}
+
+MTFTP_SERVER_TEMPLATE
+typename MTFTP_SERVER::server_state MTFTP_SERVER::streamSend(session_t *session) {
+  uint16_t bytes_read;
+  uint16_t block_no;
+
+  // retransmit blocks the client has reported missing first
+  while (session->transfer_params.num_rtx > 0 && nextRtxBlock(session, &block_no)) {
+    session->transfer_params.num_rtx --;
+
+    uint32_t index = session->transfer_params.stream_base + (uint16_t) (block_no - (uint16_t) session->transfer_params.stream_base);
+
+    // acknowledged since the NACK was sent (block_no before stream_base wraps around), or never sent
+    if (index >= session->transfer_params.stream_next) continue;
+
+    if (!sendBlock(session, index, &bytes_read)) return STATE_IDLE;
+
+    return STATE_NOCHANGE;
+  }
+
+  session->transfer_params.num_rtx = 0;
+
+  uint32_t num_unacked = session->transfer_params.stream_next - session->transfer_params.stream_base;
+
+  if (session->transfer_params.stream_next <= session->transfer_params.stream_eof && num_unacked < session->transfer_params.window_size) {
+    if (!sendBlock(session, session->transfer_params.stream_next, &bytes_read)) return STATE_IDLE;
+
+    if (bytes_read < LEN_BLOCK) {
+      session->transfer_params.stream_eof = session->transfer_params.stream_next;
+    }
+
+    session->transfer_params.stream_next ++;
+
+    if (session->transfer_params.stream_next > session->stats_stream_sent) {
+      session->stats_stream_sent = session->transfer_params.stream_next;
+    }
+
+    return STATE_NOCHANGE;
+  }
+
+  // window is full (or everything has been sent), wait for the client to acknowledge
+  return STATE_AWAIT_RESPONSE;
+}
+
+MTFTP_SERVER_TEMPLATE
+bool MTFTP_SERVER::nextRtxBlock(session_t *session, uint16_t *block_no) {
+  if (session->transfer_params.rtx_pkt[0] == TYPE_NACK) {
+    return nackNext(
+      (packet_nack_t *) session->transfer_params.rtx_pkt,
+      session->transfer_params.len_rtx_pkt,
+      &session->transfer_params.rtx_iter,
+      block_no
+    );
+  }
+
+  packet_rtx_t *pkt_rtx = (packet_rtx_t *) session->transfer_params.rtx_pkt;
+
+  *block_no = pkt_rtx->block_nos[session->transfer_params.rtx_index ++];
+  return true;
+}
+
+MTFTP_SERVER_TEMPLATE
+bool MTFTP_SERVER::sendNext(void) {
+  // service the first session (in round-robin order) that has a block to send
+  // so a window in progress for one client is interleaved with the others
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    uint8_t index = (next_session + i) % CONFIG_MAX_SESSIONS;
+    session_t *session = &sessions[index];
+
+    if (!isSending(session)) continue;
+
+    // hold the block back (for this session's turn) until the pacer or the transport allows it
+    if (!canSend()) {
+      paced_loops ++;
+
+      // still sending as far as the timeout is concerned (a stream times out from the client's last packet)
+      if (!(session->transfer_params.options & OPT_STREAM)) {
+        session->transfer_params.time_last_packet = mtftpTime();
+      }
+      return false;
+    }
+
+    next_session = (index + 1) % CONFIG_MAX_SESSIONS;
+
+    if (!sendBatch) {
+      sendStep(session);
+      return true;
+    }
+
+    // prepare the rest of the window, as far as the pacer and the transport allow, and hand it over at once
+    batch_session = session;
+    num_batched = 0;
+
+    do {
+      sendStep(session);
+    } while (isSending(session) && num_batched + MAX_STEP_PACKETS <= CONFIG_LEN_TX_BATCH && canSend());
+
+    batch_session = NULL;
+
+    if (num_batched > 0) {
+      sendBatch(session->peer_addr, batch_packets, num_batched);
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::sendStep(session_t *session) {
+  enum server_state new_state = STATE_NOCHANGE;
+
+  if (session->transfer_params.options & OPT_STREAM) {
+    // the client ACKs while the blocks arrive, so sending does not hold off the timeout
+    new_state = streamSend(session);
+  } else {
+    switch(session->state) {
+      case STATE_TRANSFER:
+      {
+        uint16_t bytes_read;
+
+        // parity_no in packet_parity cannot describe a longer window
+        bool add_parity = session->transfer_params.parity_blocks > 0 &&
+          session->transfer_params.window_size <= MAX_PARITY_WINDOW_SIZE;
+      
+        if (!sendBlock(session, session->transfer_params.block_no, &bytes_read, add_parity)) {
+          new_state = STATE_IDLE;
+          break;
+        }
+
+        bool window_end = session->transfer_params.block_no >= (session->transfer_params.window_size - 1);
+        uint8_t next_file = session->transfer_params.batch_file + session->transfer_params.batch_num_started;
+
+        if (bytes_read < LEN_BLOCK && !window_end && next_file < session->transfer_params.num_batch_files) {
+          // end of a file in a batch, the next file starts at the next block
+          session->transfer_params.batch_start[session->transfer_params.batch_num_started ++] =
+            session->transfer_params.block_no + 1;
+          session->transfer_params.block_no ++;
+        } else if (bytes_read < LEN_BLOCK || window_end) {
+          // just read final block available, or sent transfer_params.window_size blocks
+          if (session->transfer_params.options & OPT_CRC) {
+            sendCrc(session);
+          }
+
+          if (add_parity) {
+            session->transfer_params.parity_no = 0;
+            new_state = STATE_PARITY;
+          } else {
+            new_state = STATE_AWAIT_RESPONSE;
+          }
+        } else {
+          session->transfer_params.block_no ++;
+        }
+
+        // update time_last_packet here because the client is not expected to transmit
+        // while the window hasnt been completely transferred
+        session->transfer_params.time_last_packet = mtftpTime();
+        break;
+      }
+      case STATE_RTX:
+      {
+        uint16_t bytes_read;
+        uint16_t block_no;
+
+        if (nextRtxBlock(session, &block_no)) {
+          if ((int32_t) block_no > session->transfer_params.largest_block_no) {
+            // never sent, the file (or the batch) ended before it, or where a compressed block starts is not known yet
+            MTFTP_LOGD(TAG, "not retransmitting block_no=%d that was never sent", block_no);
+          } else if (!sendBlock(session, block_no, &bytes_read)) {
+            MTFTP_LOGW(TAG, "failed to retransmit block_no=%d", block_no);
+          } else if ((session->transfer_params.options & OPT_CRC) && (int32_t) block_no == session->transfer_params.largest_block_no) {
+            // the client may be waiting for the crc that followed the final block
+            sendCrc(session);
+          }
+
+          session->transfer_params.num_rtx --;
+        } else {
+          session->transfer_params.num_rtx = 0;
+        }
+
+        if (session->transfer_params.num_rtx == 0) {
+          new_state = STATE_AWAIT_RESPONSE;
+        }
+
+        session->transfer_params.time_last_packet = mtftpTime();
+        break;
+      }
+      case STATE_PARITY:
+      {
+        sendParity(session);
+
+        session->transfer_params.parity_no ++;
+        if (session->transfer_params.parity_no >= session->transfer_params.parity_blocks) {
+          new_state = STATE_AWAIT_RESPONSE;
+        }
+
+        session->transfer_params.time_last_packet = mtftpTime();
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  if (new_state != STATE_NOCHANGE) {
+    setState(session, new_state);
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::checkTimers(void) {
+  int64_t time_now = mtftpTime();
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    session_t *session = &sessions[i];
+
+    // streaming: nothing acknowledged for a while, the tail of the window (or the ACKs) may have been lost
+    // so go back and resend every unacknowledged block
+    if (
+      session->state == STATE_AWAIT_RESPONSE &&
+      (session->transfer_params.options & OPT_STREAM) &&
+      (time_now - session->transfer_params.time_last_ack) > STREAM_RESEND
+    ) {
+      if (session->transfer_params.stream_resends >= CONFIG_MAX_RETRIES) {
+        MTFTP_LOGW(TAG, "stream not acknowledged after %d resends", session->transfer_params.stream_resends);
+        MTFTP_TRACE(TRACE_TIMEOUT, traceSource(session), session->state, 0);
+
+        if (onTimeout) onTimeout();
+        setState(session, STATE_IDLE);
+        continue;
+      }
+
+      MTFTP_LOGD(TAG, "no ACK, resending from %d", session->transfer_params.stream_base);
+
+      session->transfer_params.stream_next = session->transfer_params.stream_base;
+      session->transfer_params.time_last_ack = time_now;
+      session->transfer_params.stream_resends ++;
+      setState(session, STATE_TRANSFER);
+    }
+
+    if (session->state != STATE_IDLE && (time_now - session->transfer_params.time_last_packet) > CONFIG_TIMEOUT) {
+      MTFTP_LOGW(TAG, "timeout!");
+      MTFTP_TRACE(TRACE_TIMEOUT, traceSource(session), session->state, 0);
+
+      if (onTimeout) onTimeout();
+      setState(session, STATE_IDLE);
+    }
+  }
+}
+
+MTFTP_SERVER_TEMPLATE
+int64_t MTFTP_SERVER::sendTime(void) {
+  if (txReady && !txReady()) return mtftpTime() + TX_READY_RECHECK;
+
+  int64_t needed = (int64_t) (LEN_DATA_HEADER + LEN_BLOCK) * 1000000;
+  if (pacing_rate == 0 || pacing_tokens >= needed) return mtftpTime();
+
+  // when the bucket holds a full DATA packet again
+  return time_last_refill + (needed - pacing_tokens + pacing_rate - 1) / pacing_rate;
+}
+
+MTFTP_SERVER_TEMPLATE
+int64_t MTFTP_SERVER::getDeadline(void) {
+  int64_t deadline = NO_DEADLINE;
+
+  for (uint8_t i = 0; i < CONFIG_MAX_SESSIONS; i++) {
+    session_t *session = &sessions[i];
+    if (session->state == STATE_IDLE) continue;
+
+    int64_t time_due = session->transfer_params.time_last_packet + CONFIG_TIMEOUT + 1;
+
+    if (isSending(session)) {
+      // a block to send, as soon as the pacer or the transport allow it
+      time_due = sendTime();
+    } else if (session->state == STATE_AWAIT_RESPONSE && (session->transfer_params.options & OPT_STREAM)) {
+      int64_t time_resend = session->transfer_params.time_last_ack + STREAM_RESEND + 1;
+      if (time_resend < time_due) time_due = time_resend;
+    }
+
+    if (time_due < deadline) deadline = time_due;
+  }
+
+  return deadline;
+}
+
+MTFTP_SERVER_TEMPLATE
+void MTFTP_SERVER::loop(void) {
+  // handle every packet received since the last call
+  typename packet_queue_t::packet_slot_t *slot;
+  while ((slot = packet_queue.front()) != NULL) {
+    handlePacket(slot->peer_addr, slot->data, slot->len);
+    packet_queue.pop();
+  }
+
+  sendNext();
+  checkTimers();
+}
+
+MTFTP_SERVER_TEMPLATE
+int64_t MTFTP_SERVER::poll(void) {
+  typename packet_queue_t::packet_slot_t *slot;
+  while ((slot = packet_queue.front()) != NULL) {
+    handlePacket(slot->peer_addr, slot->data, slot->len);
+    packet_queue.pop();
+  }
+
+  // every block the pacer and the transport allow, the sessions still taking turns
+  while (sendNext());
+
+  checkTimers();
+
+  return getDeadline();
+}
+
+#undef MTFTP_SERVER
+#undef MTFTP_SERVER_TEMPLATE
@@ -0,0 +1,70 @@
+#ifndef MTFTP_TRACE_H
+#define MTFTP_TRACE_H
+
+#include "sdkconfig.h"
+#include <stdint.h>
+
+// binary trace of protocol events: a ring of CONFIG_LEN_TRACE fixed size events shared by every client and server,
+// recorded without formatting anything so that tracing barely changes the timing of a transfer.
+// With CONFIG_LEN_TRACE 0 the MTFTP_TRACE calls (and their arguments) are compiled out
+
+enum trace_event_types {
+  TRACE_STATE = 1,   // arg: state before, value: state after
+  TRACE_RRQ_TX,      // arg: file_index, value: file_offset (RRQ, BRQ or DRQ sent)
+  TRACE_RRQ_RX,      // arg: file_index, value: file_offset (read request received)
+  TRACE_DATA_TX,     // arg: block_no, value: length of the block, TRACE_RETRANSMIT set if it was sent before
+  TRACE_DATA_RX,     // arg: block_no, value: length of the block
+  TRACE_RTX_TX,      // arg: blocks requested, value: number of TRACE_RTX_RUN events that follow
+  TRACE_RTX_RUN,     // arg: first block_no, value: number of blocks
+  TRACE_RTX_RX,      // arg: blocks requested, value: packet type (TYPE_RETRANSMIT or TYPE_NACK)
+  TRACE_ACK_TX,      // arg: block_no, value: window_no | window_size << 16
+  TRACE_ACK_RX,      // arg: block_no, value: window_no | window_size << 16
+  TRACE_RETRY,       // arg: retries of the packet, value: rto (us)
+  TRACE_TIMEOUT,     // arg: state
+  TRACE_QUEUE_DROP   // arg: length of the packet, value: packets dropped so far
+};
+
+// source of an event: the trace id of a client (see MtftpClient::setTraceId), or TRACE_SERVER | index of the session
+const uint8_t TRACE_SERVER = 0x80;
+// no session (eg an ACK from a peer the server has no session with)
+const uint8_t TRACE_NO_SESSION = 0x7F;
+const uint32_t TRACE_RETRANSMIT = 0x10000;
+
+typedef struct __attribute__((__packed__)) trace_event {
+  // mtftpTime() in us (wraps after about 71 minutes)
+  uint32_t time;
+  uint8_t type;
+  uint8_t source;
+  uint16_t arg;
+  uint32_t value;
+} trace_event_t;
+
+// start of a dump, followed by num_events events (oldest first)
+const uint32_t TRACE_MAGIC = 0x5254544D; // "MTTR"
+const uint8_t TRACE_VERSION = 1;
+
+typedef struct __attribute__((__packed__)) trace_header {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t len_event;
+  uint16_t reserved;
+  uint32_t num_events;
+  // events overwritten before the dump
+  uint32_t num_lost;
+} trace_header_t;
+
+#if CONFIG_LEN_TRACE > 0
+#define MTFTP_TRACE(type, source, arg, value) mtftpTrace(type, source, arg, value)
+#else
+#define MTFTP_TRACE(type, source, arg, value) do {} while (0)
+#endif
+
+// records an event, safe to call from any task (events being written while the ring is read may be torn)
+void mtftpTrace(uint8_t type, uint8_t source, uint16_t arg, uint32_t value);
+// copies up to max_events of the latest events, oldest first, returns the number copied
+uint32_t mtftpTraceRead(trace_event_t *events, uint32_t max_events);
+// writes a trace_header_t followed by every event in the ring (oldest first) to write, eg a file or a console in hex
+void mtftpTraceDump(void (*write)(const uint8_t *data, uint16_t len));
+void mtftpTraceClear(void);
+
+#endif
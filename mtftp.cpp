@@ -1,5 +1,366 @@
+#include <string.h>
 #include "mtftp.h"
 
-const char *err_types_str[1] = {
-  "FileReadErr"
+// x86 hosts built with GCC or Clang pick the SSE4.2 path at run time, even without -msse4.2
+#if defined(__SSE4_2__) || ((defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__))
+#define CRC32C_SSE
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+const char *err_types_str[4] = {
+  "FileReadErr",
+  "ServerBusy",
+  "BadOption",
+  "NoSession"
+};
+
+void parityAdd(uint8_t *parity, const uint8_t *block, uint16_t len, uint16_t len_block) {
+  for (uint16_t i = 0; i < len; i++) {
+    parity[i] ^= block[i];
+  }
+
+  if (len >= len_block) return;
+
+  if (len_block <= UINT8_MAX + 1) {
+    parity[len_block - 1] ^= len;
+    return;
+  }
+
+  uint16_t gap = len_block - 1 - len;
+
+  if (gap < 0x80) {
+    parity[len_block - 1] ^= gap;
+  } else {
+    parity[len_block - 1] ^= 0x80 | (gap & 0x7F);
+    parity[len_block - 2] ^= gap >> 7;
+  }
+}
+
+uint16_t parityLength(const uint8_t *block, uint16_t len_block) {
+  if (len_block <= UINT8_MAX + 1) {
+    return block[len_block - 1] < len_block ? block[len_block - 1] : len_block + 1;
+  }
+
+  uint16_t gap = block[len_block - 1];
+
+  if (gap & 0x80) {
+    gap = (block[len_block - 2] << 7) | (gap & 0x7F);
+    // a gap this short always fits in the last byte
+    if (gap < 0x80) return len_block + 1;
+  }
+
+  return gap < len_block ? len_block - 1 - gap : len_block + 1;
+}
+
+// slice-by-8: table k is the crc of a byte followed by k zero bytes, so 8 bytes are folded in per step
+// (built at compile time, so the 8KB of tables stay in flash)
+struct crc32c_tables {
+  uint32_t table[8][256];
+
+  constexpr crc32c_tables() : table() {
+    for (uint16_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+
+      for (uint8_t bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+      }
+
+      table[0][i] = crc;
+    }
+
+    for (uint16_t i = 0; i < 256; i++) {
+      for (uint8_t k = 1; k < 8; k++) {
+        table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+      }
+    }
+  }
 };
+
+static constexpr crc32c_tables CRC32C = crc32c_tables();
+
+uint32_t crc32cTable(uint32_t crc, const uint8_t *data, uint32_t len) {
+  const uint32_t (*table)[256] = CRC32C.table;
+  crc = ~crc;
+
+  // (words are read little endian, as on the ESP32)
+  for (; len >= 8; data += 8, len -= 8) {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, data, sizeof(lo));
+    memcpy(&hi, data + 4, sizeof(hi));
+
+    lo ^= crc;
+
+    crc =
+      table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+      table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+  }
+
+  for (; len > 0; data++, len--) {
+    crc = table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+#if defined(CRC32C_SSE)
+// built for SSE4.2 whatever the rest of the file is built for, only called once the CPU is known to have it
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse(uint32_t crc, const uint8_t *data, uint32_t len) {
+  crc = ~crc;
+
+#if defined(__x86_64__)
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+#else
+  for (; len >= 4; data += 4, len -= 4) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+#endif
+
+  for (; len > 0; data++, len--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+
+  return ~crc;
+}
+
+static bool cpuHasSse42(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cArm(uint32_t crc, const uint8_t *data, uint32_t len) {
+  crc = ~crc;
+
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+
+  for (; len > 0; data++, len--) {
+    crc = __crc32cb(crc, *data);
+  }
+
+  return ~crc;
+}
+#endif
+
+bool crc32cHardware(void) {
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+  return true;
+#elif defined(CRC32C_SSE)
+  // checked once, the first time a crc is taken
+  static const bool has_sse = cpuHasSse42();
+  return has_sse;
+#else
+  return false;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, uint32_t len) {
+#if defined(CRC32C_SSE)
+  if (crc32cHardware()) return crc32cSse(crc, data, len);
+#elif defined(__ARM_FEATURE_CRC32)
+  return crc32cArm(crc, data, len);
+#endif
+
+  return crc32cTable(crc, data, len);
+}
+
+// compressed block: a token byte < 0x80 is followed by that many literal bytes (0 pads the block),
+// a token byte >= 0x80 copies (token & 0x7F) + COMPRESS_MIN_MATCH bytes from uint16_t distance bytes back
+static const uint8_t COMPRESS_MAX_LITERALS = 0x7F;
+static const uint8_t COMPRESS_MIN_MATCH = 3;
+static const uint8_t COMPRESS_MAX_MATCH = 0x7F + COMPRESS_MIN_MATCH;
+static const uint8_t COMPRESS_LEN_MATCH = 3;
+// the position of the last 3 bytes with each hash, kept on the stack
+static const uint16_t COMPRESS_HASH_SIZE = 256;
+
+static inline uint8_t compressHash(const uint8_t *data) {
+  return ((data[0] << 5) ^ (data[1] << 2) ^ data[2] ^ (data[2] >> 3)) & (COMPRESS_HASH_SIZE - 1);
+}
+
+uint16_t compressBlock(const uint8_t *data, uint16_t len_data, bool eof, uint8_t *block, uint16_t *len_used, uint16_t len_block) {
+  uint16_t last_pos[COMPRESS_HASH_SIZE];
+  memset(last_pos, 0xFF, sizeof(last_pos));
+
+  if (len_data > MAX_COMPRESS_INPUT) {
+    len_data = MAX_COMPRESS_INPUT;
+    eof = false;
+  }
+
+  uint16_t len_packed = 0;
+  uint16_t pos = 0;
+  // first byte of the literals not yet copied to the block
+  uint16_t literals = 0;
+
+  while (pos < len_data) {
+    uint16_t len_match = 0;
+    uint16_t distance = 0;
+
+    if (pos + COMPRESS_MIN_MATCH <= len_data) {
+      uint8_t hash = compressHash(data + pos);
+      uint16_t match = last_pos[hash];
+      last_pos[hash] = pos;
+
+      if (match != 0xFFFF) {
+        uint16_t max_match = len_data - pos < COMPRESS_MAX_MATCH ? len_data - pos : COMPRESS_MAX_MATCH;
+
+        while (len_match < max_match && data[match + len_match] == data[pos + len_match]) {
+          len_match ++;
+        }
+
+        distance = pos - match;
+      }
+    }
+
+    uint16_t num_literals = pos - literals;
+
+    if (len_match >= COMPRESS_MIN_MATCH) {
+      if (len_packed + (num_literals > 0 ? num_literals + 1 : 0) + COMPRESS_LEN_MATCH > len_block) break;
+
+      if (num_literals > 0) {
+        block[len_packed ++] = num_literals;
+        memcpy(block + len_packed, data + literals, num_literals);
+        len_packed += num_literals;
+      }
+
+      block[len_packed ++] = 0x80 | (len_match - COMPRESS_MIN_MATCH);
+      block[len_packed ++] = distance & 0xFF;
+      block[len_packed ++] = distance >> 8;
+
+      // later matches can start anywhere in this one
+      for (uint16_t i = 1; i < len_match && pos + i + COMPRESS_MIN_MATCH <= len_data; i++) {
+        last_pos[compressHash(data + pos + i)] = pos + i;
+      }
+
+      pos += len_match;
+      literals = pos;
+    } else {
+      // room for the token and every literal so far, plus this one
+      if (len_packed + num_literals + 2 > len_block) break;
+
+      pos ++;
+
+      if (pos - literals == COMPRESS_MAX_LITERALS) {
+        block[len_packed ++] = COMPRESS_MAX_LITERALS;
+        memcpy(block + len_packed, data + literals, COMPRESS_MAX_LITERALS);
+        len_packed += COMPRESS_MAX_LITERALS;
+        literals = pos;
+      }
+    }
+  }
+
+  // the literals left always fit, every one of them was checked against the space left
+  if (pos > literals) {
+    block[len_packed ++] = pos - literals;
+    memcpy(block + len_packed, data + literals, pos - literals);
+    len_packed += pos - literals;
+  }
+
+  *len_used = pos;
+
+  // a short block marks the end of the file
+  if (!eof || pos < len_data) {
+    memset(block + len_packed, 0, len_block - len_packed);
+    len_packed = len_block;
+  }
+
+  return len_packed;
+}
+
+bool decompressBlock(const uint8_t *block, uint16_t len_block, uint8_t *data, uint16_t *len_data) {
+  uint16_t pos = 0;
+  uint16_t len = 0;
+
+  while (pos < len_block) {
+    uint8_t token = block[pos ++];
+
+    if (token < 0x80) {
+      if (pos + token > len_block || len + token > MAX_COMPRESS_INPUT) return false;
+
+      memcpy(data + len, block + pos, token);
+      pos += token;
+      len += token;
+    } else {
+      if (pos + 2 > len_block) return false;
+
+      uint16_t len_match = (token & 0x7F) + COMPRESS_MIN_MATCH;
+      uint16_t distance = block[pos] | (block[pos + 1] << 8);
+      pos += 2;
+
+      if (distance == 0 || distance > len || len + len_match > MAX_COMPRESS_INPUT) return false;
+
+      // byte by byte, the match may overlap the bytes it produces
+      for (uint16_t i = 0; i < len_match; i++) {
+        data[len + i] = data[len + i - distance];
+      }
+
+      len += len_match;
+    }
+  }
+
+  *len_data = len;
+  return true;
+}
+
+uint32_t deltaWeak(const uint8_t *data, uint16_t len) {
+  uint16_t a = 0;
+  uint16_t b = 0;
+
+  for (uint16_t i = 0; i < len; i++) {
+    a += data[i];
+    b += (len - i) * data[i];
+  }
+
+  return a | ((uint32_t) b << 16);
+}
+
+uint32_t deltaRoll(uint32_t weak, uint8_t out, uint8_t in, uint16_t len) {
+  uint16_t a = weak & 0xFFFF;
+  uint16_t b = weak >> 16;
+
+  a += in - out;
+  b += a - (len * out);
+
+  return a | ((uint32_t) b << 16);
+}
+
+uint32_t deltaStrong(const uint8_t *data, uint16_t len) {
+  uint32_t hash = 2166136261;
+
+  for (uint16_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 16777619;
+  }
+
+  return hash;
+}
+
+uint32_t bitmapFind(const uint32_t *bitmap, uint32_t first, uint32_t last, bool set) {
+  uint32_t i = first;
+
+  while (i < last) {
+    uint32_t word = set ? bitmap[i / 32] : ~bitmap[i / 32];
+    word >>= i % 32;
+
+    // skip to the next word if none of the rest of this one match
+    if (word == 0) {
+      i = ((i / 32) + 1) * 32;
+      continue;
+    }
+
+    i += __builtin_ctz(word);
+    break;
+  }
+
+  return i < last ? i : last;
+}
@@ -0,0 +1,222 @@
+#include <string.h>
+#include "mtftp_download_manager.hpp"
+
+MtftpDownloadManager::MtftpDownloadManager(uint8_t _max_sessions, uint16_t _max_jobs) {
+  max_sessions = _max_sessions;
+  max_jobs = _max_jobs;
+
+  jobs = new job_slot_t[max_jobs];
+  sessions = new session_t[max_sessions];
+
+  for (uint16_t i = 0; i < max_jobs; i++) {
+    jobs[i].state = JOB_FREE;
+  }
+
+  for (uint8_t i = 0; i < max_sessions; i++) {
+    sessions[i].manager = this;
+    sessions[i].job = -1;
+    sessions[i].complete = false;
+
+    sessions[i].client.init(&sessionWriteFile, &sessionSendPacket, &sessions[i]);
+    sessions[i].client.setOnFileEndCb(&sessionFileEnd, &sessions[i]);
+    // one loop() runs every client, none of them may sleep in it
+    sessions[i].client.setRecvTimeout(0);
+    sessions[i].client.setTraceId(i);
+  }
+}
+
+MtftpDownloadManager::~MtftpDownloadManager() {
+  delete[] sessions;
+  delete[] jobs;
+}
+
+void MtftpDownloadManager::init(
+  bool (*_writeFile)(void *ctx, int job, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+  void (*_sendPacketTo)(void *ctx, const uint8_t *peer_addr, const uint8_t *data, mtftp_len_t<LEN_MAX_PACKET> len),
+  void *ctx
+) {
+  writeFile.set(_writeFile, ctx);
+  sendPacketTo.set(_sendPacketTo, ctx);
+}
+
+void MtftpDownloadManager::setWindowBudget(uint16_t blocks) {
+  window_budget = blocks;
+  shareWindows();
+}
+
+bool MtftpDownloadManager::sessionWriteFile(void *ctx, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  session_t *session = (session_t *) ctx;
+
+  return session->manager->writeFile(session->job, file_index, file_offset, data, btw);
+}
+
+void MtftpDownloadManager::sessionSendPacket(void *ctx, const uint8_t *data, mtftp_len_t<LEN_MAX_PACKET> len) {
+  session_t *session = (session_t *) ctx;
+  MtftpDownloadManager *manager = session->manager;
+
+  manager->sendPacketTo(session->peer_addr, data, len);
+}
+
+void MtftpDownloadManager::sessionFileEnd(void *ctx, uint16_t file_index, uint32_t file_offset) {
+  ((session_t *) ctx)->complete = true;
+}
+
+int MtftpDownloadManager::addJob(const job_t *job) {
+  for (uint16_t i = 0; i < max_jobs; i++) {
+    if (jobs[i].state != JOB_FREE) continue;
+
+    jobs[i].state = JOB_QUEUED;
+    jobs[i].job = *job;
+    jobs[i].seq = next_seq ++;
+    num_queued ++;
+
+    MTFTP_LOGD(TAG, "job %d: file %d queued at priority %d (%d queued)", i, job->file_index, job->priority, num_queued);
+
+    return i;
+  }
+
+  MTFTP_LOGW(TAG, "addJob: all %d jobs queued or running", max_jobs);
+  return -1;
+}
+
+bool MtftpDownloadManager::cancelJob(int job) {
+  if (job < 0 || job >= max_jobs || jobs[job].state != JOB_QUEUED) return false;
+
+  jobs[job].state = JOB_FREE;
+  num_queued --;
+
+  return true;
+}
+
+MtftpClient *MtftpDownloadManager::getClient(int job) {
+  if (job < 0 || job >= max_jobs || jobs[job].state != JOB_ACTIVE) return NULL;
+
+  return &sessions[jobs[job].session].client;
+}
+
+bool MtftpDownloadManager::peerActive(const uint8_t *peer_addr) {
+  for (uint8_t i = 0; i < max_sessions; i++) {
+    if (sessions[i].job >= 0 && memcmp(sessions[i].peer_addr, peer_addr, LEN_PEER_ADDR) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+recv_result_t MtftpDownloadManager::onPacketRecv(const uint8_t *peer_addr, const uint8_t *data, uint16_t len_data) {
+  for (uint8_t i = 0; i < max_sessions; i++) {
+    // loop() may end the job (and start another one) on its own task at any time
+    if (sessions[i].job.load() >= 0 && memcmp(sessions[i].peer_addr, peer_addr, LEN_PEER_ADDR) == 0) {
+      sessions[i].client.onPacketRecv(data, len_data);
+      return RECV_OK;
+    }
+  }
+
+  return RECV_NO_SESSION;
+}
+
+// highest priority queued job whose peer is not being read from, -1 if there is none
+int MtftpDownloadManager::nextJob(void) {
+  int next = -1;
+
+  for (uint16_t i = 0; i < max_jobs; i++) {
+    if (jobs[i].state != JOB_QUEUED) continue;
+
+    if (next >= 0) {
+      if (jobs[i].job.priority < jobs[next].job.priority) continue;
+      // the seq of jobs added since it wrapped are below those before it
+      if (jobs[i].job.priority == jobs[next].job.priority && (int32_t) (jobs[i].seq - jobs[next].seq) > 0) continue;
+    }
+
+    // a server reads to one client at a time (per peer), its next job waits for the current one
+    if (peerActive(jobs[i].job.peer_addr)) continue;
+
+    next = i;
+  }
+
+  return next;
+}
+
+void MtftpDownloadManager::startJobs(void) {
+  uint8_t num_started = 0;
+
+  for (uint8_t i = 0; i < max_sessions && num_queued > 0; i++) {
+    if (sessions[i].job >= 0) continue;
+
+    int job = nextJob();
+    if (job < 0) break;
+
+    jobs[job].state = JOB_ACTIVE;
+    jobs[job].session = i;
+    num_queued --;
+    num_active ++;
+
+    // the peer is in place before onPacketRecv can see the job
+    memcpy(sessions[i].peer_addr, jobs[job].job.peer_addr, LEN_PEER_ADDR);
+    sessions[i].complete = false;
+    sessions[i].job = job;
+    num_started ++;
+  }
+
+  if (num_started == 0) return;
+
+  // every job started now asks for its share in its RRQ, and the others are down to theirs from their next window
+  shareWindows();
+
+  for (uint8_t i = 0; i < max_sessions; i++) {
+    session_t *session = &sessions[i];
+    int job_id = session->job;
+    // a job ends as soon as its client goes idle, so an idle client has just been given its job
+    if (job_id < 0 || session->client.getState() != MtftpClient::STATE_IDLE) continue;
+
+    const job_t *job = &jobs[job_id].job;
+
+    MTFTP_LOGI(TAG, "job %d: reading file %d on session %d (%d running, %d queued)", job_id, job->file_index, i, num_active, num_queued);
+
+    session->client.beginRead(job->file_index, job->file_offset, job->window_size, job->options, job->parity_blocks);
+  }
+}
+
+void MtftpDownloadManager::endJob(session_t *session) {
+  int job = session->job;
+
+  jobs[job].state = JOB_FREE;
+  session->job = -1;
+  num_active --;
+
+  shareWindows();
+
+  MTFTP_LOGI(TAG, "job %d: ended (%s)", job, session->complete ? "complete" : "failed");
+
+  if (onJobEnd) onJobEnd(job, session->complete);
+}
+
+void MtftpDownloadManager::shareWindows(void) {
+  uint16_t limit = CONFIG_WINDOW_SIZE_MAX;
+
+  if (window_budget > 0 && num_active > 0 && window_budget / num_active < limit) {
+    limit = window_budget / num_active;
+  }
+
+  for (uint8_t i = 0; i < max_sessions; i++) {
+    sessions[i].client.setWindowLimit(limit);
+  }
+}
+
+void MtftpDownloadManager::loop(void) {
+  startJobs();
+
+  for (uint8_t i = 0; i < max_sessions; i++) {
+    session_t *session = &sessions[(next_session + i) % max_sessions];
+    if (session->job < 0) continue;
+
+    session->client.poll();
+
+    if (session->client.getState() == MtftpClient::STATE_IDLE) {
+      endJob(session);
+    }
+  }
+
+  next_session = max_sessions > 0 ? (next_session + 1) % max_sessions : 0;
+}
@@ -0,0 +1,3 @@
+#include "mtftp_packet_queue.hpp"
+
+template class BasicMtftpPacketQueue<>;
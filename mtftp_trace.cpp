@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "mtftp_os.h"
+#include "mtftp_trace.h"
+
+#if CONFIG_LEN_TRACE > 0
+
+static trace_event_t trace_ring[CONFIG_LEN_TRACE];
+// events recorded since the ring was cleared, the next one goes in trace_ring[trace_next % CONFIG_LEN_TRACE]
+static uint32_t trace_next = 0;
+
+void mtftpTrace(uint8_t type, uint8_t source, uint16_t arg, uint32_t value) {
+  // each caller claims its own slot, so events from different tasks never share one
+  uint32_t index = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+  trace_event_t *event = &trace_ring[index % CONFIG_LEN_TRACE];
+
+  event->time = mtftpTime();
+  event->type = type;
+  event->source = source;
+  event->arg = arg;
+  event->value = value;
+}
+
+// first event still in the ring and the number of events after it
+static uint32_t traceSpan(uint32_t *num_events) {
+  uint32_t next = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+
+  *num_events = next < CONFIG_LEN_TRACE ? next : CONFIG_LEN_TRACE;
+
+  return next - *num_events;
+}
+
+uint32_t mtftpTraceRead(trace_event_t *events, uint32_t max_events) {
+  uint32_t num_events;
+  uint32_t first = traceSpan(&num_events);
+
+  if (num_events > max_events) {
+    first += num_events - max_events;
+    num_events = max_events;
+  }
+
+  for (uint32_t i = 0; i < num_events; i++) {
+    events[i] = trace_ring[(first + i) % CONFIG_LEN_TRACE];
+  }
+
+  return num_events;
+}
+
+void mtftpTraceDump(void (*write)(const uint8_t *data, uint16_t len)) {
+  uint32_t num_events;
+  uint32_t first = traceSpan(&num_events);
+
+  trace_header_t header = {};
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.len_event = sizeof(trace_event_t);
+  header.num_events = num_events;
+  header.num_lost = first;
+
+  write((const uint8_t *) &header, sizeof(header));
+
+  // the events run to the end of the ring and then on from its start, written in pieces write can take
+  const uint32_t MAX_WRITE = UINT16_MAX / sizeof(trace_event_t);
+
+  while (num_events > 0) {
+    uint32_t slot = first % CONFIG_LEN_TRACE;
+    uint32_t len = CONFIG_LEN_TRACE - slot;
+
+    if (len > num_events) len = num_events;
+    if (len > MAX_WRITE) len = MAX_WRITE;
+
+    write((const uint8_t *) &trace_ring[slot], len * sizeof(trace_event_t));
+
+    first += len;
+    num_events -= len;
+  }
+}
+
+void mtftpTraceClear(void) {
+  __atomic_store_n(&trace_next, 0, __ATOMIC_RELAXED);
+}
+
+#else
+
+void mtftpTrace(uint8_t type, uint8_t source, uint16_t arg, uint32_t value) {}
+
+uint32_t mtftpTraceRead(trace_event_t *events, uint32_t max_events) {
+  return 0;
+}
+
+void mtftpTraceDump(void (*write)(const uint8_t *data, uint16_t len)) {
+  trace_header_t header = {};
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.len_event = sizeof(trace_event_t);
+
+  write((const uint8_t *) &header, sizeof(header));
+}
+
+void mtftpTraceClear(void) {}
+
+#endif
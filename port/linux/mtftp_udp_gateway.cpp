@@ -0,0 +1,212 @@
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "mtftp_os.h"
+#include "mtftp_udp_gateway.hpp"
+
+static const char *TAG = "mtftp-udp";
+
+// events taken from epoll at once
+static const int MAX_EVENTS = 64;
+
+MtftpUdpGateway::MtftpUdpGateway(uint16_t _max_reads) {
+  max_reads = _max_reads;
+
+  reads = new read_t[max_reads];
+
+  for (uint16_t i = 0; i < max_reads; i++) {
+    reads[i].gateway = this;
+    reads[i].client.init(&clientWriteFile, &clientSendPacket, &reads[i]);
+    reads[i].client.setOnFileEndCb(&clientFileEnd, &reads[i]);
+    // one thread runs every client, none of them may sleep
+    reads[i].client.setRecvTimeout(0);
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  assert(epoll_fd >= 0);
+}
+
+MtftpUdpGateway::~MtftpUdpGateway() {
+  for (uint16_t i = 0; i < max_reads; i++) {
+    if (reads[i].fd >= 0) close(reads[i].fd);
+  }
+
+  close(epoll_fd);
+  delete[] reads;
+}
+
+void MtftpUdpGateway::init(
+  bool (*_writeFile)(int read, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+  void (*_onReadEnd)(int read, bool complete)
+) {
+  writeFile = _writeFile;
+  onReadEnd = _onReadEnd;
+}
+
+void MtftpUdpGateway::init(
+  bool (*_writeFile)(void *ctx, int read, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+  void (*_onReadEnd)(void *ctx, int read, bool complete),
+  void *ctx
+) {
+  writeFile.set(_writeFile, ctx);
+  onReadEnd.set(_onReadEnd, ctx);
+}
+
+bool MtftpUdpGateway::clientWriteFile(void *ctx, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  read_t *read = (read_t *) ctx;
+
+  return read->gateway->writeFile(read - read->gateway->reads, file_index, file_offset, data, btw);
+}
+
+void MtftpUdpGateway::clientSendPacket(void *ctx, const uint8_t *data, uint8_t len) {
+  read_t *read = (read_t *) ctx;
+
+  // a datagram that does not fit in the socket buffer is lost, as on the air
+  if (send(read->fd, data, len, MSG_DONTWAIT) < 0) {
+    MTFTP_LOGD(TAG, "read %d: send failed (%d)", (int) (read - read->gateway->reads), errno);
+  }
+}
+
+void MtftpUdpGateway::clientFileEnd(void *ctx, uint16_t file_index, uint32_t file_offset) {
+  ((read_t *) ctx)->complete = true;
+}
+
+MtftpClient *MtftpUdpGateway::getFreeClient(void) {
+  for (uint16_t i = 0; i < max_reads; i++) {
+    if (reads[i].fd < 0) return &reads[i].client;
+  }
+
+  return NULL;
+}
+
+int MtftpUdpGateway::beginRead(
+  const struct sockaddr_in *addr,
+  uint16_t file_index,
+  uint32_t file_offset,
+  uint16_t window_size,
+  uint8_t options
+) {
+  int read = -1;
+  for (uint16_t i = 0; i < max_reads; i++) {
+    if (reads[i].fd < 0) {
+      read = i;
+      break;
+    }
+  }
+
+  if (read < 0) {
+    MTFTP_LOGW(TAG, "beginRead: all %d reads running", max_reads);
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    MTFTP_LOGE(TAG, "beginRead: socket failed (%d)", errno);
+    return -1;
+  }
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u32 = read;
+
+  if (connect(fd, (const struct sockaddr *) addr, sizeof(struct sockaddr_in)) < 0) {
+    MTFTP_LOGE(TAG, "beginRead: connect failed (%d)", errno);
+    close(fd);
+    return -1;
+  }
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    MTFTP_LOGE(TAG, "beginRead: epoll_ctl failed (%d)", errno);
+    close(fd);
+    return -1;
+  }
+
+  reads[read].fd = fd;
+  reads[read].complete = false;
+  num_reads ++;
+
+  reads[read].client.beginRead(file_index, file_offset, window_size, options);
+
+  // the RRQ is resent if no response arrives in time
+  if (reads[read].client.getDeadline() < next_deadline) next_deadline = reads[read].client.getDeadline();
+
+  MTFTP_LOGI(TAG, "read %d: reading %d from port %d", read, file_index, ntohs(addr->sin_port));
+
+  return read;
+}
+
+void MtftpUdpGateway::receive(int read) {
+  MtftpClient *client = &reads[read].client;
+  // one more byte, so that a datagram too long for a packet is seen as such
+  uint8_t data[LEN_MAX_PACKET + 1];
+
+  while (true) {
+    ssize_t len = recv(reads[read].fd, data, sizeof(data), 0);
+
+    if (len < 0) {
+      // ECONNREFUSED: nothing listening at the node (yet), the client retries until it times out
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+        MTFTP_LOGW(TAG, "read %d: recv failed (%d)", read, errno);
+      }
+      break;
+    }
+
+    if (len == 0 || len > LEN_MAX_PACKET) {
+      MTFTP_LOGW(TAG, "read %d: dropped datagram of %d bytes", read, (int) len);
+      continue;
+    }
+
+    client->onPacketRecv(data, len);
+
+    // keep the queue from filling up
+    if (client->getPacketsQueued() >= CONFIG_LEN_PACKET_QUEUE / 2) {
+      client->poll();
+    }
+  }
+}
+
+void MtftpUdpGateway::endRead(int read) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, reads[read].fd, NULL);
+  close(reads[read].fd);
+  reads[read].fd = -1;
+  num_reads --;
+
+  MTFTP_LOGI(TAG, "read %d: ended (%s)", read, reads[read].complete ? "complete" : "failed");
+
+  if (onReadEnd) onReadEnd(read, reads[read].complete);
+}
+
+void MtftpUdpGateway::run(int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS];
+
+  // sleep no longer than the first timer of a read, rounded up to the ms epoll counts in
+  if (next_deadline != NO_DEADLINE) {
+    int64_t time_left = next_deadline - mtftpTime();
+    int deadline_ms = time_left > 0 ? (time_left + 999) / 1000 : 0;
+
+    if (timeout_ms < 0 || deadline_ms < timeout_ms) timeout_ms = deadline_ms;
+  }
+
+  int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < num_events; i++) {
+    receive(events[i].data.u32);
+  }
+
+  // the packets received, timers (and the end of every read whose last packet was just handled)
+  next_deadline = NO_DEADLINE;
+
+  for (uint16_t i = 0; i < max_reads; i++) {
+    if (reads[i].fd < 0) continue;
+
+    int64_t deadline = reads[i].client.poll();
+
+    if (reads[i].client.getState() == MtftpClient::STATE_IDLE) {
+      endRead(i);
+    } else if (deadline < next_deadline) {
+      next_deadline = deadline;
+    }
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef MTFTP_UDP_GATEWAY_H
+#define MTFTP_UDP_GATEWAY_H
+
+#include <netinet/in.h>
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+
+// runs many MtftpClient reads over UDP from one thread (Linux, epoll). Every read has its own socket
+// connected to the node it reads from, so the kernel sorts the datagrams by node and a read only
+// sees the packets of its own server
+class MtftpUdpGateway {
+  public:
+    MtftpUdpGateway(uint16_t _max_reads);
+    ~MtftpUdpGateway();
+
+    // writeFile is called with the id of the read (from beginRead) the data belongs to,
+    // onReadEnd once the read is over, with complete set if the final block of the file has been written
+    void init(
+      bool (*_writeFile)(int read, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+      void (*_onReadEnd)(int read, bool complete)
+    );
+
+    // as init, the callbacks are given ctx as their first argument
+    void init(
+      bool (*_writeFile)(void *ctx, int read, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw),
+      void (*_onReadEnd)(void *ctx, int read, bool complete),
+      void *ctx
+    );
+
+    // starts reading file_index from the node at addr, returns the id of the read
+    // (-1 if max_reads are already running or the socket could not be opened)
+    int beginRead(
+      const struct sockaddr_in *addr,
+      uint16_t file_index,
+      uint32_t file_offset,
+      uint16_t window_size = CONFIG_WINDOW_SIZE,
+      uint8_t options = 0
+    );
+
+    // waits for datagrams, up to timeout_ms (-1 for no limit) and no longer than the first timer of a read is due,
+    // hands them to the clients they are for and then runs poll() of every read
+    void run(int timeout_ms);
+
+    // client of a read, to change its settings (before beginRead, the client of the next read is the one returned by getFreeClient)
+    MtftpClient *getClient(int read) { return &reads[read].client; };
+    MtftpClient *getFreeClient(void);
+    uint16_t getNumReads(void) { return num_reads; };
+  private:
+    typedef struct read {
+      MtftpUdpGateway *gateway;
+      MtftpClient client;
+      // connected socket, -1 while the read is not running
+      int fd = -1;
+      // the final block of the file has been written
+      bool complete;
+    } read_t;
+
+    read_t *reads;
+    uint16_t max_reads;
+    uint16_t num_reads = 0;
+    int epoll_fd;
+    // first deadline of the running reads (their poll())
+    int64_t next_deadline = NO_DEADLINE;
+
+    MtftpCallback<bool, int, uint16_t, uint32_t, const uint8_t *, uint16_t> writeFile;
+    MtftpCallback<void, int, bool> onReadEnd;
+
+    // the client callbacks are given their read_t
+    static bool clientWriteFile(void *ctx, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw);
+    static void clientSendPacket(void *ctx, const uint8_t *data, uint8_t len);
+    static void clientFileEnd(void *ctx, uint16_t file_index, uint32_t file_offset);
+
+    void receive(int read);
+    void endRead(int read);
+};
+
+#endif
@@ -0,0 +1,10 @@
+#include <time.h>
+
+#include "mtftp_os.h"
+
+int64_t mtftpTime(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "mtftp_os.h"
+
+// POSIX port of mtftp_os.h (without mtftpTime, see mtftp_clock.cpp)
+
+enum mtftp_log_level mtftp_log_level = MTFTP_LOG_WARN;
+
+struct mtftp_signal {
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool given = false;
+};
+
+void mtftpLog(enum mtftp_log_level level, const char *tag, const char *format, ...) {
+  static const char LETTERS[] = "-EWIDV";
+
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  // as esp_log prints them, with the time in ms
+  fprintf(stderr, "%c (%lld) %s: %s\n", LETTERS[level], (long long) (mtftpTime() / 1000), tag, line);
+}
+
+mtftp_signal_t mtftpSignalCreate(void) {
+  return new mtftp_signal;
+}
+
+void mtftpSignalDelete(mtftp_signal_t signal) {
+  delete signal;
+}
+
+void mtftpSignalGive(mtftp_signal_t signal) {
+  {
+    std::lock_guard<std::mutex> lock(signal->mutex);
+    signal->given = true;
+  }
+
+  signal->cond.notify_one();
+}
+
+bool mtftpSignalWait(mtftp_signal_t signal, uint32_t timeout_ms) {
+  std::unique_lock<std::mutex> lock(signal->mutex);
+
+  if (!signal->given && timeout_ms > 0) {
+    signal->cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [signal] { return signal->given; });
+  }
+
+  bool given = signal->given;
+  signal->given = false;
+
+  return given;
+}
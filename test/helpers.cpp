@@ -13,8 +13,16 @@ bool readFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t
   readFile_stats.file_offset = file_offset;
   readFile_stats.btr = btr;
 
-  *br = LEN_SAMPLE_DATA;
-  memcpy(data, SAMPLE_DATA, *br);
+  // the file is made up of repeated blocks of SAMPLE_DATA,
+  // ending at the first block shorter than CONFIG_LEN_BLOCK
+  *br = 0;
+  while (*br < btr) {
+    uint16_t len = (btr - *br) < LEN_SAMPLE_DATA ? (btr - *br) : LEN_SAMPLE_DATA;
+    memcpy(data + *br, SAMPLE_DATA, len);
+    *br += len;
+
+    if (LEN_SAMPLE_DATA < CONFIG_LEN_BLOCK) break;
+  }
 
   return true;
 }
@@ -23,9 +31,23 @@ bool writeFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, u
   writeFile_stats.called ++;
   writeFile_stats.file_index = file_index;
   writeFile_stats.file_offset = file_offset;
-  memcpy(writeFile_stats.data, data, btw);
+  memcpy(writeFile_stats.data, data, btw < sizeof(writeFile_stats.data) ? btw : sizeof(writeFile_stats.data));
   writeFile_stats.btw = btw;
 
+#if CONFIG_LEN_WRITE_BUFFER > 0
+  if ((file_offset + btw) % CONFIG_LEN_WRITE_BUFFER != 0) {
+    writeFile_stats.num_unaligned ++;
+  }
+#endif
+
+  if (file_offset + btw <= sizeof(writeFile_stats.file)) {
+    memcpy(writeFile_stats.file + file_offset, data, btw);
+
+    if (file_offset + btw > writeFile_stats.len_file) {
+      writeFile_stats.len_file = file_offset + btw;
+    }
+  }
+
   return true;
 }
 
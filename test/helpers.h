@@ -28,6 +28,11 @@ struct writeFile_stats_t {
   // allocate enough memory to hold the entire packet buffer if necessary
   uint8_t data[CONFIG_LEN_MTFTP_BUFFER * CONFIG_LEN_BLOCK];
   uint16_t btw;
+  // writes that do not end on a CONFIG_LEN_WRITE_BUFFER boundary
+  uint8_t num_unaligned;
+  // contents of the file written so far (from offset 0)
+  uint8_t file[2 * CONFIG_WINDOW_SIZE * CONFIG_LEN_BLOCK];
+  uint32_t len_file;
 };
 
 extern writeFile_stats_t writeFile_stats;
@@ -0,0 +1,153 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+// client and server connected back to back, reading a batch of small files
+static MtftpClient *batch_client;
+static MtftpServer *batch_server;
+
+static const uint8_t NUM_BATCH_FILES = 6;
+// an empty file, files that end in the middle of a block, on a block boundary and spanning windows
+static const uint32_t LEN_BATCH_FILES[NUM_BATCH_FILES] = {
+  100,
+  0,
+  CONFIG_LEN_BLOCK,
+  3 * CONFIG_LEN_BLOCK + 17,
+  10,
+  12 * CONFIG_LEN_BLOCK + 5
+};
+static const uint32_t LEN_MAX_BATCH_FILE = 12 * CONFIG_LEN_BLOCK + 5;
+
+static uint8_t batch_files[NUM_BATCH_FILES][LEN_MAX_BATCH_FILE];
+static uint32_t len_written[NUM_BATCH_FILES];
+static uint16_t file_ends[NUM_BATCH_FILES];
+static uint32_t file_end_offsets[NUM_BATCH_FILES];
+static uint8_t num_file_ends;
+
+// DATA packets dropped on the way to the client (only their first transmission)
+static uint32_t num_batch_data_pkts;
+static uint32_t batch_drops;
+static uint32_t num_requests;
+
+static uint8_t batchFileByte(uint16_t file_index, uint32_t offset) {
+  return (file_index * 31 + offset) & 0xFF;
+}
+
+// file index i is stored at i + 10 so that a mix up with the batch position is caught
+static bool readBatchFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  uint32_t len_file = LEN_BATCH_FILES[file_index - 10];
+
+  *br = 0;
+  while (*br < btr && file_offset + *br < len_file) {
+    data[*br] = batchFileByte(file_index, file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool writeBatchFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  uint8_t file = file_index - 10;
+
+  TEST_ASSERT_LESS_OR_EQUAL(LEN_MAX_BATCH_FILE, file_offset + btw);
+
+  memcpy(batch_files[file] + file_offset, data, btw);
+  if (file_offset + btw > len_written[file]) {
+    len_written[file] = file_offset + btw;
+  }
+
+  return true;
+}
+
+static void onBatchFileEnd(uint16_t file_index, uint32_t file_offset) {
+  file_ends[num_file_ends] = file_index;
+  file_end_offsets[num_file_ends] = file_offset;
+  num_file_ends ++;
+}
+
+static void batchClientToServer(const uint8_t *data, uint8_t len) {
+  if (data[0] == TYPE_READ_REQUEST || data[0] == TYPE_BATCH_READ_REQUEST) num_requests ++;
+
+  batch_server->onPacketRecv(data, len);
+}
+
+static void batchServerToClient(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    uint32_t pkt_no = num_batch_data_pkts ++;
+
+    if (pkt_no < 32 && (batch_drops & (1 << pkt_no))) return;
+  }
+
+  batch_client->onPacketRecv(data, len);
+}
+
+static void runBatch(uint32_t drops) {
+  memset(batch_files, 0, sizeof(batch_files));
+  memset(len_written, 0, sizeof(len_written));
+  num_file_ends = 0;
+  num_batch_data_pkts = 0;
+  num_requests = 0;
+  batch_drops = drops;
+
+  MtftpClient client;
+  MtftpServer server;
+  batch_client = &client;
+  batch_server = &server;
+
+  client.init(&writeBatchFile, &batchClientToServer);
+  client.setAdaptiveWindow(false);
+  client.setOnFileEndCb(&onBatchFileEnd);
+  server.init(&readBatchFile, &batchServerToClient);
+
+  batch_file_t files[NUM_BATCH_FILES];
+  for (uint8_t i = 0; i < NUM_BATCH_FILES; i++) {
+    files[i].file_index = i + 10;
+    files[i].file_offset = 0;
+  }
+
+  client.beginBatchRead(files, NUM_BATCH_FILES, 8);
+
+  int64_t time_start = esp_timer_get_time();
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  // one request for the whole batch, every file complete and reported in order
+  TEST_ASSERT_EQUAL(1, num_requests);
+  TEST_ASSERT_EQUAL(NUM_BATCH_FILES, num_file_ends);
+
+  for (uint8_t i = 0; i < NUM_BATCH_FILES; i++) {
+    TEST_ASSERT_EQUAL(i + 10, file_ends[i]);
+    TEST_ASSERT_EQUAL(LEN_BATCH_FILES[i], file_end_offsets[i]);
+    TEST_ASSERT_EQUAL(LEN_BATCH_FILES[i], len_written[i]);
+
+    for (uint32_t j = 0; j < LEN_BATCH_FILES[i]; j++) {
+      TEST_ASSERT_EQUAL_HEX8(batchFileByte(i + 10, j), batch_files[i][j]);
+    }
+  }
+}
+
+TEST_CASE("test client batch read", "[client][batch]") {
+  runBatch(0);
+
+  // files share windows, the blocks of the batch (one more for the file ending on a boundary)
+  // fit in 3 windows of 8
+  TEST_ASSERT_EQUAL(1 + 1 + 2 + 4 + 1 + 13, num_batch_data_pkts);
+}
+
+TEST_CASE("test client batch read with loss", "[client][batch]") {
+  // the empty file, the middle of a file and the final block of the first window
+  runBatch((1 << 1) | (1 << 5) | (1 << 7));
+}
+
+TEST_CASE("test client batch read losing the end of a file", "[client][batch]") {
+  // the end of the file ending on a boundary, then the end of the batch
+  runBatch((1 << 3) | (1 << 22));
+}
@@ -13,6 +13,8 @@ TEST_CASE("test client", "[client]") {
 
   MtftpClient client;
   client.init(&writeFile, &sendPacket);
+  // check that every block is written as soon as it can be
+  client.setWriteCoalescing(false);
 
   STORE_SENDPACKET();
   client.beginRead(SAMPLE_FILE_INDEX, SAMPLE_FILE_OFFSET, CONFIG_WINDOW_SIZE);
@@ -71,3 +73,116 @@ TEST_CASE("test client", "[client]") {
   // transfer should have ended
   TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
 }
+
+TEST_CASE("test client coalesces writes", "[client]") {
+  const uint16_t SAMPLE_FILE_INDEX = 123;
+  const uint32_t SAMPLE_FILE_OFFSET = 0;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.beginRead(SAMPLE_FILE_INDEX, SAMPLE_FILE_OFFSET, CONFIG_WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  STORE_WRITEFILE();
+
+  for (uint8_t block_no = 0; block_no < CONFIG_WINDOW_SIZE; block_no++) {
+    pkt_data.block_no = block_no;
+    pkt_data.block[0] = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+
+  // only the write flushed before the ACK may end unaligned
+  uint32_t len_window = CONFIG_WINDOW_SIZE * CONFIG_LEN_BLOCK;
+  TEST_ASSERT_EQUAL((len_window + CONFIG_LEN_WRITE_BUFFER - 1) / CONFIG_LEN_WRITE_BUFFER, GET_WRITEFILE());
+  TEST_ASSERT_LESS_OR_EQUAL(1, writeFile_stats.num_unaligned);
+
+  // the whole window should have been written before it was acknowledged
+  TEST_ASSERT_EQUAL(len_window, writeFile_stats.len_file);
+
+  // final partial block
+  pkt_data.block_no = 0;
+  pkt_data.block[0] = CONFIG_WINDOW_SIZE;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + 1);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
+  TEST_ASSERT_EQUAL(len_window + 1, writeFile_stats.len_file);
+
+  for (uint8_t block_no = 0; block_no <= CONFIG_WINDOW_SIZE; block_no++) {
+    TEST_ASSERT_EQUAL(block_no, writeFile_stats.file[block_no * CONFIG_LEN_BLOCK]);
+  }
+}
+
+TEST_CASE("test client adapts window size", "[client]") {
+  const uint16_t INITIAL_WINDOW_SIZE = 8;
+  const uint16_t LOST_BLOCK_NO = 3;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.beginRead(0, 0, INITIAL_WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  // window without loss, the window should grow
+  for (uint16_t block_no = 0; block_no < INITIAL_WINDOW_SIZE; block_no++) {
+    pkt_data.block_no = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  uint16_t window_size = INITIAL_WINDOW_SIZE + CONFIG_WINDOW_INCREASE;
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(window_size, client.getWindowSize());
+
+  packet_ack_t *pkt_ack = (packet_ack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_ACK, pkt_ack->opcode);
+  TEST_ASSERT_EQUAL(sizeof(packet_ack_t), sendPacket_stats.len);
+  TEST_ASSERT_EQUAL(window_size, pkt_ack->window_size);
+
+  // window with a lost block, the window should be halved
+  for (uint16_t block_no = 0; block_no < window_size; block_no++) {
+    if (block_no == LOST_BLOCK_NO) continue;
+
+    pkt_data.block_no = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+
+  pkt_data.block_no = LOST_BLOCK_NO;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(window_size / 2, client.getWindowSize());
+  TEST_ASSERT_EQUAL(TYPE_ACK, pkt_ack->opcode);
+  TEST_ASSERT_EQUAL(window_size - 1, pkt_ack->block_no);
+  TEST_ASSERT_EQUAL(window_size / 2, pkt_ack->window_size);
+
+  // a fixed window does not change
+  client.setAdaptiveWindow(false);
+
+  for (uint16_t block_no = 0; block_no < window_size / 2; block_no++) {
+    pkt_data.block_no = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(window_size / 2, client.getWindowSize());
+}
@@ -0,0 +1,302 @@
+#include <string.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+static const uint32_t LEN_MAX_COMPRESS_FILE = 32768;
+
+static uint8_t compress_file[LEN_MAX_COMPRESS_FILE];
+static uint32_t len_compress_file;
+static uint8_t compress_written[LEN_MAX_COMPRESS_FILE];
+static uint32_t len_compress_written;
+
+// CSV lines like a sensor logger would write
+static void makeSensorLog(uint32_t len) {
+  uint32_t seed = 1;
+  uint32_t line = 0;
+
+  len_compress_file = 0;
+  while (len_compress_file < len) {
+    seed = seed * 1103515245 + 12345;
+
+    char text[80];
+    int len_text = snprintf(
+      text, sizeof(text), "2026-10-16T12:%02d:%02d,temp=%d.%d,hum=%d,bat=3.%03dV\n",
+      (line / 60) % 60, line % 60, 21 + ((seed >> 16) % 3), (seed >> 20) % 10, 40 + ((seed >> 24) % 5), 700 + (line % 50)
+    );
+
+    for (int i = 0; i < len_text && len_compress_file < len; i++) {
+      compress_file[len_compress_file ++] = text[i];
+    }
+
+    line ++;
+  }
+}
+
+static void makeRandomFile(uint32_t len) {
+  uint32_t seed = 7;
+
+  for (uint32_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    compress_file[i] = seed >> 16;
+  }
+
+  len_compress_file = len;
+}
+
+static bool readCompressFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < len_compress_file) {
+    data[*br] = compress_file[file_offset + *br];
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool writeCompressFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  TEST_ASSERT_LESS_OR_EQUAL(LEN_MAX_COMPRESS_FILE, file_offset + btw);
+
+  memcpy(compress_written + file_offset, data, btw);
+  if (file_offset + btw > len_compress_written) {
+    len_compress_written = file_offset + btw;
+  }
+
+  return true;
+}
+
+static void checkCompressFile(void) {
+  TEST_ASSERT_EQUAL(len_compress_file, len_compress_written);
+  TEST_ASSERT_EQUAL_MEMORY(compress_file, compress_written, len_compress_file);
+}
+
+// packs the whole file block by block, returns the number of blocks
+static uint32_t packFile(void) {
+  uint32_t offset = 0;
+  uint32_t num_blocks = 0;
+  uint8_t len_block;
+
+  do {
+    uint8_t block[CONFIG_LEN_BLOCK];
+    uint8_t data[MAX_COMPRESS_INPUT];
+    uint16_t len_left = len_compress_file - offset < MAX_COMPRESS_INPUT ? len_compress_file - offset : MAX_COMPRESS_INPUT;
+    uint16_t len_used;
+    uint16_t len_data;
+
+    len_block = compressBlock(compress_file + offset, len_left, offset + len_left == len_compress_file, block, &len_used);
+
+    TEST_ASSERT_TRUE(decompressBlock(block, len_block, data, &len_data));
+    TEST_ASSERT_EQUAL(len_used, len_data);
+    TEST_ASSERT_EQUAL_MEMORY(compress_file + offset, data, len_data);
+
+    offset += len_used;
+    num_blocks ++;
+
+    // only the final block is short, and only once everything has been packed
+    TEST_ASSERT_TRUE(len_block == CONFIG_LEN_BLOCK || offset == len_compress_file);
+  } while (len_block == CONFIG_LEN_BLOCK);
+
+  TEST_ASSERT_EQUAL(len_compress_file, offset);
+
+  return num_blocks;
+}
+
+TEST_CASE("test compressed blocks unpack to the file", "[compress]") {
+  makeSensorLog(10000);
+  uint32_t num_log_blocks = packFile();
+  // the log packs into well under half the blocks
+  TEST_ASSERT_LESS_THAN(10000 / CONFIG_LEN_BLOCK / 2, num_log_blocks);
+
+  // data that does not compress still fits, at a small cost
+  makeRandomFile(5000);
+  uint32_t num_random_blocks = packFile();
+  TEST_ASSERT_LESS_OR_EQUAL(5000 / CONFIG_LEN_BLOCK + 2, num_random_blocks);
+
+  // a long run is limited by MAX_COMPRESS_INPUT
+  memset(compress_file, 'a', 3000);
+  len_compress_file = 3000;
+  TEST_ASSERT_EQUAL((3000 + MAX_COMPRESS_INPUT - 1) / MAX_COMPRESS_INPUT, packFile());
+
+  // an empty file is a single empty block
+  uint8_t block[CONFIG_LEN_BLOCK];
+  uint16_t len_used;
+  TEST_ASSERT_EQUAL(0, compressBlock(compress_file, 0, true, block, &len_used));
+
+  // a match reaching back before the start of the block is corrupt
+  const uint8_t corrupt[] = { 0x01, 'a', 0x80, 0x02, 0x00 };
+  uint8_t data[MAX_COMPRESS_INPUT];
+  uint16_t len_data;
+  TEST_ASSERT_FALSE(decompressBlock(corrupt, sizeof(corrupt), data, &len_data));
+}
+
+static MtftpClient *compress_client;
+static MtftpServer *compress_server;
+static uint32_t num_compress_data_pkts;
+static uint32_t compress_drops;
+
+static void compressClientToServer(const uint8_t *data, uint8_t len) {
+  compress_server->onPacketRecv(data, len);
+}
+
+static void compressServerToClient(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    uint32_t pkt_no = num_compress_data_pkts ++;
+
+    if (pkt_no < 32 && (compress_drops & (1 << pkt_no))) return;
+  }
+
+  compress_client->onPacketRecv(data, len);
+}
+
+// returns the time (us) to read the file, rate is the pacing rate of the server in bytes/s (0 for none)
+static int64_t runCompressed(uint8_t options, uint8_t parity_blocks, uint32_t drops, uint32_t rate = 0) {
+  memset(compress_written, 0, sizeof(compress_written));
+  len_compress_written = 0;
+  num_compress_data_pkts = 0;
+  compress_drops = drops;
+
+  MtftpClient client;
+  MtftpServer server;
+  compress_client = &client;
+  compress_server = &server;
+
+  client.init(&writeCompressFile, &compressClientToServer);
+  client.setAdaptiveWindow(false);
+  server.init(&readCompressFile, &compressServerToClient);
+  if (rate > 0) {
+    server.setPacing(rate, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  }
+
+  int64_t time_start = esp_timer_get_time();
+
+  client.beginRead(0, 0, 16, options, parity_blocks);
+
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(10 * CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  int64_t duration = esp_timer_get_time() - time_start;
+
+  checkCompressFile();
+
+  return duration;
+}
+
+TEST_CASE("test client reads compressed file", "[client][compress]") {
+  makeSensorLog(20000);
+
+  runCompressed(OPT_COMPRESS, 0, 0);
+  uint32_t num_compressed = num_compress_data_pkts;
+
+  runCompressed(0, 0, 0);
+  TEST_ASSERT_LESS_THAN(num_compress_data_pkts / 2, num_compressed);
+
+  // the start, the middle and the end of the first window, then blocks of later windows
+  runCompressed(OPT_COMPRESS, 0, (1 << 0) | (1 << 7) | (1 << 15) | (1 << 20) | (1 << 29));
+
+  // lost blocks rebuilt from parity
+  runCompressed(OPT_COMPRESS, 2, (1 << 3) | (1 << 18));
+
+  // a file that fills the block exactly once compressed (as two runs of literals), followed by an empty block
+  makeRandomFile(CONFIG_LEN_BLOCK - 2);
+  runCompressed(OPT_COMPRESS, 0, 0);
+  TEST_ASSERT_EQUAL(2, num_compress_data_pkts);
+
+  // an empty file
+
+  len_compress_file = 0;
+  runCompressed(OPT_COMPRESS, 0, 0);
+  TEST_ASSERT_EQUAL(1, num_compress_data_pkts);
+}
+
+TEST_CASE("test client reads without compression if server rejects it", "[client][compress]") {
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.beginRead(1, 0, 8, OPT_COMPRESS);
+
+  packet_rrq_t *rrq_pkt = (packet_rrq_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(OPT_COMPRESS, rrq_pkt->options);
+
+  STORE_SENDPACKET();
+
+  packet_err_t err_pkt;
+  err_pkt.err = ERR_OPTION;
+  client.onPacketRecv((uint8_t *) &err_pkt, sizeof(err_pkt));
+  client.loop();
+
+  // the same RRQ without OPT_COMPRESS
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(TYPE_READ_REQUEST, rrq_pkt->opcode);
+  TEST_ASSERT_EQUAL(1, rrq_pkt->file_index);
+  TEST_ASSERT_EQUAL(0, rrq_pkt->options);
+
+  // the server rejects a compressed window it cannot keep track of
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  packet_rrq_t big_rrq;
+  big_rrq.file_index = 1;
+  big_rrq.file_offset = 0;
+  big_rrq.window_size = CONFIG_WINDOW_SIZE_MAX + 1;
+  big_rrq.options = OPT_COMPRESS;
+
+  server.onPacketRecv((uint8_t *) &big_rrq, sizeof(big_rrq));
+  server.loop();
+
+  TEST_ASSERT_TRUE(server.isIdle());
+  TEST_ASSERT_EQUAL(TYPE_ERR, sendPacket_stats.data[0]);
+  TEST_ASSERT_EQUAL(ERR_OPTION, ((packet_err_t *) sendPacket_stats.data)->err);
+}
+
+TEST_CASE("benchmark compression", "[compress][bench]") {
+  const uint32_t LEN_FILE = 30000;
+  // a link where airtime is the bottleneck
+  const uint32_t LINK_RATE = 100000;
+
+  const char *names[] = { "sensor log", "random" };
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (i == 0) {
+      makeSensorLog(LEN_FILE);
+    } else {
+      makeRandomFile(LEN_FILE);
+    }
+
+    // cpu time to pack and unpack every block
+    int64_t time_start = esp_timer_get_time();
+    uint32_t num_blocks = 0;
+    for (uint8_t repeat = 0; repeat < 10; repeat++) {
+      num_blocks = packFile();
+    }
+    int64_t time_per_block = (esp_timer_get_time() - time_start) * 1000 / (10 * num_blocks);
+
+    int64_t time_raw = runCompressed(0, 0, 0, LINK_RATE);
+    uint32_t num_raw = num_compress_data_pkts;
+    int64_t time_compressed = runCompressed(OPT_COMPRESS, 0, 0, LINK_RATE);
+    uint32_t num_compressed = num_compress_data_pkts;
+
+    printf(
+      "%-10s: %d bytes in %d blocks (%d raw), ratio %.2f, %" PRId64 " ns/block to pack and unpack, "
+      "%" PRId64 " us compressed vs %" PRId64 " us raw at %d bytes/s\n",
+      names[i], LEN_FILE, num_compressed, num_raw, (float) LEN_FILE / (num_compressed * CONFIG_LEN_BLOCK),
+      time_per_block, time_compressed, time_raw, LINK_RATE
+    );
+
+    if (i == 0) {
+      TEST_ASSERT_LESS_THAN(time_raw / 2, time_compressed);
+    } else {
+      // incompressible data costs a few blocks at most
+      TEST_ASSERT_LESS_OR_EQUAL(num_raw + 2 * LEN_FILE / MAX_COMPRESS_INPUT, num_compressed);
+    }
+  }
+}
@@ -0,0 +1,222 @@
+#include <string.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+typedef uint32_t (*crc_fn_t)(uint32_t crc, const uint8_t *data, uint32_t len);
+
+static void checkCrc32c(crc_fn_t crc_fn) {
+  // check value of CRC-32C
+  TEST_ASSERT_EQUAL_HEX32(0xE3069283, crc_fn(0, (const uint8_t *) "123456789", 9));
+  TEST_ASSERT_EQUAL_HEX32(0, crc_fn(0, NULL, 0));
+
+  uint8_t data[64];
+  for (uint8_t i = 0; i < sizeof(data); i++) {
+    data[i] = i * 7 + 3;
+  }
+
+  // the same crc however the data is split up and wherever it starts
+  uint32_t crc = crc_fn(0, data, sizeof(data));
+
+  for (uint8_t split = 0; split <= sizeof(data); split++) {
+    TEST_ASSERT_EQUAL_HEX32(crc, crc_fn(crc_fn(0, data, split), data + split, sizeof(data) - split));
+  }
+
+  uint8_t shifted[sizeof(data) + 8];
+  for (uint8_t offset = 1; offset < 8; offset++) {
+    memcpy(shifted + offset, data, sizeof(data));
+    TEST_ASSERT_EQUAL_HEX32(crc, crc_fn(0, shifted + offset, sizeof(data)));
+  }
+
+  // every single bit error is caught
+  for (uint16_t bit = 0; bit < sizeof(data) * 8; bit++) {
+    data[bit / 8] ^= 1 << (bit % 8);
+    TEST_ASSERT_NOT_EQUAL(crc, crc_fn(0, data, sizeof(data)));
+    data[bit / 8] ^= 1 << (bit % 8);
+  }
+}
+
+TEST_CASE("test crc32c", "[crc]") {
+  checkCrc32c(&crc32cTable);
+  printf("crc32c %s the CRC instructions\n", crc32cHardware() ? "uses" : "does not use");
+
+  if (!crc32cHardware()) return;
+
+  checkCrc32c(&crc32c);
+
+  // and both paths agree for every length and alignment
+  uint8_t data[CONFIG_LEN_BLOCK + 8];
+  for (uint16_t i = 0; i < sizeof(data); i++) {
+    data[i] = i * 31 + (i >> 3);
+  }
+
+  for (uint8_t offset = 0; offset < 8; offset++) {
+    for (uint16_t len = 0; len <= CONFIG_LEN_BLOCK; len++) {
+      TEST_ASSERT_EQUAL_HEX32(crc32cTable(len, data + offset, len), crc32c(len, data + offset, len));
+    }
+  }
+}
+
+static const uint32_t LEN_CRC_FILE = 12000;
+
+static uint8_t crc_file[LEN_CRC_FILE];
+static uint8_t crc_written[LEN_CRC_FILE];
+static uint32_t len_crc_written;
+
+static MtftpClient *crc_client;
+static MtftpServer *crc_server;
+// DATA packet with a byte flipped on the way (0xFFFFFFFF for none) and CRC packets lost (bit mask)
+static uint32_t num_crc_data_pkts;
+static uint32_t crc_corrupt_pkt;
+static uint32_t num_crc_pkts;
+static uint32_t crc_pkt_drops;
+
+static bool readCrcFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < LEN_CRC_FILE) {
+    data[*br] = crc_file[file_offset + *br];
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool writeCrcFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  TEST_ASSERT_LESS_OR_EQUAL(LEN_CRC_FILE, file_offset + btw);
+  // a window is only written once its crc has been checked
+  TEST_ASSERT_EQUAL_MEMORY(crc_file + file_offset, data, btw);
+
+  memcpy(crc_written + file_offset, data, btw);
+  if (file_offset + btw > len_crc_written) {
+    len_crc_written = file_offset + btw;
+  }
+
+  return true;
+}
+
+static void crcClientToServer(const uint8_t *data, uint8_t len) {
+  crc_server->onPacketRecv(data, len);
+}
+
+static void crcServerToClient(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA && num_crc_data_pkts ++ == crc_corrupt_pkt) {
+    // gets past the link layer with the last byte flipped
+    uint8_t corrupt[LEN_MAX_PACKET];
+    memcpy(corrupt, data, len);
+    corrupt[len - 1] ^= 0x10;
+
+    crc_client->onPacketRecv(corrupt, len);
+    return;
+  }
+
+  if (data[0] == TYPE_CRC) {
+    uint32_t pkt_no = num_crc_pkts ++;
+
+    if (pkt_no < 32 && (crc_pkt_drops & (1 << pkt_no))) return;
+  }
+
+  crc_client->onPacketRecv(data, len);
+}
+
+// returns the number of windows read again
+static uint32_t runCrc(uint8_t options, uint32_t corrupt_pkt, uint32_t crc_drops) {
+  memset(crc_written, 0, sizeof(crc_written));
+  len_crc_written = 0;
+  num_crc_data_pkts = 0;
+  crc_corrupt_pkt = corrupt_pkt;
+  num_crc_pkts = 0;
+  crc_pkt_drops = crc_drops;
+
+  MtftpClient client;
+  MtftpServer server;
+  crc_client = &client;
+  crc_server = &server;
+
+  client.init(&writeCrcFile, &crcClientToServer);
+  client.setAdaptiveWindow(false);
+  server.init(&readCrcFile, &crcServerToClient);
+
+  int64_t time_start = esp_timer_get_time();
+
+  client.beginRead(0, 0, 16, options);
+
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(10 * CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  TEST_ASSERT_EQUAL(LEN_CRC_FILE, len_crc_written);
+  TEST_ASSERT_EQUAL_MEMORY(crc_file, crc_written, LEN_CRC_FILE);
+
+  return client.getCrcErrors();
+}
+
+TEST_CASE("test client reads window again if crc does not match", "[client][crc]") {
+  uint32_t seed = 11;
+  for (uint32_t i = 0; i < LEN_CRC_FILE; i++) {
+    seed = seed * 1103515245 + 12345;
+    crc_file[i] = seed >> 16;
+  }
+
+  TEST_ASSERT_EQUAL(0, runCrc(OPT_CRC, 0xFFFFFFFF, 0));
+  // one CRC packet for each of the 4 windows (12000 bytes in windows of 16 blocks)
+  TEST_ASSERT_EQUAL(4, num_crc_pkts);
+
+  // a block in the first window and the final block of a later window
+  TEST_ASSERT_EQUAL(1, runCrc(OPT_CRC, 3, 0));
+  TEST_ASSERT_EQUAL(1, runCrc(OPT_CRC, 31, 0));
+  // ... and the final (short) block of the file
+  TEST_ASSERT_EQUAL(1, runCrc(OPT_CRC, LEN_CRC_FILE / CONFIG_LEN_BLOCK, 0));
+
+  // the crc of the first window is lost and the final block is requested again
+  TEST_ASSERT_EQUAL(0, runCrc(OPT_CRC, 0xFFFFFFFF, 1 << 0));
+  TEST_ASSERT_EQUAL(5, num_crc_pkts);
+
+  // compressed blocks are checked as they were sent
+  TEST_ASSERT_EQUAL(1, runCrc(OPT_CRC | OPT_COMPRESS, 2, 0));
+}
+
+TEST_CASE("benchmark crc32c", "[crc][bench]") {
+  const uint32_t NUM_BLOCKS = 20000;
+
+  static uint8_t blocks[64][CONFIG_LEN_BLOCK];
+  uint8_t copy[CONFIG_LEN_BLOCK];
+
+  for (uint16_t i = 0; i < 64; i++) {
+    memset(blocks[i], i, CONFIG_LEN_BLOCK);
+  }
+
+  int64_t time_start = esp_timer_get_time();
+  uint32_t crc = 0;
+  for (uint32_t i = 0; i < NUM_BLOCKS; i++) {
+    crc = crc32c(crc, blocks[i % 64], CONFIG_LEN_BLOCK);
+  }
+  int64_t time_crc = esp_timer_get_time() - time_start;
+
+  // the copy every received block already goes through from the packet queue into the ring
+  time_start = esp_timer_get_time();
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < NUM_BLOCKS; i++) {
+    memcpy(copy, blocks[i % 64], CONFIG_LEN_BLOCK);
+    // (so the copy is not optimised away)
+    sum += copy[i % CONFIG_LEN_BLOCK];
+  }
+  int64_t time_copy = esp_timer_get_time() - time_start;
+
+  // a DATA packet takes 2 ms to send at 1 Mbit/s
+  const int64_t AIRTIME = (LEN_DATA_HEADER + CONFIG_LEN_BLOCK) * 8;
+
+  printf(
+    "crc32c: %" PRId64 " ns/block, memcpy: %" PRId64 " ns/block, airtime at 1 Mbit/s: %" PRId64 " ns/block (%d byte blocks, crc=%08X sum=%d)\n",
+    time_crc * 1000 / NUM_BLOCKS, time_copy * 1000 / NUM_BLOCKS, AIRTIME * 1000, CONFIG_LEN_BLOCK, crc, sum
+  );
+
+  // the crc costs more than copying the block, but nothing next to sending it
+  TEST_ASSERT_LESS_THAN(AIRTIME * NUM_BLOCKS / 100, time_crc);
+}
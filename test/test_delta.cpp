@@ -0,0 +1,229 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+static const uint32_t LEN_MAX_DELTA_FILE = 32768;
+
+// the copy the client holds and the file on the server
+static uint8_t delta_basis[LEN_MAX_DELTA_FILE];
+static uint32_t len_delta_basis;
+static uint8_t delta_file[LEN_MAX_DELTA_FILE];
+static uint32_t len_delta_file;
+static uint8_t delta_written[LEN_MAX_DELTA_FILE];
+static uint32_t len_delta_written;
+
+static void makeBasis(uint32_t len) {
+  uint32_t seed = 3;
+
+  for (uint32_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    delta_basis[i] = seed >> 16;
+  }
+
+  len_delta_basis = len;
+
+  memcpy(delta_file, delta_basis, len);
+  len_delta_file = len;
+}
+
+// inserts len bytes at offset of the file on the server
+static void insertBytes(uint32_t offset, uint32_t len) {
+  memmove(delta_file + offset + len, delta_file + offset, len_delta_file - offset);
+
+  for (uint32_t i = 0; i < len; i++) {
+    delta_file[offset + i] = 'A' + (i % 26);
+  }
+
+  len_delta_file += len;
+}
+
+static bool readDeltaFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < len_delta_file) {
+    data[*br] = delta_file[file_offset + *br];
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool readDeltaBasis(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < len_delta_basis) {
+    data[*br] = delta_basis[file_offset + *br];
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool writeDeltaFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  TEST_ASSERT_LESS_OR_EQUAL(LEN_MAX_DELTA_FILE, file_offset + btw);
+
+  memcpy(delta_written + file_offset, data, btw);
+  if (file_offset + btw > len_delta_written) {
+    len_delta_written = file_offset + btw;
+  }
+
+  return true;
+}
+
+static MtftpClient *delta_client;
+static MtftpServer *delta_server;
+static uint32_t num_delta_data_pkts;
+static uint32_t num_delta_drqs;
+static uint32_t delta_drops;
+static uint32_t delta_drq_drops;
+
+static void deltaClientToServer(const uint8_t *data, uint8_t len) {
+  if (data[0] == TYPE_DELTA_READ_REQUEST) {
+    uint32_t pkt_no = num_delta_drqs ++;
+
+    if (pkt_no < 32 && (delta_drq_drops & (1 << pkt_no))) return;
+  }
+
+  delta_server->onPacketRecv(data, len);
+}
+
+static void deltaServerToClient(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    uint32_t pkt_no = num_delta_data_pkts ++;
+
+    if (pkt_no < 32 && (delta_drops & (1 << pkt_no))) return;
+  }
+
+  delta_client->onPacketRecv(data, len);
+}
+
+// reads delta_file as changes to delta_basis, drops are bit masks of the DATA packets and DRQs lost
+static void runDelta(uint32_t drops, uint32_t drq_drops, bool delta = true) {
+  memset(delta_written, 0, sizeof(delta_written));
+  len_delta_written = 0;
+  num_delta_data_pkts = 0;
+  num_delta_drqs = 0;
+  delta_drops = drops;
+  delta_drq_drops = drq_drops;
+
+  MtftpClient client;
+  MtftpServer server;
+  delta_client = &client;
+  delta_server = &server;
+
+  client.init(&writeDeltaFile, &deltaClientToServer);
+  client.setAdaptiveWindow(false);
+  client.setReadBasisCb(&readDeltaBasis);
+  server.init(&readDeltaFile, &deltaServerToClient);
+
+  int64_t time_start = esp_timer_get_time();
+
+  if (delta) {
+    client.beginDeltaRead(0, len_delta_basis, 16);
+  } else {
+    client.beginRead(0, 0, 16);
+  }
+
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(10 * CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  TEST_ASSERT_EQUAL(len_delta_file, len_delta_written);
+  TEST_ASSERT_EQUAL_MEMORY(delta_file, delta_written, len_delta_file);
+}
+
+TEST_CASE("test client reads changes to the copy it holds", "[client][delta]") {
+  makeBasis(16000);
+
+  // the whole file, for comparison
+  runDelta(0, 0, false);
+  uint32_t num_raw = num_delta_data_pkts;
+
+  // nothing has changed
+  runDelta(0, 0);
+  // 64 chunks of 250 bytes
+  TEST_ASSERT_EQUAL((CONFIG_DELTA_CHUNKS + LEN_DRQ_CHUNKS - 1) / LEN_DRQ_CHUNKS, num_delta_drqs);
+  TEST_ASSERT_LESS_THAN(num_raw / 8, num_delta_data_pkts);
+
+  // bytes inserted, changed and appended
+  insertBytes(3000, 100);
+  memset(delta_file + 9000, 0x55, 50);
+  insertBytes(len_delta_file, 500);
+
+  runDelta(0, 0);
+  uint32_t num_changed = num_delta_data_pkts;
+  TEST_ASSERT_LESS_THAN(num_raw / 3, num_changed);
+
+  // blocks lost from the first and later windows
+  runDelta((1 << 0) | (1 << 2) | (1 << 5), 0);
+
+  // the first DRQ is lost, its chunks are sent as they are
+  runDelta(0, 1 << 0);
+  TEST_ASSERT_GREATER_THAN(num_changed, num_delta_data_pkts);
+
+  // an empty copy
+  len_delta_basis = 0;
+  runDelta(0, 0);
+  TEST_ASSERT_EQUAL(1, num_delta_drqs);
+}
+
+TEST_CASE("test client reads the whole file if server rejects delta read", "[client][delta]") {
+  initTestTracking();
+
+  makeBasis(4000);
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setReadBasisCb(&readDeltaBasis);
+  client.beginDeltaRead(1, len_delta_basis, 8);
+
+  // chunks no smaller than MIN_DELTA_CHUNK_SIZE, too many for one DRQ
+  packet_drq_t *drq_pkt = (packet_drq_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_DELTA_READ_REQUEST, drq_pkt->opcode);
+  TEST_ASSERT_EQUAL(1, drq_pkt->last);
+  TEST_ASSERT_EQUAL(MIN_DELTA_CHUNK_SIZE, drq_pkt->chunk_size);
+  TEST_ASSERT_EQUAL(LEN_DRQ_CHUNKS * 2, drq_pkt->first_chunk);
+  TEST_ASSERT_EQUAL(4000 / MIN_DELTA_CHUNK_SIZE - (LEN_DRQ_CHUNKS * 2), drq_pkt->num_chunks);
+
+  STORE_SENDPACKET();
+
+  packet_err_t err_pkt;
+  err_pkt.err = ERR_OPTION;
+  client.onPacketRecv((uint8_t *) &err_pkt, sizeof(err_pkt));
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+
+  packet_rrq_t *rrq_pkt = (packet_rrq_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_READ_REQUEST, rrq_pkt->opcode);
+  TEST_ASSERT_EQUAL(1, rrq_pkt->file_index);
+  TEST_ASSERT_EQUAL(0, rrq_pkt->file_offset);
+
+  // the server rejects chunks it cannot check
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  packet_drq_t bad_drq;
+  bad_drq.file_index = 1;
+  bad_drq.file_offset = 0;
+  bad_drq.window_size = 8;
+  bad_drq.chunk_size = MAX_DELTA_CHUNK_SIZE + 1;
+  bad_drq.first_chunk = 0;
+  bad_drq.last = 1;
+
+  STORE_SENDPACKET();
+
+  server.onPacketRecv((uint8_t *) &bad_drq, LEN_DRQ_HEADER);
+  server.loop();
+
+  TEST_ASSERT_TRUE(server.isIdle());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(TYPE_ERR, sendPacket_stats.data[0]);
+  TEST_ASSERT_EQUAL(ERR_OPTION, ((packet_err_t *) sendPacket_stats.data)->err);
+}
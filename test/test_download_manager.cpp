@@ -0,0 +1,177 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_server.hpp"
+#include "mtftp_download_manager.hpp"
+
+static const uint8_t NUM_NODES = 4;
+static const uint8_t NUM_JOBS = 6;
+static const uint32_t LEN_NODE_FILE = 5 * CONFIG_LEN_BLOCK + 17;
+
+typedef struct node {
+  uint8_t index;
+  uint8_t addr[LEN_PEER_ADDR];
+  MtftpServer server;
+} node_t;
+
+typedef struct fleet {
+  MtftpDownloadManager *manager;
+  node_t nodes[NUM_NODES];
+  uint8_t files[NUM_JOBS][LEN_NODE_FILE];
+  uint32_t len_files[NUM_JOBS];
+  bool ended[NUM_JOBS];
+  bool complete[NUM_JOBS];
+  // jobs in the order they ended
+  int end_order[NUM_JOBS];
+  uint8_t num_ended;
+} fleet_t;
+
+static uint8_t nodeFileByte(uint8_t node, uint32_t offset) {
+  return (offset * 7 + node * 31) & 0xFF;
+}
+
+static bool readNodeFile(void *ctx, uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  node_t *node = (node_t *) ctx;
+
+  *br = 0;
+  while (*br < btr && file_offset + *br < LEN_NODE_FILE) {
+    data[*br] = nodeFileByte(node->index, file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static fleet_t *fleet;
+
+static void nodeSendPacket(void *ctx, const uint8_t *data, uint8_t len) {
+  fleet->manager->onPacketRecv(((node_t *) ctx)->addr, data, len);
+}
+
+static bool writeJobFile(void *ctx, int job, uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  fleet_t *fleet = (fleet_t *) ctx;
+  if (file_offset + btw > LEN_NODE_FILE) return false;
+
+  memcpy(fleet->files[job] + file_offset, data, btw);
+  if (file_offset + btw > fleet->len_files[job]) fleet->len_files[job] = file_offset + btw;
+
+  return true;
+}
+
+static void sendToNode(void *ctx, const uint8_t *peer_addr, const uint8_t *data, uint8_t len) {
+  fleet_t *fleet = (fleet_t *) ctx;
+
+  for (uint8_t i = 0; i < NUM_NODES; i++) {
+    if (memcmp(fleet->nodes[i].addr, peer_addr, LEN_PEER_ADDR) == 0) {
+      fleet->nodes[i].server.onPacketRecv(data, len);
+    }
+  }
+}
+
+static void onJobEnd(void *ctx, int job, bool complete) {
+  fleet_t *fleet = (fleet_t *) ctx;
+
+  fleet->ended[job] = true;
+  fleet->complete[job] = complete;
+  fleet->end_order[fleet->num_ended ++] = job;
+}
+
+TEST_CASE("test download manager", "[client][manager]") {
+  static fleet_t test_fleet;
+  memset(test_fleet.files, 0, sizeof(test_fleet.files));
+  memset(test_fleet.len_files, 0, sizeof(test_fleet.len_files));
+  memset(test_fleet.ended, 0, sizeof(test_fleet.ended));
+  test_fleet.num_ended = 0;
+  fleet = &test_fleet;
+
+  MtftpDownloadManager manager(2, NUM_JOBS);
+  test_fleet.manager = &manager;
+  manager.init(&writeJobFile, &sendToNode, &test_fleet);
+  manager.setOnJobEndCb(&onJobEnd, &test_fleet);
+  // 4 blocks a window for each of the two sessions
+  manager.setWindowBudget(8);
+
+  for (uint8_t i = 0; i < NUM_NODES; i++) {
+    node_t *node = &test_fleet.nodes[i];
+    node->index = i;
+    memset(node->addr, 0, LEN_PEER_ADDR);
+    node->addr[0] = 0x10 + i;
+    node->server.init(&readNodeFile, &nodeSendPacket, node);
+  }
+
+  // node 0 twice (its second job waits for the first), node 3 at a higher priority than the rest
+  const uint8_t job_nodes[NUM_JOBS] = {0, 1, 0, 2, 3, 1};
+  const uint8_t job_priorities[NUM_JOBS] = {0, 0, 0, 0, 2, 0};
+  int jobs[NUM_JOBS];
+
+  for (uint8_t i = 0; i < NUM_JOBS; i++) {
+    MtftpDownloadManager::job_t job = {};
+    memcpy(job.peer_addr, test_fleet.nodes[job_nodes[i]].addr, LEN_PEER_ADDR);
+    job.window_size = 16;
+    job.priority = job_priorities[i];
+
+    jobs[i] = manager.addJob(&job);
+    TEST_ASSERT_EQUAL(i, jobs[i]);
+  }
+
+  MtftpDownloadManager::job_t extra = {};
+  TEST_ASSERT_EQUAL(-1, manager.addJob(&extra));
+
+  // node 1's second job is dropped before it starts
+  TEST_ASSERT_TRUE(manager.cancelJob(jobs[5]));
+  TEST_ASSERT_EQUAL(MtftpDownloadManager::JOB_FREE, manager.getJobState(jobs[5]));
+  TEST_ASSERT_EQUAL(5, manager.getNumQueued());
+
+  // the packets of an unknown peer are not taken
+  uint8_t unknown[LEN_PEER_ADDR] = {0x77};
+  uint8_t data[1] = {TYPE_DATA};
+  TEST_ASSERT_EQUAL(RECV_NO_SESSION, manager.onPacketRecv(unknown, data, sizeof(data)));
+
+  manager.loop();
+
+  // the priority job and the oldest of the rest
+  TEST_ASSERT_EQUAL(2, manager.getNumActive());
+  TEST_ASSERT_EQUAL(MtftpDownloadManager::JOB_ACTIVE, manager.getJobState(jobs[4]));
+  TEST_ASSERT_EQUAL(MtftpDownloadManager::JOB_ACTIVE, manager.getJobState(jobs[0]));
+  TEST_ASSERT_FALSE(manager.cancelJob(jobs[0]));
+  TEST_ASSERT_LESS_OR_EQUAL(4, manager.getClient(jobs[0])->getWindowSize());
+  TEST_ASSERT_NULL(manager.getClient(jobs[1]));
+
+  int64_t time_start = esp_timer_get_time();
+  while (!manager.isIdle()) {
+    for (uint8_t i = 0; i < NUM_NODES; i++) {
+      test_fleet.nodes[i].server.loop();
+    }
+    manager.loop();
+
+    TEST_ASSERT_LESS_OR_EQUAL(2, manager.getNumActive());
+    // node 0 is only ever read from once at a time
+    TEST_ASSERT_FALSE(manager.getJobState(jobs[0]) == MtftpDownloadManager::JOB_ACTIVE &&
+                      manager.getJobState(jobs[2]) == MtftpDownloadManager::JOB_ACTIVE);
+    TEST_ASSERT_LESS_THAN_MESSAGE(4 * CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "jobs did not complete");
+  }
+
+  TEST_ASSERT_EQUAL(5, test_fleet.num_ended);
+  TEST_ASSERT_FALSE(test_fleet.ended[jobs[5]]);
+
+  for (uint8_t i = 0; i < NUM_JOBS - 1; i++) {
+    TEST_ASSERT_TRUE(test_fleet.ended[jobs[i]]);
+    TEST_ASSERT_TRUE(test_fleet.complete[jobs[i]]);
+    TEST_ASSERT_EQUAL(LEN_NODE_FILE, test_fleet.len_files[jobs[i]]);
+
+    for (uint32_t j = 0; j < LEN_NODE_FILE; j++) {
+      TEST_ASSERT_EQUAL_HEX8(nodeFileByte(job_nodes[i], j), test_fleet.files[jobs[i]][j]);
+    }
+  }
+
+  // the priority job ended first, node 0's first job before its second
+  TEST_ASSERT_EQUAL(jobs[4], test_fleet.end_order[0]);
+  uint8_t end_first = 0, end_second = 0;
+  for (uint8_t i = 0; i < test_fleet.num_ended; i++) {
+    if (test_fleet.end_order[i] == jobs[0]) end_first = i;
+    if (test_fleet.end_order[i] == jobs[2]) end_second = i;
+  }
+  TEST_ASSERT_LESS_THAN(end_second, end_first);
+}
@@ -0,0 +1,273 @@
+#include <string.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+static MtftpClient *fec_client;
+static MtftpServer *fec_server;
+
+static uint32_t len_fec_file;
+
+static uint8_t fecFileByte(uint32_t offset) {
+  return (offset * 7 + (offset >> 8)) & 0xFF;
+}
+
+static bool readFecFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < len_fec_file) {
+    data[*br] = fecFileByte(file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static void checkFecFile(void) {
+  TEST_ASSERT_EQUAL(len_fec_file, writeFile_stats.len_file);
+  for (uint32_t i = 0; i < len_fec_file; i++) {
+    TEST_ASSERT_EQUAL_HEX8(fecFileByte(i), writeFile_stats.file[i]);
+  }
+}
+
+// blocks of the first window dropped on the way to the client
+static uint32_t fec_dropped_blocks;
+static uint32_t num_rtx_pkts;
+
+static void fecClientToServer(const uint8_t *data, uint8_t len) {
+  if (data[0] == TYPE_RETRANSMIT || data[0] == TYPE_NACK) num_rtx_pkts ++;
+
+  fec_server->onPacketRecv(data, len);
+}
+
+static void fecServerToClient(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    packet_data_t *data_pkt = (packet_data_t *) data;
+
+    if (data_pkt->block_no < 32 && (fec_dropped_blocks & (1 << data_pkt->block_no))) {
+      // only the first transmission is lost
+      fec_dropped_blocks &= ~(1 << data_pkt->block_no);
+      return;
+    }
+  }
+
+  fec_client->onPacketRecv(data, len);
+}
+
+TEST_CASE("test client rebuilds lost blocks from parity", "[fec]") {
+  const uint16_t WINDOW_SIZE = 8;
+  const uint8_t PARITY_BLOCKS = 2;
+
+  // the file ends in the first window, the final (partial) block is lost along with one other
+  len_fec_file = 5 * CONFIG_LEN_BLOCK + (CONFIG_LEN_BLOCK / 3);
+  fec_dropped_blocks = (1 << 2) | (1 << 5);
+  num_rtx_pkts = 0;
+
+  initTestTracking();
+
+  MtftpClient client;
+  MtftpServer server;
+  fec_client = &client;
+  fec_server = &server;
+
+  client.init(&writeFile, &fecClientToServer);
+  server.init(&readFecFile, &fecServerToClient);
+
+  client.beginRead(0, 0, WINDOW_SIZE, 0, PARITY_BLOCKS);
+
+  int64_t time_start = esp_timer_get_time();
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  // one block out of each group was rebuilt, nothing had to be retransmitted
+  checkFecFile();
+  TEST_ASSERT_EQUAL(2, client.getRecovered());
+  TEST_ASSERT_EQUAL(0, num_rtx_pkts);
+}
+
+TEST_CASE("test client requests blocks parity cannot rebuild", "[fec]") {
+  const uint16_t WINDOW_SIZE = 8;
+  const uint8_t PARITY_BLOCKS = 2;
+
+  len_fec_file = 2 * WINDOW_SIZE * CONFIG_LEN_BLOCK + 10;
+  // two blocks of group 0 and one of group 1
+  fec_dropped_blocks = (1 << 0) | (1 << 4) | (1 << 3);
+  num_rtx_pkts = 0;
+
+  initTestTracking();
+
+  MtftpClient client;
+  MtftpServer server;
+  fec_client = &client;
+  fec_server = &server;
+
+  client.init(&writeFile, &fecClientToServer);
+  client.setAdaptiveWindow(false);
+  server.init(&readFecFile, &fecServerToClient);
+
+  client.beginRead(0, 0, WINDOW_SIZE, 0, PARITY_BLOCKS);
+
+  int64_t time_start = esp_timer_get_time();
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  // block 3 is rebuilt straight away, block 4 once block 0 has been retransmitted
+  checkFecFile();
+  TEST_ASSERT_EQUAL(2, client.getRecovered());
+  TEST_ASSERT_EQUAL(1, num_rtx_pkts);
+}
+
+TEST_CASE("test server ignores parity request when streaming", "[fec]") {
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  LEN_SAMPLE_DATA = 10;
+
+  packet_rrq_t rrq_pkt;
+  rrq_pkt.file_index = 0;
+  rrq_pkt.file_offset = 0;
+  rrq_pkt.window_size = 4;
+  rrq_pkt.options = OPT_STREAM;
+  rrq_pkt.parity_blocks = 2;
+
+  server.onPacketRecv((uint8_t *) &rrq_pkt, sizeof(rrq_pkt));
+  server.loop();
+  server.loop();
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+  TEST_ASSERT_EQUAL(TYPE_DATA, sendPacket_stats.data[0] & OPCODE_MASK);
+}
+
+// simulated link: every packet arrives LINK_DELAY us after it was sent, DATA and PARITY packets
+// are lost at random, the server is paced to LINK_RATE bytes/sec
+static const int64_t LINK_DELAY = 5000;
+static const uint32_t LINK_RATE = 100000;
+static const uint8_t LEN_LINK_QUEUE = 64;
+
+typedef struct link_queue {
+  uint8_t data[LEN_LINK_QUEUE][LEN_MAX_PACKET];
+  uint8_t len[LEN_LINK_QUEUE];
+  int64_t time_arrival[LEN_LINK_QUEUE];
+  uint8_t head;
+  uint8_t count;
+} link_queue_t;
+
+static link_queue_t to_client;
+static link_queue_t to_server;
+static uint32_t link_loss;
+static uint32_t link_seed;
+
+// loss in 1/1000ths
+static bool linkLost(void) {
+  link_seed = link_seed * 1103515245 + 12345;
+  return ((link_seed >> 16) % 1000) < link_loss;
+}
+
+static void linkPush(link_queue_t *queue, const uint8_t *data, uint8_t len) {
+  TEST_ASSERT_LESS_THAN(LEN_LINK_QUEUE, queue->count);
+
+  uint8_t index = (queue->head + queue->count) % LEN_LINK_QUEUE;
+  memcpy(queue->data[index], data, len);
+  queue->len[index] = len;
+  queue->time_arrival[index] = esp_timer_get_time() + LINK_DELAY;
+  queue->count ++;
+}
+
+static void linkToClient(const uint8_t *data, uint8_t len) {
+  if (((data[0] & OPCODE_MASK) == TYPE_DATA || (data[0] & OPCODE_MASK) == TYPE_PARITY) && linkLost()) return;
+
+  linkPush(&to_client, data, len);
+}
+
+static void linkToServer(const uint8_t *data, uint8_t len) {
+  linkPush(&to_server, data, len);
+}
+
+static void linkPoll(link_queue_t *queue, bool client) {
+  int64_t now = esp_timer_get_time();
+
+  while (queue->count > 0 && queue->time_arrival[queue->head] <= now) {
+    if (client) {
+      fec_client->onPacketRecv(queue->data[queue->head], queue->len[queue->head]);
+    } else {
+      fec_server->onPacketRecv(queue->data[queue->head], queue->len[queue->head]);
+    }
+
+    queue->head = (queue->head + 1) % LEN_LINK_QUEUE;
+    queue->count --;
+  }
+}
+
+// returns the time (us) to transfer the file over the simulated link
+static int64_t runLossyLink(uint32_t loss, uint8_t parity_blocks) {
+  const uint16_t WINDOW_SIZE = 16;
+
+  memset(&to_client, 0, sizeof(to_client));
+  memset(&to_server, 0, sizeof(to_server));
+  link_loss = loss;
+  link_seed = 1;
+  initTestTracking();
+
+  MtftpClient client;
+  MtftpServer server;
+  fec_client = &client;
+  fec_server = &server;
+
+  client.init(&writeFile, &linkToServer);
+  client.setAdaptiveWindow(false);
+  server.init(&readFecFile, &linkToClient);
+  server.setPacing(LINK_RATE, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+
+  int64_t time_start = esp_timer_get_time();
+
+  client.beginRead(0, 0, WINDOW_SIZE, 0, parity_blocks);
+
+  do {
+    server.loop();
+    linkPoll(&to_client, true);
+    client.loop();
+    linkPoll(&to_server, false);
+  } while (client.getState() != MtftpClient::STATE_IDLE);
+
+  int64_t duration = esp_timer_get_time() - time_start;
+
+  checkFecFile();
+
+  printf(
+    "loss %4.1f%%, %d parity blocks: %7" PRId64 " us, %3d blocks rebuilt, %d retries\n",
+    loss / 10.0, parity_blocks, duration, client.getRecovered(), client.getRetries()
+  );
+
+  return duration;
+}
+
+TEST_CASE("benchmark completion time with FEC", "[fec][bench]") {
+  len_fec_file = 60 * CONFIG_LEN_BLOCK + 1;
+
+  printf("link: %d bytes/s, %" PRId64 " us each way, window of 16 blocks\n", LINK_RATE, LINK_DELAY);
+
+  const uint32_t losses[] = { 0, 20, 50, 100 };
+  int64_t time_plain[sizeof(losses) / sizeof(losses[0])];
+  int64_t time_fec[sizeof(losses) / sizeof(losses[0])];
+
+  for (uint8_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+    time_plain[i] = runLossyLink(losses[i], 0);
+    time_fec[i] = runLossyLink(losses[i], 2);
+  }
+
+  // at 10% loss nearly every window loses a block, rebuilding it is faster than a round trip for an RTX
+  TEST_ASSERT_LESS_THAN(time_plain[3], time_fec[3]);
+}
@@ -0,0 +1,314 @@
+#include <string.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+static bool tx_ready;
+
+static bool isTxReady(void) {
+  return tx_ready;
+}
+
+TEST_CASE("test server pacing", "[server][pacing]") {
+  const uint32_t RATE = 50000;
+  const uint32_t BURST = 2 * (LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  const int64_t DURATION = 200000;
+
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+  server.setPacing(RATE, BURST);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 0;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = 4000;
+
+  server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+
+  STORE_SENDPACKET();
+
+  int64_t time_start = esp_timer_get_time();
+  while (esp_timer_get_time() - time_start < DURATION) {
+    server.loop();
+  }
+
+  // the burst, then RATE bytes/sec
+  uint32_t expected = (BURST + (RATE * DURATION) / 1000000) / (LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+
+  TEST_ASSERT_GREATER_OR_EQUAL(expected - (expected / 5), GET_SENDPACKET());
+  TEST_ASSERT_LESS_OR_EQUAL(expected + 1, GET_SENDPACKET());
+  TEST_ASSERT_GREATER_THAN(0, server.getPacedLoops());
+
+  // the transport reports its TX queue is full, nothing should be sent
+  tx_ready = false;
+  server.setPacing(0, 0);
+  server.setTxReadyCb(&isTxReady);
+
+  STORE_SENDPACKET();
+  uint32_t paced_loops = server.getPacedLoops();
+
+  for (uint8_t i = 0; i < 10; i++) {
+    server.loop();
+  }
+
+  TEST_ASSERT_EQUAL(0, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(paced_loops + 10, server.getPacedLoops());
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_TRANSFER, server.getState());
+
+  tx_ready = true;
+  server.loop();
+
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+}
+
+// simulated link: packets from the server wait in a TX queue of LINK_QUEUE packets
+// which drains at LINK_RATE bytes/sec, packets sent while the queue is full are lost
+static const uint32_t LINK_RATE = 100000;
+static const uint8_t LINK_QUEUE = 8;
+static const uint32_t LEN_LINK_FILE = 60 * CONFIG_LEN_BLOCK + 1;
+
+static struct {
+  uint8_t data[LINK_QUEUE][LEN_MAX_PACKET];
+  uint8_t len[LINK_QUEUE];
+  int64_t time_sent[LINK_QUEUE];
+  uint8_t head;
+  uint8_t count;
+  // time the packet at the back of the queue will have been sent
+  int64_t time_free;
+  uint32_t drops;
+} link;
+
+static MtftpClient *link_client;
+static MtftpServer *link_server;
+
+static bool readLinkFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < LEN_LINK_FILE) {
+    data[*br] = (file_offset + *br) & 0xFF;
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static void linkSend(const uint8_t *data, uint8_t len) {
+  if (link.count == LINK_QUEUE) {
+    link.drops ++;
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  if (link.time_free < now) link.time_free = now;
+  link.time_free += ((int64_t) len * 1000000) / LINK_RATE;
+
+  uint8_t index = (link.head + link.count) % LINK_QUEUE;
+  memcpy(link.data[index], data, len);
+  link.len[index] = len;
+  link.time_sent[index] = link.time_free;
+  link.count ++;
+}
+
+static void linkPoll(void) {
+  int64_t now = esp_timer_get_time();
+
+  while (link.count > 0 && link.time_sent[link.head] <= now) {
+    link_client->onPacketRecv(link.data[link.head], link.len[link.head]);
+
+    link.head = (link.head + 1) % LINK_QUEUE;
+    link.count --;
+  }
+}
+
+static bool isLinkReady(void) {
+  return link.count < LINK_QUEUE;
+}
+
+static void linkToServer(const uint8_t *data, uint8_t len) {
+  link_server->onPacketRecv(data, len);
+}
+
+// returns the goodput (bytes/sec) of a transfer over the simulated link
+static uint32_t runLink(uint32_t pacing_rate, bool backpressure) {
+  memset(&link, 0, sizeof(link));
+  initTestTracking();
+
+  MtftpClient client;
+  MtftpServer server;
+  link_client = &client;
+  link_server = &server;
+
+  client.init(&writeFile, &linkToServer);
+  server.init(&readLinkFile, &linkSend);
+  server.setPacing(pacing_rate, 2 * (LEN_DATA_HEADER + CONFIG_LEN_BLOCK));
+  if (backpressure) {
+    server.setTxReadyCb(&isLinkReady);
+  }
+
+  int64_t time_start = esp_timer_get_time();
+
+  client.beginRead(0, 0, CONFIG_WINDOW_SIZE);
+
+  do {
+    server.loop();
+    linkPoll();
+    client.loop();
+  } while (client.getState() != MtftpClient::STATE_IDLE);
+
+  int64_t duration = esp_timer_get_time() - time_start;
+
+  TEST_ASSERT_EQUAL(LEN_LINK_FILE, writeFile_stats.len_file);
+  for (uint32_t i = 0; i < LEN_LINK_FILE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(i & 0xFF, writeFile_stats.file[i]);
+  }
+
+  uint32_t goodput = (uint32_t) (((int64_t) LEN_LINK_FILE * 1000000) / duration);
+
+  printf(
+    "pacing %6d bytes/s%s: %6d bytes/s goodput, %4d packets lost, %d retries\n",
+    pacing_rate, backpressure ? " + backpressure" : "", goodput, link.drops, client.getRetries()
+  );
+
+  return goodput;
+}
+
+TEST_CASE("benchmark goodput against pacing rate", "[server][pacing][bench]") {
+  printf("link: %d bytes/s, TX queue of %d packets\n", LINK_RATE, LINK_QUEUE);
+
+  uint32_t goodput_unpaced = runLink(0, false);
+
+  uint32_t goodput_best = 0;
+  const uint32_t rates[] = { LINK_RATE / 2, (LINK_RATE * 9) / 10, LINK_RATE, 2 * LINK_RATE };
+
+  for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    uint32_t goodput = runLink(rates[i], false);
+    if (goodput > goodput_best) goodput_best = goodput;
+  }
+
+  uint32_t goodput_backpressure = runLink(0, true);
+
+  // pacing close to the link rate avoids the losses of bursting into the TX queue
+  TEST_ASSERT_GREATER_THAN(goodput_unpaced, goodput_best);
+  TEST_ASSERT_GREATER_THAN(goodput_unpaced, goodput_backpressure);
+}
+
+static struct {
+  uint16_t calls;
+  uint16_t num_packets;
+  uint16_t num_data;
+  uint16_t num_crc;
+  bool zero_peer;
+  MtftpClient *client;
+} batch;
+
+static void sendBatch(const uint8_t *peer_addr, const MtftpServer::tx_packet_t *packets, uint16_t num_packets) {
+  const uint8_t zero_peer[LEN_PEER_ADDR] = {};
+
+  batch.calls ++;
+  batch.num_packets += num_packets;
+  batch.zero_peer = memcmp(peer_addr, zero_peer, LEN_PEER_ADDR) == 0;
+
+  for (uint16_t i = 0; i < num_packets; i++) {
+    if ((packets[i].data[0] & OPCODE_MASK) == TYPE_DATA) batch.num_data ++;
+    if (packets[i].data[0] == TYPE_CRC) batch.num_crc ++;
+
+    if (batch.client != NULL) batch.client->onPacketRecv(packets[i].data, packets[i].len);
+  }
+}
+
+static MtftpServer *batch_server;
+
+static void batchToServer(const uint8_t *data, uint8_t len) {
+  batch_server->onPacketRecv(data, len);
+}
+
+TEST_CASE("test server batch send", "[server][pacing]") {
+  const uint16_t WINDOW_SIZE = 8;
+  const uint16_t LEN_PACKET = LEN_DATA_HEADER + CONFIG_LEN_BLOCK;
+
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  initTestTracking();
+  memset(&batch, 0, sizeof(batch));
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+  server.setSendBatchCb(&sendBatch);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 0;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = WINDOW_SIZE;
+  pkt_rrq.options = OPT_CRC;
+
+  server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+  STORE_SENDPACKET();
+
+  // the whole window and its crc in one call to loop(), none of it through sendPacket
+  server.loop();
+
+  TEST_ASSERT_EQUAL(1, batch.calls);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, batch.num_data);
+  TEST_ASSERT_EQUAL(1, batch.num_crc);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE + 1, batch.num_packets);
+  TEST_ASSERT_TRUE(batch.zero_peer);
+  TEST_ASSERT_EQUAL(0, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+
+  // paced: only the burst goes in a batch
+  memset(&batch, 0, sizeof(batch));
+
+  MtftpServer paced_server;
+  paced_server.init(&readFile, &sendPacket);
+  paced_server.setSendBatchCb(&sendBatch);
+  paced_server.setPacing(50000, 3 * LEN_PACKET);
+
+  pkt_rrq.options = 0;
+  paced_server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+  paced_server.loop();
+
+  TEST_ASSERT_EQUAL(1, batch.calls);
+  TEST_ASSERT_EQUAL(3, batch.num_data);
+
+  // a whole transfer over the batch path, one call per window
+  initTestTracking();
+  memset(&batch, 0, sizeof(batch));
+
+  MtftpClient client;
+  MtftpServer file_server;
+  batch.client = &client;
+  batch_server = &file_server;
+
+  client.init(&writeFile, &batchToServer);
+  client.setAdaptiveWindow(false);
+  file_server.init(&readLinkFile, &sendPacket);
+  file_server.setSendBatchCb(&sendBatch);
+
+  client.beginRead(0, 0, 2 * WINDOW_SIZE, OPT_CRC);
+
+  int64_t time_start = esp_timer_get_time();
+  do {
+    file_server.loop();
+    client.poll();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !file_server.isIdle());
+
+  TEST_ASSERT_EQUAL(LEN_LINK_FILE, writeFile_stats.len_file);
+  for (uint32_t i = 0; i < LEN_LINK_FILE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(i & 0xFF, writeFile_stats.file[i]);
+  }
+
+  uint16_t num_windows = (LEN_LINK_FILE / CONFIG_LEN_BLOCK + 2 * WINDOW_SIZE) / (2 * WINDOW_SIZE);
+  TEST_ASSERT_EQUAL(num_windows, batch.calls);
+  TEST_ASSERT_EQUAL(num_windows, batch.num_crc);
+  TEST_ASSERT_EQUAL(0, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(0, client.getRetries());
+}
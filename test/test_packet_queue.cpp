@@ -0,0 +1,106 @@
+#include <string.h>
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_packet_queue.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "esp_timer.h"
+
+TEST_CASE("test packet queue", "[queue]") {
+  const uint16_t NUM_SLOTS = 4;
+  const uint8_t peer_addr[LEN_PEER_ADDR] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
+
+  MtftpPacketQueue queue(NUM_SLOTS);
+
+  TEST_ASSERT_NULL(queue.front());
+
+  uint8_t packet[LEN_MAX_PACKET];
+
+  // fill the queue, the next push should be dropped
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    memset(packet, i, sizeof(packet));
+    TEST_ASSERT_TRUE(queue.push(peer_addr, packet, i + 1));
+  }
+
+  TEST_ASSERT_FALSE(queue.push(peer_addr, packet, 1));
+  TEST_ASSERT_EQUAL(1, queue.getDrops());
+  TEST_ASSERT_EQUAL(NUM_SLOTS, queue.getHighWater());
+
+  // packets longer than a slot are dropped
+  TEST_ASSERT_FALSE(queue.push(peer_addr, packet, LEN_MAX_PACKET + 1));
+  TEST_ASSERT_EQUAL(2, queue.getDrops());
+
+  // packets should come out in the order they were pushed
+  for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+    MtftpPacketQueue::packet_slot_t *slot = queue.front();
+
+    TEST_ASSERT_NOT_NULL(slot);
+    TEST_ASSERT_EQUAL(i + 1, slot->len);
+    TEST_ASSERT_EQUAL(i, slot->data[0]);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(peer_addr, slot->peer_addr, LEN_PEER_ADDR);
+
+    queue.pop();
+  }
+
+  TEST_ASSERT_NULL(queue.front());
+  TEST_ASSERT_EQUAL(0, queue.size());
+
+  // wrap around the end of the slots
+  for (uint8_t i = 0; i < NUM_SLOTS * 3; i++) {
+    packet[0] = i;
+    TEST_ASSERT_TRUE(queue.push(peer_addr, packet, LEN_MAX_PACKET));
+    TEST_ASSERT_EQUAL(i, queue.front()->data[0]);
+    queue.pop();
+  }
+
+  TEST_ASSERT_EQUAL(NUM_SLOTS, queue.getHighWater());
+}
+
+TEST_CASE("benchmark packet queue against ringbuffer", "[queue][bench]") {
+  const uint32_t NUM_PACKETS = 10000;
+  const uint8_t BURST = 16;
+  const uint8_t peer_addr[LEN_PEER_ADDR] = {0};
+
+  uint8_t packet[LEN_MAX_PACKET];
+  memset(packet, 0xAB, sizeof(packet));
+
+  // push and pop bursts of full length DATA packets, as they arrive during a window
+  RingbufHandle_t ringbuf = xRingbufferCreate(2 * BURST * (LEN_MAX_PACKET + 16), RINGBUF_TYPE_NOSPLIT);
+  TEST_ASSERT_NOT_NULL(ringbuf);
+
+  int64_t time_start = esp_timer_get_time();
+  for (uint32_t i = 0; i < NUM_PACKETS; i += BURST) {
+    for (uint8_t j = 0; j < BURST; j++) {
+      TEST_ASSERT_EQUAL(pdTRUE, xRingbufferSend(ringbuf, packet, LEN_MAX_PACKET, 0));
+    }
+
+    for (uint8_t j = 0; j < BURST; j++) {
+      size_t len;
+      void *data = xRingbufferReceive(ringbuf, &len, 0);
+      TEST_ASSERT_NOT_NULL(data);
+      vRingbufferReturnItem(ringbuf, data);
+    }
+  }
+  int64_t time_ringbuf = esp_timer_get_time() - time_start;
+
+  vRingbufferDelete(ringbuf);
+
+  MtftpPacketQueue queue(BURST);
+
+  time_start = esp_timer_get_time();
+  for (uint32_t i = 0; i < NUM_PACKETS; i += BURST) {
+    for (uint8_t j = 0; j < BURST; j++) {
+      TEST_ASSERT_TRUE(queue.push(peer_addr, packet, LEN_MAX_PACKET));
+    }
+
+    for (uint8_t j = 0; j < BURST; j++) {
+      TEST_ASSERT_NOT_NULL(queue.front());
+      queue.pop();
+    }
+  }
+  int64_t time_queue = esp_timer_get_time() - time_start;
+
+  printf("ringbuffer: %d ns/packet\n", (int) ((time_ringbuf * 1000) / NUM_PACKETS));
+  printf("packet queue: %d ns/packet\n", (int) ((time_queue * 1000) / NUM_PACKETS));
+}
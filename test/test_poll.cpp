@@ -0,0 +1,126 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+static bool tx_ready;
+
+static bool isTxReady(void) {
+  return tx_ready;
+}
+
+static void sendRrq(MtftpServer *server, uint16_t window_size) {
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 0;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = window_size;
+
+  server->onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+}
+
+TEST_CASE("test server poll sends every block allowed", "[server][poll]") {
+  const uint16_t WINDOW_SIZE = 8;
+  const uint32_t RATE = 50000;
+  const uint16_t LEN_PACKET = LEN_DATA_HEADER + CONFIG_LEN_BLOCK;
+
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  TEST_ASSERT_TRUE(server.poll() == NO_DEADLINE);
+
+  // the whole window in one call, then nothing but the timeout is due
+  sendRrq(&server, WINDOW_SIZE);
+  STORE_SENDPACKET();
+
+  int64_t deadline = server.poll();
+  int64_t now = esp_timer_get_time();
+
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+  TEST_ASSERT_TRUE(deadline > now);
+  TEST_ASSERT_LESS_OR_EQUAL(CONFIG_TIMEOUT + 1, deadline - now);
+
+  // paced: the burst, then the deadline is when the bucket holds the next block
+  MtftpServer paced_server;
+  paced_server.init(&readFile, &sendPacket);
+  paced_server.setPacing(RATE, 2 * LEN_PACKET);
+
+  sendRrq(&paced_server, WINDOW_SIZE);
+  STORE_SENDPACKET();
+
+  deadline = paced_server.poll();
+  now = esp_timer_get_time();
+
+  TEST_ASSERT_EQUAL(2, GET_SENDPACKET());
+  TEST_ASSERT_TRUE(deadline > now);
+  TEST_ASSERT_LESS_OR_EQUAL(((int64_t) LEN_PACKET * 1000000) / RATE + 1, deadline - now);
+
+  while (esp_timer_get_time() < deadline);
+
+  paced_server.poll();
+  TEST_ASSERT_EQUAL(3, GET_SENDPACKET());
+
+  // the transport holds blocks back, it is checked again shortly
+  tx_ready = false;
+  paced_server.setPacing(0, 0);
+  paced_server.setTxReadyCb(&isTxReady);
+
+  deadline = paced_server.poll();
+  now = esp_timer_get_time();
+
+  TEST_ASSERT_EQUAL(3, GET_SENDPACKET());
+  TEST_ASSERT_LESS_OR_EQUAL(MtftpServer::TX_READY_RECHECK, deadline - now);
+
+  tx_ready = true;
+  paced_server.poll();
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, GET_SENDPACKET());
+}
+
+TEST_CASE("test client poll deadline", "[client][poll]") {
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+
+  TEST_ASSERT_TRUE(client.poll() == NO_DEADLINE);
+
+  STORE_SENDPACKET();
+  client.beginRead(0, 0, CONFIG_WINDOW_SIZE);
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+
+  // the RRQ is resent one rto after it was sent
+  int64_t deadline = client.getDeadline();
+  int64_t now = esp_timer_get_time();
+
+  TEST_ASSERT_TRUE(deadline > now);
+  TEST_ASSERT_LESS_OR_EQUAL(client.getRto() + 1, deadline - now);
+
+  TEST_ASSERT_TRUE(client.poll() == deadline);
+  TEST_ASSERT_EQUAL(0, client.getRetries());
+
+  // nothing arrives, wait() sleeps until the deadline
+  TEST_ASSERT_FALSE(client.wait(deadline));
+  TEST_ASSERT_TRUE(esp_timer_get_time() >= deadline);
+
+  int64_t next_deadline = client.poll();
+
+  TEST_ASSERT_EQUAL(1, client.getRetries());
+  TEST_ASSERT_EQUAL(2, GET_SENDPACKET());
+  TEST_ASSERT_TRUE(next_deadline > deadline);
+
+  // a packet is already queued, wait() returns at once
+  packet_err_t err_pkt;
+  err_pkt.err = ERR_FREAD;
+  client.onPacketRecv((uint8_t *) &err_pkt, sizeof(err_pkt));
+
+  TEST_ASSERT_TRUE(client.wait(esp_timer_get_time() + CONFIG_TIMEOUT));
+  TEST_ASSERT_TRUE(client.poll() == NO_DEADLINE);
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
+}
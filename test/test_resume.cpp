@@ -0,0 +1,292 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+
+// checkpoint store holding a single file
+static bool checkpoint_set;
+static uint16_t checkpoint_file_index;
+static uint32_t checkpoint_offset;
+static uint8_t num_checkpoint_saves;
+static uint8_t num_checkpoint_clears;
+static uint8_t num_resume_timeouts;
+
+static bool loadCheckpoint(uint16_t file_index, uint32_t *file_offset) {
+  if (!checkpoint_set || file_index != checkpoint_file_index) return false;
+
+  *file_offset = checkpoint_offset;
+  return true;
+}
+
+static void saveCheckpoint(uint16_t file_index, uint32_t file_offset) {
+  checkpoint_set = true;
+  checkpoint_file_index = file_index;
+  checkpoint_offset = file_offset;
+  num_checkpoint_saves ++;
+}
+
+static void clearCheckpoint(uint16_t file_index) {
+  TEST_ASSERT_EQUAL(checkpoint_file_index, file_index);
+
+  checkpoint_set = false;
+  num_checkpoint_clears ++;
+}
+
+static const MtftpClient::checkpoint_store_t checkpoint_store = {
+  &loadCheckpoint,
+  &saveCheckpoint,
+  &clearCheckpoint
+};
+
+static void onResumeTimeout() {
+  num_resume_timeouts ++;
+}
+
+static void initCheckpoints(void) {
+  checkpoint_set = false;
+  checkpoint_file_index = 0;
+  checkpoint_offset = 0;
+  num_checkpoint_saves = 0;
+  num_checkpoint_clears = 0;
+  num_resume_timeouts = 0;
+}
+
+static void recvBlock(MtftpClient *client, uint16_t block_no, uint8_t data, uint8_t len_block = CONFIG_LEN_BLOCK) {
+  packet_data_t pkt_data;
+
+  pkt_data.block_no = block_no;
+  memset(pkt_data.block, data, CONFIG_LEN_BLOCK);
+
+  client->onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + len_block);
+  client->loop();
+}
+
+TEST_CASE("test client resumes after a timeout keeping buffered blocks", "[client][resume]") {
+  const uint16_t FILE_INDEX = 5;
+  const uint16_t WINDOW_SIZE = 8;
+
+  initTestTracking();
+  initCheckpoints();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setOnTimeoutCb(&onResumeTimeout);
+  client.setAdaptiveWindow(false);
+  client.setCheckpointStore(&checkpoint_store);
+  client.beginRead(FILE_INDEX, 0, WINDOW_SIZE);
+
+  // blocks 2 and 3 are lost, then the link goes down before anything else arrives
+  const uint8_t received[] = { 0, 1, 4, 5, 6 };
+  for (uint8_t i = 0; i < sizeof(received); i++) {
+    recvBlock(&client, received[i], received[i]);
+  }
+
+  int64_t time_start = esp_timer_get_time();
+  while (client.getResumes() == 0) {
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(2 * CONFIG_MAX_RETRIES * CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "read was not resumed");
+  }
+
+  // the read starts again after the blocks written, the window only covers the blocks missing
+  // before the ones buffered
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+  TEST_ASSERT_EQUAL(0, num_resume_timeouts);
+  TEST_ASSERT_EQUAL(1, num_checkpoint_saves);
+  TEST_ASSERT_EQUAL(FILE_INDEX, checkpoint_file_index);
+  TEST_ASSERT_EQUAL(2 * CONFIG_LEN_BLOCK, checkpoint_offset);
+
+  packet_rrq_t *rrq_pkt = (packet_rrq_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_READ_REQUEST, rrq_pkt->opcode);
+  TEST_ASSERT_EQUAL(FILE_INDEX, rrq_pkt->file_index);
+  TEST_ASSERT_EQUAL(2 * CONFIG_LEN_BLOCK, rrq_pkt->file_offset);
+  TEST_ASSERT_EQUAL(2, rrq_pkt->window_size);
+
+  // the missing blocks arrive, the buffered ones are written after them and acknowledged
+  recvBlock(&client, 0, 2);
+  recvBlock(&client, 1, 3);
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+
+  packet_ack_t *ack_pkt = (packet_ack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_ACK, ack_pkt->opcode);
+  TEST_ASSERT_EQUAL(4, ack_pkt->block_no);
+  // back to the full window
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, ack_pkt->window_size);
+  TEST_ASSERT_EQUAL(7 * CONFIG_LEN_BLOCK, checkpoint_offset);
+
+  // final block, the checkpoint is no longer needed
+  recvBlock(&client, 0, 7, 10);
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
+  TEST_ASSERT_FALSE(checkpoint_set);
+  TEST_ASSERT_EQUAL(1, num_checkpoint_clears);
+
+  TEST_ASSERT_EQUAL(7 * CONFIG_LEN_BLOCK + 10, writeFile_stats.len_file);
+  for (uint32_t i = 0; i < writeFile_stats.len_file; i++) {
+    TEST_ASSERT_EQUAL(i / CONFIG_LEN_BLOCK, writeFile_stats.file[i]);
+  }
+}
+
+TEST_CASE("test client begins read at stored checkpoint", "[client][resume]") {
+  const uint16_t FILE_INDEX = 5;
+
+  initTestTracking();
+  initCheckpoints();
+
+  checkpoint_set = true;
+  checkpoint_file_index = FILE_INDEX;
+  checkpoint_offset = 3 * CONFIG_LEN_BLOCK;
+
+  packet_rrq_t *rrq_pkt = (packet_rrq_t *) sendPacket_stats.data;
+
+  // the checkpoint is past the offset requested (eg the device rebooted part way through the file)
+  {
+    MtftpClient client;
+    client.init(&writeFile, &sendPacket);
+    client.setCheckpointStore(&checkpoint_store);
+    client.beginRead(FILE_INDEX, CONFIG_LEN_BLOCK);
+
+    TEST_ASSERT_EQUAL(TYPE_READ_REQUEST, rrq_pkt->opcode);
+    TEST_ASSERT_EQUAL(3 * CONFIG_LEN_BLOCK, rrq_pkt->file_offset);
+  }
+
+  // an offset after the checkpoint is used as it is
+  {
+    MtftpClient client;
+    client.init(&writeFile, &sendPacket);
+    client.setCheckpointStore(&checkpoint_store);
+    client.beginRead(FILE_INDEX, 4 * CONFIG_LEN_BLOCK);
+
+    TEST_ASSERT_EQUAL(4 * CONFIG_LEN_BLOCK, rrq_pkt->file_offset);
+  }
+
+  // no checkpoint for another file
+  {
+    MtftpClient client;
+    client.init(&writeFile, &sendPacket);
+    client.setCheckpointStore(&checkpoint_store);
+    client.beginRead(FILE_INDEX + 1, 0);
+
+    TEST_ASSERT_EQUAL(FILE_INDEX + 1, rrq_pkt->file_index);
+    TEST_ASSERT_EQUAL(0, rrq_pkt->file_offset);
+  }
+
+  TEST_ASSERT_EQUAL(0, num_checkpoint_saves);
+}
+
+TEST_CASE("test client gives up after resuming CONFIG_MAX_RESUMES times", "[client][resume]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  initTestTracking();
+  initCheckpoints();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setOnTimeoutCb(&onResumeTimeout);
+  client.setAdaptiveWindow(false);
+  client.setCheckpointStore(&checkpoint_store);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  // one window arrives, then nothing
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    recvBlock(&client, block_no, block_no);
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+
+  int64_t time_start = esp_timer_get_time();
+  while (client.getState() != MtftpClient::STATE_IDLE) {
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN(2 * (CONFIG_MAX_RESUMES + 1) * CONFIG_MAX_RETRIES * CONFIG_TIMEOUT, esp_timer_get_time() - time_start);
+  }
+
+  // every resume asked for the window after the one acknowledged
+  TEST_ASSERT_EQUAL(CONFIG_MAX_RESUMES, client.getResumes());
+  TEST_ASSERT_EQUAL(1, num_resume_timeouts);
+
+  packet_rrq_t *rrq_pkt = (packet_rrq_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_READ_REQUEST, rrq_pkt->opcode);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, rrq_pkt->file_offset);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, rrq_pkt->window_size);
+
+  // the checkpoint is kept for the next read
+  TEST_ASSERT_TRUE(checkpoint_set);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, checkpoint_offset);
+  TEST_ASSERT_EQUAL(0, num_checkpoint_clears);
+}
+
+// a checkpoint store of its own for each client, given as the context of the callbacks
+typedef struct ctx_store {
+  bool set;
+  uint32_t offset;
+  uint8_t num_saves;
+} ctx_store_t;
+
+static bool loadCtxCheckpoint(void *ctx, uint16_t file_index, uint32_t *file_offset) {
+  ctx_store_t *store = (ctx_store_t *) ctx;
+  if (!store->set) return false;
+
+  *file_offset = store->offset;
+  return true;
+}
+
+static void saveCtxCheckpoint(void *ctx, uint16_t file_index, uint32_t file_offset) {
+  ctx_store_t *store = (ctx_store_t *) ctx;
+
+  store->set = true;
+  store->offset = file_offset;
+  store->num_saves ++;
+}
+
+static void clearCtxCheckpoint(void *ctx, uint16_t file_index) {
+  ((ctx_store_t *) ctx)->set = false;
+}
+
+static const MtftpClient::checkpoint_store_ctx_t ctx_checkpoint_store = {
+  &loadCtxCheckpoint,
+  &saveCtxCheckpoint,
+  &clearCtxCheckpoint
+};
+
+TEST_CASE("test clients with separate checkpoint stores", "[client][resume]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  initTestTracking();
+
+  ctx_store_t store_a = {};
+  ctx_store_t store_b = {true, 3 * CONFIG_LEN_BLOCK, 0};
+
+  MtftpClient client_a;
+  client_a.init(&writeFile, &sendPacket);
+  client_a.setAdaptiveWindow(false);
+  client_a.setCheckpointStore(&ctx_checkpoint_store, &store_a);
+
+  MtftpClient client_b;
+  client_b.init(&writeFile, &sendPacket);
+  client_b.setCheckpointStore(&ctx_checkpoint_store, &store_b);
+
+  // the same file, each client starts from its own checkpoint
+  packet_rrq_t *rrq_pkt = (packet_rrq_t *) sendPacket_stats.data;
+
+  client_a.beginRead(0, 0, WINDOW_SIZE);
+  TEST_ASSERT_EQUAL(0, rrq_pkt->file_offset);
+
+  client_b.beginRead(0, 0, WINDOW_SIZE);
+  TEST_ASSERT_EQUAL(3 * CONFIG_LEN_BLOCK, rrq_pkt->file_offset);
+
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    recvBlock(&client_a, block_no, block_no);
+  }
+
+  // the ACK of the first window only saved the checkpoint of client_a
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client_a.getState());
+  TEST_ASSERT_TRUE(store_a.set);
+  TEST_ASSERT_EQUAL(1, store_a.num_saves);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, store_a.offset);
+  TEST_ASSERT_EQUAL(0, store_b.num_saves);
+  TEST_ASSERT_EQUAL(3 * CONFIG_LEN_BLOCK, store_b.offset);
+}
@@ -1,4 +1,6 @@
+#include <stdlib.h>
 #include <string.h>
+#include "esp_timer.h"
 #include "unity.h"
 #include "helpers.h"
 #include "mtftp.h"
@@ -16,6 +18,8 @@ TEST_CASE("test client retransmit behavior", "[client]") {
 
   MtftpClient client;
   client.init(&writeFile, &sendPacket);
+  // check that every block is written as soon as it can be
+  client.setWriteCoalescing(false);
   client.beginRead(SAMPLE_FILE_INDEX, SAMPLE_FILE_OFFSET, WINDOW_SIZE);
 
   packet_data_t pkt_data;
@@ -134,12 +138,273 @@ TEST_CASE("test for correct blocks in RTX", "[server]") {
     client.loop();
   }
 
-  // expect that the RTX contains the two lost data blocks
+  // the NACK encoding (base 3, bitmap 0b101) is shorter than listing the two blocks
+  packet_nack_t *pkt_nack = (packet_nack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_NACK, pkt_nack->opcode);
+  TEST_ASSERT_EQUAL(LEN_NACK_HEADER + 1, sendPacket_stats.len);
+
+  // expect that the NACK contains the two lost data blocks
+  nack_iter_t iter = {};
+  uint16_t block_no;
+
+  TEST_ASSERT_EQUAL(2, nackCount(pkt_nack, sendPacket_stats.len));
+  TEST_ASSERT_TRUE(nackNext(pkt_nack, sendPacket_stats.len, &iter, &block_no));
+  TEST_ASSERT_EQUAL(WINDOW_SIZE - 5, block_no);
+  TEST_ASSERT_TRUE(nackNext(pkt_nack, sendPacket_stats.len, &iter, &block_no));
+  TEST_ASSERT_EQUAL(WINDOW_SIZE - 3, block_no);
+  TEST_ASSERT_FALSE(nackNext(pkt_nack, sendPacket_stats.len, &iter, &block_no));
+}
+
+TEST_CASE("test client requests blocks lost during retransmit", "[client]") {
+  const uint8_t WINDOW_SIZE = 8;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.beginRead(123, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  for (uint8_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    if (block_no == 2 || block_no == 5) continue;
+
+    pkt_data.block_no = block_no;
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+
+  // the retransmit of block 2 is lost, the last block requested arrives
+  STORE_SENDPACKET();
+
+  pkt_data.block_no = 5;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  // block 2 should be requested again straight away
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+
   packet_rtx_t *pkt_rtx = (packet_rtx_t *) sendPacket_stats.data;
   TEST_ASSERT_EQUAL(TYPE_RETRANSMIT, pkt_rtx->opcode);
-  TEST_ASSERT_EQUAL(2, pkt_rtx->num_elements);
-  TEST_ASSERT_EQUAL(WINDOW_SIZE - 5, pkt_rtx->block_nos[0]);
-  TEST_ASSERT_EQUAL(WINDOW_SIZE - 3, pkt_rtx->block_nos[1]);
+  TEST_ASSERT_EQUAL(1, pkt_rtx->num_elements);
+  TEST_ASSERT_EQUAL(2, pkt_rtx->block_nos[0]);
+
+  pkt_data.block_no = 2;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+}
+
+TEST_CASE("test NACK encoding", "[nack]") {
+  // a burst loss, followed by scattered losses, followed by another burst
+  nack_range_t runs[200];
+  uint16_t num_runs = 0;
+  uint32_t num_missing = 0;
+
+  runs[num_runs].offset = 100;
+  runs[num_runs++].num_blocks = 3000;
+
+  for (uint16_t block_no = 3200; block_no < 3200 + (150 * 3); block_no += 3) {
+    runs[num_runs].offset = block_no;
+    runs[num_runs++].num_blocks = 1;
+  }
+
+  runs[num_runs].offset = 20000;
+  runs[num_runs++].num_blocks = 40000;
+
+  for (uint16_t i = 0; i < num_runs; i++) {
+    num_missing += runs[i].num_blocks;
+  }
+
+  packet_nack_t pkt_nack;
+  uint16_t num_encoded = num_runs;
+  uint8_t len_pkt = nackEncode(&pkt_nack, runs, &num_encoded);
+
+  // everything should fit into a single packet
+  TEST_ASSERT_EQUAL(num_runs, num_encoded);
+  TEST_ASSERT_LESS_OR_EQUAL(LEN_MAX_PACKET, len_pkt);
+  TEST_ASSERT_TRUE(nackValid(&pkt_nack, len_pkt));
+  TEST_ASSERT_EQUAL(num_missing, nackCount(&pkt_nack, len_pkt));
+  TEST_ASSERT_EQUAL(59999, nackLast(&pkt_nack, len_pkt));
+
+  // decode every block and check it against the runs
+  nack_iter_t iter = {};
+  uint16_t block_no;
+  uint32_t num_decoded = 0;
+  uint16_t last_block_no = 0;
+
+  while (nackNext(&pkt_nack, len_pkt, &iter, &block_no)) {
+    bool found = false;
+    for (uint16_t i = 0; i < num_runs; i++) {
+      if (block_no >= runs[i].offset && block_no < runs[i].offset + runs[i].num_blocks) {
+        found = true;
+        break;
+      }
+    }
+
+    TEST_ASSERT_TRUE(found);
+    num_decoded ++;
+    last_block_no = block_no;
+  }
+
+  TEST_ASSERT_EQUAL(num_missing, num_decoded);
+  TEST_ASSERT_EQUAL(nackLast(&pkt_nack, len_pkt), last_block_no);
+
+  // more scattered runs than fit in one packet
+  for (num_runs = 0; num_runs < 200; num_runs++) {
+    runs[num_runs].offset = num_runs * 100;
+    runs[num_runs].num_blocks = 1;
+  }
+
+  num_encoded = num_runs;
+  len_pkt = nackEncode(&pkt_nack, runs, &num_encoded);
+
+  TEST_ASSERT_LESS_THAN(num_runs, num_encoded);
+  TEST_ASSERT_EQUAL(num_encoded, nackCount(&pkt_nack, len_pkt));
+  TEST_ASSERT_EQUAL(runs[num_encoded - 1].offset, nackLast(&pkt_nack, len_pkt));
+}
+
+TEST_CASE("test bitmapFind", "[nack]") {
+  uint32_t bitmap[4] = {};
+
+  TEST_ASSERT_EQUAL(128, bitmapFind(bitmap, 0, 128, true));
+  TEST_ASSERT_EQUAL(0, bitmapFind(bitmap, 0, 128, false));
+
+  bitmapSet(bitmap, 5);
+  bitmapSet(bitmap, 31);
+  bitmapSet(bitmap, 32);
+  bitmapSet(bitmap, 100);
+
+  TEST_ASSERT_TRUE(bitmapTest(bitmap, 31));
+  TEST_ASSERT_FALSE(bitmapTest(bitmap, 30));
+  TEST_ASSERT_EQUAL(5, bitmapFind(bitmap, 0, 128, true));
+  TEST_ASSERT_EQUAL(31, bitmapFind(bitmap, 6, 128, true));
+  TEST_ASSERT_EQUAL(32, bitmapFind(bitmap, 32, 128, true));
+  TEST_ASSERT_EQUAL(100, bitmapFind(bitmap, 33, 128, true));
+  TEST_ASSERT_EQUAL(33, bitmapFind(bitmap, 31, 128, false));
+
+  // nothing past the end is returned, even if it is set
+  TEST_ASSERT_EQUAL(90, bitmapFind(bitmap, 33, 90, true));
+  TEST_ASSERT_EQUAL(40, bitmapFind(bitmap, 40, 40, true));
+  TEST_ASSERT_EQUAL(10, bitmapFind(bitmap, 12, 10, true));
+
+  bitmapClear(bitmap, 100);
+  TEST_ASSERT_EQUAL(128, bitmapFind(bitmap, 33, 128, true));
+
+  memset(bitmap, 0xFF, sizeof(bitmap));
+  TEST_ASSERT_EQUAL(97, bitmapFind(bitmap, 0, 97, false));
+  bitmapClear(bitmap, 96);
+  TEST_ASSERT_EQUAL(96, bitmapFind(bitmap, 0, 97, false));
+}
+
+// the missing runs of a window, as the client found them before it tracked buffered blocks in a bitmap
+static uint16_t missingRunsScan(const uint8_t *len, uint32_t num_blocks, nack_range_t *runs) {
+  uint16_t num_runs = 0;
+
+  for (uint32_t i = 0; i < num_blocks; i++) {
+    if (len[i] != 0xFF) continue;
+
+    if (num_runs > 0 && runs[num_runs - 1].offset + runs[num_runs - 1].num_blocks == i) {
+      runs[num_runs - 1].num_blocks ++;
+    } else {
+      runs[num_runs].offset = i;
+      runs[num_runs].num_blocks = 1;
+      num_runs ++;
+    }
+  }
+
+  return num_runs;
+}
+
+static uint16_t missingRunsBitmap(const uint32_t *filled, uint32_t num_blocks, nack_range_t *runs) {
+  uint16_t num_runs = 0;
+
+  for (uint32_t start = bitmapFind(filled, 0, num_blocks, false); start < num_blocks; start = bitmapFind(filled, start, num_blocks, false)) {
+    uint32_t end = bitmapFind(filled, start, num_blocks, true);
+
+    runs[num_runs].offset = start;
+    runs[num_runs].num_blocks = end - start;
+    num_runs ++;
+
+    start = end;
+  }
+
+  return num_runs;
+}
+
+TEST_CASE("benchmark missing block runs", "[nack][bench]") {
+  const uint32_t WINDOW_SIZES[] = {256, 4096, 65535};
+  // in 1/1000
+  const uint32_t LOSSES[] = {1, 10, 100, 500};
+  const uint32_t MAX_BLOCKS = 65535;
+  const uint32_t ITERATIONS = 20;
+
+  uint8_t *len = (uint8_t *) malloc(MAX_BLOCKS);
+  uint32_t *filled = (uint32_t *) malloc(((MAX_BLOCKS + 31) / 32) * sizeof(uint32_t));
+  nack_range_t *runs_scan = (nack_range_t *) malloc(MAX_BLOCKS * sizeof(nack_range_t));
+  nack_range_t *runs_bitmap = (nack_range_t *) malloc(MAX_BLOCKS * sizeof(nack_range_t));
+  TEST_ASSERT_NOT_NULL(len);
+  TEST_ASSERT_NOT_NULL(filled);
+  TEST_ASSERT_NOT_NULL(runs_scan);
+  TEST_ASSERT_NOT_NULL(runs_bitmap);
+
+  for (uint32_t num_blocks : WINDOW_SIZES) {
+    for (uint32_t loss : LOSSES) {
+      uint32_t seed = 1;
+      memset(filled, 0, ((num_blocks + 31) / 32) * sizeof(uint32_t));
+
+      for (uint32_t i = 0; i < num_blocks; i++) {
+        seed = seed * 1103515245 + 12345;
+
+        if ((seed >> 16) % 1000 < loss) {
+          len[i] = 0xFF;
+        } else {
+          len[i] = CONFIG_LEN_BLOCK;
+          bitmapSet(filled, i);
+        }
+      }
+
+      uint16_t num_runs_scan = 0;
+      int64_t time_start = esp_timer_get_time();
+      for (uint32_t i = 0; i < ITERATIONS; i++) {
+        num_runs_scan = missingRunsScan(len, num_blocks, runs_scan);
+      }
+      int64_t time_scan = esp_timer_get_time() - time_start;
+
+      uint16_t num_runs_bitmap = 0;
+      time_start = esp_timer_get_time();
+      for (uint32_t i = 0; i < ITERATIONS; i++) {
+        num_runs_bitmap = missingRunsBitmap(filled, num_blocks, runs_bitmap);
+      }
+      int64_t time_bitmap = esp_timer_get_time() - time_start;
+
+      TEST_ASSERT_EQUAL(num_runs_scan, num_runs_bitmap);
+      for (uint16_t i = 0; i < num_runs_scan; i++) {
+        TEST_ASSERT_EQUAL(runs_scan[i].offset, runs_bitmap[i].offset);
+        TEST_ASSERT_EQUAL(runs_scan[i].num_blocks, runs_bitmap[i].num_blocks);
+      }
+
+      printf(
+        "%5d blocks, %4.1f%% loss, %5d runs: scan %7d ns/window, bitmap %7d ns/window\n", (int) num_blocks, loss / 10.0,
+        num_runs_scan, (int) ((time_scan * 1000) / ITERATIONS), (int) ((time_bitmap * 1000) / ITERATIONS)
+      );
+
+      // with few losses the bitmap skips whole words of received blocks
+      if (num_blocks >= 4096 && loss <= 10) {
+        TEST_ASSERT_LESS_THAN(time_scan, time_bitmap);
+      }
+    }
+  }
+
+  free(len);
+  free(filled);
+  free(runs_scan);
+  free(runs_bitmap);
 }
 
 TEST_CASE("test server retransmit behavior", "[server]") {
@@ -182,6 +447,8 @@ TEST_CASE("test server retransmit behavior", "[server]") {
   result = server.onPacketRecv((uint8_t *) &pkt_rtx, LEN_RTX_HEADER + (pkt_rtx.num_elements * sizeof(uint16_t)));
   TEST_ASSERT_EQUAL(RECV_OK, result);
 
+  MtftpServer::cache_stats_t cache_stats = server.getCacheStats();
+
   // check to ensure that the correct blocks are transmitted
   for (uint8_t i = 0; i < sizeof(missing_blocks) / sizeof(missing_blocks[0]); i++) {
     uint8_t block_no = missing_blocks[i];
@@ -190,16 +457,17 @@ TEST_CASE("test server retransmit behavior", "[server]") {
     STORE_SENDPACKET();
 
     server.loop();
-    TEST_ASSERT_EQUAL(1, GET_READFILE());
-    TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
 
-    TEST_ASSERT_EQUAL(SAMPLE_FILE_INDEX, readFile_stats.file_index);
-    TEST_ASSERT_EQUAL(SAMPLE_FILE_OFFSET + (block_no * CONFIG_LEN_BLOCK), readFile_stats.file_offset);
-    TEST_ASSERT_EQUAL(CONFIG_LEN_BLOCK, readFile_stats.btr);
+    // retransmitted blocks are sent from the read cache
+    TEST_ASSERT_EQUAL(0, GET_READFILE());
+    TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+    TEST_ASSERT_EQUAL(cache_stats.hits + i + 1, server.getCacheStats().hits);
+    TEST_ASSERT_EQUAL(cache_stats.misses, server.getCacheStats().misses);
 
     packet_data_t *pkt_data = (packet_data_t *) sendPacket_stats.data;
     TEST_ASSERT_EQUAL(TYPE_DATA, pkt_data->opcode);
     TEST_ASSERT_EQUAL(block_no, pkt_data->block_no);
+    TEST_ASSERT_TRUE(pkt_data->retransmit);
     TEST_ASSERT_EQUAL_HEX8_ARRAY(SAMPLE_DATA, &(pkt_data->block), LEN_SAMPLE_DATA);
   }
 
@@ -230,7 +498,7 @@ TEST_CASE("test server retransmit behavior", "[server]") {
 
   TEST_ASSERT_EQUAL(SAMPLE_FILE_INDEX, readFile_stats.file_index);
   TEST_ASSERT_EQUAL(SAMPLE_FILE_OFFSET + (WINDOW_SIZE * CONFIG_LEN_BLOCK), readFile_stats.file_offset);
-  TEST_ASSERT_EQUAL(CONFIG_LEN_BLOCK, readFile_stats.btr);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, readFile_stats.btr);
 
   packet_data_t *pkt_data = (packet_data_t *) sendPacket_stats.data;
   TEST_ASSERT_EQUAL(TYPE_DATA, pkt_data->opcode);
@@ -238,11 +506,536 @@ TEST_CASE("test server retransmit behavior", "[server]") {
   TEST_ASSERT_EQUAL(LEN_DATA_HEADER + LEN_SAMPLE_DATA, sendPacket_stats.len);
   TEST_ASSERT_EQUAL_HEX8_ARRAY(SAMPLE_DATA, &(pkt_data->block), LEN_SAMPLE_DATA);
 
-  // server receives an ACK for block 0
+  // blocks past the end of the file were never sent, they are not answered
+  pkt_rtx.num_elements = 1;
+  pkt_rtx.block_nos[0] = 3;
+
+  STORE_SENDPACKET();
+
+  result = server.onPacketRecv((uint8_t *) &pkt_rtx, LEN_RTX_HEADER + sizeof(uint16_t));
+  TEST_ASSERT_EQUAL(RECV_OK, result);
+  server.loop();
+
+  TEST_ASSERT_EQUAL(0, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+
+  // server receives an ACK for block 0 of the second window
 
   pkt_ack.block_no = 0;
+  pkt_ack.window_no = 1;
   result = server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(packet_ack_t));
   TEST_ASSERT_EQUAL(RECV_OK, result);
+  server.loop();
 
   TEST_ASSERT_EQUAL(MtftpServer::STATE_IDLE, server.getState());
 }
+
+TEST_CASE("test server retransmits blocks in NACK", "[server][nack]") {
+  const uint16_t WINDOW_SIZE = 4000;
+
+  const uint8_t transfer_data[CONFIG_LEN_BLOCK] = { 0x01, 0x02, 0x03, 0x04 };
+  memcpy(SAMPLE_DATA, transfer_data, CONFIG_LEN_BLOCK);
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 1;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = WINDOW_SIZE;
+  server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+
+  do {
+    server.loop();
+  } while (server.getState() == MtftpServer::STATE_TRANSFER);
+
+  // lose most of the window in a single burst, plus a few scattered blocks
+  nack_range_t runs[] = { { 1, 1 }, { 7, 2 }, { 10, 3500 }, { 3999, 1 } };
+  uint16_t num_runs = sizeof(runs) / sizeof(runs[0]);
+
+  packet_nack_t pkt_nack;
+  uint8_t len_pkt = nackEncode(&pkt_nack, runs, &num_runs);
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv((uint8_t *) &pkt_nack, len_pkt));
+
+  // every missing block should be retransmitted exactly once
+  static uint8_t retransmitted[WINDOW_SIZE];
+  memset(retransmitted, 0, sizeof(retransmitted));
+  uint16_t num_retransmitted = 0;
+
+  do {
+    STORE_SENDPACKET();
+    server.loop();
+
+    if (GET_SENDPACKET() > 0) {
+      packet_data_t *pkt_data = (packet_data_t *) sendPacket_stats.data;
+      TEST_ASSERT_EQUAL(TYPE_DATA, pkt_data->opcode);
+      TEST_ASSERT_LESS_THAN(WINDOW_SIZE, pkt_data->block_no);
+
+      retransmitted[pkt_data->block_no] ++;
+      num_retransmitted ++;
+    }
+  } while (server.getState() == MtftpServer::STATE_RTX);
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+  TEST_ASSERT_EQUAL(3504, num_retransmitted);
+
+  for (uint16_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+    for (uint16_t j = 0; j < runs[i].num_blocks; j++) {
+      TEST_ASSERT_EQUAL(1, retransmitted[runs[i].offset + j]);
+    }
+  }
+}
+
+static uint8_t num_client_timeouts;
+
+static void onClientTimeout(void) {
+  num_client_timeouts ++;
+}
+
+TEST_CASE("test client resends ACK until retries run out", "[client][rto]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  initTestTracking();
+  num_client_timeouts = 0;
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setOnTimeoutCb(&onClientTimeout);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    pkt_data.block_no = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+
+  // the RRQ was answered straight away, so the timeout is much shorter than the initial timeout
+  int64_t rto = client.getRto();
+  TEST_ASSERT_LESS_THAN(CONFIG_TIMEOUT_CLIENT, rto);
+
+  // the server never responds, the ACK is resent with the timeout doubling every time
+  for (uint8_t retry = 1; retry <= CONFIG_MAX_RETRIES; retry++) {
+    STORE_SENDPACKET();
+
+    while (client.getRetries() < retry) {
+      client.loop();
+    }
+
+    TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+    TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+
+    packet_ack_t *pkt_ack = (packet_ack_t *) sendPacket_stats.data;
+    TEST_ASSERT_EQUAL(TYPE_ACK, pkt_ack->opcode);
+    TEST_ASSERT_EQUAL(WINDOW_SIZE - 1, pkt_ack->block_no);
+    TEST_ASSERT_EQUAL(0, pkt_ack->window_no);
+
+    rto = rto * 2 < MtftpClient::RTO_MAX ? rto * 2 : MtftpClient::RTO_MAX;
+    TEST_ASSERT_EQUAL(rto, client.getRto());
+  }
+
+  // out of retries
+  int64_t time_start = esp_timer_get_time();
+  while (client.getState() != MtftpClient::STATE_IDLE) {
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN(2 * CONFIG_TIMEOUT, esp_timer_get_time() - time_start);
+  }
+
+  TEST_ASSERT_EQUAL(CONFIG_MAX_RETRIES, client.getRetries());
+  TEST_ASSERT_EQUAL(1, num_client_timeouts);
+}
+
+TEST_CASE("test client times the response to an ACK sent after retries", "[client][rto]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  // block 1 is lost, the response to the RRQ is timed
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    if (block_no == 1) continue;
+
+    pkt_data.block_no = block_no;
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+  TEST_ASSERT_EQUAL(1, client.getStats().rtt_samples);
+
+  // the RTX goes unanswered once, the block then arrives and the window is acknowledged
+  while (client.getRetries() < 1) {
+    client.loop();
+  }
+
+  pkt_data.block_no = 1;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(1, client.getStats().rtt_samples);
+
+  // the ACK is a new packet, its response is timed even though the RTX before it was resent
+  pkt_data.block_no = 0;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+  TEST_ASSERT_EQUAL(2, client.getStats().rtt_samples);
+  TEST_ASSERT_LESS_OR_EQUAL(MtftpClient::RTO_MAX, client.getRto());
+}
+
+TEST_CASE("test client starts again when the server has no session", "[client][server][rto]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  initTestTracking();
+
+  // an ACK from a peer without a session is answered with ERR
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  packet_ack_t pkt_ack;
+  pkt_ack.block_no = WINDOW_SIZE - 1;
+
+  STORE_SENDPACKET();
+  server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(pkt_ack));
+  server.loop();
+
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+  packet_err_t *pkt_err = (packet_err_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_ERR, pkt_err->opcode);
+  TEST_ASSERT_EQUAL(ERR_NO_SESSION, pkt_err->err);
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    pkt_data.block_no = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+
+  // the server had timed out, the read is requested again after the window written (without a checkpoint store)
+  packet_err_t err;
+  err.err = ERR_NO_SESSION;
+
+  STORE_SENDPACKET();
+  client.onPacketRecv((uint8_t *) &err, sizeof(err));
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+  TEST_ASSERT_EQUAL(1, client.getResumes());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+
+  packet_rrq_t *pkt_rrq = (packet_rrq_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_READ_REQUEST, pkt_rrq->opcode);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, pkt_rrq->file_offset);
+
+  // the answer to a second ACK already sent is ignored, the new RRQ is on its way
+  client.onPacketRecv((uint8_t *) &err, sizeof(err));
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+  TEST_ASSERT_EQUAL(1, client.getResumes());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+}
+
+TEST_CASE("test server resends window on repeated ACK", "[server][rto]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 0;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = WINDOW_SIZE;
+
+  server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+  while (server.loop(), server.getState() == MtftpServer::STATE_TRANSFER);
+
+  packet_ack_t pkt_ack;
+  pkt_ack.block_no = WINDOW_SIZE - 1;
+  pkt_ack.window_no = 0;
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(pkt_ack)));
+  while (server.loop(), server.getState() == MtftpServer::STATE_TRANSFER);
+
+  // the second window was lost, the client resends its ACK of the first window
+  STORE_READFILE();
+  STORE_SENDPACKET();
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(pkt_ack)));
+  while (server.loop(), server.getState() == MtftpServer::STATE_TRANSFER);
+
+  // the same window is sent again (from the cache) instead of the window after it
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, GET_SENDPACKET());
+  TEST_ASSERT_EQUAL(0, GET_READFILE());
+
+  // ACK of a window the server has not sent yet is ignored
+  STORE_SENDPACKET();
+
+  pkt_ack.window_no = 2;
+  server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(pkt_ack));
+  server.loop();
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+  TEST_ASSERT_EQUAL(0, GET_SENDPACKET());
+}
+
+TEST_CASE("test client requests the end of a lost window", "[client][rto]") {
+  const uint16_t WINDOW_SIZE = 8;
+  const uint16_t NUM_RECEIVED = 5;
+  const uint8_t LEN_FINAL_BLOCK = 10;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  for (uint16_t block_no = 0; block_no < NUM_RECEIVED; block_no++) {
+    pkt_data.block_no = block_no;
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  // the rest of the window is lost, the client should ask for it
+  STORE_SENDPACKET();
+
+  int64_t time_start = esp_timer_get_time();
+  while (client.getState() == MtftpClient::STATE_TRANSFER) {
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN(CONFIG_TIMEOUT, esp_timer_get_time() - time_start);
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+
+  packet_nack_t *pkt_nack = (packet_nack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_NACK, pkt_nack->opcode);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE - NUM_RECEIVED, nackCount(pkt_nack, sendPacket_stats.len));
+
+  nack_iter_t iter = {};
+  uint16_t block_no;
+  for (uint16_t i = NUM_RECEIVED; i < WINDOW_SIZE; i++) {
+    TEST_ASSERT_TRUE(nackNext(pkt_nack, sendPacket_stats.len, &iter, &block_no));
+    TEST_ASSERT_EQUAL(i, block_no);
+  }
+
+  // the file ends in the middle of the requested blocks
+  pkt_data.block_no = NUM_RECEIVED + 1;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + LEN_FINAL_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+
+  pkt_data.block_no = NUM_RECEIVED;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  // nothing exists after the final block, so the transfer is complete
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
+  TEST_ASSERT_EQUAL((NUM_RECEIVED + 1) * CONFIG_LEN_BLOCK + LEN_FINAL_BLOCK, writeFile_stats.len_file);
+
+  packet_ack_t *pkt_ack = (packet_ack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_ACK, pkt_ack->opcode);
+  TEST_ASSERT_EQUAL(NUM_RECEIVED + 1, pkt_ack->block_no);
+}
+
+TEST_CASE("test client window larger than its buffer", "[client]") {
+  // more blocks arrive after the missing one than fit in the buffer
+  const uint16_t WINDOW_SIZE = 2 * CONFIG_LEN_MTFTP_BUFFER + 4;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+
+  // block 0 is lost
+  for (uint16_t block_no = 1; block_no < WINDOW_SIZE; block_no++) {
+    pkt_data.block_no = block_no;
+    memset(pkt_data.block, block_no & 0xFF, CONFIG_LEN_BLOCK);
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  // only the missing block is requested, the blocks that did not fit come after it
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+  TEST_ASSERT_EQUAL(0, writeFile_stats.len_file);
+
+  packet_rtx_t *pkt_rtx = (packet_rtx_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_RETRANSMIT, pkt_rtx->opcode);
+  TEST_ASSERT_EQUAL(1, pkt_rtx->num_elements);
+  TEST_ASSERT_EQUAL(0, pkt_rtx->block_nos[0]);
+
+  pkt_data.block_no = 0;
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  // every buffered block is written, the rest of the window is acknowledged as missing
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(CONFIG_LEN_MTFTP_BUFFER * CONFIG_LEN_BLOCK, writeFile_stats.len_file);
+
+  packet_ack_t *pkt_ack = (packet_ack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_ACK, pkt_ack->opcode);
+  TEST_ASSERT_EQUAL(CONFIG_LEN_MTFTP_BUFFER - 1, pkt_ack->block_no);
+
+  for (uint32_t i = 0; i < writeFile_stats.len_file; i++) {
+    TEST_ASSERT_EQUAL_HEX8((i / CONFIG_LEN_BLOCK) & 0xFF, writeFile_stats.file[i]);
+  }
+
+  // the server resumes after the acknowledged blocks, the file ends in the next window
+  pkt_data.block_no = 0;
+  memset(pkt_data.block, CONFIG_LEN_MTFTP_BUFFER, CONFIG_LEN_BLOCK);
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + 10);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
+  TEST_ASSERT_EQUAL(CONFIG_LEN_MTFTP_BUFFER * CONFIG_LEN_BLOCK + 10, writeFile_stats.len_file);
+  TEST_ASSERT_EQUAL_HEX8(CONFIG_LEN_MTFTP_BUFFER, writeFile_stats.file[writeFile_stats.len_file - 1]);
+}
+
+TEST_CASE("test client drops blocks of a window already acknowledged", "[client]") {
+  const uint16_t WINDOW_SIZE = 4;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setWriteCoalescing(false);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  pkt_data.window_tag = windowTag(0);
+
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    pkt_data.block_no = block_no;
+    memset(pkt_data.block, 0xA0 + block_no, CONFIG_LEN_BLOCK);
+
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, writeFile_stats.len_file);
+
+  // a block of the first window sent again (or duplicated on the way) after the ACK, its block no is within the next window
+  pkt_data.block_no = 1;
+  memset(pkt_data.block, 0xA1, CONFIG_LEN_BLOCK);
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK, writeFile_stats.len_file);
+  TEST_ASSERT_EQUAL(1, client.getStats().duplicates);
+
+  // the next window ends the file
+  pkt_data.window_tag = windowTag(1);
+  pkt_data.block_no = 0;
+  memset(pkt_data.block, 0xB0, CONFIG_LEN_BLOCK);
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + 10);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_IDLE, client.getState());
+  TEST_ASSERT_EQUAL(WINDOW_SIZE * CONFIG_LEN_BLOCK + 10, writeFile_stats.len_file);
+  TEST_ASSERT_EQUAL_HEX8(0xA3, writeFile_stats.file[WINDOW_SIZE * CONFIG_LEN_BLOCK - 1]);
+  TEST_ASSERT_EQUAL_HEX8(0xB0, writeFile_stats.file[WINDOW_SIZE * CONFIG_LEN_BLOCK]);
+}
+
+TEST_CASE("test client waits for the retransmit of the last block requested", "[client]") {
+  const uint16_t WINDOW_SIZE = 8;
+
+  initTestTracking();
+
+  MtftpClient client;
+  client.init(&writeFile, &sendPacket);
+  client.setAdaptiveWindow(false);
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  packet_data_t pkt_data;
+  pkt_data.window_tag = windowTag(0);
+  memset(pkt_data.block, 0, CONFIG_LEN_BLOCK);
+
+  // blocks 4 and 6 are held back
+  for (uint16_t block_no = 0; block_no < WINDOW_SIZE; block_no++) {
+    if (block_no == 4 || block_no == 6) continue;
+
+    pkt_data.block_no = block_no;
+    client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+    client.loop();
+  }
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+
+  packet_nack_t *pkt_nack = (packet_nack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_NACK, pkt_nack->opcode);
+  TEST_ASSERT_EQUAL(2, nackCount(pkt_nack, sendPacket_stats.len));
+  TEST_ASSERT_EQUAL(6, nackLast(pkt_nack, sendPacket_stats.len));
+
+  STORE_SENDPACKET();
+
+  // the original block 6 arrives late, block 4 is still on its way back so nothing is requested again
+  pkt_data.block_no = 6;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_AWAIT_RTX, client.getState());
+  TEST_ASSERT_EQUAL(0, GET_SENDPACKET());
+
+  pkt_data.retransmit = 1;
+  pkt_data.block_no = 4;
+  client.onPacketRecv((uint8_t *) &pkt_data, LEN_DATA_HEADER + CONFIG_LEN_BLOCK);
+  client.loop();
+
+  // the retransmit of block 4 completes the window
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_ACK_SENT, client.getState());
+  TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
+
+  packet_ack_t *pkt_ack = (packet_ack_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(TYPE_ACK, pkt_ack->opcode);
+  TEST_ASSERT_EQUAL(WINDOW_SIZE - 1, pkt_ack->block_no);
+}
@@ -27,26 +27,37 @@ TEST_CASE("test server", "[server]") {
 
   result = server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
   TEST_ASSERT_EQUAL(RECV_OK, result);
-  TEST_ASSERT_EQUAL(MtftpServer::STATE_TRANSFER, server.getState());
+
+  // the RRQ is only handled in the next call to loop()
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_IDLE, server.getState());
 
   // read and send CONFIG_WINDOW_SIZE blocks of data
   for (uint8_t block_no = 0; block_no < CONFIG_WINDOW_SIZE; block_no ++) {
     STORE_READFILE();
     STORE_SENDPACKET();
 
-    TEST_ASSERT_EQUAL(MtftpServer::STATE_TRANSFER, server.getState());
     server.loop();
+    TEST_ASSERT_EQUAL(block_no < CONFIG_WINDOW_SIZE - 1 ? MtftpServer::STATE_TRANSFER : MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
 
-    TEST_ASSERT_EQUAL_MESSAGE(1, GET_READFILE(), "readFile should be called once");
     TEST_ASSERT_EQUAL_MESSAGE(1, GET_SENDPACKET(), "sendPacket should be called once");
 
-    TEST_ASSERT_EQUAL(SAMPLE_FILE_INDEX, readFile_stats.file_index);
-    TEST_ASSERT_EQUAL(SAMPLE_FILE_OFFSET + (block_no * CONFIG_LEN_BLOCK), readFile_stats.file_offset);
-    TEST_ASSERT_EQUAL(CONFIG_LEN_BLOCK, readFile_stats.btr);
+    // the window is read ahead into the cache with a single call to readFile
+    if (block_no % CONFIG_LEN_READ_CACHE == 0) {
+      uint16_t num_blocks = CONFIG_WINDOW_SIZE - block_no < CONFIG_LEN_READ_CACHE ? CONFIG_WINDOW_SIZE - block_no : CONFIG_LEN_READ_CACHE;
+
+      TEST_ASSERT_EQUAL_MESSAGE(1, GET_READFILE(), "readFile should be called once");
+      TEST_ASSERT_EQUAL(SAMPLE_FILE_INDEX, readFile_stats.file_index);
+      TEST_ASSERT_EQUAL(SAMPLE_FILE_OFFSET + (block_no * CONFIG_LEN_BLOCK), readFile_stats.file_offset);
+      TEST_ASSERT_EQUAL(num_blocks * CONFIG_LEN_BLOCK, readFile_stats.btr);
+    } else {
+      TEST_ASSERT_EQUAL_MESSAGE(0, GET_READFILE(), "block should be sent from the cache");
+    }
 
     packet_data_t *pkt_data = (packet_data_t *) sendPacket_stats.data;
     TEST_ASSERT_EQUAL(TYPE_DATA, pkt_data->opcode);
     TEST_ASSERT_EQUAL(block_no, pkt_data->block_no);
+    TEST_ASSERT_EQUAL(windowTag(0), pkt_data->window_tag);
+    TEST_ASSERT_FALSE(pkt_data->retransmit);
     TEST_ASSERT_EQUAL_HEX8_ARRAY(SAMPLE_DATA, &(pkt_data->block), LEN_SAMPLE_DATA);
   }
 
@@ -78,15 +89,19 @@ TEST_CASE("test server", "[server]") {
   packet_data_t *pkt_data = (packet_data_t *) sendPacket_stats.data;
   TEST_ASSERT_EQUAL(TYPE_DATA, pkt_data->opcode);
   TEST_ASSERT_EQUAL(0, pkt_data->block_no);
+  // a block of the second window
+  TEST_ASSERT_EQUAL(windowTag(1), pkt_data->window_tag);
   TEST_ASSERT_EQUAL_HEX8_ARRAY(SAMPLE_DATA, &(pkt_data->block), LEN_SAMPLE_DATA);
 
   // acknowledge the single partial block just sent
   TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
 
   pkt_ack.block_no = 0;
+  pkt_ack.window_no = 1;
 
   result = server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(packet_ack_t));
   TEST_ASSERT_EQUAL(RECV_OK, result);
+  server.loop();
 
   // end of transfer, should have gone back to idle
   TEST_ASSERT_EQUAL(MtftpServer::STATE_IDLE, server.getState());
@@ -130,12 +145,246 @@ TEST_CASE("test server behavior when receive an ACK for non-latest block", "[ser
 
   server.loop();
 
-  TEST_ASSERT_EQUAL(1, GET_READFILE());
+  // the start of the next window was already read ahead
+  TEST_ASSERT_EQUAL(0, GET_READFILE());
   TEST_ASSERT_EQUAL(1, GET_SENDPACKET());
 
-  // check that readFile was called with the correct offset
-  // + 1 because pkt_ack.block_no is the last valid received, so load next one
-  TEST_ASSERT_EQUAL(SAMPLE_FILE_OFFSET + ((pkt_ack.block_no + 1) * CONFIG_LEN_BLOCK), readFile_stats.file_offset);
-
   TEST_ASSERT_EQUAL(TYPE_DATA, ((packet_data_t *) sendPacket_stats.data)->opcode);
+  TEST_ASSERT_EQUAL(0, ((packet_data_t *) sendPacket_stats.data)->block_no);
+
+  // the first block after the cached blocks should be read from the correct offset
+  // + 1 because pkt_ack.block_no is the last valid received, so the window starts at the next one
+  uint16_t num_cached = CONFIG_WINDOW_SIZE - (pkt_ack.block_no + 1);
+  while (GET_READFILE() == 0) {
+    server.loop();
+  }
+
+  TEST_ASSERT_EQUAL(num_cached, ((packet_data_t *) sendPacket_stats.data)->block_no);
+  TEST_ASSERT_EQUAL(SAMPLE_FILE_OFFSET + (CONFIG_WINDOW_SIZE * CONFIG_LEN_BLOCK), readFile_stats.file_offset);
+}
+
+// the last packet sent to each of the test peers, indexed by peer_addr[0]
+static struct {
+  uint8_t called;
+  uint8_t data[MAX_LEN_PACKET];
+  uint8_t len;
+} peer_stats[CONFIG_MAX_SESSIONS + 2];
+
+static void sendPacketTo(const uint8_t *peer_addr, const uint8_t *data, uint8_t len) {
+  peer_stats[peer_addr[0]].called ++;
+  memcpy(peer_stats[peer_addr[0]].data, data, len);
+  peer_stats[peer_addr[0]].len = len;
+}
+
+TEST_CASE("test server resizes the window on ACK", "[server]") {
+  const uint16_t WINDOW_SIZE = 4;
+  const uint16_t NEW_WINDOW_SIZE = 6;
+
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 0;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = WINDOW_SIZE;
+
+  server.onPacketRecv((uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+
+  STORE_SENDPACKET();
+  while (server.loop(), server.getState() == MtftpServer::STATE_TRANSFER);
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, GET_SENDPACKET());
+
+  // ACK from a client that does not resize the window
+  packet_ack_t pkt_ack;
+  pkt_ack.block_no = WINDOW_SIZE - 1;
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv((uint8_t *) &pkt_ack, LEN_ACK_BASE));
+
+  STORE_SENDPACKET();
+  while (server.loop(), server.getState() == MtftpServer::STATE_TRANSFER);
+
+  TEST_ASSERT_EQUAL(WINDOW_SIZE, GET_SENDPACKET());
+
+  // the next window is sent with the size in the ACK
+  pkt_ack.window_size = NEW_WINDOW_SIZE;
+  pkt_ack.window_no = 1;
+  server.onPacketRecv((uint8_t *) &pkt_ack, sizeof(pkt_ack));
+
+  STORE_SENDPACKET();
+  while (server.loop(), server.getState() == MtftpServer::STATE_TRANSFER);
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+  TEST_ASSERT_EQUAL(NEW_WINDOW_SIZE, GET_SENDPACKET());
+
+  packet_data_t *pkt_data = (packet_data_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(NEW_WINDOW_SIZE - 1, pkt_data->block_no);
+}
+
+TEST_CASE("test server interleaves sessions", "[server]") {
+  const uint8_t WINDOW_SIZE = 4;
+
+  const uint8_t transfer_data[CONFIG_LEN_BLOCK] = { 0x01, 0x02, 0x03, 0x04 };
+  memcpy(SAMPLE_DATA, transfer_data, CONFIG_LEN_BLOCK);
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  memset(peer_stats, 0, sizeof(peer_stats));
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacketTo);
+
+  const uint8_t peer_a[LEN_PEER_ADDR] = { 1 };
+  const uint8_t peer_b[LEN_PEER_ADDR] = { 2 };
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 1;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = WINDOW_SIZE;
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_a, (uint8_t *) &pkt_rrq, sizeof(pkt_rrq)));
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_b, (uint8_t *) &pkt_rrq, sizeof(pkt_rrq)));
+
+  // a repeated RRQ from a peer with an active session is ignored
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_a, (uint8_t *) &pkt_rrq, sizeof(pkt_rrq)));
+
+  // blocks should alternate between the two peers
+  for (uint8_t block_no = 0; block_no < WINDOW_SIZE; block_no ++) {
+    server.loop();
+    TEST_ASSERT_EQUAL(2, server.getNumSessions());
+    TEST_ASSERT_EQUAL(block_no + 1, peer_stats[1].called);
+    TEST_ASSERT_EQUAL(block_no, ((packet_data_t *) peer_stats[1].data)->block_no);
+
+    server.loop();
+    TEST_ASSERT_EQUAL(block_no + 1, peer_stats[2].called);
+    TEST_ASSERT_EQUAL(block_no, ((packet_data_t *) peer_stats[2].data)->block_no);
+  }
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState(peer_a));
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState(peer_b));
+
+  // fill the remaining sessions, the next peer should be turned away with ERR_BUSY
+  for (uint8_t peer = 3; peer <= CONFIG_MAX_SESSIONS; peer ++) {
+    const uint8_t peer_addr[LEN_PEER_ADDR] = { peer };
+    TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_addr, (uint8_t *) &pkt_rrq, sizeof(pkt_rrq)));
+  }
+
+  const uint8_t peer_busy[LEN_PEER_ADDR] = { CONFIG_MAX_SESSIONS + 1 };
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_busy, (uint8_t *) &pkt_rrq, sizeof(pkt_rrq)));
+  server.loop();
+
+  TEST_ASSERT_EQUAL(CONFIG_MAX_SESSIONS, server.getNumSessions());
+  TEST_ASSERT_EQUAL(1, peer_stats[CONFIG_MAX_SESSIONS + 1].called);
+
+  packet_err_t *pkt_err = (packet_err_t *) peer_stats[CONFIG_MAX_SESSIONS + 1].data;
+  TEST_ASSERT_EQUAL(TYPE_ERR, pkt_err->opcode);
+  TEST_ASSERT_EQUAL(ERR_BUSY, pkt_err->err);
+
+  // ending one session leaves the others running
+  packet_ack_t pkt_ack;
+  pkt_ack.block_no = WINDOW_SIZE - 1;
+  LEN_SAMPLE_DATA = 0;
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_a, (uint8_t *) &pkt_ack, sizeof(pkt_ack)));
+
+  // the other sessions are still sending their first window
+  do {
+    server.loop();
+  } while (server.getState(peer_a) == MtftpServer::STATE_TRANSFER);
+
+  pkt_ack.block_no = 0;
+  pkt_ack.window_no = 1;
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv(peer_a, (uint8_t *) &pkt_ack, sizeof(pkt_ack)));
+  server.loop();
+
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_IDLE, server.getState(peer_a));
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState(peer_b));
+  TEST_ASSERT_EQUAL(CONFIG_MAX_SESSIONS - 1, server.getNumSessions());
+}
+
+// runs NUM_WINDOWS windows to each of num_clients clients which take RTT_LOOPS calls
+// to loop() to ACK each window, returns the number of calls to loop() taken
+static uint32_t runSessions(uint8_t num_clients) {
+  const uint8_t WINDOW_SIZE = 8;
+  const uint8_t NUM_WINDOWS = 4;
+  const uint8_t RTT_LOOPS = 8;
+
+  uint8_t windows_left[CONFIG_MAX_SESSIONS + 1];
+  uint8_t ack_in[CONFIG_MAX_SESSIONS + 1];
+
+  memset(peer_stats, 0, sizeof(peer_stats));
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacketTo);
+
+  packet_rrq_t pkt_rrq;
+  pkt_rrq.file_index = 1;
+  pkt_rrq.file_offset = 0;
+  pkt_rrq.window_size = WINDOW_SIZE;
+
+  for (uint8_t peer = 1; peer <= num_clients; peer ++) {
+    const uint8_t peer_addr[LEN_PEER_ADDR] = { peer };
+    server.onPacketRecv(peer_addr, (uint8_t *) &pkt_rrq, sizeof(pkt_rrq));
+
+    windows_left[peer] = NUM_WINDOWS;
+    ack_in[peer] = 0;
+  }
+
+  uint32_t num_loops = 0;
+
+  do {
+    server.loop();
+    num_loops ++;
+
+    for (uint8_t peer = 1; peer <= num_clients; peer ++) {
+      const uint8_t peer_addr[LEN_PEER_ADDR] = { peer };
+
+      if (server.getState(peer_addr) != MtftpServer::STATE_AWAIT_RESPONSE) continue;
+
+      // simulate the client taking RTT_LOOPS to respond to the end of the window
+      if (ack_in[peer] == 0) {
+        ack_in[peer] = RTT_LOOPS;
+        continue;
+      }
+
+      if (--ack_in[peer] > 0) continue;
+
+      // final window is a partial block
+      windows_left[peer] --;
+      LEN_SAMPLE_DATA = windows_left[peer] == 1 ? 1 : CONFIG_LEN_BLOCK;
+
+      packet_ack_t pkt_ack;
+      pkt_ack.block_no = windows_left[peer] == 0 ? 0 : WINDOW_SIZE - 1;
+      pkt_ack.window_no = NUM_WINDOWS - 1 - windows_left[peer];
+      server.onPacketRecv(peer_addr, (uint8_t *) &pkt_ack, sizeof(pkt_ack));
+    }
+  } while (!server.isIdle());
+
+  return num_loops;
+}
+
+TEST_CASE("test server aggregate throughput scales with sessions", "[server]") {
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  uint32_t prev_blocks_per_kloop = 0;
+
+  for (uint8_t num_clients = 1; num_clients <= CONFIG_MAX_SESSIONS; num_clients ++) {
+    uint32_t num_loops = runSessions(num_clients);
+
+    uint32_t num_blocks = 0;
+    for (uint8_t peer = 1; peer <= num_clients; peer ++) {
+      num_blocks += peer_stats[peer].called;
+    }
+
+    uint32_t blocks_per_kloop = (num_blocks * 1000) / num_loops;
+    printf("%d client(s): %d blocks in %d loops (%d blocks per 1000 loops)\n", num_clients, num_blocks, num_loops, blocks_per_kloop);
+
+    // the round trip of one client should be hidden by sending to the others
+    TEST_ASSERT_GREATER_THAN(prev_blocks_per_kloop, blocks_per_kloop);
+    prev_blocks_per_kloop = blocks_per_kloop;
+  }
 }
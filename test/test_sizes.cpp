@@ -0,0 +1,171 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+// UDP sized instances next to the default (ESP-NOW) ones
+const uint16_t LEN_UDP_PACKET = 1400;
+const uint16_t LEN_UDP_BLOCK = LEN_UDP_PACKET - LEN_DATA_HEADER;
+
+typedef BasicMtftpClient<LEN_UDP_BLOCK, 16, LEN_UDP_PACKET> UdpClient;
+typedef BasicMtftpServer<LEN_UDP_BLOCK, LEN_UDP_PACKET> UdpServer;
+
+TEST_CASE("test parity length of large blocks", "[fec][sizes]") {
+  static uint8_t block[LEN_UDP_BLOCK];
+  static uint8_t parity[LEN_UDP_BLOCK];
+
+  const uint16_t lens[] = {0, 1, 100, LEN_UDP_BLOCK - 129, LEN_UDP_BLOCK - 128, LEN_UDP_BLOCK - 2, LEN_UDP_BLOCK - 1};
+
+  for (uint8_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+    memset(parity, 0, sizeof(parity));
+
+    // a full block of the group and the final block
+    memset(block, 0xFF, sizeof(block));
+    parityAdd(parity, block, LEN_UDP_BLOCK, LEN_UDP_BLOCK);
+    memset(block, 0x5A, sizeof(block));
+    parityAdd(parity, block, lens[i], LEN_UDP_BLOCK);
+
+    // rebuilt from the parity and the full block
+    memset(block, 0xFF, sizeof(block));
+    parityAdd(parity, block, LEN_UDP_BLOCK, LEN_UDP_BLOCK);
+
+    TEST_ASSERT_EQUAL(lens[i], parityLength(parity, LEN_UDP_BLOCK));
+    for (uint16_t j = 0; j < lens[i]; j++) {
+      TEST_ASSERT_EQUAL_HEX8(0x5A, parity[j]);
+    }
+  }
+
+  // blocks of up to 256 bytes keep the length in the last byte
+  memset(parity, 0, sizeof(parity));
+  parityAdd(parity, block, 100);
+  TEST_ASSERT_EQUAL(100, parity[CONFIG_LEN_BLOCK - 1]);
+  TEST_ASSERT_EQUAL(100, parityLength(parity));
+
+  // a gap short enough for the last byte is never sent in two
+  memset(parity, 0, sizeof(parity));
+  parity[LEN_UDP_BLOCK - 1] = 0x80 | 5;
+  TEST_ASSERT_GREATER_THAN(LEN_UDP_BLOCK, parityLength(parity, LEN_UDP_BLOCK));
+}
+
+TEST_CASE("test NACK encoding in large packets", "[nack][sizes]") {
+  static nack_range_t runs[300];
+  for (uint16_t i = 0; i < 300; i++) {
+    runs[i].offset = i * 100;
+    runs[i].num_blocks = 64;
+  }
+
+  UdpClient::packet_nack_t nack_pkt;
+  uint16_t num_runs = 300;
+  uint16_t len_nack = nackEncode(&nack_pkt, runs, &num_runs);
+
+  // num_ranges is a uint8_t
+  TEST_ASSERT_EQUAL(UINT8_MAX, num_runs);
+  TEST_ASSERT_EQUAL(LEN_NACK_HEADER + UINT8_MAX * sizeof(nack_range_t), len_nack);
+  TEST_ASSERT_TRUE(nackValid(&nack_pkt, len_nack));
+  TEST_ASSERT_EQUAL(UINT8_MAX * 64, nackCount(&nack_pkt, len_nack));
+  TEST_ASSERT_EQUAL(254 * 100 + 63, nackLast(&nack_pkt, len_nack));
+}
+
+static UdpClient *udp_client;
+static UdpServer *udp_server;
+
+static const uint32_t LEN_UDP_FILE = 20 * LEN_UDP_BLOCK + 500;
+static uint8_t udp_file[LEN_UDP_FILE];
+static uint32_t len_udp_file;
+
+// blocks of the first window lost the first time they are sent, and whether the final block has been lost
+static uint32_t udp_dropped_blocks;
+static bool udp_dropped_end;
+static uint16_t udp_largest_packet;
+
+static uint8_t udpFileByte(uint32_t offset) {
+  return (offset * 13 + (offset >> 9)) & 0xFF;
+}
+
+static bool readUdpFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < LEN_UDP_FILE) {
+    data[*br] = udpFileByte(file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool writeUdpFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  if (file_offset + btw > LEN_UDP_FILE) return false;
+
+  memcpy(udp_file + file_offset, data, btw);
+  if (file_offset + btw > len_udp_file) len_udp_file = file_offset + btw;
+
+  return true;
+}
+
+static void udpClientToServer(const uint8_t *data, uint16_t len) {
+  udp_server->onPacketRecv(data, len);
+}
+
+static void udpServerToClient(const uint8_t *data, uint16_t len) {
+  if (len > udp_largest_packet) udp_largest_packet = len;
+
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    UdpServer::packet_data_t *data_pkt = (UdpServer::packet_data_t *) data;
+
+    if (data_pkt->block_no < 32 && (udp_dropped_blocks & (1 << data_pkt->block_no))) {
+      udp_dropped_blocks &= ~(1 << data_pkt->block_no);
+      return;
+    }
+
+    if (len < LEN_DATA_HEADER + LEN_UDP_BLOCK && !udp_dropped_end) {
+      udp_dropped_end = true;
+      return;
+    }
+  }
+
+  udp_client->onPacketRecv(data, len);
+}
+
+TEST_CASE("test transfer with 1400 byte packets", "[client][server][sizes]") {
+  const uint16_t WINDOW_SIZE = 16;
+  const uint8_t PARITY_BLOCKS = 2;
+
+  // two blocks of group 0 and one of group 1 in the first window, the final block (group 0 of the second window)
+  udp_dropped_blocks = (1 << 0) | (1 << 2) | (1 << 5);
+  udp_dropped_end = false;
+  udp_largest_packet = 0;
+  len_udp_file = 0;
+  memset(udp_file, 0, sizeof(udp_file));
+
+  // far larger than the default instances, so they are not put on the stack
+  static UdpClient client;
+  static UdpServer server;
+  udp_client = &client;
+  udp_server = &server;
+
+  client.init(&writeUdpFile, &udpClientToServer);
+  client.setAdaptiveWindow(false);
+  server.init(&readUdpFile, &udpServerToClient);
+
+  client.beginRead(0, 0, WINDOW_SIZE, 0, PARITY_BLOCKS);
+
+  int64_t time_start = esp_timer_get_time();
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != UdpClient::STATE_IDLE || !server.isIdle());
+
+  TEST_ASSERT_EQUAL(LEN_UDP_FILE, len_udp_file);
+  for (uint32_t i = 0; i < LEN_UDP_FILE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(udpFileByte(i), udp_file[i]);
+  }
+
+  TEST_ASSERT_EQUAL(LEN_DATA_HEADER + LEN_UDP_BLOCK, udp_largest_packet);
+  // block 5 straight away, block 2 once block 0 has been retransmitted and the final block from its two byte length
+  TEST_ASSERT_TRUE(udp_dropped_end);
+  TEST_ASSERT_EQUAL(3, client.getRecovered());
+}
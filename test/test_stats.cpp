@@ -0,0 +1,128 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+static const uint32_t LEN_STATS_FILE = 5000;
+
+static uint32_t len_stats_written;
+
+static MtftpClient *stats_client;
+static MtftpServer *stats_server;
+// DATA packets sent by the server so far, the one to lose and the one to deliver twice
+static uint32_t num_stats_data_pkts;
+static uint32_t stats_drops;
+static uint32_t stats_duplicate_pkt;
+
+static bool readStatsFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < LEN_STATS_FILE) {
+    data[*br] = file_offset + *br;
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static bool writeStatsFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  if (file_offset + btw > len_stats_written) {
+    len_stats_written = file_offset + btw;
+  }
+
+  return true;
+}
+
+static void statsClientToServer(const uint8_t *data, uint8_t len) {
+  stats_server->onPacketRecv(data, len);
+}
+
+static void statsServerToClient(const uint8_t *data, uint8_t len) {
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA) {
+    uint32_t pkt_no = num_stats_data_pkts ++;
+
+    if (pkt_no < 32 && (stats_drops & (1 << pkt_no))) return;
+
+    if (pkt_no == stats_duplicate_pkt) {
+      stats_client->onPacketRecv(data, len);
+    }
+  }
+
+  stats_client->onPacketRecv(data, len);
+}
+
+TEST_CASE("test client and server stats", "[client][server][stats]") {
+  const uint16_t WINDOW_SIZE = 8;
+  const uint32_t NUM_BLOCKS = LEN_STATS_FILE / CONFIG_LEN_BLOCK + 1;
+  const uint32_t NUM_WINDOWS = (NUM_BLOCKS + WINDOW_SIZE - 1) / WINDOW_SIZE;
+
+  len_stats_written = 0;
+  num_stats_data_pkts = 0;
+  // blocks 2 and 3 of the first window are lost, block 5 arrives twice
+  stats_drops = (1 << 2) | (1 << 3);
+  stats_duplicate_pkt = 5;
+
+  MtftpClient client;
+  MtftpServer server;
+  stats_client = &client;
+  stats_server = &server;
+
+  client.init(&writeStatsFile, &statsClientToServer);
+  client.setAdaptiveWindow(false);
+  server.init(&readStatsFile, &statsServerToClient);
+
+  int64_t time_start = esp_timer_get_time();
+
+  client.beginRead(0, 0, WINDOW_SIZE);
+
+  do {
+    server.loop();
+    client.loop();
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(10 * CONFIG_TIMEOUT, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  TEST_ASSERT_EQUAL(LEN_STATS_FILE, len_stats_written);
+
+  MtftpClient::client_stats_t client_stats = client.getStats();
+  MtftpServer::server_stats_t server_stats = server.getStats();
+
+  // every block once, and the two lost blocks again
+  TEST_ASSERT_EQUAL(NUM_BLOCKS + 2, server_stats.blocks_sent);
+  TEST_ASSERT_EQUAL(2, server_stats.blocks_retransmitted);
+  TEST_ASSERT_EQUAL(NUM_BLOCKS + 1, client_stats.blocks_received);
+
+  TEST_ASSERT_EQUAL(1, client_stats.duplicates);
+  // blocks 4 to 7 arrived before the lost blocks, block 7 in the sixth slot of the ring
+  TEST_ASSERT_EQUAL(4, client_stats.out_of_order);
+  TEST_ASSERT_EQUAL(6, client_stats.ring_high_water);
+  TEST_ASSERT_EQUAL(0, client_stats.ring_drops);
+
+  TEST_ASSERT_EQUAL(1, client_stats.rtx_sent);
+  TEST_ASSERT_EQUAL(2, client_stats.blocks_requested);
+  TEST_ASSERT_EQUAL(client_stats.rtx_sent, server_stats.rtx_received);
+  TEST_ASSERT_EQUAL(client_stats.blocks_requested, server_stats.blocks_requested);
+  TEST_ASSERT_EQUAL(NUM_WINDOWS, server_stats.windows);
+  TEST_ASSERT_EQUAL(0, server_stats.duplicate_acks);
+
+  TEST_ASSERT_EQUAL(LEN_STATS_FILE, client_stats.bytes_written);
+  TEST_ASSERT_EQUAL(LEN_STATS_FILE, server_stats.bytes_sent);
+
+  // the RRQ, the RTX and every ACK but the last is answered
+  TEST_ASSERT_EQUAL(NUM_WINDOWS + 1, client_stats.rtt_samples);
+  TEST_ASSERT_LESS_OR_EQUAL(client_stats.rtt_avg, client_stats.rtt_min);
+  TEST_ASSERT_LESS_OR_EQUAL(client_stats.rtt_max, client_stats.rtt_avg);
+  TEST_ASSERT_EQUAL(NUM_WINDOWS + 1, server_stats.rtt_samples);
+
+  TEST_ASSERT_GREATER_THAN(0, client_stats.time);
+  TEST_ASSERT_EQUAL((int64_t) client_stats.bytes_written * 1000000 / client_stats.time, client_stats.goodput);
+
+  // the stats are kept once the transfer has ended, and start again with the next read
+  TEST_ASSERT_EQUAL(client_stats.time, client.getStats().time);
+
+  client.beginRead(0, 0, WINDOW_SIZE);
+  TEST_ASSERT_EQUAL(0, client.getStats().blocks_received);
+  TEST_ASSERT_EQUAL(0, client.getStats().rtx_sent);
+}
@@ -0,0 +1,162 @@
+#include <string.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+
+// client and server connected back to back, dropping every DROP_INTERVAL'th data packet
+static MtftpClient *stream_client;
+static MtftpServer *stream_server;
+
+static const uint32_t LEN_STREAM_FILE = 50 * CONFIG_LEN_BLOCK + (CONFIG_LEN_BLOCK / 2);
+static const uint16_t DROP_INTERVAL = 7;
+
+static uint32_t num_data_pkts;
+static uint32_t num_server_idle_loops;
+// the client has stopped answering
+static bool client_silent;
+
+static uint8_t streamFileByte(uint32_t offset) {
+  return (offset ^ (offset >> 8)) & 0xFF;
+}
+
+static bool readStreamFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < LEN_STREAM_FILE) {
+    data[*br] = streamFileByte(file_offset + *br);
+    (*br) ++;
+  }
+
+  return true;
+}
+
+static void clientToServer(const uint8_t *data, uint8_t len) {
+  if (client_silent) return;
+
+  stream_server->onPacketRecv(data, len);
+}
+
+static void serverToClient(const uint8_t *data, uint8_t len) {
+  if (data[0] == TYPE_DATA && (++ num_data_pkts % DROP_INTERVAL) == 0) return;
+
+  stream_client->onPacketRecv(data, len);
+}
+
+TEST_CASE("test streaming transfer with loss", "[stream]") {
+  initTestTracking();
+  num_data_pkts = 0;
+  num_server_idle_loops = 0;
+  client_silent = false;
+
+  MtftpClient client;
+  MtftpServer server;
+  stream_client = &client;
+  stream_server = &server;
+
+  client.init(&writeFile, &clientToServer);
+  server.init(&readStreamFile, &serverToClient);
+
+  client.beginRead(0, 0, CONFIG_WINDOW_SIZE, OPT_STREAM);
+
+  TEST_ASSERT_EQUAL(MtftpClient::STATE_TRANSFER, client.getState());
+
+  int64_t time_start = esp_timer_get_time();
+  do {
+    server.loop();
+    client.loop();
+
+    // waiting on the client with blocks left to send
+    if (server.getState() == MtftpServer::STATE_AWAIT_RESPONSE) {
+      num_server_idle_loops ++;
+    }
+
+    TEST_ASSERT_LESS_THAN_MESSAGE(5000000, esp_timer_get_time() - time_start, "transfer did not complete");
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  // the whole file was written in order
+  TEST_ASSERT_EQUAL(LEN_STREAM_FILE, writeFile_stats.len_file);
+  for (uint32_t i = 0; i < LEN_STREAM_FILE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(streamFileByte(i), writeFile_stats.file[i]);
+  }
+
+  // lost blocks were requested while the transfer kept going,
+  // so very few extra blocks were sent and the server rarely had to wait for an ACK
+  uint32_t num_blocks = (LEN_STREAM_FILE / CONFIG_LEN_BLOCK) + 1;
+  TEST_ASSERT_LESS_THAN(num_blocks + (num_blocks / 2), num_data_pkts);
+  TEST_ASSERT_LESS_THAN(num_blocks, num_server_idle_loops);
+}
+
+TEST_CASE("test server falls back without stream option", "[stream]") {
+  initTestTracking();
+
+  MtftpServer server;
+  server.init(&readFile, &sendPacket);
+
+  LEN_SAMPLE_DATA = CONFIG_LEN_BLOCK;
+
+  // RRQ from a client that does not know about options
+  packet_rrq_t rrq_pkt;
+  rrq_pkt.file_index = 0;
+  rrq_pkt.file_offset = 0;
+  rrq_pkt.window_size = 2;
+  rrq_pkt.options = OPT_STREAM;
+
+  server.onPacketRecv((uint8_t *) &rrq_pkt, LEN_RRQ_BASE);
+  server.loop();
+  server.loop();
+
+  // sent a window of 2 then stopped to wait for the ACK
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_AWAIT_RESPONSE, server.getState());
+
+  packet_data_t *data_pkt = (packet_data_t *) sendPacket_stats.data;
+  TEST_ASSERT_EQUAL(1, data_pkt->block_no);
+}
+
+TEST_CASE("test stream server times out when the client goes silent", "[stream]") {
+  initTestTracking();
+  num_data_pkts = 0;
+  client_silent = false;
+
+  MtftpClient client;
+  MtftpServer server;
+  stream_client = &client;
+  stream_server = &server;
+
+  client.init(&writeFile, &clientToServer);
+  server.init(&readStreamFile, &serverToClient);
+
+  client.beginRead(0, 0, 8, OPT_STREAM);
+
+  // part of the way into the file, the client stops answering
+  while (num_data_pkts < 20) {
+    server.poll();
+    client.poll();
+  }
+
+  client_silent = true;
+  uint32_t num_sent = num_data_pkts;
+  int64_t time_silent = esp_timer_get_time();
+
+  while (!server.isIdle()) {
+    server.poll();
+    TEST_ASSERT_LESS_THAN_MESSAGE(3 * CONFIG_TIMEOUT, esp_timer_get_time() - time_silent, "session did not time out");
+  }
+
+  // idle CONFIG_TIMEOUT after the last packet of the client, having resent the unacknowledged blocks at most once
+  TEST_ASSERT_GREATER_OR_EQUAL(CONFIG_TIMEOUT, esp_timer_get_time() - time_silent);
+  TEST_ASSERT_LESS_OR_EQUAL(num_sent + 2 * 8, num_data_pkts);
+
+  // the session is free for a new read from the same peer
+  packet_rrq_t rrq_pkt;
+  rrq_pkt.file_index = 0;
+  rrq_pkt.file_offset = 0;
+  rrq_pkt.window_size = 8;
+  rrq_pkt.options = OPT_STREAM;
+
+  TEST_ASSERT_EQUAL(RECV_OK, server.onPacketRecv((uint8_t *) &rrq_pkt, sizeof(rrq_pkt)));
+  server.poll();
+
+  TEST_ASSERT_FALSE(server.isIdle());
+}
@@ -0,0 +1,132 @@
+#include <string.h>
+#include "unity.h"
+#include "helpers.h"
+#include "mtftp.h"
+#include "mtftp_client.hpp"
+#include "mtftp_server.hpp"
+#include "mtftp_trace.h"
+
+#if CONFIG_LEN_TRACE > 0
+
+static MtftpClient *trace_client;
+static MtftpServer *trace_server;
+static uint32_t num_trace_data_pkts;
+
+static bool readTraceFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+  while (*br < btr && file_offset + *br < 1000) {
+    data[(*br) ++] = 0;
+  }
+
+  return true;
+}
+
+static bool writeTraceFile(uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  return true;
+}
+
+static void traceClientToServer(const uint8_t *data, uint8_t len) {
+  trace_server->onPacketRecv(data, len);
+}
+
+static void traceServerToClient(const uint8_t *data, uint8_t len) {
+  // block 1 is lost the first time
+  if ((data[0] & OPCODE_MASK) == TYPE_DATA && num_trace_data_pkts ++ == 1) return;
+
+  trace_client->onPacketRecv(data, len);
+}
+
+static const trace_event_t *findEvent(const trace_event_t *events, uint32_t num_events, uint8_t type, uint8_t source, uint32_t *index) {
+  for (; *index < num_events; (*index) ++) {
+    if (events[*index].type == type && events[*index].source == source) return &events[(*index) ++];
+  }
+
+  return NULL;
+}
+
+static uint32_t len_trace_dump;
+
+static void countTraceDump(const uint8_t *data, uint16_t len) {
+  len_trace_dump += len;
+}
+
+TEST_CASE("test trace of a transfer", "[trace]") {
+  num_trace_data_pkts = 0;
+
+  MtftpClient client;
+  MtftpServer server;
+  trace_client = &client;
+  trace_server = &server;
+
+  client.init(&writeTraceFile, &traceClientToServer);
+  client.setTraceId(3);
+  server.init(&readTraceFile, &traceServerToClient);
+
+  mtftpTraceClear();
+
+  // 1000 bytes, 5 blocks in one window
+  client.beginRead(7, 0, 8);
+
+  do {
+    server.loop();
+    client.loop();
+  } while (client.getState() != MtftpClient::STATE_IDLE || !server.isIdle());
+
+  static trace_event_t events[CONFIG_LEN_TRACE];
+  uint32_t num_events = mtftpTraceRead(events, CONFIG_LEN_TRACE);
+  uint32_t index = 0;
+
+  const trace_event_t *event = findEvent(events, num_events, TRACE_RRQ_TX, 3, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(7, event->arg);
+
+  event = findEvent(events, num_events, TRACE_RRQ_RX, TRACE_SERVER | 0, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(7, event->arg);
+
+  // the lost block is requested and sent again
+  event = findEvent(events, num_events, TRACE_RTX_TX, 3, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(1, event->arg);
+  event = findEvent(events, num_events, TRACE_RTX_RUN, 3, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(1, event->arg);
+  TEST_ASSERT_EQUAL(1, event->value);
+
+  event = findEvent(events, num_events, TRACE_DATA_TX, TRACE_SERVER | 0, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(1, event->arg);
+  TEST_ASSERT_EQUAL(CONFIG_LEN_BLOCK | TRACE_RETRANSMIT, event->value);
+
+  event = findEvent(events, num_events, TRACE_ACK_TX, 3, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(1000 / CONFIG_LEN_BLOCK, event->arg);
+
+  event = findEvent(events, num_events, TRACE_STATE, TRACE_SERVER | 0, &index);
+  TEST_ASSERT_NOT_NULL(event);
+  TEST_ASSERT_EQUAL(MtftpServer::STATE_IDLE, event->value);
+
+  // times never go backwards
+  for (uint32_t i = 1; i < num_events; i++) {
+    TEST_ASSERT_LESS_OR_EQUAL(0x80000000, events[i].time - events[i - 1].time);
+  }
+
+  // once the ring wraps, the oldest events are overwritten and the rest are still read oldest first
+  mtftpTraceClear();
+  for (uint32_t i = 0; i < CONFIG_LEN_TRACE + 10; i++) {
+    mtftpTrace(TRACE_DATA_RX, 0, i, 0);
+  }
+
+  TEST_ASSERT_EQUAL(CONFIG_LEN_TRACE, mtftpTraceRead(events, CONFIG_LEN_TRACE));
+  TEST_ASSERT_EQUAL(10, events[0].arg);
+  TEST_ASSERT_EQUAL(CONFIG_LEN_TRACE + 9, events[CONFIG_LEN_TRACE - 1].arg);
+
+  TEST_ASSERT_EQUAL(2, mtftpTraceRead(events, 2));
+  TEST_ASSERT_EQUAL(CONFIG_LEN_TRACE + 8, events[0].arg);
+
+  len_trace_dump = 0;
+  mtftpTraceDump(&countTraceDump);
+  TEST_ASSERT_EQUAL(sizeof(trace_header_t) + CONFIG_LEN_TRACE * sizeof(trace_event_t), len_trace_dump);
+}
+
+#endif